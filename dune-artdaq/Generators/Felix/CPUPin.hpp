@@ -1,20 +1,54 @@
 #ifndef CPU_PIN_HPP
 #define CPU_PIN_HPP
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 
 #include <sched.h>
 
 #include "json.hpp"
 
+#include "dune-artdaq/DAQLogger/DAQLogger.hh"
+#include "dune-artdaq/Generators/Felix/CPUTopology.hh"
 
-#define DEBUG_CPU_PIN
-
+/*
+ * CPUPin
+ * Description: Decides which CPUs each readout thread runs on. Every thread
+ *   has a role and a name, eg. "dispatcher 712/0/3" or "tpf 5/1", and gets
+ *   the CPUs the pin file lists for that name, or else one CPU picked from
+ *   the host topology on the NUMA node it asks for: an isolated CPU if the
+ *   node has any, the first SMT thread of each core before any second one,
+ *   and the least used CPU first, so threads only share when the node runs
+ *   out. Asking again for the same name gives the same CPUs.
+ *   Every assignment is logged with its name, which is also the key to
+ *   override it with in the pin file, and is checked against isolcpus and
+ *   the node asked for.
+ * Date: November 2019
+*/
 class CPUPin
 {
 public:
+  enum class Role { Reader, Dispatcher, Selector, Subscriber, Matcher, TPF, Compression };
+
+  static const char* roleName(Role role) {
+    switch (role) {
+      case Role::Reader:      return "reader";
+      case Role::Dispatcher:  return "dispatcher";
+      case Role::Selector:    return "selector";
+      case Role::Subscriber:  return "subscriber";
+      case Role::Matcher:     return "matcher";
+      case Role::TPF:         return "tpf";
+      case Role::Compression: return "compression";
+    }
+    return "unknown";
+  }
 
   static CPUPin& getInstance(){
     static CPUPin myInstance;
@@ -23,124 +57,219 @@ public:
   CPUPin(CPUPin const&) = delete;             // Copy construct
   CPUPin(CPUPin&&) = delete;                  // Move construct
   CPUPin& operator=(CPUPin const&) = delete;  // Copy assign
-  CPUPin& operator=(CPUPin &&) = delete;      // Move assign 
+  CPUPin& operator=(CPUPin &&) = delete;      // Move assign
 
-  cpu_set_t getReaderCPUs(unsigned flxId, unsigned cardId) {
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    auto& cpuVec = m_cardreaderCores[flxId][cardId];
-    for (auto cpu : cpuVec){
-      CPU_SET(cpu, &cpuset);
+  // The CPUs of thread `id` of `role`, eg. (Role::Subscriber, "3") for the
+  // subscriber of link 3, preferably on NUMA node `node` (-1 for any)
+  std::vector<unsigned> cpusFor(Role role, const std::string& id, int node = -1) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const std::string name = std::string(roleName(role)) + " " + id;
+    auto assigned = m_assigned.find(name);
+    // The pin file always wins. Its CPUs were counted when it was loaded
+    auto over = m_overrides.find(name);
+    if (over != m_overrides.end()) {
+      unpick(name);
+      if (assigned == m_assigned.end() || assigned->second != over->second) {
+        m_assigned[name] = over->second;
+        check(name, "pin file", over->second, node);
+      }
+      return over->second;
     }
-    return cpuset;
-  }
+    if (assigned != m_assigned.end()) { return assigned->second; }
 
-  cpu_set_t getDispatcherCPUs(unsigned flxId, unsigned cardId, unsigned linkId) {
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    auto& cpuVec = m_dispatcherCores[flxId][cardId][linkId];
-    for (auto cpu : cpuVec){
-      CPU_SET(cpu, &cpuset);
+    std::vector<unsigned> cpus;
+    int cpu = pickCPU(node);
+    if (cpu >= 0) {
+      cpus.push_back(cpu);
+      ++m_useCount[cpu];
     }
-    return cpuset;
+    m_assigned[name] = cpus;
+    m_picked.insert(name);
+    check(name, "topology", cpus, node);
+    return cpus;
   }
 
-  cpu_set_t getSelectorCPUs(unsigned linkId) {
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    auto& cpuVec = m_selectorCores[linkId];
-    for (auto cpu : cpuVec){
-      std::cout << " CHANGED! PROVIDING CPU: " << cpu << " FOR LINKID: " << linkId << '\n';
-      CPU_SET(cpu, &cpuset);  
-    }
-    return cpuset;
+  cpu_set_t cpuSetFor(Role role, const std::string& id, int node = -1) {
+    return toCpuSet(cpusFor(role, id, node));
+  }
+
+  cpu_set_t getReaderCPUs(unsigned flxId, unsigned cardId, int node = -1) {
+    return cpuSetFor(Role::Reader, std::to_string(flxId) + "/" + std::to_string(cardId), node);
   }
 
+  cpu_set_t getDispatcherCPUs(unsigned flxId, unsigned cardId, unsigned linkId, int node = -1) {
+    return cpuSetFor(Role::Dispatcher, std::to_string(flxId) + "/" + std::to_string(cardId) + "/" + std::to_string(linkId), node);
+  }
+
+  cpu_set_t getSelectorCPUs(unsigned linkId, int node = -1) {
+    return cpuSetFor(Role::Selector, std::to_string(linkId), node);
+  }
+
+  // The pin file overrides the topology for the threads it lists:
+  // {"712": {"cards": {"0": {"reader": [1], "links": {"0": [2], ...}}, ...},
+  //          "selectors": {"0": [12], ...}},
+  //  "overrides": {"subscriber 3": [14], "tpf 3/0": [16], ...}}
+  // where the overrides are keyed by the names in the assignment logs.
+  // An empty filename leaves everything to the topology. Every interface
+  // loads the file at each configure, so loading only replaces the
+  // overrides: the CPUs already handed out stay handed out, and counted,
+  // so that the threads of the other interfaces in the process don't
+  // get them again
   bool load(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pinsJson = nlohmann::json();
+    // The old file's CPUs come off the counts, and the new file's go on below
+    for (auto const& over : m_overrides) {
+      for (unsigned cpu : over.second) { release(cpu); }
+    }
+    m_overrides.clear();
+    if (filename.empty()) { return true; }
     std::ifstream i(filename);
+    if (!i) {
+      dune::DAQLogger::LogWarning("CPUPin::load") << "Can't open pin file " << filename << ", pinning from the topology only";
+      return false;
+    }
     i >> m_pinsJson;
     for (auto it = m_pinsJson.begin(); it != m_pinsJson.end(); ++it) {
-      std::istringstream ciss(it.key());
-      unsigned int cardId;
-      ciss >> cardId;
+      if (it.key() == "overrides") {
+        for (auto oit = it.value().begin(); oit != it.value().end(); ++oit) {
+          std::vector<unsigned> cpus = oit.value();
+          m_overrides[oit.key()] = cpus;
+        }
+        continue;
+      }
+      const std::string flxId = it.key();
       for (auto cit = it.value()["cards"].begin(); cit!=it.value()["cards"].end(); ++cit) {
-        std::istringstream chiss(cit.key());
-        unsigned int cardPartId;
-        chiss >> cardPartId;
+        const std::string cardPartId = cit.key();
         std::vector<unsigned> readerCPUs = cit.value()["reader"];
-        m_cardreaderCores[cardId][cardPartId] = readerCPUs;
+        m_overrides[std::string(roleName(Role::Reader)) + " " + flxId + "/" + cardPartId] = readerCPUs;
         for (auto lit = cit.value()["links"].begin(); lit!=cit.value()["links"].end(); ++lit) {
-          std::istringstream liss(lit.key());
-          unsigned linkId;
-          liss >> linkId;
           std::vector<unsigned> linkCPUs = lit.value();
-          m_dispatcherCores[cardId][cardPartId][linkId] = linkCPUs;
+          m_overrides[std::string(roleName(Role::Dispatcher)) + " " + flxId + "/" + cardPartId + "/" + lit.key()] = linkCPUs;
         } // links
       } // card halfs
       for (auto sit = it.value()["selectors"].begin(); sit!=it.value()["selectors"].end(); ++sit){
-        std::istringstream shiss(sit.key());
-        unsigned selId;
-        shiss >> selId;
         std::vector<unsigned> selCPUs = sit.value();
-        m_selectorCores[selId] = selCPUs;
+        m_overrides[std::string(roleName(Role::Selector)) + " " + sit.key()] = selCPUs;
       }
-      auto selJson = it.value()["selectors"];
-      
     } // card types
 
-#ifdef DEBUG_CPU_PIN
-    std::cout << "CARDREADERS: \n";
-    for (auto it=m_cardreaderCores.begin(); it!=m_cardreaderCores.end(); ++it){
-      unsigned cid = it->first;
-      std::cout << "  CARD " << cid << '\n'; 
-      for (auto it2=it->second.begin(); it2!=it->second.end(); ++it2) {
-        unsigned hid = it2->first;
-        std::cout << "  -> READER " << it2->first << " pinned to: "; 
-        for (auto cpu : it2->second){
-          std::cout << cpu << " ";
-        }
-        std::cout << '\n';
-        auto disps = m_dispatcherCores[cid][hid];
-        for (auto linkIt=disps.begin(); linkIt!=disps.end(); ++linkIt){
-          unsigned lid = linkIt->first;
-          std::cout << "    -> LINK " << lid << " pinned to: ";
-          for (auto lcpu : linkIt->second){
-            std::cout << lcpu << " ";
-          }
-          std::cout << '\n';
-        }//links 
-      }//cardreaders
-    }//cards
-    std::cout << "SELECTORS: \n";
-    for (auto linkIt = m_selectorCores.begin(); linkIt!=m_selectorCores.end(); ++linkIt){
-      std::cout << "   -> LINK " << linkIt->first << " pinned to: "; 
-      for (auto lcpu : linkIt->second){
-        std::cout << lcpu << " ";
-      }
-      std::cout << '\n';
+    // Keep the topology's picks off the CPUs the file hands out
+    for (auto const& over : m_overrides) {
+      for (unsigned cpu : over.second) { ++m_useCount[cpu]; }
     }
-#endif
+    dune::DAQLogger::LogInfo("CPUPin::load") << "Pin file " << filename << " sets the CPUs of " << m_overrides.size() << " threads";
     return true;
-  }; 
+  }
 
+  static cpu_set_t toCpuSet(const std::vector<unsigned>& cpus) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (unsigned cpu : cpus) { CPU_SET(cpu, &cpuset); }
+    return cpuset;
+  }
 
 protected:
   // Singleton mode
-  CPUPin() { };
+  CPUPin() {
+    dune::DAQLogger::LogInfo("CPUPin::CPUPin") << "Host has " << m_topology.describe();
+  }
   ~CPUPin() { };
 
 private:
+  // The CPU for a new thread on `node`, -1 if the topology is unknown
+  int pickCPU(int node) const {
+    std::vector<const CPUTopology::CPU*> candidates;
+    for (auto const& cpu : m_topology.cpus()) {
+      if (node < 0 || cpu.node == node) { candidates.push_back(&cpu); }
+    }
+    if (candidates.empty()) {
+      for (auto const& cpu : m_topology.cpus()) { candidates.push_back(&cpu); }
+    }
+    if (candidates.empty()) { return -1; }
+    // The kernel keeps its housekeeping off the isolated CPUs, so those are
+    // ours if there are any. If not, leave the node's first core to the
+    // kernel and the less demanding threads
+    if (std::any_of(candidates.begin(), candidates.end(), [](const CPUTopology::CPU* c){ return c->isolated; })) {
+      candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](const CPUTopology::CPU* c){ return !c->isolated; }),
+                       candidates.end());
+    } else {
+      const CPUTopology::CPU* first = *std::min_element(candidates.begin(), candidates.end(),
+                                                        [](const CPUTopology::CPU* a, const CPUTopology::CPU* b){ return a->id < b->id; });
+      std::vector<const CPUTopology::CPU*> rest;
+      for (auto c : candidates) {
+        if (c->socket != first->socket || c->core != first->core) { rest.push_back(c); }
+      }
+      if (!rest.empty()) { candidates.swap(rest); }
+    }
+    // Least used first, then the first SMT thread of every core before the second
+    auto better = [this](const CPUTopology::CPU* a, const CPUTopology::CPU* b) {
+      unsigned ua = useCount(a->id), ub = useCount(b->id);
+      if (ua != ub) { return ua < ub; }
+      if (a->thread != b->thread) { return a->thread < b->thread; }
+      return a->id < b->id;
+    };
+    return (*std::min_element(candidates.begin(), candidates.end(), better))->id;
+  }
+
+  void release(unsigned cpu) {
+    auto it = m_useCount.find(cpu);
+    if (it != m_useCount.end() && --it->second == 0) { m_useCount.erase(it); }
+  }
 
+  // The pin file now has thread `name`: give back the CPUs the topology picked for it
+  void unpick(const std::string& name) {
+    if (m_picked.erase(name) == 0) { return; }
+    for (unsigned cpu : m_assigned[name]) { release(cpu); }
+  }
+
+  unsigned useCount(unsigned cpu) const {
+    auto it = m_useCount.find(cpu);
+    return (it == m_useCount.end()) ? 0 : it->second;
+  }
+
+  // Log the assignment, and warn about the ones that will hurt
+  void check(const std::string& name, const char* source, const std::vector<unsigned>& cpus, int node) const {
+    if (cpus.empty()) {
+      dune::DAQLogger::LogWarning("CPUPin::check") << name << " is not pinned: no CPUs from the " << source;
+      return;
+    }
+    std::ostringstream where;
+    for (unsigned cpu : cpus) {
+      const CPUTopology::CPU* info = m_topology.find(cpu);
+      if (!info) {
+        dune::DAQLogger::LogWarning("CPUPin::check") << name << " is pinned to CPU " << cpu << ", which is offline or doesn't exist";
+        continue;
+      }
+      where << " [" << cpu << ": socket " << info->socket << " core " << info->core << " thread " << info->thread
+            << " node " << info->node << (info->isolated ? " isolated" : "") << "]";
+      if (m_topology.hasIsolated() && !info->isolated) {
+        dune::DAQLogger::LogWarning("CPUPin::check") << name << " is pinned to CPU " << cpu << ", which is not in isolcpus";
+      }
+      if (node >= 0 && info->node != node) {
+        dune::DAQLogger::LogWarning("CPUPin::check") << name << " is pinned to CPU " << cpu << " on NUMA node " << info->node
+                                                     << ", but its data is on node " << node;
+      }
+      if (useCount(cpu) > 1) {
+        dune::DAQLogger::LogWarning("CPUPin::check") << name << " shares CPU " << cpu << " with " << useCount(cpu)-1 << " other thread(s)";
+      }
+    }
+    dune::DAQLogger::LogInfo("CPUPin::check") << name << " pinned from the " << source << " to CPU " << CPUTopology::formatList(cpus) << where.str();
+  }
+
+  std::mutex m_mutex;
   nlohmann::json m_pinsJson;
+  CPUTopology m_topology;
 
-  // 711 -> card0,card1 CardReaders-> vector of cores to pin.
-  std::map<unsigned, std::map<unsigned, std::vector<unsigned>>> m_cardreaderCores;
-  // 711 -> card0,card1 -> linkId Dispatchers -> vector of cores to pin.
-  std::map<unsigned, std::map<unsigned, std::map<unsigned, std::vector<unsigned>>>> m_dispatcherCores;
-  // 711 -> trm -> linkId to process -> vector of cores to pin.
-  std::map<unsigned, std::vector<unsigned>> m_selectorCores;
+  // Thread name -> CPUs, from the pin file
+  std::map<std::string, std::vector<unsigned>> m_overrides;
+  // Thread name -> CPUs it was given
+  std::map<std::string, std::vector<unsigned>> m_assigned;
+  // CPU -> how many threads were given it
+  std::map<unsigned, unsigned> m_useCount;
+  // The threads whose CPUs the topology picked, rather than the pin file
+  std::set<std::string> m_picked;
 
 };
 
 #endif // CPU_PIN_HPP
-
@@ -0,0 +1,139 @@
+#ifndef CPU_TOPOLOGY_HH_
+#define CPU_TOPOLOGY_HH_
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * CPUTopology
+ * Description: The CPUs of the host as sysfs describes them: for each online
+ *   CPU its socket, physical core, SMT thread within the core, NUMA node,
+ *   and whether it is in isolcpus. Read once, from /sys/devices/system, or
+ *   from another root for a copied tree.
+ * Date: November 2019
+*/
+class CPUTopology
+{
+public:
+  struct CPU
+  {
+    unsigned id;
+    int socket;
+    int core;        // core_id, only unique within the socket
+    unsigned thread; // 0 for the first SMT sibling of the core, 1 for the second...
+    int node;
+    bool isolated;
+  };
+
+  explicit CPUTopology(const std::string& root = "/sys/devices/system") {
+    std::set<unsigned> isolated;
+    for (unsigned cpu : parseList(readLine(root + "/cpu/isolated"))) { isolated.insert(cpu); }
+
+    std::map<unsigned, int> nodeOfCpu;
+    for (unsigned node : parseList(readLine(root + "/node/online"))) {
+      for (unsigned cpu : parseList(readLine(root + "/node/node" + std::to_string(node) + "/cpulist"))) {
+        nodeOfCpu[cpu] = node;
+      }
+    }
+
+    for (unsigned id : parseList(readLine(root + "/cpu/online"))) {
+      const std::string topo = root + "/cpu/cpu" + std::to_string(id) + "/topology/";
+      CPU cpu;
+      cpu.id = id;
+      cpu.socket = readInt(topo + "physical_package_id", 0);
+      cpu.core = readInt(topo + "core_id", id);
+      std::vector<unsigned> siblings = parseList(readLine(topo + "thread_siblings_list"));
+      cpu.thread = std::find(siblings.begin(), siblings.end(), id) - siblings.begin();
+      if (cpu.thread >= siblings.size()) { cpu.thread = 0; }
+      // Hosts without NUMA have no node directory: everything is node 0
+      auto n = nodeOfCpu.find(id);
+      cpu.node = (n == nodeOfCpu.end()) ? 0 : n->second;
+      cpu.isolated = isolated.count(id) != 0;
+      m_cpus.push_back(cpu);
+    }
+  }
+
+  const std::vector<CPU>& cpus() const { return m_cpus; }
+
+  // nullptr for an offline or non-existent CPU
+  const CPU* find(unsigned id) const {
+    for (auto const& cpu : m_cpus) { if (cpu.id == id) { return &cpu; } }
+    return nullptr;
+  }
+
+  bool hasIsolated() const {
+    return std::any_of(m_cpus.begin(), m_cpus.end(), [](const CPU& c){ return c.isolated; });
+  }
+
+  // eg. "2 sockets, 2 NUMA nodes, 24 cores, 48 CPUs, isolated: 2-11,14-23,26-35,38-47"
+  std::string describe() const {
+    std::set<int> sockets, nodes;
+    std::set<std::pair<int,int>> cores;
+    std::vector<unsigned> isolated;
+    for (auto const& cpu : m_cpus) {
+      sockets.insert(cpu.socket);
+      nodes.insert(cpu.node);
+      cores.insert(std::make_pair(cpu.socket, cpu.core));
+      if (cpu.isolated) { isolated.push_back(cpu.id); }
+    }
+    std::ostringstream ss;
+    ss << sockets.size() << " sockets, " << nodes.size() << " NUMA nodes, " << cores.size() << " cores, "
+       << m_cpus.size() << " CPUs, isolated: " << (isolated.empty() ? "none" : formatList(isolated));
+    return ss.str();
+  }
+
+  // A sysfs CPU list, eg. "0-3,8,10-11", as CPU numbers. Empty for ""
+  static std::vector<unsigned> parseList(const std::string& list) {
+    std::vector<unsigned> ret;
+    std::istringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+      unsigned first = 0, last = 0;
+      char dash = 0;
+      std::istringstream rs(range);
+      if (!(rs >> first)) { continue; }
+      last = first;
+      if (rs >> dash && dash == '-') { rs >> last; }
+      for (unsigned cpu = first; cpu <= last; ++cpu) { ret.push_back(cpu); }
+    }
+    return ret;
+  }
+
+  // The other way round, for the logs
+  static std::string formatList(std::vector<unsigned> cpus) {
+    std::sort(cpus.begin(), cpus.end());
+    std::ostringstream ss;
+    for (size_t i = 0; i < cpus.size(); ) {
+      size_t j = i;
+      while (j+1 < cpus.size() && cpus[j+1] == cpus[j]+1) { ++j; }
+      ss << (i ? "," : "") << cpus[i];
+      if (j > i) { ss << "-" << cpus[j]; }
+      i = j+1;
+    }
+    return ss.str();
+  }
+
+private:
+  static std::string readLine(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+  }
+
+  static int readInt(const std::string& path, int dflt) {
+    std::ifstream in(path);
+    int ret = dflt;
+    if (!(in >> ret)) { return dflt; }
+    return ret;
+  }
+
+  std::vector<CPU> m_cpus;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef COMPLETION_LATCH_HH_
+#define COMPLETION_LATCH_HH_
+
+#include "Utilities.hh"
+
+#include <atomic>
+#include <cstdint>
+
+/*
+ * CompletionLatch
+ * Description: Fan-in for per-link work. The dispatcher arms the latch with the
+ *   number of tasks it hands out, every task counts down once when it is done,
+ *   and wait() returns as soon as the last one finished. Waiters spin briefly
+ *   and then park on a futex, so there is no polling interval to pay.
+ *   The latch can be re-armed after wait() returned.
+ * Date: October 2019
+*/
+class CompletionLatch
+{
+public:
+  CompletionLatch() : m_count(0) { }
+  CompletionLatch(CompletionLatch const&) = delete;
+  CompletionLatch& operator=(CompletionLatch const&) = delete;
+
+  void reset(uint32_t count) { m_count.store(count, std::memory_order_release); }
+
+  // Returns true for the call that released the latch.
+  bool count_down() {
+    if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      futex_wake(&m_count);
+      return true;
+    }
+    return false;
+  }
+
+  bool done() const { return m_count.load(std::memory_order_acquire) == 0; }
+
+  void wait() {
+    for (unsigned i=0; i<s_spins; ++i) {
+      if (done()) return;
+      cpu_relax();
+    }
+    uint32_t c;
+    while ((c = m_count.load(std::memory_order_acquire)) != 0) {
+      futex_wait(&m_count, c);
+    }
+  }
+
+private:
+  static constexpr unsigned s_spins = 2000;
+  std::atomic<uint32_t> m_count;
+};
+
+#endif
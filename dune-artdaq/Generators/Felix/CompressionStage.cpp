@@ -0,0 +1,110 @@
+#include "CompressionStage.hh"
+#include "Utilities.hh"
+#include "CPUPin.hpp"
+#include "dune-artdaq/DAQLogger/DAQLogger.hh"
+
+#include <cstring>
+
+using namespace dune;
+
+CompressionStage::CompressionStage(unsigned numWorkers, Compressor::Backend backend, unsigned level, int qatEngine, int numaNode)
+  : m_numWorkers(numWorkers > 0 ? numWorkers : 1),
+    m_backend(backend),
+    m_level(level),
+    m_qatEngine(qatEngine),
+    m_numaNode(numaNode)
+{
+}
+
+CompressionStage::~CompressionStage()
+{
+  stop();
+}
+
+bool CompressionStage::createCompressors()
+{
+  m_compressors.clear();
+  for (unsigned i=0; i<m_numWorkers; ++i) {
+    std::unique_ptr<Compressor> compressor = Compressor::create(m_backend, m_level, m_qatEngine);
+    if (!compressor) {
+      DAQLogger::LogWarning("CompressionStage::createCompressors")
+        << "Worker " << i << " could not set up a " << Compressor::backendName(m_backend) << " compressor.";
+      m_compressors.clear();
+      return false;
+    }
+    m_compressors.push_back(std::move(compressor));
+  }
+  return true;
+}
+
+int CompressionStage::start()
+{
+  if (!createCompressors()) {
+    if (m_backend != Compressor::Backend::QAT) {
+      return -1;
+    }
+    // All or nothing: every worker has to write the same format.
+    DAQLogger::LogWarning("CompressionStage::start")
+      << "Not enough QAT sessions for " << m_numWorkers << " workers, falling back to software deflate.";
+    m_backend = Compressor::Backend::Deflate;
+    if (!createCompressors()) {
+      return -1;
+    }
+  }
+  for (unsigned i=0; i<m_numWorkers; ++i) {
+    m_workers.emplace_back(&CompressionStage::run, this, i);
+    set_thread_name(m_workers[i], "comp", i);
+    cpu_set_t cpuset = CPUPin::getInstance().cpuSetFor(CPUPin::Role::Compression, std::to_string(i), m_numaNode);
+    int ret = pthread_setaffinity_np(m_workers[i].native_handle(), sizeof(cpu_set_t), &cpuset);
+    if (ret != 0) {
+      DAQLogger::LogWarning("CompressionStage::start")
+        << "Could not pin compression worker " << i << ". Return code: " << ret;
+    }
+  }
+  DAQLogger::LogInfo("CompressionStage::start")
+    << "Started " << m_numWorkers << " " << Compressor::backendName(m_backend)
+    << " compression workers at level " << m_level << ".";
+  return 0;
+}
+
+void CompressionStage::stop()
+{
+  // One end marker per worker, behind the jobs that are still queued.
+  for (unsigned i=0; i<m_workers.size(); ++i) {
+    m_jobs.push(Job{nullptr, 0, nullptr, nullptr});
+  }
+  for (auto& worker : m_workers) {
+    worker.join();
+  }
+  m_workers.clear();
+  m_compressors.clear();
+}
+
+void CompressionStage::submit(Job&& job)
+{
+  m_jobs.push(std::move(job));
+}
+
+void CompressionStage::run(unsigned wid)
+{
+  Compressor& compressor = *m_compressors[wid];
+  Job job;
+  for (;;) {
+    m_jobs.pop(job);
+    if (job.dst == nullptr) break;
+
+    // Compress straight into the fragment, then shrink it to what was written.
+    size_t capacity = compressor.bound(job.srcSize);
+    job.dst->resizeBytes(capacity);
+    size_t compSize = compressor.compress(job.src, job.srcSize, job.dst->dataBeginBytes(), capacity);
+    if (compSize == 0) {
+      DAQLogger::LogWarning("CompressionStage::run")
+        << "Compression of " << job.srcSize << " bytes failed, storing them uncompressed.";
+      job.dst->resizeBytes(job.srcSize);
+      memcpy(job.dst->dataBeginBytes(), job.src, job.srcSize);
+    } else {
+      job.dst->resizeBytes(compSize);
+    }
+    job.onComplete(compSize);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef COMPRESSION_STAGE_HH_
+#define COMPRESSION_STAGE_HH_
+
+#include "artdaq-core/Data/Fragment.hh"
+
+#include "Compressor.hh"
+
+#include <tbb/concurrent_queue.h>
+
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+/*
+ * CompressionStage
+ * Description: Pool of compression workers, decoupled from the trigger matchers.
+ *   A matcher assembles its window into a staging buffer, submits it and goes on
+ *   with the next request. Every worker owns its Compressor (QAT falls back to
+ *   Deflate when no QAT instance could be set up) and compresses straight into
+ *   the destination fragment, so there is no copy back from an internal buffer.
+ * Date: October 2019
+*/
+class CompressionStage {
+public:
+  struct Job {
+    const uint8_t* src;                   // must stay valid until onComplete
+    size_t srcSize;
+    artdaq::Fragment* dst;                // resized to the compressed size
+    std::function<void(size_t)> onComplete; // compressed size, 0 if stored as is
+  };
+
+  // The workers are pinned by CPUPin, on numaNode if it's not -1
+  CompressionStage(unsigned numWorkers, Compressor::Backend backend, unsigned level, int qatEngine, int numaNode = -1);
+  ~CompressionStage();
+  CompressionStage(CompressionStage const&) = delete;
+  CompressionStage& operator=(CompressionStage const&) = delete;
+
+  // Set up one compressor per worker and spawn the workers. Returns 0 on success.
+  int start();
+  void stop(); // Finishes the queued jobs first.
+
+  // Asynchronous: onComplete is called from a worker thread.
+  void submit(Job&& job);
+
+  unsigned numWorkers() const { return m_numWorkers; }
+  // Backend actually in use, after a possible fallback. Valid after start().
+  Compressor::Backend backend() const { return m_backend; }
+
+private:
+  bool createCompressors();
+  void run(unsigned wid);
+
+  const unsigned m_numWorkers;
+  Compressor::Backend m_backend;
+  const unsigned m_level;
+  const int m_qatEngine;
+  const int m_numaNode;
+
+  tbb::concurrent_bounded_queue<Job> m_jobs;
+  std::vector<std::unique_ptr<Compressor>> m_compressors;
+  std::vector<std::thread> m_workers;
+};
+
+#endif /* COMPRESSION_STAGE_HH_ */
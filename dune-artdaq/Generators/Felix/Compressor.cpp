@@ -0,0 +1,283 @@
+#include "Compressor.hh"
+#include "QzCompressor.hh"
+#include "DeltaPackCodec.hh"
+
+#include <zlib.h>
+#ifdef FELIX_HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef FELIX_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <cstring>
+
+namespace {
+
+class QatCompressor : public Compressor {
+public:
+  QatCompressor(unsigned level) : m_qz(QzCompressor::QzAlgo::Deflate, level, 64) { }
+  int init(int engine) { return m_qz.init(0, engine); } // compress() needs no internal buffer
+
+  // QATzip adds its own header on top of the deflate stream: keep a margin.
+  size_t bound(size_t srcSize) const override { return compressBound(srcSize) + 1024; }
+  size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) override {
+    return m_qz.compress(src, srcSize, dst, dstCapacity);
+  }
+  Backend backend() const override { return Backend::QAT; }
+
+private:
+  QzCompressor m_qz;
+};
+
+// Same gzip framing as QATzip, so the readers do not need to care which one was used.
+class DeflateCompressor : public Compressor {
+public:
+  DeflateCompressor(unsigned level) : m_init(false) {
+    memset(&m_zs, 0, sizeof(m_zs));
+    m_init = (deflateInit2(&m_zs, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  }
+  ~DeflateCompressor() { if (m_init) { deflateEnd(&m_zs); } }
+  bool ok() const { return m_init; }
+
+  size_t bound(size_t srcSize) const override {
+    return deflateBound(const_cast<z_stream*>(&m_zs), srcSize);
+  }
+  size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) override {
+    deflateReset(&m_zs);
+    m_zs.next_in = const_cast<Bytef*>(src);
+    m_zs.avail_in = srcSize;
+    m_zs.next_out = dst;
+    m_zs.avail_out = dstCapacity;
+    if (deflate(&m_zs, Z_FINISH) != Z_STREAM_END) {
+      return 0;
+    }
+    return m_zs.total_out;
+  }
+  Backend backend() const override { return Backend::Deflate; }
+
+private:
+  z_stream m_zs;
+  bool m_init;
+};
+
+#ifdef FELIX_HAVE_LZ4
+// Level 1 is the fast LZ4 mode, higher levels go through LZ4 HC.
+class LZ4Compressor : public Compressor {
+public:
+  LZ4Compressor(unsigned level) : m_level(level) { }
+
+  size_t bound(size_t srcSize) const override { return LZ4_compressBound(srcSize); }
+  size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) override {
+    int ret = (m_level <= 1)
+      ? LZ4_compress_default((const char*)src, (char*)dst, srcSize, dstCapacity)
+      : LZ4_compress_HC((const char*)src, (char*)dst, srcSize, dstCapacity, m_level);
+    return (ret > 0) ? ret : 0;
+  }
+  Backend backend() const override { return Backend::LZ4; }
+
+private:
+  unsigned m_level;
+};
+#endif
+
+#ifdef FELIX_HAVE_ZSTD
+class ZstdCompressor : public Compressor {
+public:
+  ZstdCompressor(unsigned level) : m_ctx(ZSTD_createCCtx()), m_level(level) { }
+  ~ZstdCompressor() { ZSTD_freeCCtx(m_ctx); }
+  bool ok() const { return m_ctx != nullptr; }
+
+  size_t bound(size_t srcSize) const override { return ZSTD_compressBound(srcSize); }
+  size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) override {
+    size_t ret = ZSTD_compressCCtx(m_ctx, dst, dstCapacity, src, srcSize, m_level);
+    return ZSTD_isError(ret) ? 0 : ret;
+  }
+  Backend backend() const override { return Backend::Zstd; }
+
+private:
+  ZSTD_CCtx* m_ctx;
+  int m_level;
+};
+#endif
+
+class DeltaPackCompressor : public Compressor {
+public:
+  size_t bound(size_t srcSize) const override { return DeltaPackCodec::bound(srcSize); }
+  size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) override {
+    return DeltaPackCodec::encode(dst, dstCapacity, src, srcSize);
+  }
+  Backend backend() const override { return Backend::DeltaPack; }
+};
+
+} // namespace
+
+uint8_t Compressor::formatId(Backend b)
+{
+  switch (b) {
+    case Backend::QAT:
+    case Backend::Deflate: return 1;
+    case Backend::LZ4:     return 2;
+    case Backend::Zstd:    return 3;
+    case Backend::DeltaPack: return 4;
+  }
+  return 0;
+}
+
+std::string Compressor::formatName(uint8_t formatId)
+{
+  switch (formatId) {
+    case rawFormatId: return "raw";
+    case 1:           return "gzip";
+    case 2:           return "lz4";
+    case 3:           return "zstd";
+    case 4:           return "deltapack";
+  }
+  return "unknown";
+}
+
+bool Compressor::knownFormat(uint8_t formatId)
+{
+  return formatName(formatId) != "unknown";
+}
+
+bool Compressor::validFormat(uint8_t metadataVersion, uint8_t formatId)
+{
+  switch (metadataVersion) {
+    case 1: return formatId <= 1;
+    case 2: return knownFormat(formatId);
+  }
+  return false;
+}
+
+namespace {
+
+// QATzip writes one gzip member per hardware buffer: inflate them one after the other.
+size_t gunzip(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15+16) != Z_OK) return 0;
+  zs.next_in = const_cast<Bytef*>(src);
+  zs.avail_in = srcSize;
+  zs.next_out = dst;
+  zs.avail_out = dstCapacity;
+  int ret = Z_OK;
+  while (zs.avail_in > 0) {
+    ret = inflate(&zs, Z_FINISH);
+    if (ret != Z_STREAM_END) break;
+    if (zs.avail_in > 0) inflateReset(&zs);
+  }
+  // total_out starts over with every member
+  size_t size = zs.next_out - dst;
+  inflateEnd(&zs);
+  return (ret == Z_STREAM_END) ? size : 0;
+}
+
+} // namespace
+
+size_t Compressor::decompress(uint8_t formatId, const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity)
+{
+  switch (formatId) {
+    case rawFormatId:
+      if (srcSize > dstCapacity) return 0;
+      memcpy(dst, src, srcSize);
+      return srcSize;
+    case 1:
+      return gunzip(src, srcSize, dst, dstCapacity);
+#ifdef FELIX_HAVE_LZ4
+    case 2: {
+      int ret = LZ4_decompress_safe((const char*)src, (char*)dst, srcSize, dstCapacity);
+      return (ret > 0) ? ret : 0;
+    }
+#endif
+#ifdef FELIX_HAVE_ZSTD
+    case 3: {
+      size_t ret = ZSTD_decompress(dst, dstCapacity, src, srcSize);
+      return ZSTD_isError(ret) ? 0 : ret;
+    }
+#endif
+    case 4:
+      return DeltaPackCodec::decode(dst, dstCapacity, src, srcSize);
+    default:
+      return 0;
+  }
+}
+
+size_t Compressor::decompressFragment(uint8_t metadataVersion, uint8_t formatId,
+                                      const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity)
+{
+  if (!validFormat(metadataVersion, formatId)) return 0;
+  return decompress(formatId, src, srcSize, dst, dstCapacity);
+}
+
+std::string Compressor::backendName(Backend b)
+{
+  switch (b) {
+    case Backend::QAT:     return "qat";
+    case Backend::Deflate: return "deflate";
+    case Backend::LZ4:     return "lz4";
+    case Backend::Zstd:    return "zstd";
+    case Backend::DeltaPack: return "deltapack";
+  }
+  return "unknown";
+}
+
+bool Compressor::parseBackend(const std::string& name, Backend& b)
+{
+  for (Backend c : { Backend::QAT, Backend::Deflate, Backend::LZ4, Backend::Zstd, Backend::DeltaPack }) {
+    if (name == backendName(c)) {
+      b = c;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Compressor::available(Backend b)
+{
+  switch (b) {
+    case Backend::QAT:
+    case Backend::Deflate:
+    case Backend::DeltaPack: return true;
+#ifdef FELIX_HAVE_LZ4
+    case Backend::LZ4:     return true;
+#endif
+#ifdef FELIX_HAVE_ZSTD
+    case Backend::Zstd:    return true;
+#endif
+    default:               return false;
+  }
+}
+
+std::unique_ptr<Compressor> Compressor::create(Backend b, unsigned level, int qatEngine)
+{
+  switch (b) {
+    case Backend::QAT: {
+      std::unique_ptr<QatCompressor> c = std::make_unique<QatCompressor>(level);
+      if (c->init(qatEngine) != 0) return nullptr;
+      return std::move(c);
+    }
+    case Backend::Deflate: {
+      std::unique_ptr<DeflateCompressor> c = std::make_unique<DeflateCompressor>(level);
+      if (!c->ok()) return nullptr;
+      return std::move(c);
+    }
+#ifdef FELIX_HAVE_LZ4
+    case Backend::LZ4:
+      return std::make_unique<LZ4Compressor>(level);
+#endif
+#ifdef FELIX_HAVE_ZSTD
+    case Backend::Zstd: {
+      std::unique_ptr<ZstdCompressor> c = std::make_unique<ZstdCompressor>(level);
+      if (!c->ok()) return nullptr;
+      return std::move(c);
+    }
+#endif
+    case Backend::DeltaPack:
+      return std::make_unique<DeltaPackCompressor>();
+    default:
+      return nullptr;
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef COMPRESSOR_HH_
+#define COMPRESSOR_HH_
+
+#include <memory>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Compressor
+ * Description: Buffer to buffer compression backend. One instance per thread,
+ *   implementations keep their session/context state between calls.
+ *   QAT and Deflate both write gzip streams; LZ4 and Zstd are only built when
+ *   their libraries were found (FELIX_HAVE_LZ4, FELIX_HAVE_ZSTD). DeltaPack is
+ *   the in-house DeltaPackCodec, it has no levels.
+ *   Best ratios are reached on reordered fragments (FelixReorder), where the
+ *   ADC values of a channel are contiguous instead of interleaved per frame.
+ * Date: October 2019
+*/
+class Compressor {
+public:
+  enum class Backend { QAT, Deflate, LZ4, Zstd, DeltaPack };
+
+  virtual ~Compressor() { }
+
+  // Worst case output size for srcSize input bytes.
+  virtual size_t bound(size_t srcSize) const = 0;
+  // Returns the compressed size, 0 on failure (e.g. dst too small).
+  virtual size_t compress(const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity) = 0;
+  virtual Backend backend() const = 0;
+
+  // Value for FelixFragmentBase::Metadata::compressed: 0 stored as is, 1 gzip,
+  // 2 lz4 (raw block), 3 zstd (frame), 4 deltapack.
+  // Metadata version 1 only knew 0 and 1, as a gzip flag. Fragments with a
+  // higher id are written as version 2, so that older readers reject them.
+  static constexpr uint8_t rawFormatId = 0;
+  uint8_t formatId() const { return formatId(backend()); }
+  static uint8_t formatId(Backend b);
+  // eg. "gzip", "unknown" for an id no backend writes
+  static std::string formatName(uint8_t formatId);
+  static bool knownFormat(uint8_t formatId);
+  // Metadata::version to write along with formatId
+  static uint8_t metadataVersion(uint8_t formatId) { return (formatId <= 1) ? 1 : 2; }
+  // Whether a fragment of that metadata version may carry formatId
+  static bool validFormat(uint8_t metadataVersion, uint8_t formatId);
+
+  // The reader side: decode a payload written with formatId into dst.
+  // Returns the decoded size, 0 on a corrupt payload, if dst is too small,
+  // or if the format is unknown or its library was not built in.
+  // LZ4 blocks do not record their size: dstCapacity must be at least it.
+  static size_t decompress(uint8_t formatId, const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity);
+  // Same, from the version and compressed fields of a fragment's metadata.
+  // Returns 0 if they do not go together.
+  static size_t decompressFragment(uint8_t metadataVersion, uint8_t formatId,
+                                   const uint8_t* src, size_t srcSize, uint8_t* dst, size_t dstCapacity);
+
+  static std::string backendName(Backend b);
+  static bool parseBackend(const std::string& name, Backend& b); // "qat", "deflate", "lz4", "zstd", "deltapack"
+  static bool available(Backend b);
+
+  // nullptr if the backend is not built in, or could not be initialised (no QAT device).
+  static std::unique_ptr<Compressor> create(Backend b, unsigned level, int qatEngine = -1);
+};
+
+#endif /* COMPRESSOR_HH_ */
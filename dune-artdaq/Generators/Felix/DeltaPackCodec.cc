@@ -0,0 +1,250 @@
+#include "DeltaPackCodec.hh"
+
+#include <algorithm>
+#include <cstring>
+
+void DeltaPackCodec::write_header(uint8_t *dst, size_t srcSize)
+{
+    const uint32_t header[2] = {m_magic, static_cast<uint32_t>(srcSize)};
+    memcpy(dst, header, m_header_size);
+}
+
+// Zig-zag encoded deltas of num_samples samples into zz, padded with zeros to a
+// full block. Returns the OR of all values, for the width of the block.
+unsigned DeltaPackCodec::baseline_deltas(uint16_t *zz, const uint16_t *samples, size_t num_samples, uint16_t prev)
+{
+    unsigned all = 0;
+    for (size_t i = 0; i < num_samples; ++i)
+    {
+        const int16_t delta = static_cast<int16_t>(samples[i] - prev);
+        zz[i] = static_cast<uint16_t>((static_cast<uint16_t>(delta) << 1) ^ (delta >> 15));
+        all |= zz[i];
+        prev = samples[i];
+    }
+    for (size_t i = num_samples; i < m_num_samples_per_block; ++i)
+        zz[i] = 0;
+    return all;
+}
+
+// Value j of lane l is zz[j * 16 + l]. Each lane packs its 16 values LSB first
+// into width 16 bit words, and word k of lane l is stored at k * 16 + l.
+void DeltaPackCodec::baseline_pack(uint8_t *dst, const uint16_t *zz, unsigned width)
+{
+    uint16_t out[m_num_samples_per_block];
+    for (unsigned l = 0; l < m_num_lanes; ++l)
+    {
+        unsigned k = 0, filled = 0;
+        uint16_t acc = 0;
+        for (unsigned j = 0; j < m_num_samples_per_block / m_num_lanes; ++j)
+        {
+            const uint16_t v = zz[j * m_num_lanes + l];
+            acc |= v << filled;
+            filled += width;
+            if (filled >= 16)
+            {
+                out[k++ * m_num_lanes + l] = acc;
+                filled -= 16;
+                acc = filled ? v >> (width - filled) : 0;
+            }
+        }
+    }
+    memcpy(dst, out, width * m_num_lanes * 2);
+}
+
+void DeltaPackCodec::baseline_unpack(uint16_t *zz, const uint8_t *src, unsigned width)
+{
+    uint16_t in[m_num_samples_per_block];
+    memcpy(in, src, width * m_num_lanes * 2);
+    const uint32_t mask = (1u << width) - 1;
+    for (unsigned l = 0; l < m_num_lanes; ++l)
+    {
+        unsigned k = 0, filled = 0;
+        for (unsigned j = 0; j < m_num_samples_per_block / m_num_lanes; ++j)
+        {
+            if (width == 0)
+            {
+                zz[j * m_num_lanes + l] = 0;
+                continue;
+            }
+            uint32_t v = in[k * m_num_lanes + l] >> filled;
+            filled += width;
+            if (filled > 16)
+            {
+                ++k;
+                filled -= 16;
+                v |= static_cast<uint32_t>(in[k * m_num_lanes + l]) << (width - filled);
+            }
+            else if (filled == 16)
+            {
+                ++k;
+                filled = 0;
+            }
+            zz[j * m_num_lanes + l] = v & mask;
+        }
+    }
+}
+
+size_t DeltaPackCodec::encode_baseline(uint8_t *dst, size_t dstCapacity, const uint8_t *src, size_t srcSize) noexcept
+{
+    if (dstCapacity < bound(srcSize) || srcSize > UINT32_MAX)
+        return 0;
+
+    write_header(dst, srcSize);
+    uint8_t *out = dst + m_header_size;
+
+    const size_t num_samples = srcSize / 2;
+    uint16_t block[m_num_samples_per_block];
+    uint16_t zz[m_num_samples_per_block];
+    uint16_t prev = 0;
+    for (size_t first = 0; first < num_samples; first += m_num_samples_per_block)
+    {
+        const size_t n = std::min(num_samples - first, size_t(m_num_samples_per_block));
+        memcpy(block, src + 2 * first, 2 * n);
+        const unsigned all = baseline_deltas(zz, block, n, prev);
+        prev = block[n - 1];
+
+        const unsigned width = all ? 32 - __builtin_clz(all) : 0;
+        *out++ = width;
+        baseline_pack(out, zz, width);
+        out += width * m_num_lanes * 2;
+    }
+    if (srcSize % 2)
+        *out++ = src[srcSize - 1];
+    return out - dst;
+}
+
+#ifdef __AVX2__
+unsigned DeltaPackCodec::avx_deltas(uint16_t *zz, const uint16_t *samples)
+{
+    // samples[-1] has to be readable: the first block of a stream goes through
+    // baseline_deltas
+    __m256i all = _mm256_setzero_si256();
+    for (unsigned i = 0; i < m_num_samples_per_block; i += m_num_lanes)
+    {
+        const __m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(samples + i));
+        const __m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(samples + i - 1));
+        const __m256i delta = _mm256_sub_epi16(cur, prev);
+        const __m256i v = _mm256_xor_si256(_mm256_slli_epi16(delta, 1), _mm256_srai_epi16(delta, 15));
+        _mm256_store_si256(reinterpret_cast<__m256i *>(zz + i), v);
+        all = _mm256_or_si256(all, v);
+    }
+    // Horizontal OR of the 16 lanes
+    __m128i r = _mm_or_si128(_mm256_castsi256_si128(all), _mm256_extracti128_si256(all, 1));
+    r = _mm_or_si128(r, _mm_srli_si128(r, 8));
+    r = _mm_or_si128(r, _mm_srli_si128(r, 4));
+    r = _mm_or_si128(r, _mm_srli_si128(r, 2));
+    return _mm_extract_epi16(r, 0);
+}
+
+void DeltaPackCodec::avx_pack(uint8_t *dst, const uint16_t *zz, unsigned width)
+{
+    __m256i *out = reinterpret_cast<__m256i *>(dst);
+    __m256i acc = _mm256_setzero_si256();
+    unsigned filled = 0;
+    for (unsigned j = 0; j < m_num_samples_per_block / m_num_lanes; ++j)
+    {
+        const __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(zz + j * m_num_lanes));
+        acc = _mm256_or_si256(acc, _mm256_sll_epi16(v, _mm_cvtsi32_si128(filled)));
+        filled += width;
+        if (filled >= 16)
+        {
+            _mm256_storeu_si256(out++, acc);
+            filled -= 16;
+            acc = filled ? _mm256_srl_epi16(v, _mm_cvtsi32_si128(width - filled)) : _mm256_setzero_si256();
+        }
+    }
+}
+
+size_t DeltaPackCodec::encode_avx(uint8_t *dst, size_t dstCapacity, const uint8_t *src, size_t srcSize) noexcept
+{
+    if (dstCapacity < bound(srcSize) || srcSize > UINT32_MAX)
+        return 0;
+
+    write_header(dst, srcSize);
+    uint8_t *out = dst + m_header_size;
+
+    const size_t num_samples = srcSize / 2;
+    const uint16_t *samples = reinterpret_cast<const uint16_t *>(src);
+    alignas(32) uint16_t block[m_num_samples_per_block];
+    alignas(32) uint16_t zz[m_num_samples_per_block];
+    uint16_t prev = 0;
+    for (size_t first = 0; first < num_samples; first += m_num_samples_per_block)
+    {
+        const size_t n = std::min(num_samples - first, size_t(m_num_samples_per_block));
+        unsigned all;
+        if (first > 0 && n == m_num_samples_per_block)
+        {
+            all = avx_deltas(zz, samples + first);
+        }
+        else
+        {
+            memcpy(block, src + 2 * first, 2 * n);
+            all = baseline_deltas(zz, block, n, prev);
+        }
+        memcpy(&prev, src + 2 * (first + n - 1), 2);
+
+        const unsigned width = all ? 32 - __builtin_clz(all) : 0;
+        *out++ = width;
+        avx_pack(out, zz, width);
+        out += width * m_num_lanes * 2;
+    }
+    if (srcSize % 2)
+        *out++ = src[srcSize - 1];
+    return out - dst;
+}
+#endif
+
+size_t DeltaPackCodec::encode(uint8_t *dst, size_t dstCapacity, const uint8_t *src, size_t srcSize) noexcept
+{
+#ifdef __AVX2__
+    return encode_avx(dst, dstCapacity, src, srcSize);
+#else
+    return encode_baseline(dst, dstCapacity, src, srcSize);
+#endif
+}
+
+size_t DeltaPackCodec::decoded_size(const uint8_t *src, size_t srcSize) noexcept
+{
+    if (srcSize < m_header_size)
+        return 0;
+    uint32_t header[2];
+    memcpy(header, src, m_header_size);
+    return header[0] == m_magic ? header[1] : 0;
+}
+
+size_t DeltaPackCodec::decode(uint8_t *dst, size_t dstCapacity, const uint8_t *src, size_t srcSize) noexcept
+{
+    const size_t size = decoded_size(src, srcSize);
+    if (size == 0 || dstCapacity < size)
+        return 0;
+
+    const uint8_t *in = src + m_header_size;
+    const uint8_t *end = src + srcSize;
+    const size_t num_samples = size / 2;
+    uint16_t zz[m_num_samples_per_block];
+    uint16_t prev = 0;
+    for (size_t first = 0; first < num_samples; first += m_num_samples_per_block)
+    {
+        if (in >= end)
+            return 0;
+        const unsigned width = *in++;
+        if (width > 16 || in + width * m_num_lanes * 2 > end)
+            return 0;
+        baseline_unpack(zz, in, width);
+        in += width * m_num_lanes * 2;
+
+        const size_t n = std::min(num_samples - first, size_t(m_num_samples_per_block));
+        for (size_t i = 0; i < n; ++i)
+        {
+            prev += (zz[i] >> 1) ^ -(zz[i] & 1);
+            memcpy(dst + 2 * (first + i), &prev, 2);
+        }
+    }
+    if (size % 2)
+    {
+        if (in >= end)
+            return 0;
+        dst[size - 1] = *in++;
+    }
+    return size;
+}
@@ -0,0 +1,69 @@
+#ifndef DELTA_PACK_CODEC_HH_
+#define DELTA_PACK_CODEC_HH_
+
+/*
+ * DeltaPackCodec
+ * Description: Lossless codec for reordered Felix fragments (FelixReorder).
+ *   The payload is read as a stream of 16 bit samples. In the reordered layout
+ *   these are the ADC values of one channel after the other, so the difference
+ *   to the previous sample is small for TPC noise. Every block of 256 samples
+ *   is stored as zig-zag encoded deltas, bit-packed to the widest delta of the
+ *   block (vertical layout over 16 lanes, as in FastPFor's SIMD-BP128).
+ *   The AVX2 and the baseline encoders write the same bytes.
+ *
+ *   Format: uint32 magic, uint32 input size, then per block one width byte
+ *   (0..16) followed by 32 * width bytes. The last block is padded with zero
+ *   deltas, an odd trailing input byte is stored as is.
+ * Date: October 2019
+*/
+
+#include <inttypes.h>
+#include <immintrin.h>
+#include <cstddef>
+
+class DeltaPackCodec
+{
+  public:
+    static constexpr uint32_t m_magic = 0x314b5044; // "DPK1"
+    static constexpr size_t m_header_size = 8;
+    static constexpr size_t m_num_lanes = 16;
+    static constexpr size_t m_num_samples_per_block = 256;
+
+    // Worst case encoded size for srcSize input bytes.
+    static size_t bound(size_t srcSize)
+    {
+        const size_t num_blocks = (srcSize / 2 + m_num_samples_per_block - 1) / m_num_samples_per_block;
+        return m_header_size + num_blocks * (1 + m_num_samples_per_block * 2) + srcSize % 2;
+    }
+
+    /// METHODS ///
+    // Return the encoded size, 0 if dstCapacity is too small.
+    static size_t encode(uint8_t* dst, size_t dstCapacity, const uint8_t* src, size_t srcSize) noexcept;
+    static size_t encode_baseline(uint8_t* dst, size_t dstCapacity, const uint8_t* src, size_t srcSize) noexcept;
+#ifdef __AVX2__
+    static size_t encode_avx(uint8_t* dst, size_t dstCapacity, const uint8_t* src, size_t srcSize) noexcept;
+#endif
+
+    // Size of the decoded data, 0 if src is not a DeltaPackCodec stream.
+    static size_t decoded_size(const uint8_t* src, size_t srcSize) noexcept;
+    // Return the decoded size, 0 on a corrupt stream or if dstCapacity is too small.
+    static size_t decode(uint8_t* dst, size_t dstCapacity, const uint8_t* src, size_t srcSize) noexcept;
+
+#ifdef __AVX2__
+    static const bool avx_available = true;
+#else
+    static const bool avx_available = false;
+#endif
+
+  private:
+    static void write_header(uint8_t* dst, size_t srcSize);
+    static unsigned baseline_deltas(uint16_t* zz, const uint16_t* samples, size_t num_samples, uint16_t prev);
+    static void baseline_pack(uint8_t* dst, const uint16_t* zz, unsigned width);
+    static void baseline_unpack(uint16_t* zz, const uint8_t* src, unsigned width);
+#ifdef __AVX2__
+    static unsigned avx_deltas(uint16_t* zz, const uint16_t* samples);
+    static void avx_pack(uint8_t* dst, const uint16_t* zz, unsigned width);
+#endif
+};
+
+#endif /* DELTA_PACK_CODEC_HH_ */
@@ -2,6 +2,8 @@
 #include "dune-artdaq/DAQLogger/DAQLogger.hh"
 #include "dune-artdaq/Generators/Felix/FelixHardwareInterface.hh"
 #include "dune-artdaq/Generators/Felix/NetioHandler.hh"
+#include "dune-artdaq/Generators/Felix/NumaMemory.hh"
+#include "dune-artdaq/Generators/Felix/CPUPin.hpp"
 #include "dune-raw-data/Overlays/FelixFragment.hh"
 #include "dune-raw-data/Overlays/FragmentType.hh"
 
@@ -39,13 +41,21 @@ FelixHardwareInterface::FelixHardwareInterface(fhicl::ParameterSet const& ps) :
   message_size_ = hps.get<size_t>("message_size");
   backend_ = hps.get<std::string>("backend");
   zerocopy_ = hps.get<bool>("zerocopy");
-  offset_ = hps.get<unsigned>("offset");
+  pin_file_ = hps.get<std::string>("pin_file", "");
   window_ = hps.get<unsigned>("trigger_matching_window_ticks");
   window_offset_ = hps.get<unsigned>("trigger_matching_offset_ticks");
   reordering_ = hps.get<bool>("reordering", false);
+  reorder_avx512_ = hps.get<bool>("reorder_avx512", true);
   compression_ = hps.get<bool>("compression", false);  
   trigger_primitive_finding_ = hps.get<bool>("trigger_primitive_finding", false);
+  fused_expansion_ = hps.get<bool>("fused_expansion", true);
   qat_engine_ = hps.get<int>("qat_engine", -1);  
+  compression_threads_ = hps.get<unsigned>("compression_threads", 4);
+  compression_backend_ = hps.get<std::string>("compression_backend", "qat");
+  compression_level_ = hps.get<unsigned>("compression_level", 4);
+  request_pipeline_depth_ = hps.get<unsigned>("request_pipeline_depth", 1);
+  numa_node_ = hps.get<int>("numa_node", -1);
+  netio_interface_ = hps.get<std::string>("netio_interface", "");
   requester_address_ = ps.get<std::string>("zmq_fragment_connection_out");
   
 
@@ -74,6 +84,19 @@ FelixHardwareInterface::FelixHardwareInterface(fhicl::ParameterSet const& ps) :
   nioh_.setMessageSize(message_size_);
   nioh_.setTimeWindow(window_);
   nioh_.setWindowOffset(window_offset_);
+  nioh_.setPipelineDepth(request_pipeline_depth_);
+  nioh_.setCompressionThreads(compression_threads_);
+
+  // The link buffers and TP finders live next to the NIC the data comes in on
+  int numaNode = numa_node_;
+  if (numaNode < 0 && !netio_interface_.empty()) {
+    numaNode = numa_memory::netInterfaceNode(netio_interface_);
+    DAQLogger::LogInfo("dune::FelixHardwareInterface::FelixHardwareInterface")
+      << "Interface " << netio_interface_ << " is on NUMA node " << numaNode;
+  }
+  nioh_.setNumaNode(numaNode);
+  // Threads go on that node too, unless the pin file says otherwise
+  CPUPin::getInstance().load(pin_file_);
 
   fragment_meta_.control_word = 0xabc;
   fragment_meta_.version = 1;
@@ -82,7 +105,7 @@ FelixHardwareInterface::FelixHardwareInterface(fhicl::ParameterSet const& ps) :
 
   // Reordering
   if (reordering_) { // from config
-    nioh_.doReorder(true, false);
+    nioh_.doReorder(true, false, !reorder_avx512_);
     nioh_.doCompress(true);
     fragment_meta_.reordered = 1;
   } else {
@@ -94,20 +117,24 @@ FelixHardwareInterface::FelixHardwareInterface(fhicl::ParameterSet const& ps) :
   // For final setup and compression engine
   nioh_.recalculateFragmentSizes();
 
-  // QAT compression
+  // Compression: QAT, or a software backend.
   if (compression_) {
-    int ret = nioh_.initQAT(qat_engine_);
-    DAQLogger::LogInfo("dune::FelixHardwareInterface::FelixHardwareInterface")
-      << "Init QAT: " << ret;
-    if (ret==0){
-      fragment_meta_.compressed = 1;
-    } else {
-      fragment_meta_.compressed = 0;
+    Compressor::Backend backend = Compressor::Backend::QAT;
+    if (!Compressor::parseBackend(compression_backend_, backend) || !Compressor::available(backend)) {
+      DAQLogger::LogWarning("dune::FelixHardwareInterface::FelixHardwareInterface")
+        << "Compression backend " << compression_backend_ << " is not available, using deflate.";
+      backend = Compressor::Backend::Deflate;
     }
+    int ret = nioh_.initCompression(backend, compression_level_, qat_engine_);
+    DAQLogger::LogInfo("dune::FelixHardwareInterface::FelixHardwareInterface")
+      << "Init compression: " << ret;
+    fragment_meta_.compressed = nioh_.getCompressionFormat();
+    fragment_meta_.version = Compressor::metadataVersion(fragment_meta_.compressed);
   }
 
   // Trigger primitive finding
   nioh_.doTPFinding(trigger_primitive_finding_);
+  nioh_.doFuseExpansion(fused_expansion_);
 
   // metadata settings
   uint32_t framesPerMsg = message_size_/nioh_.getFrameSize(); // will be 12 for a looong time.
@@ -138,8 +165,8 @@ FelixHardwareInterface::~FelixHardwareInterface(){
 
   nioh_.stopContext();
   DAQLogger::LogInfo("dune::FelixHardwareInterface::FelixHardwareInterface")
-    << "Shutting down QAT.";
-  nioh_.shutdownQAT();
+    << "Shutting down compression.";
+  nioh_.shutdownCompression();
 }
 
 
@@ -152,8 +179,9 @@ void FelixHardwareInterface::StartDatataking() {
   send_calls_ = 0;
   fake_trigger_ = 0;
   fake_trigger_attempts_ = 0;
+  requests_in_flight_.clear(); // leftovers of the previous run
   nioh_.startTriggerMatchers(); // Start trigger matchers in NIOH.
-  nioh_.lockTrmsToCPUs(offset_);
+  nioh_.lockTrmsToCPUs();
 
   request_receiver_->start(); // Start request receiver.
   sleep(1);
@@ -169,7 +197,7 @@ void FelixHardwareInterface::StartDatataking() {
     DAQLogger::LogInfo("dune::FelixHardwareInterface::FelixHardwareInterface")
       << "Starting subscribers and locking to CPUs...";
     nioh_.startSubscribers();
-    nioh_.lockSubsToCPUs(offset_);// This should be always after startSubs!!!
+    nioh_.lockSubsToCPUs();// This should be always after startSubs!!!
     first_datataking_.store(false);
   }
 
@@ -251,29 +279,50 @@ bool FelixHardwareInterface::FillFragment( std::unique_ptr<artdaq::Fragment>& fr
     } 
     else {
 */
-      TriggerInfo request = request_receiver_->getNextRequest();
-      uint64_t requestSeqId = request.seqID;
-      uint64_t requestTimestamp = request.timestamp;
+      // Keep the matchers busy with up to request_pipeline_depth_ requests,
+      // then hand out the oldest one once all links have filled it.
+      SubmitRequests(frag, fraghits);
+      if (requests_in_flight_.empty()) {
+        // No request arrived within the timeout: let the matchers do their housekeeping.
+        nioh_.triggerWorkers(0, 0, frag, fraghits);
+        return false;
+      }
+      std::unique_ptr<TriggerRequest> request = std::move(requests_in_flight_.front());
+      requests_in_flight_.pop_front();
+      request->done.wait();
+      uint64_t requestSeqId = request->sequenceId;
+      uint64_t requestTimestamp = request->timestamp;
+      // The readers must not try to decompress a payload that was stored as is
+      dune::FelixFragmentBase::Metadata meta = fragment_meta_;
+      if (request->storedRaw.load(std::memory_order_relaxed)) {
+        meta.compressed = Compressor::rawFormatId;
+        meta.version = Compressor::metadataVersion(meta.compressed);
+      }
+      // A link skipped on a full queue left no frames: flag the window as incomplete
+      // with num_frames = 0, so readers do not take the missing part for data.
+      uint32_t linksSkipped = request->linksSkipped.load(std::memory_order_relaxed);
+      if (linksSkipped != 0) {
+        meta.num_frames = 0;
+        DAQLogger::LogWarning("dune::FelixHardwareInterface::FillFragment")
+          << "Fragment for TS " << request->timestamp << " and seqID " << request->sequenceId
+          << " is incomplete: " << linksSkipped << " link(s) were skipped.";
+      }
+      frag = std::move(request->frag);
+      fraghits = std::move(request->fragHits);
 
       //Compare the TPHits TS with the current Felix TS (50MHz ticks)
       std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
 
-      //auto reqMap = artdaq_request_receiver_.GetRequests();
-      //uint64_t requestSeqId = reqMap.cbegin()->first;
-      //uint64_t requestTimestamp = reqMap.cbegin()->second;
-
-      bool success = nioh_.triggerWorkers(requestTimestamp, requestSeqId, frag, fraghits);
-      if (success) {
 	//number of ticks per second for a 50MHz clock
 	auto ticks = std::chrono::duration_cast<std::chrono::duration<uint64_t, std::ratio<1,50000000>>>(now.time_since_epoch());
 
-        frag->setSequenceID(requestSeqId);
-        frag->setTimestamp(requestTimestamp);
-        frag->updateMetadata(fragment_meta_);
+      frag->setSequenceID(requestSeqId);
+      frag->setTimestamp(requestTimestamp);
+      frag->updateMetadata(meta);
 
-        fraghits->setSequenceID(requestSeqId);
-        fraghits->setTimestamp(requestTimestamp);
-        fraghits->updateMetadata(fragment_hits_meta_);
+      fraghits->setSequenceID(requestSeqId);
+      fraghits->setTimestamp(requestTimestamp);
+      fraghits->updateMetadata(fragment_hits_meta_);
 
 	if (frag->dataSizeBytes() == 0) {
 	  DAQLogger::LogWarning("dune::FelixHardwareInterface::FillFragment")
@@ -288,10 +337,6 @@ bool FelixHardwareInterface::FillFragment( std::unique_ptr<artdaq::Fragment>& fr
 	  DAQLogger::LogInfo("dune::FelixHardwareInterface::FillFragment") << "Difference between current TS and SWTrigger request TS "
 									   << ticks.count() - requestTimestamp;
 	}
-        //artdaq_request_receiver_.RemoveRequest(requestSeqId);
-      } else {
-        return false;
-      }
 
       ++send_calls_;
       return true;
@@ -303,6 +348,33 @@ bool FelixHardwareInterface::FillFragment( std::unique_ptr<artdaq::Fragment>& fr
   return true; // should never reach this
 }
 
+void FelixHardwareInterface::SubmitRequests( const std::unique_ptr<artdaq::Fragment>& frag, const std::unique_ptr<artdaq::Fragment>& fraghits ){
+  while (requests_in_flight_.size() < request_pipeline_depth_) {
+    // Only block for a new request if there is nothing in flight to hand out.
+    TriggerInfo trigger = requests_in_flight_.empty() ? request_receiver_->getNextRequest()
+                                                      : request_receiver_->getNextRequest(0);
+    if (trigger.timestamp == 0) {
+      return;
+    }
+
+    std::unique_ptr<TriggerRequest> request = std::make_unique<TriggerRequest>();
+    request->timestamp = trigger.timestamp;
+    request->sequenceId = trigger.seqID;
+    request->frag = std::unique_ptr<artdaq::Fragment>(
+      artdaq::Fragment::FragmentBytes(0, trigger.seqID, frag->fragmentID(),
+                                      fragment_type_, fragment_meta_, trigger.timestamp) );
+    request->fragHits = std::unique_ptr<artdaq::Fragment>(
+      artdaq::Fragment::FragmentBytes(0, trigger.seqID, fraghits->fragmentID(),
+                                      fragment_hits_type_, fragment_hits_meta_, trigger.timestamp) );
+    if (!nioh_.submitRequest(*request)) {
+      DAQLogger::LogWarning("dune::FelixHardwareInterface::SubmitRequests")
+        << "NIOH refused trigger TS " << trigger.timestamp << " and seqID " << trigger.seqID << ", dropping it.";
+      return;
+    }
+    requests_in_flight_.push_back(std::move(request));
+  }
+}
+
 // Pretend that the "BoardType" is some vendor-defined integer which
 // differs from the fragment_type_ we want to use as developers (and
 // which must be between 1 and 224, inclusive) so add an offset
@@ -46,6 +46,11 @@ public:
   unsigned TriggerWindowSize() const;
   unsigned TriggerWindowOffset() const;
 
+private:
+  // Keeps up to request_pipeline_depth_ requests at the matchers.
+  void SubmitRequests( const std::unique_ptr<artdaq::Fragment>& frag, const std::unique_ptr<artdaq::Fragment>& fraghits );
+
+public:
   // Inner structures
   struct LinkParameters
   {
@@ -76,22 +81,31 @@ private:
   unsigned message_size_; //480
   std::string backend_; // posix or fi_verbs
   bool zerocopy_;
-  unsigned offset_;
+  std::string pin_file_; // JSON overrides of the CPUs CPUPin picks from the topology
   unsigned window_;
   unsigned window_offset_;
   bool reordering_;
+  bool reorder_avx512_; // use the AVX512 reorder kernel if the CPU has it
   bool trigger_primitive_finding_;
+  bool fused_expansion_; // reorder from the ADCs expanded by the TP finding
   bool compression_;
   int qat_engine_;
+  unsigned compression_threads_; // workers of the compression stage
+  std::string compression_backend_; // qat, deflate, lz4, zstd or deltapack
+  unsigned compression_level_;
   std::string requester_address_;
   std::string request_address_;
   unsigned short request_port_;
   unsigned short requests_size_;
+  unsigned request_pipeline_depth_; // outstanding trigger requests
+  int numa_node_; // where the link buffers go, -1 for the node of the netio interface
+  std::string netio_interface_; // eg. ib0, to find the NUMA node of the NIC
 
   // NETIO & NIOH & RequestReceiver
   std::vector<LinkParameters> link_parameters_;
   NetioHandler& nioh_;
   std::unique_ptr<RequestReceiver> request_receiver_;
+  std::deque<std::unique_ptr<TriggerRequest>> requests_in_flight_; // in submission order
 
   // Statistics and internals
   std::atomic<unsigned long long> messages_received_;
@@ -2,6 +2,7 @@
 #include "dune-artdaq/DAQLogger/DAQLogger.hh"
 #include "dune-artdaq/Generators/Felix/FelixOnHostInterface.hh"
 #include "dune-artdaq/Generators/Felix/FelixOnHostInterface.hh"
+#include "dune-artdaq/Generators/Felix/NumaMemory.hh"
 #include "dune-raw-data/Overlays/FelixFragment.hh"
 #include "dune-raw-data/Overlays/FragmentType.hh"
 
@@ -11,6 +12,7 @@
 #include <chrono>
 #include <unistd.h>
 #include <iostream>
+#include <sstream>
 
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 
@@ -40,7 +42,7 @@ FelixOnHostInterface::FelixOnHostInterface(fhicl::ParameterSet const& ps) :
     << "Configuration for HWInterface from FHiCL."; 
 
   fhicl::ParameterSet hps = ps.get<fhicl::ParameterSet>("HWInterface");
-  pin_file_ = hps.get<std::string>("pin_file");
+  pin_file_ = hps.get<std::string>("pin_file", "");
   cpu_pin_.load(pin_file_);
 
   num_sources_ = hps.get<unsigned>("num_logical_units", 2);
@@ -59,6 +61,7 @@ FelixOnHostInterface::FelixOnHostInterface(fhicl::ParameterSet const& ps) :
   window_ = hps.get<unsigned>("trigger_matching_window_ticks");
   window_offset_ = hps.get<unsigned>("trigger_matching_offset_ticks");
   reordering_ = hps.get<bool>("reordering", false);
+  reorder_avx512_ = hps.get<bool>("reorder_avx512", true);
   compression_ = hps.get<bool>("compression", false);  
   qat_engine_ = hps.get<int>("qat_engine", -1);  
   requester_address_ = ps.get<std::string>("zmq_fragment_connection_out");
@@ -84,6 +87,30 @@ FelixOnHostInterface::FelixOnHostInterface(fhicl::ParameterSet const& ps) :
 
 /////////////// ON HOST BR /////////////////////////////
 
+  // NUMA NODE OF EACH CARD: from "numa_nodes" if given, or else the node
+  // of its PCI device, the card_open() number'th one of the "flx_driver"
+  // driver. The reader, the queues and the threads behind them go there.
+  // Only if the kernel doesn't know the node, follow the reader's CPUs
+  std::vector<int> numaNodes = hps.get<std::vector<int>>("numa_nodes", std::vector<int>());
+  const std::vector<std::string> flxDevices = numa_memory::pciDriverDevices(hps.get<std::string>("flx_driver", "flx"));
+  for (unsigned r=numaNodes.size(); r<num_sources_; ++r) {
+    const unsigned cno = r+card_offset_;
+    int node = (cno < flxDevices.size()) ? numa_memory::deviceNode(flxDevices[cno]) : -1;
+    if (node >= 0) {
+      DAQLogger::LogInfo("dune::FelixOnHostInterface::FelixOnHostInterface")
+        << "Card " << cno << " (" << flxDevices[cno] << ") is on NUMA node " << node;
+    } else {
+      cpu_set_t cpuset = cpu_pin_.getReaderCPUs(felix_id_, r);
+      for (int cpu=0; cpu<CPU_SETSIZE && node<0; ++cpu) {
+        if (CPU_ISSET(cpu, &cpuset)) { node = numa_memory::nodeOfCpu(cpu); }
+      }
+      DAQLogger::LogWarning("dune::FelixOnHostInterface::FelixOnHostInterface")
+        << "NUMA node of card " << cno << " unknown (" << flxDevices.size() << " FLX devices in sysfs), "
+        << "using node " << node << " of its reader CPUs. Set numa_nodes to place it";
+    }
+    numaNodes.push_back(node);
+  }
+
   // PREPARE SPSC QUEUES FOR DATA
   unsigned sumNumLinks = num_sources_*num_links_;
   for (unsigned i=0; i<sumNumLinks; ++i){
@@ -91,7 +118,7 @@ FelixOnHostInterface::FelixOnHostInterface(fhicl::ParameterSet const& ps) :
     //if ( num_logical_units_ == 1 && card_offset_ == 1) { 
     //  qId+= num_links_; 
     //}
-    queh_.addQueue(i, flx_queue_size_);
+    queh_.addQueue(i, flx_queue_size_, numaNodes[i/num_links_]);
     last_tss_.push_back(0);
     frag_ptrs_.push_back(nullptr);
   }
@@ -114,7 +141,7 @@ FelixOnHostInterface::FelixOnHostInterface(fhicl::ParameterSet const& ps) :
   for (unsigned r=0; r<card_readers_.size(); ++r) {
     card_readers_[r+card_offset_]->startRunning();
     parser_threads_[r+card_offset_] = std::thread(&ProtoDuneReader::run, card_readers_[r+card_offset_].get());
-    cpu_set_t cpuset = cpu_pin_.getReaderCPUs(felix_id_, r);
+    cpu_set_t cpuset = cpu_pin_.getReaderCPUs(felix_id_, r, numaNodes[r]);
     pthread_setaffinity_np(parser_threads_[r+card_offset_].native_handle(), sizeof(cpu_set_t), &cpuset);
   }
   
@@ -132,7 +159,7 @@ FelixOnHostInterface::FelixOnHostInterface(fhicl::ParameterSet const& ps) :
   fragment_meta_.reordered = 0;
   fragment_meta_.compressed = 0;
 
-  m_reorderFacility = std::make_unique<ReorderFacility>(false); // forceNoAVX = false
+  m_reorderFacility = std::make_unique<ReorderFacility>(false, !reorder_avx512_); // forceNoAVX = false
   // Reordering
   if (reordering_) { // from config
     m_compressionFacility = std::make_unique<QzCompressor>(QzCompressor::QzAlgo::Deflate, 4, 64);
@@ -276,6 +303,11 @@ void FelixOnHostInterface::StopDatataking() {
 
   // Stop triggermatchers.
 //  nioh_.stopTriggerMatchers();
+  stop_trigger_.store(true);
+  trm_done_.wait();
+  for (uint32_t i=0; i<trm_latency_hists_.size(); ++i){
+    PrintMatcherLatencyHist(i);
+  }
   DAQLogger::LogInfo("dune::FelixOnHostInterface::StopDatataking") << "Stopped triggerMatchers..";
 
   // Clean stop.
@@ -315,12 +347,17 @@ bool FelixOnHostInterface::FillFragments( artdaq::FragmentPtrs& frags ) {
 }
 
 bool FelixOnHostInterface::Busy(){
-  uint32_t busyLinks = 0;
-  for (uint32_t i=0; i<trm_extractors_.size(); ++i) {
-    bool busy = (trm_extractors_[i]->get_readiness()==false) ? true : false;
-    if (busy) { busyLinks++; }
+  return !trm_done_.done();
+}
+
+void FelixOnHostInterface::PrintMatcherLatencyHist(uint32_t tid) const {
+  const PowerTwoHist<24>& hist = trm_latency_hists_[tid];
+  std::stringstream latency_hist_ss;
+  latency_hist_ss << "TriggerMatcher[" << tid << "] latency histogram (bin low edge, microseconds):" << std::endl;
+  for(size_t i=0; i<hist.nbins(); ++i){
+    latency_hist_ss << hist.binLo(i) << "\t" << hist.bin(i) << std::endl;
   }
-  return (busyLinks != 0) ? true : false;
+  DAQLogger::LogInfo("FelixOnHostInterface::PrintMatcherLatencyHist") << latency_hist_ss.str();
 }
 
 
@@ -331,9 +368,16 @@ bool FelixOnHostInterface::TriggerWorkers(artdaq::FragmentPtrs& frags) {
   uint32_t i = 0;
   for (auto&& frag : frags){
     frag_ptrs_[i] = frag.get();
-    trm_extractors_[i]->set_work(trm_functors_[i]);
     ++i;
   }
+  // Fan out to the extractors, then park until the slowest link is done.
+  trm_done_.reset(i);
+  for (uint32_t j=0; j<i; ++j){
+    if (!trm_extractors_[j]->set_work(trm_functors_[j], &trm_done_)) {
+      DAQLogger::LogWarning("FelixOnHostInterface::TriggerWorkers") << "TriggerMatcher[" << j << "] is still busy, skipping it.";
+      trm_done_.count_down();
+    }
+  }
   auto tdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t1);
   DAQLogger::LogInfo("FelixOnHostInterface::TriggerWorkers") << " Setting work took " << tdelta.count() << " us";
 
@@ -343,11 +387,9 @@ bool FelixOnHostInterface::TriggerWorkers(artdaq::FragmentPtrs& frags) {
   //}
 
   t1 = std::chrono::high_resolution_clock::now();
-  while (Busy()) {
-    std::this_thread::sleep_for(std::chrono::microseconds(50));
-  }
+  trm_done_.wait();
   tdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t1);
-  DAQLogger::LogInfo("FelixOnHostInterface::TriggerWorkers") << " Busy took " << tdelta.count() << " us";
+  DAQLogger::LogInfo("FelixOnHostInterface::TriggerWorkers") << " Matchers took " << tdelta.count() << " us";
 
   if (trigger_ts_ == 0) {
     return false;  
@@ -358,6 +400,9 @@ bool FelixOnHostInterface::TriggerWorkers(artdaq::FragmentPtrs& frags) {
 
 bool FelixOnHostInterface::SetupTriggerMatchers(){
   stop_trigger_.store(false);
+  trm_functors_.clear();
+  trm_latency_hists_.assign(queh_.getNumOfChannels(), PowerTwoHist<24>());
+  trm_done_.reset(0);
   for (uint32_t i=0; i<queh_.getNumOfChannels(); ++i){
     // Prepare resources
     last_tss_.push_back(0);
@@ -365,59 +410,37 @@ bool FelixOnHostInterface::SetupTriggerMatchers(){
     set_thread_name(trm_extractors_[i]->get_thread(), "trm", i);
     uint32_t tid = i;
     uint32_t framesPerMsg = message_size_/frame_size_;
-    size_t frameCapacity = flx_queue_size_;
 
     // Create functions
-    trm_functors_.push_back( [&, tid, frameCapacity, framesPerMsg] {
+    auto match = [&, tid, framesPerMsg] {
       frag_ptrs_[tid]->setSequenceID(trigger_seq_id_);
       frag_ptrs_[tid]->setTimestamp(trigger_ts_);
       frag_ptrs_[tid]->updateMetadata(fragment_meta_);
 
-      UniqueFrameQueue& queue = queh_.getQueue(tid);
+      LinkBuffer& buffer = *queh_.getQueue(tid);
       if(stop_trigger_.load()){ // Safety if stop trigger is issued.
         DAQLogger::LogInfo("FelixOnHostInterface::SetupTriggerMatchers")
           << "Should stop triggers, bailing out.\n";
           return;
       }
 
-      if (queue->isEmpty()) {
+      if (buffer.isEmpty()) {
         DAQLogger::LogWarning("FelixOnHostInterface::TriggerMatcher")
           << " ["<< tid << "] Queue is empty... Is FelixCore publishing data?\n";
         return;
       }
 
-      if (trigger_ts_==0){ // Check if we got a trigger request
-        size_t qsize = queue->sizeGuess();
-        if (qsize > 0.5 * flx_queue_size_){
-          DAQLogger::LogInfo("FelixOnHostInterface::TriggerMatcher") 
-            << " ["<< tid <<"] Removing old non requested data; (" << qsize << ") messages in queue.";
-          queue->popXFront(0.8 * qsize);
-        }
+      if (trigger_ts_==0){ // No request: the link buffer recycles its oldest slots by itself.
         return;
       }
       // From here on we got a trigger and we need to extract.
       uint_fast64_t startWindowTimestamp = trigger_ts_ - (uint_fast64_t)(window_offset_ * tick_dist_);
-      dune::WIBHeader wh = *(reinterpret_cast<const dune::WIBHeader*>( queue->frontPtr() ));
-      last_tss_[tid] = wh.timestamp();
-      uint_fast64_t lastTs = last_tss_[tid];
-      // Check if there is such a delay in trigger requests that data have gone already.
-      if (lastTs > startWindowTimestamp ) {
-        DAQLogger::LogWarning("FelixOnHostInterface::TriggerMatcher")
-          << "Requested data are so old that they were dropped. Trigger request TS = "
-         << trigger_ts_ << ", oldest TS in queue = "  << lastTs;
-        return;
-      }
-
-      // Calculate tick difference
-      uint_fast64_t timeTickDiff = (startWindowTimestamp-lastTs)/(uint_fast64_t)tick_dist_;
+      uint_fast64_t lastMsgTimestamp = startWindowTimestamp + (m_timeWindowNumMessages-1)*framesPerMsg*tick_dist_;
 
-      // Wait to have enough frames in the queue
-      uint_fast64_t minQueueSize = (timeTickDiff + window_) / framesPerMsg + 10;
-      size_t qsize = queue->sizeGuess();
+      // Wait until the last message of the window arrived.
       uint_fast32_t waitingForDataCtr = 0;
-      while (qsize < minQueueSize){
+      while (buffer.newestTimestamp() < lastMsgTimestamp){
         std::this_thread::sleep_for(std::chrono::microseconds(100));
-        qsize = queue->sizeGuess();
         ++waitingForDataCtr;
         if (waitingForDataCtr > 20000){
           DAQLogger::LogWarning("FelixOnHostInterface::TriggerMatcher")
@@ -426,34 +449,76 @@ bool FelixOnHostInterface::SetupTriggerMatchers(){
         }
       }
 
-      // Pop until the start of window.
-      queue->popXFront(timeTickDiff/framesPerMsg);
+      // Direct lookup of the first message of the window.
+      uint64_t startSeq = 0;
+      LinkBuffer::Status status = buffer.locate(startWindowTimestamp, startSeq);
+      if (status == LinkBuffer::Status::Ok && startSeq + m_timeWindowNumMessages > buffer.written()) {
+        status = LinkBuffer::Status::NotYet;
+      }
+      if (status == LinkBuffer::Status::NotYet) {
+        last_tss_[tid] = buffer.newestTimestamp();
+        DAQLogger::LogWarning("FelixOnHostInterface::TriggerMatcher")
+          << "Requested data are not yet written. Trigger request TS = "
+          << trigger_ts_ << ", newest TS in buffer = "  << last_tss_[tid];
+        return;
+      }
+      if (status != LinkBuffer::Status::Ok) {
+        last_tss_[tid] = buffer.timestampAt(buffer.oldest());
+        DAQLogger::LogWarning("FelixOnHostInterface::TriggerMatcher")
+          << "Requested data are so old that they were dropped. Trigger request TS = "
+         << trigger_ts_ << ", oldest TS in buffer = "  << last_tss_[tid];
+        return;
+      }
+      last_tss_[tid] = buffer.timestampAt(startSeq);
 
       // FILL FRAGMENT at frag_ptrs[tid]
       frag_ptrs_[tid]->resizeBytes(m_timeWindowByteSizeOut);
       uint64_t fragSize = m_timeWindowByteSizeOut;
       if (!reordering_)
       {
-        for (unsigned i = 0; i < m_timeWindowNumMessages; i++)
-        {
-          memcpy(frag_ptrs_[tid]->dataBeginBytes() + message_size_ * i, (char *)queue->frontPtr(), message_size_);
-          queue->popFront();
-        } 
+        buffer.copyOut((char *)frag_ptrs_[tid]->dataBeginBytes(), startSeq, m_timeWindowNumMessages, message_size_);
       } else {
         m_reorderFacility->do_reorder_start(m_timeWindowNumFrames);
-        for (unsigned i = 0; i < m_timeWindowNumMessages; i++) {
-          m_reorderFacility->do_reorder_part(
-            frag_ptrs_[tid]->dataBeginBytes(),
-            (uint_fast8_t *)queue->frontPtr(),
-            i * framesPerMsg, (i + 1) * framesPerMsg
-          );
-          queue->popFront();
+        if (message_size_ == sizeof(SUPERCHUNK_CHAR_STRUCT)) {
+          LinkBuffer::Span spans[2];
+          unsigned nspans = buffer.spans(startSeq, m_timeWindowNumMessages, spans);
+          unsigned frame = 0;
+          for (unsigned s = 0; s < nspans; ++s) {
+            unsigned nframes = spans[s].messages * framesPerMsg;
+            m_reorderFacility->do_reorder_part(
+              frag_ptrs_[tid]->dataBeginBytes(),
+              (uint_fast8_t *)spans[s].data,
+              frame, frame + nframes
+            );
+            frame += nframes;
+          }
+        } else {
+          for (unsigned i = 0; i < m_timeWindowNumMessages; i++) {
+            m_reorderFacility->do_reorder_part(
+              frag_ptrs_[tid]->dataBeginBytes(),
+              (uint_fast8_t *)buffer.at(startSeq + i),
+              i * framesPerMsg, (i + 1) * framesPerMsg
+            );
+          }
         }
       }
 
+      // The writer may have lapped us while we were reading in place.
+      if (!buffer.valid(startSeq)) {
+        DAQLogger::LogWarning("FelixOnHostInterface::TriggerMatcher")
+          << "[" << tid << "] Link buffer overwritten during readout of trigger " << trigger_ts_ << "!";
+      }
+
       if (compression_) {
         uint_fast32_t compSize = m_compressionFacility->do_compress(frag_ptrs_[tid], fragSize);
         DAQLogger::LogInfo("FelixOnHostInterface::TriggerMatcher") << "[" << tid << "] Compressed size: " << compSize;
+        if (compSize == 0) {
+          // do_compress() left the payload as it was: say so in the metadata
+          frag_ptrs_[tid]->metadata<dune::FelixFragmentBase::Metadata>()->compressed = 0;
+          if (reordering_) {
+            frag_ptrs_[tid]->resizeBytes(fragSize);
+          }
+        }
       } else {
         if (reordering_) {
           frag_ptrs_[tid]->resizeBytes(fragSize);
@@ -464,6 +529,14 @@ bool FelixOnHostInterface::SetupTriggerMatchers(){
       frag_ptrs_[tid]->print(oss);
       DAQLogger::LogInfo("FelixOnHostInterface::TriggerMatcher") << "[" << tid << "] Created frag: " << oss.str();
 
+    };
+
+    // Time the matcher. Its thread reports to the completion latch once it is idle again.
+    trm_functors_.push_back( [this, tid, match] {
+      auto t0 = std::chrono::high_resolution_clock::now();
+      match();
+      auto tdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t0);
+      trm_latency_hists_[tid].fill(tdelta.count());
     });
   }
   return true; 
@@ -479,7 +552,7 @@ void FelixOnHostInterface::LockTriggerMatchers() {
     // RS : Not a good attempt.
     //CPU_SET(cpuid+16, &cpuset);
 
-    cpu_set_t cpuset = cpu_pin_.getSelectorCPUs(i);
+    cpu_set_t cpuset = cpu_pin_.getSelectorCPUs(i, queh_.getNumaNode(i));
     int ret = pthread_setaffinity_np(trm_extractors_[i]->get_thread().native_handle(), sizeof(cpu_set_t), &cpuset);
     if (ret!=0) {
       DAQLogger::LogError("FelixOnHostInterface::lockTrmsToCPUs")
@@ -8,7 +8,10 @@
 
 #include "NetioHandler.hh"
 #include "QueueHandler.hh"
+#include "QzCompressor.hh"
 #include "RequestReceiver.hh"
+#include "CompletionLatch.hh"
+#include "dune-artdaq/Generators/swTrigger/PowerTwoHist.hh"
 
 #include "dune-artdaq/Generators/Felix/FelixProtoduneReader.hpp"
 
@@ -34,6 +37,8 @@ public:
 
   // Busy check of NETIO communication
   bool Busy();
+  // Per link trigger matcher latency
+  void PrintMatcherLatencyHist(uint32_t tid) const;
   bool SetupTriggerMatchers();
   void LockTriggerMatchers();
   bool TriggerWorkers(artdaq::FragmentPtrs& frags);
@@ -87,6 +92,7 @@ private:
   unsigned window_;
   unsigned window_offset_;
   bool reordering_;
+  bool reorder_avx512_; // use the AVX512 reorder kernel if the CPU has it
   bool compression_;
   int qat_engine_;
   std::string requester_address_;
@@ -104,6 +110,8 @@ private:
   // TriggerMatchers
   std::vector<std::unique_ptr<ReusableThread>> trm_extractors_;
   std::vector<std::function<void()>> trm_functors_;
+  CompletionLatch trm_done_; // armed with the number of links per request
+  std::vector<PowerTwoHist<24>> trm_latency_hists_; // per link, microseconds
   std::vector<artdaq::Fragment*> frag_ptrs_;
   // Thread control
   std::atomic<bool> stop_trigger_;
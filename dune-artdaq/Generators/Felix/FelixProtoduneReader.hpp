@@ -9,6 +9,7 @@
 
 #include "dune-artdaq/Generators/Felix/QueueHandler.hh"
 #include "dune-artdaq/Generators/Felix/NetioHandler.hh"
+#include "dune-artdaq/Generators/Felix/Utilities.hh"
 
 #include "ProducerConsumerQueue.hh"
 
@@ -32,7 +33,19 @@
 #define SUPERCHUNK_SIZE (5568) // for 12: 5568  for 6: 2784  for 24: 11136
 
 // Threshold. There needs to be this amount of blocks available for the readout loop to start.
-#define BLOCK_THRESHOLD (256) //256
+// The loop polls adaptively (see POLL_SPIN_US), so it doesn't need to wait for a big batch.
+#define BLOCK_THRESHOLD (1) //256
+
+// How long the readout loop busy-polls the DMA write pointer after the last blocks came in,
+// before it starts sleeping between polls. The sleeps double up to POLL_MAX_SLEEP_US.
+#define POLL_SPIN_US (100)
+#define POLL_MAX_SLEEP_US (5000) // The old fixed poll time
+
+// Number of block ranges each dispatcher queue holds. A range is a run of consecutive blocks
+// from one elink, so this is at least this many blocks of backlog for the elink's parser.
+#define DISPATCH_QUEUE_RANGES (1<<18)
+// The longest a dispatcher sleeps between polls of its queue when its elink is idle
+#define DISPATCH_MAX_SLEEP_US (100)
 
 #define IOVEC_QUEUE 1
 
@@ -139,7 +152,7 @@ struct ProtoDuneParserOps : public felix::packetformat::ParserOperations
 
   //folly::ProducerConsumerQueue<felix::packetformat::block> m_q_blocks;
 
-  std::unique_ptr<folly::ProducerConsumerQueue<SUPERCHUNK_CHAR_STRUCT>>& m_pcq;
+  UniqueLinkBuffer& m_pcq;
 
 #ifdef TAGPUBLISHER
   std::unique_ptr<netio::tag_publisher> m_tagPub;
@@ -424,22 +437,30 @@ struct ProtoDuneParserOps : public felix::packetformat::ParserOperations
     msg.serialize_to_usr_buffer((void*)&superchunk);    
     //m_tagPub->publish(msg);
 #elif defined(DUMP_SUPCHUNKS) //DUMP_SUPCHUNKS
-    SUPERCHUNK_CHAR_STRUCT superchunk;
+    SUPERCHUNK_CHAR_STRUCT* superchunk = m_pcq->claim();
     long unsigned bytes_copied_chunk = 0;
     auto subchunk_data = chunk.subchunks();
     auto subchunk_sizes = chunk.subchunk_lengths();
     unsigned n_subchunks = chunk.subchunk_number();
     for(unsigned i=0; i<n_subchunks; i++)
       {
-        dump_to_buffer(subchunk_data[i], subchunk_sizes[i], (void*)&superchunk, bytes_copied_chunk);
+        dump_to_buffer(subchunk_data[i], subchunk_sizes[i], (void*)superchunk, bytes_copied_chunk);
         bytes_copied_chunk += subchunk_sizes[i];
       }
-    m_pcq->write( std::move(superchunk) );
+    m_pcq->publish();
 #else
-    netio::message msg((uint8_t**)chunk.subchunks(), chunk.subchunk_lengths(), chunk.subchunk_number());
-    SUPERCHUNK_CHAR_STRUCT superchunk;
-    msg.serialize_to_usr_buffer((void*)&superchunk);
-    m_pcq->write( std::move(superchunk) ); 
+    // The subchunks go straight into the next slot of the link buffer, which
+    // is the only copy. The chunk is SUPERCHUNK_SIZE bytes, as checked above,
+    // so it fills the slot exactly
+    static_assert(SUPERCHUNK_SIZE == sizeof(SUPERCHUNK_CHAR_STRUCT), "a chunk has to fill a link buffer slot");
+    char* slot = m_pcq->claim()->fragments;
+    const uint32_t n_subchunks = chunk.subchunk_number();
+    for (uint32_t i=0; i<n_subchunks; ++i)
+    {
+      memcpy(slot, chunk.subchunks()[i], chunk.subchunk_lengths()[i]);
+      slot += chunk.subchunk_lengths()[i];
+    }
+    m_pcq->publish();
 //    m_pub->publish(0, msg);
 #endif
     log_packet(false);
@@ -513,6 +534,18 @@ struct ProtoDuneParserOps : public felix::packetformat::ParserOperations
 
 class ProtoDuneDispatcher
 {
+public:
+  // A run of `count` consecutive blocks of this dispatcher's elink in the CMEM buffer,
+  // starting at virtual address `addr`. `end` is the block index one past the run,
+  // counting every block the reader has read since the start, and keeps going up
+  // when the buffer wraps round. A range never wraps round the buffer.
+  struct BlockRange
+  {
+    uint64_t addr;
+    uint64_t end;
+    uint32_t count;
+  };
+
 private:
   typedef felix::packetformat::BlockParser<ProtoDuneParserOps> ProtoDuneParser;
   bool m_running;
@@ -523,8 +556,12 @@ private:
   //unsigned m_readVirtAddr; //eg180615 for GLM: this was not defined.. was it an atomic?
   ProtoDuneParserOps m_parser_ops;
   ProtoDuneParser m_parser;
-  folly::ProducerConsumerQueue<uint64_t> m_queue;
+  folly::ProducerConsumerQueue<BlockRange> m_queue;
   //boost::lockfree::spsc_queue<uint64_t, boost::lockfree::capacity<1024*1024> > m_queue;
+  std::atomic<uint64_t> m_processedEnd; // The end of the last range the parser is done with
+  uint64_t m_queuedEnd;                 // The end of the last range queued. Reader only
+  uint64_t m_failures;                  // Times the queue was full. Reader only
+  uint64_t m_failures_interval;
 public:
   ProtoDuneDispatcher(unsigned card, unsigned link, unsigned tag, unsigned queueId )://std::unique_ptr<netio::publish_socket>& socket) :
     m_running(false),
@@ -533,7 +570,11 @@ public:
     m_queueId(queueId),
     m_parser_ops(tag, link, queueId),
     m_parser(m_parser_ops),
-    m_queue(6000000)
+    m_queue(DISPATCH_QUEUE_RANGES),
+    m_processedEnd(0),
+    m_queuedEnd(0),
+    m_failures(0),
+    m_failures_interval(1)
   {
 
     unsigned id = link;
@@ -555,16 +596,34 @@ public:
     statistics.detach();
 
   }
+
+  unsigned queueId() const { return m_queueId; }
+
   void run()
   {
     int expected = -1;
+    // Spin while ranges keep coming, and back off to the old 100us sleep when the elink is idle
+    AdaptiveBackoff backoff(std::chrono::microseconds(POLL_SPIN_US), std::chrono::microseconds(DISPATCH_MAX_SLEEP_US));
     while (m_running)
     {
-      uint64_t block_addr;
-      if (m_queue.read( block_addr ))
+      BlockRange range;
+      if (!m_queue.read( range ))
+      {
+        // no data to process, wait a bit
+        backoff.wait();
+        continue;
+      }
+      backoff.reset();
+      for (uint32_t i = 0; i<range.count; ++i)
       {
+        const char* block_addr = (const char*)range.addr + i*BLOCKSIZE;
+        // The next block follows this one: get it on its way while this one is parsed
+        if (i+1<range.count)
+        {
+          for (size_t offset = 0; offset<BLOCKSIZE; offset+=64) __builtin_prefetch(block_addr+BLOCKSIZE+offset);
+        }
         const felix::packetformat::block* block = const_cast<felix::packetformat::block*>
-                                                  (felix::packetformat::block_from_bytes((const char*)block_addr));
+                                                  (felix::packetformat::block_from_bytes(block_addr));
         if (expected >= 0) {
           if (expected != block->seqnr){
             //std::cout << "WOOF WOOF --> link:" << m_linkId << " Not expected seqn! Expected:" << expected << " but got:" << block->seqnr << std::endl;     
@@ -574,11 +633,7 @@ public:
 
         m_parser.process(block);
       }
-      else
-      {
-        // no data to process, sleep a bit
-        std::this_thread::sleep_for(std::chrono::microseconds(100));
-      }
+      m_processedEnd.store(range.end, std::memory_order_release);
     }
   }
 
@@ -591,29 +646,49 @@ public:
   			return m_readVirtAddr;
   		}
   */
-  void queue(uint64_t block_addr)
+  // Reader side.
+  // Nothing is queued, and false returned, if the queue is full: the reader then
+  // leaves the range in the buffer, and does not let the card go past it
+  bool queue(const BlockRange& range)
   {
-    //blocking call: do not allow the felix reader to continue if we can't process the data fast enough!
-    static uint64_t failures=0;
-    static uint64_t failures_interval=1;
+    //do not allow the felix reader to continue if we can't process the data fast enough!
     m_qsize = m_queue.sizeGuess();
-    if ( !m_queue.write(block_addr) )
+    if ( !m_queue.write(range) )
     {
-      failures++;
-      if(failures > 0 && failures%failures_interval == 0)
+      m_failures++;
+      if(m_failures%m_failures_interval == 0)
       {
-        std::cout << "Dispatcher queue for elink " << m_linkId << " full!!! " << failures <<
-                  " dropped blocks.";
-        failures_interval *=100;
+        std::cout << "Dispatcher queue for elink " << m_linkId << " full!!! The reader waited " << m_failures <<
+                  " times." << '\n';
+        m_failures_interval *=100;
       }
+      return false;
     }
+    m_queuedEnd = range.end;
+    return true;
+  }
+
+  // Reader side. The oldest block (counted as BlockRange::end) the parser may still
+  // need, given that the reader has read up to `readEnd`: the start of the ranges
+  // still queued, or nothing if they have all been parsed
+  uint64_t oldestNeeded(uint64_t readEnd) const
+  {
+    const uint64_t processed = m_processedEnd.load(std::memory_order_acquire);
+    return (processed == m_queuedEnd) ? readEnd : processed;
   }
 
 };
 
 
-std::map<unsigned, std::unique_ptr<FlxCard>> m_flxCards;
-std::mutex card_mutex;
+// Each card, with the lock for its control operations (open, resets, starting the DMA).
+// Reading and moving the pointers of a DMA only touches the descriptor registers of that
+// DMA, which belong to a single reader, so the readout loop takes no lock.
+struct FlxCardHandle
+{
+  std::unique_ptr<FlxCard> card;
+  std::mutex mutex;
+};
+std::map<unsigned, FlxCardHandle> m_flxCards;
 
 class ProtoDuneReader
 {
@@ -622,11 +697,13 @@ private:
   //FlxCard m_flxCard;
   unsigned m_cardno;
   unsigned m_dmaid;
+  FlxCardHandle* m_card;
   int m_cmem_handle;            // handle to the DMA memory block
   uint64_t m_virt_addr;           // virtual address of the DMA memory block
   uint64_t m_phys_addr;           // physical address of the DMA memory block
   uint64_t m_currentAddress;      // pointer to the current write position for the card
   unsigned m_read_index;
+  uint64_t m_read_count;          // Blocks read since the start, as in ProtoDuneDispatcher::BlockRange::end
   u_long dst;
 
   ////////////////
@@ -647,7 +724,8 @@ public:
     unsigned id = cardno + dmaid;
 
     std::cout << "INSERT UNIQUE FLXCARD FOR CARD: " << m_cardno << '\n';
-    m_flxCards[m_cardno] = std::make_unique<FlxCard>();
+    m_card = &m_flxCards[m_cardno];
+    m_card->card = std::make_unique<FlxCard>();
 
     std::thread statistics([this, id]()
     {
@@ -693,9 +771,8 @@ public:
     try
     {
       std::cout <<"Opening CARD " << m_cardno << '\n';
-      card_mutex.lock();
-      m_flxCards[m_cardno]->card_open(m_cardno, LOCK_NONE);
-      card_mutex.unlock();
+      std::lock_guard<std::mutex> lock(m_card->mutex);
+      m_card->card->card_open(m_cardno, LOCK_NONE);
     }
     catch(FlxException ex)
     {
@@ -707,29 +784,29 @@ public:
     m_cmem_handle = dma_allocate_cmem(PROTODUNE_MEMSIZE, &m_phys_addr, &m_virt_addr);
     std::cout <<"CMEM circular buffer allocated (" << PROTODUNE_MEMSIZE/1024/1024 << " MB)" << '\n';
 
-    card_mutex.lock();
-    m_flxCards[m_cardno]->dma_stop(m_dmaid);
+    m_card->mutex.lock();
+    m_card->card->dma_stop(m_dmaid);
     std::cout <<"flxCard.dma_stop issued." << '\n';
 
     //m_flxCards[m_cardno]->irq_disable();
     //std::cout <<"flxCard.irq_disable issued.");
 
-    m_flxCards[m_cardno]->dma_reset();
+    m_card->card->dma_reset();
     std::cout <<"flxCard.dma_reset issued." << '\n';
 
-    m_flxCards[m_cardno]->soft_reset();
+    m_card->card->soft_reset();
     std::cout <<"flxCard.soft_reset issued." << '\n';
 
     //flxCard.irq_disable(ALL_IRQS);
     //std::cout <<"flxCard.irq_diable(ALL_IRQS) issued.");
 
-    m_flxCards[m_cardno]->dma_fifo_flush();
+    m_card->card->dma_fifo_flush();
     std::cout <<"flxCard.dma_fifo_flush issued." << '\n';
 
     //m_flxCards[m_cardno]->irq_enable(IRQ_DATA_AVAILABLE);
     //std::cout <<"flxCard.irq_enable(IRQ_DATA_AVAILABLE) issued.");
 
-    card_mutex.unlock();
+    m_card->mutex.unlock();
 
 
     ///////////////////
@@ -741,12 +818,15 @@ public:
     m_currentAddress = m_phys_addr;
     dst = m_phys_addr;
     m_read_index = 0;
+    m_read_count = 0;
 
     CPUPin& cpup = CPUPin::getInstance();
     for (uint32_t i = 0; i<m_dispatchers.size(); ++i)
     {
       m_dispatchers[i]->isRunning(true);
-      cpu_set_t cpuset = cpup.getDispatcherCPUs(712, m_cardno, i);
+      // Next to the queue it fills
+      int node = QueueHandler::getInstance().getNumaNode(m_dispatchers[i]->queueId());
+      cpu_set_t cpuset = cpup.getDispatcherCPUs(712, m_cardno, i, node);
       m_dispatcherThreads[i] = std::thread(&ProtoDuneDispatcher::run, m_dispatchers[i].get());
       int rc0 = pthread_setaffinity_np(m_dispatcherThreads[i].native_handle(), sizeof(cpu_set_t),
                                        &cpuset);
@@ -775,9 +855,9 @@ public:
       rcc_error_print(stdout, ret);
       std::cout << "You either allocated to little CMEM memory or run felixcore demanding too much CMEM memory." << '\n';
       std::cout << "Fix the CMEM memory reservation in the driver or run felixcore with the -m option." << '\n';
-      card_mutex.lock();
-      m_flxCards[m_cardno]->card_close();
-      card_mutex.unlock();
+      m_card->mutex.lock();
+      m_card->card->card_close();
+      m_card->mutex.unlock();
       exit(EXIT_FAILURE);
     }
 
@@ -796,19 +876,18 @@ public:
            PROTODUNE_MEMSIZE;
   }
 
+  // A single register read of our own DMA's status: no lock needed
   inline void read_current_addr()
   {
-    card_mutex.lock();
-    m_currentAddress = m_flxCards[m_cardno]->m_bar0->DMA_DESC_STATUS[m_dmaid].current_address;
-    card_mutex.unlock();
+    m_currentAddress = m_card->card->m_bar0->DMA_DESC_STATUS[m_dmaid].current_address;
   }
 
   void startRunning()
   {
     std::cout <<"issuing flxCard.dma_to_host for card " << m_cardno << " dma id:" << m_dmaid << '\n';
-    card_mutex.lock();
-    m_flxCards[m_cardno]->dma_to_host(m_dmaid, m_phys_addr, PROTODUNE_MEMSIZE, FLX_DMA_WRAPAROUND);
-    card_mutex.unlock();
+    m_card->mutex.lock();
+    m_card->card->dma_to_host(m_dmaid, m_phys_addr, PROTODUNE_MEMSIZE, FLX_DMA_WRAPAROUND);
+    m_card->mutex.unlock();
     std::cout <<"flxCard.dma_to_host issued for card " << m_cardno << "." << '\n';
   }
 
@@ -870,24 +949,42 @@ public:
   void run()
   {
     this->isRunning(true);
+    // Busy-poll while blocks are coming in, and back off to the old
+    // 5ms poll time when the links are quiet
+    AdaptiveBackoff backoff(std::chrono::microseconds(POLL_SPIN_US), std::chrono::microseconds(POLL_MAX_SLEEP_US));
     while (m_running)
     {
-      // Loop while there are not enough data
-      while((m_currentAddress < m_phys_addr) || (m_phys_addr+PROTODUNE_MEMSIZE < m_currentAddress))
-      {
-        read_current_addr();
-        std::this_thread::sleep_for(std::chrono::microseconds(5000)); //cfg.poll_time = 5000
-      }
-
-      while (bytesAvailable() < BLOCK_THRESHOLD*BLOCKSIZE)
+      read_current_addr();
+      // Loop while there are not enough data (or the card isn't writing into our buffer yet)
+      if ((m_currentAddress < m_phys_addr) || (m_phys_addr+PROTODUNE_MEMSIZE < m_currentAddress) ||
+          bytesAvailable() < BLOCK_THRESHOLD*BLOCKSIZE)
       {
-        std::this_thread::sleep_for(std::chrono::microseconds(5000)); // cfg.poll_time = 5000
-        read_current_addr();
+        backoff.wait();
+        continue;
       }
 
-      u_long write_index = (m_currentAddress - m_phys_addr) / BLOCKSIZE;
-
-      uint64_t bytes = 0;
+      // The write pointer can be at the very end of the buffer, which is block 0
+      const u_long n_blocks = PROTODUNE_MEMSIZE / BLOCKSIZE;
+      u_long write_index = ((m_currentAddress - m_phys_addr) / BLOCKSIZE) % n_blocks;
+
+      // Each run of consecutive blocks from the same elink goes to its
+      // dispatcher as one range. If a dispatcher is full, its range stays
+      // in the buffer and the reading carries on from there next time
+      ProtoDuneDispatcher* pending = nullptr;
+      ProtoDuneDispatcher::BlockRange range{0, 0, 0};
+      u_long range_index = m_read_index;
+      const uint64_t first_count = m_read_count;
+      auto flush = [&]() {
+        if (pending == nullptr) return true;
+        const bool queued = pending->queue(range);
+        if (!queued)
+        {
+          m_read_index = range_index;
+          m_read_count = range.end - range.count;
+        }
+        pending = nullptr;
+        return queued;
+      };
       while (m_read_index != write_index)
       {
         uint64_t fromAddress = m_virt_addr + (m_read_index * BLOCKSIZE);
@@ -902,23 +999,35 @@ public:
         //}
         //
 
-        m_dispatchers[block->elink/64]->queue( fromAddress ); 
-        //parser.process(block);
+        ProtoDuneDispatcher* dispatcher = m_dispatchers[block->elink/64].get();
+        if (dispatcher != pending)
+        {
+          if (!flush()) break;
+          pending = dispatcher;
+          range = ProtoDuneDispatcher::BlockRange{fromAddress, m_read_count, 0};
+          range_index = m_read_index;
+        }
+        ++range.count;
+        ++range.end;
 
-        m_read_index = (m_read_index + 1) % (PROTODUNE_MEMSIZE / BLOCKSIZE);
-        bytes += BLOCKSIZE;
+        m_read_index = (m_read_index + 1) % n_blocks;
+        ++m_read_count;
+        // Ranges don't wrap round the buffer
+        if (m_read_index == 0 && !flush()) break;
       }
+      flush();
+
+      // Nothing went out: the dispatchers are full, so wait for them as if there was no data
+      if (m_read_count == first_count) backoff.wait();
+      else                             backoff.reset();
 
       // here check if we can move the read pointer in the circ buf!!
-      //uint64_t dst = m_phys_addr + (write_index*BLOCKSIZE) - (MARGIN_BLOCKS*BLOCKSIZE);
-      dst = m_phys_addr + (write_index*BLOCKSIZE) - (MARGIN_BLOCKS*BLOCKSIZE);
-      if (dst < m_phys_addr)
-      {
-        dst += PROTODUNE_MEMSIZE;
-      }
-      card_mutex.lock();
-      m_flxCards[m_cardno]->dma_set_ptr(m_dmaid, dst);
-      card_mutex.unlock(); 
+      // The card may write up to the oldest block a dispatcher still has to parse, less the margin
+      uint64_t oldest = m_read_count;
+      for (auto& dispatcher : m_dispatchers) oldest = std::min(oldest, dispatcher->oldestNeeded(m_read_count));
+      dst = m_phys_addr + ((oldest + n_blocks - MARGIN_BLOCKS) % n_blocks) * BLOCKSIZE;
+      // Only our DMA's descriptor: no lock needed
+      m_card->card->dma_set_ptr(m_dmaid, dst);
     }
 
     std::this_thread::sleep_for(std::chrono::milliseconds(1000));
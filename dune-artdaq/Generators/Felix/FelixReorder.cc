@@ -3,7 +3,10 @@
 #include "dune-raw-data/Overlays/FelixFragment.hh"
 #include "FelixReorder.hh"
 
-#define UNUSED(x) (void)(x)
+// The SIMD kernels are compiled for their instruction set whatever the build
+// flags say, and only run when the CPU has it: see avx_available/avx512_available.
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
 
 
 void FelixReorder::copy_headers(uint8_t *dst, const uint8_t *src) {
@@ -120,7 +123,7 @@ bool FelixReorder::do_reorder_part(uint8_t *dst, const uint8_t *src, const unsig
     return true;
 }
 
-#ifdef __AVX2__
+TARGET_AVX2
 void FelixReorder::reorder_avx_handle_four_segments(const uint8_t *src, uint8_t *dst, const unsigned &num_frames)
 {
     /// Set up the two registers
@@ -163,12 +166,14 @@ void FelixReorder::reorder_avx_handle_four_segments(const uint8_t *src, uint8_t
     }
 }
 
+TARGET_AVX2
 void FelixReorder::reorder_avx_handle_block(const uint8_t *src, uint8_t *dst, const unsigned &num_frames)
 {
     reorder_avx_handle_four_segments(src, dst, num_frames);
     reorder_avx_handle_four_segments(src + 4 * m_num_bytes_per_seg, dst + 4 * m_num_bytes_per_reord_seg * num_frames, num_frames);
 }
 
+TARGET_AVX2
 void FelixReorder::reorder_avx_handle_frame(const uint8_t *src, uint8_t *dst, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty)
 {
     /// Destinations
@@ -189,6 +194,8 @@ void FelixReorder::reorder_avx_handle_frame(const uint8_t *src, uint8_t *dst, un
 
 bool FelixReorder::do_avx_reorder(uint8_t *dst, const uint8_t *src, const unsigned &num_frames, unsigned *num_faulty) noexcept
 {
+    if (!avx_available)
+        return false;
     try
     {
         for (unsigned i = 0; i < num_frames; i++)
@@ -205,6 +212,8 @@ bool FelixReorder::do_avx_reorder(uint8_t *dst, const uint8_t *src, const unsign
 
 bool FelixReorder::do_avx_reorder_part(uint8_t *dst, const uint8_t *src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
 {
+    if (!avx_available)
+        return false;
     try
     {
         for (unsigned i = 0; i < frames_stop - frames_start; i++)
@@ -219,135 +228,139 @@ bool FelixReorder::do_avx_reorder_part(uint8_t *dst, const uint8_t *src, const u
     return true;
 }
 
-#else
-bool FelixReorder::do_avx_reorder(uint8_t *dst, const uint8_t *src, const unsigned &num_frames, unsigned *num_faulty) noexcept
-{
-    UNUSED(dst);
-    UNUSED(src);
-    UNUSED(num_frames);
-    UNUSED(num_faulty);
-    return false;
-}
 
-bool FelixReorder::do_avx_reorder_part(uint8_t *dst, const uint8_t *src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
+/// AVX512 REORDERING ///
+// One segment of four consecutive frames per call. Each 128 bit lane holds the
+// segment of one frame: shuffle the two bytes of every 12 bit value into a 16
+// bit word, shift the odd channels down, mask, then transpose so that the four
+// frames of a channel are next to each other and can be written as one
+// 64 bit word into the row of that channel.
+TARGET_AVX512
+void FelixReorder::reorder_avx512_handle_four_frames_one_segment(const uint8_t *src, uint8_t *dst, const __m512i &rows)
 {
-    UNUSED(dst);
-    UNUSED(src);
-    UNUSED(num_frames);
-    UNUSED(frames_start);
-    UNUSED(frames_stop);
-    UNUSED(num_faulty);
-
-    return false;
+    const __mmask16 seg_mask = (1 << m_num_bytes_per_seg) - 1;
+    __m512i v = _mm512_inserti32x4(_mm512_setzero_si512(), _mm_maskz_loadu_epi8(seg_mask, src + m_frame0), 0);
+    v = _mm512_inserti32x4(v, _mm_maskz_loadu_epi8(seg_mask, src + m_frame1), 1);
+    v = _mm512_inserti32x4(v, _mm_maskz_loadu_epi8(seg_mask, src + m_frame2), 2);
+    v = _mm512_inserti32x4(v, _mm_maskz_loadu_epi8(seg_mask, src + m_frame3), 3);
+
+    /// Channels 0-3 of the even ADC, then channels 0-3 of the odd ADC
+    const __m512i bytes = _mm512_maskz_broadcast_i32x4(0xffff, _mm_setr_epi8(b_adc0_ch0_p0, b_adc0_ch0_p1, b_adc0_ch1_p0, b_adc0_ch1_p1,
+                                                                             b_adc0_ch2_p0, b_adc0_ch2_p1, b_adc0_ch3_p0, b_adc0_ch3_p1,
+                                                                             b_adc1_ch0_p0, b_adc1_ch0_p1, b_adc1_ch1_p0, b_adc1_ch1_p1,
+                                                                             b_adc1_ch2_p0, b_adc1_ch2_p1, b_adc1_ch3_p0, b_adc1_ch3_p1));
+    const __m512i shifts = _mm512_maskz_broadcast_i32x4(0xffff, _mm_setr_epi16(0, 4, 0, 4, 0, 4, 0, 4));
+    v = _mm512_shuffle_epi8(v, bytes);
+    v = _mm512_srlv_epi16(v, shifts);
+    v = _mm512_and_si512(v, _mm512_set1_epi16(0x0fff));
+
+    /// Word 4 * c + f of the result is channel c of frame f
+    static const uint16_t transpose[32] = {0, 8, 16, 24, 1, 9, 17, 25, 2, 10, 18, 26, 3, 11, 19, 27,
+                                           4, 12, 20, 28, 5, 13, 21, 29, 6, 14, 22, 30, 7, 15, 23, 31};
+    v = _mm512_permutexvar_epi16(_mm512_loadu_si512(transpose), v);
+
+    _mm512_i64scatter_epi64(dst, rows, v, m_adc_size);
 }
-#endif
 
-#ifdef __AVX512__REMOVE_ME_AFTER_GCC_PATCH
-void FelixReorder::reorder_avx512_handle_four_frames_two_segments(const uint8_t *src, uint8_t *dst, const unsigned &num_frames)
+TARGET_AVX512
+void FelixReorder::reorder_avx512_handle_four_frames(const uint8_t *src, uint8_t *dst, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty)
 {
-    /// Set up the two registers
-    __m512i noshift = _mm512_set_epi8(src[m_frame3 + b_seg_1 + b_adc1_ch2_p1], src[m_frame3 + b_seg_1 + b_adc1_ch2_p0], src[m_frame2 + b_seg_1 + b_adc1_ch2_p1], src[m_frame2 + b_seg_1 + b_adc1_ch2_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc1_ch2_p1], src[m_frame1 + b_seg_1 + b_adc1_ch2_p0], src[m_frame0 + b_seg_1 + b_adc1_ch2_p1], src[m_frame0 + b_seg_1 + b_adc1_ch2_p0],
-
-                                      src[m_frame3 + b_seg_1 + b_adc1_ch0_p1], src[m_frame3 + b_seg_1 + b_adc1_ch0_p0], src[m_frame2 + b_seg_1 + b_adc1_ch0_p1], src[m_frame2 + b_seg_1 + b_adc1_ch0_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc1_ch0_p1], src[m_frame1 + b_seg_1 + b_adc1_ch0_p0], src[m_frame0 + b_seg_1 + b_adc1_ch0_p1], src[m_frame0 + b_seg_1 + b_adc1_ch0_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc1_ch2_p1], src[m_frame3 + b_seg_0 + b_adc1_ch2_p0], src[m_frame2 + b_seg_0 + b_adc1_ch2_p1], src[m_frame2 + b_seg_0 + b_adc1_ch2_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc1_ch2_p1], src[m_frame1 + b_seg_0 + b_adc1_ch2_p0], src[m_frame0 + b_seg_0 + b_adc1_ch2_p1], src[m_frame0 + b_seg_0 + b_adc1_ch2_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc1_ch0_p1], src[m_frame3 + b_seg_0 + b_adc1_ch0_p0], src[m_frame2 + b_seg_0 + b_adc1_ch0_p1], src[m_frame2 + b_seg_0 + b_adc1_ch0_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc1_ch0_p1], src[m_frame1 + b_seg_0 + b_adc1_ch0_p0], src[m_frame0 + b_seg_0 + b_adc1_ch0_p1], src[m_frame0 + b_seg_0 + b_adc1_ch0_p0],
-
-                                      src[m_frame3 + b_seg_1 + b_adc0_ch2_p1], src[m_frame3 + b_seg_1 + b_adc0_ch2_p0], src[m_frame2 + b_seg_1 + b_adc0_ch2_p1], src[m_frame2 + b_seg_1 + b_adc0_ch2_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc0_ch2_p1], src[m_frame1 + b_seg_1 + b_adc0_ch2_p0], src[m_frame0 + b_seg_1 + b_adc0_ch2_p1], src[m_frame0 + b_seg_1 + b_adc0_ch2_p0],
-
-                                      src[m_frame3 + b_seg_1 + b_adc0_ch0_p1], src[m_frame3 + b_seg_1 + b_adc0_ch0_p0], src[m_frame2 + b_seg_1 + b_adc0_ch0_p1], src[m_frame2 + b_seg_1 + b_adc0_ch0_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc0_ch0_p1], src[m_frame1 + b_seg_1 + b_adc0_ch0_p0], src[m_frame0 + b_seg_1 + b_adc0_ch0_p1], src[m_frame0 + b_seg_1 + b_adc0_ch0_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc0_ch2_p1], src[m_frame3 + b_seg_0 + b_adc0_ch2_p0], src[m_frame2 + b_seg_0 + b_adc0_ch2_p1], src[m_frame2 + b_seg_0 + b_adc0_ch2_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc0_ch2_p1], src[m_frame1 + b_seg_0 + b_adc0_ch2_p0], src[m_frame0 + b_seg_0 + b_adc0_ch2_p1], src[m_frame0 + b_seg_0 + b_adc0_ch2_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc0_ch0_p1], src[m_frame3 + b_seg_0 + b_adc0_ch0_p0], src[m_frame2 + b_seg_0 + b_adc0_ch0_p1], src[m_frame2 + b_seg_0 + b_adc0_ch0_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc0_ch0_p1], src[m_frame1 + b_seg_0 + b_adc0_ch0_p0], src[m_frame0 + b_seg_0 + b_adc0_ch0_p1], src[m_frame0 + b_seg_0 + b_adc0_ch0_p0]);
-
-    __m512i toshift = _mm512_set_epi8(src[m_frame3 + b_seg_1 + b_adc1_ch3_p1], src[m_frame3 + b_seg_1 + b_adc1_ch3_p0], src[m_frame2 + b_seg_1 + b_adc1_ch3_p1], src[m_frame2 + b_seg_1 + b_adc1_ch3_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc1_ch3_p1], src[m_frame1 + b_seg_1 + b_adc1_ch3_p0], src[m_frame0 + b_seg_1 + b_adc1_ch3_p1], src[m_frame0 + b_seg_1 + b_adc1_ch3_p0],
-
-                                      src[m_frame3 + b_seg_1 + b_adc1_ch1_p1], src[m_frame3 + b_seg_1 + b_adc1_ch1_p0], src[m_frame2 + b_seg_1 + b_adc1_ch1_p1], src[m_frame2 + b_seg_1 + b_adc1_ch1_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc1_ch1_p1], src[m_frame1 + b_seg_1 + b_adc1_ch1_p0], src[m_frame0 + b_seg_1 + b_adc1_ch1_p1], src[m_frame0 + b_seg_1 + b_adc1_ch1_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc1_ch3_p1], src[m_frame3 + b_seg_0 + b_adc1_ch3_p0], src[m_frame2 + b_seg_0 + b_adc1_ch3_p1], src[m_frame2 + b_seg_0 + b_adc1_ch3_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc1_ch3_p1], src[m_frame1 + b_seg_0 + b_adc1_ch3_p0], src[m_frame0 + b_seg_0 + b_adc1_ch3_p1], src[m_frame0 + b_seg_0 + b_adc1_ch3_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc1_ch1_p1], src[m_frame3 + b_seg_0 + b_adc1_ch1_p0], src[m_frame2 + b_seg_0 + b_adc1_ch1_p1], src[m_frame2 + b_seg_0 + b_adc1_ch1_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc1_ch1_p1], src[m_frame1 + b_seg_0 + b_adc1_ch1_p0], src[m_frame0 + b_seg_0 + b_adc1_ch1_p1], src[m_frame0 + b_seg_0 + b_adc1_ch1_p0],
-
-                                      src[m_frame3 + b_seg_1 + b_adc0_ch3_p1], src[m_frame3 + b_seg_1 + b_adc0_ch3_p0], src[m_frame2 + b_seg_1 + b_adc0_ch3_p1], src[m_frame2 + b_seg_1 + b_adc0_ch3_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc0_ch3_p1], src[m_frame1 + b_seg_1 + b_adc0_ch3_p0], src[m_frame0 + b_seg_1 + b_adc0_ch3_p1], src[m_frame0 + b_seg_1 + b_adc0_ch3_p0],
-
-                                      src[m_frame3 + b_seg_1 + b_adc0_ch1_p1], src[m_frame3 + b_seg_1 + b_adc0_ch1_p0], src[m_frame2 + b_seg_1 + b_adc0_ch1_p1], src[m_frame2 + b_seg_1 + b_adc0_ch1_p0],
-                                      src[m_frame1 + b_seg_1 + b_adc0_ch1_p1], src[m_frame1 + b_seg_1 + b_adc0_ch1_p0], src[m_frame0 + b_seg_1 + b_adc0_ch1_p1], src[m_frame0 + b_seg_1 + b_adc0_ch1_p0],
-
-                                      src[m_frame3 + b_seg_0 + b_adc0_ch3_p1], src[m_frame3 + b_seg_0 + b_adc0_ch3_p0], src[m_frame2 + b_seg_0 + b_adc0_ch3_p1], src[m_frame2 + b_seg_0 + b_adc0_ch3_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc0_ch3_p1], src[m_frame1 + b_seg_0 + b_adc0_ch3_p0], src[m_frame0 + b_seg_0 + b_adc0_ch3_p1], src[m_frame0 + b_seg_0 + b_adc0_ch3_p0],
+    /// Destinations
+    uint8_t *data_destination = dst + frame_num * m_adc_size;
+    uint8_t *end = dst + num_frames * m_num_bytes_per_data;
 
-                                      src[m_frame3 + b_seg_0 + b_adc0_ch1_p1], src[m_frame3 + b_seg_0 + b_adc0_ch1_p0], src[m_frame2 + b_seg_0 + b_adc0_ch1_p1], src[m_frame2 + b_seg_0 + b_adc0_ch1_p0],
-                                      src[m_frame1 + b_seg_0 + b_adc0_ch1_p1], src[m_frame1 + b_seg_0 + b_adc0_ch1_p0], src[m_frame0 + b_seg_0 + b_adc0_ch1_p1], src[m_frame0 + b_seg_0 + b_adc0_ch1_p0]);
+    /// Sources
+    const uint8_t *data_start = src + m_wib_header_size + m_coldata_header_size;
 
-    /// Shift 4 bits right, all bits align now
-    __m512i afshift = _mm512_srai_epi32(toshift, 4);
+    /// Copies
+    for (unsigned j = 0; j < 4; ++j)
+    {
+        handle_headers(end, src + j * m_num_bytes_per_frame, frame_num + j, num_frames, num_faulty);
+    }
 
-    /// Mask upper four bits of each 16 bit part
-    const __m512i mask = _mm512_set_epi16(0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0xfff,
-                                          0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0x0fff, 0xfff);
-    __m512i v1 = _mm512_and_si512(noshift, mask);
-    __m512i v2 = _mm512_and_si512(afshift, mask);
+    /// Rows of the even ADC channels 0-3 and the odd ADC channels 0-3 of a segment,
+    /// in units of m_adc_size
+    const __m512i rows = _mm512_set_epi64(11 * num_frames, 10 * num_frames, 9 * num_frames, 8 * num_frames,
+                                          3 * num_frames, 2 * num_frames, 1 * num_frames, 0 * num_frames);
 
-    /// Adressing vector
-    __m512i addr1 = _mm512_set_epi64(14 * num_frames, 12 * num_frames, 10 * num_frames, 8 * num_frames, 6 * num_frames, 4 * num_frames, 2 * num_frames, 0 * num_frames);
-    __m512i addr2 = _mm512_set_epi64(15 * num_frames, 13 * num_frames, 11 * num_frames, 9 * num_frames, 7 * num_frames, 5 * num_frames, 3 * num_frames, 1 * num_frames);
+    for (unsigned i = 0; i < m_num_blocks_per_frame; ++i)
+    {
+        const uint8_t *block_src = data_start + i * (m_coldata_header_size + m_num_bytes_per_block);
+        uint8_t *block_dst = data_destination + i * m_num_ch_per_block * m_adc_size * num_frames;
+        for (unsigned seg = 0; seg < m_num_seg_per_block; ++seg)
+        {
+            /// Segments 2n and 2n+1 hold ADCs 2n and 2n+1, channels 0-3 and 4-7
+            const unsigned first_ch = (seg / 2) * 2 * m_num_ch_per_seg + (seg % 2) * 4;
+            reorder_avx512_handle_four_frames_one_segment(block_src + seg * m_num_bytes_per_seg,
+                                                          block_dst + first_ch * m_adc_size * num_frames, rows);
+        }
+    }
+}
 
-    _mm512_i64scatter_epi64(dst, addr1, v1, m_adc_size);
-    _mm512_i64scatter_epi64(dst, addr2, v2, m_adc_size);
+bool FelixReorder::do_avx512_reorder(uint8_t *dst, const uint8_t *src, const unsigned &num_frames, unsigned *num_faulty) noexcept
+{
+    return do_avx512_reorder_part(dst, src, 0, num_frames, num_frames, num_faulty);
 }
 
-void FelixReorder::reorder_avx512_handle_four_frames_one_block(const uint8_t *src, uint8_t *dst, const unsigned &num_frames)
+bool FelixReorder::do_avx512_reorder_part(uint8_t *dst, const uint8_t *src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
 {
-    for (unsigned i = 0; i < 4; ++i)
+    if (!avx512_available)
+        return false;
+    try
     {
-        reorder_avx512_handle_four_frames_two_segments(src + 2 * i * m_num_bytes_per_seg, dst + 2 * i * m_num_bytes_per_reord_seg * num_frames, num_frames);
+        const unsigned num_quads = (frames_stop - frames_start) / 4;
+        for (unsigned i = 0; i < 4 * num_quads; i += 4)
+        {
+            reorder_avx512_handle_four_frames(src + i * m_num_bytes_per_frame, dst, frames_start + i, num_frames, num_faulty);
+        }
+        /// Leftover frames, when the part is not a multiple of four frames
+        baseline_handle_frames(dst, src + 4 * num_quads * m_num_bytes_per_frame, frames_start + 4 * num_quads, frames_stop, num_frames, num_faulty);
     }
+    catch (...)
+    {
+        return false;
+    }
+    return true;
 }
 
-void FelixReorder::reorder_avx512_handle_four_frames(const uint8_t *src, uint8_t *dst, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty)
+/// EXPANDED REORDERING ///
+void FelixReorder::expanded_handle_headers(uint8_t *dst, const uint8_t *src, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty)
 {
-    /// Destinations
-    uint8_t *data_destination = dst + frame_num * m_adc_size;
-
-    /// Sources
-    const uint8_t *data_start = src + m_wib_header_size + m_coldata_header_size;
     uint8_t *end = dst + num_frames * m_num_bytes_per_data;
-
-    /// Copies
-    for (unsigned j = 0; j < 4; ++j)
+    for (unsigned i = 0; i < m_num_frames_per_expanded_msg; ++i)
     {
-        handle_headers(end, src + j * m_num_bytes_per_frame, frame_num + j, num_frames, num_faulty);
+        handle_headers(end, src + i * m_num_bytes_per_frame, frame_num + i, num_frames, num_faulty);
     }
+}
 
-    for (unsigned i = 0; i < m_num_blocks_per_frame; ++i)
+void FelixReorder::expanded_handle_message(uint8_t *dst, const uint16_t *expanded, unsigned frame_num, const unsigned &num_frames)
+{
+    for (unsigned reg = 0; reg < m_num_expanded_regs_per_frame; ++reg)
     {
-        reorder_avx512_handle_four_frames_one_block(data_start + i * (m_coldata_header_size + m_num_bytes_per_block),
-                                                    data_destination + i * m_num_ch_per_block * m_adc_size * num_frames, num_frames);
+        const uint16_t *times = expanded + reg * m_num_frames_per_expanded_msg * m_num_adcs_per_expanded_reg;
+        for (unsigned p = 0; p < m_num_adcs_per_expanded_reg; ++p)
+        {
+            uint8_t *out = dst + (expanded_channel(reg, p) * num_frames + frame_num) * m_adc_size;
+            for (unsigned t = 0; t < m_num_frames_per_expanded_msg; ++t)
+            {
+                memcpy(out + t * m_adc_size, times + t * m_num_adcs_per_expanded_reg + p, m_adc_size);
+            }
+        }
     }
 }
 
-bool FelixReorder::do_avx512_reorder(uint8_t *dst, const uint8_t *src, const unsigned &num_frames, unsigned *num_faulty) noexcept
+bool FelixReorder::do_expanded_reorder_part(uint8_t *dst, const uint8_t *src, const uint16_t *expanded, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
 {
+    if ((frames_stop - frames_start) % m_num_frames_per_expanded_msg != 0)
+        return false;
     try
     {
-        for (unsigned i = 0; i < num_frames; i += 4)
+        for (unsigned fr = frames_start; fr < frames_stop; fr += m_num_frames_per_expanded_msg)
         {
-            reorder_avx512_handle_four_frames(src + i * m_num_bytes_per_frame, dst, i, num_frames, num_faulty);
+            expanded_handle_headers(dst, src, fr, num_frames, num_faulty);
+            expanded_handle_message(dst, expanded, fr, num_frames);
+            src += m_num_frames_per_expanded_msg * m_num_bytes_per_frame;
+            expanded += m_num_expanded_regs_per_frame * m_num_frames_per_expanded_msg * m_num_adcs_per_expanded_reg;
         }
     }
     catch (...)
@@ -357,13 +370,87 @@ bool FelixReorder::do_avx512_reorder(uint8_t *dst, const uint8_t *src, const uns
     return true;
 }
 
-bool FelixReorder::do_avx512_reorder_part(uint8_t *dst, const uint8_t *src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
+/// Transposes the 12 times x 16 lanes of each register to 16 channels x 12 times.
+/// The unpacks work within 128 bit lanes, so lanes 0-7 and 8-15 go in parallel:
+/// an 8x8 transpose of times 0-7 and a 4x8 one of times 8-11.
+TARGET_AVX2
+void FelixReorder::expanded_avx_handle_message(uint8_t *dst, const uint16_t *expanded, unsigned frame_num, const unsigned &num_frames)
 {
+    for (unsigned reg = 0; reg < m_num_expanded_regs_per_frame; ++reg)
+    {
+        const __m256i *rows = reinterpret_cast<const __m256i *>(expanded + reg * m_num_frames_per_expanded_msg * m_num_adcs_per_expanded_reg);
+        __m256i a[12];
+        for (unsigned t = 0; t < 12; ++t)
+            a[t] = _mm256_loadu_si256(rows + t);
+
+        /// Times 0-7
+        __m256i t0 = _mm256_unpacklo_epi16(a[0], a[1]);
+        __m256i t1 = _mm256_unpackhi_epi16(a[0], a[1]);
+        __m256i t2 = _mm256_unpacklo_epi16(a[2], a[3]);
+        __m256i t3 = _mm256_unpackhi_epi16(a[2], a[3]);
+        __m256i t4 = _mm256_unpacklo_epi16(a[4], a[5]);
+        __m256i t5 = _mm256_unpackhi_epi16(a[4], a[5]);
+        __m256i t6 = _mm256_unpacklo_epi16(a[6], a[7]);
+        __m256i t7 = _mm256_unpackhi_epi16(a[6], a[7]);
+
+        __m256i u0 = _mm256_unpacklo_epi32(t0, t2);
+        __m256i u1 = _mm256_unpackhi_epi32(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi32(t1, t3);
+        __m256i u3 = _mm256_unpackhi_epi32(t1, t3);
+        __m256i u4 = _mm256_unpacklo_epi32(t4, t6);
+        __m256i u5 = _mm256_unpackhi_epi32(t4, t6);
+        __m256i u6 = _mm256_unpacklo_epi32(t5, t7);
+        __m256i u7 = _mm256_unpackhi_epi32(t5, t7);
+
+        __m256i r[8];
+        r[0] = _mm256_unpacklo_epi64(u0, u4);
+        r[1] = _mm256_unpackhi_epi64(u0, u4);
+        r[2] = _mm256_unpacklo_epi64(u1, u5);
+        r[3] = _mm256_unpackhi_epi64(u1, u5);
+        r[4] = _mm256_unpacklo_epi64(u2, u6);
+        r[5] = _mm256_unpackhi_epi64(u2, u6);
+        r[6] = _mm256_unpacklo_epi64(u3, u7);
+        r[7] = _mm256_unpackhi_epi64(u3, u7);
+
+        /// Times 8-11: each 64 bit half is one lane
+        __m256i s0 = _mm256_unpacklo_epi16(a[8], a[9]);
+        __m256i s1 = _mm256_unpackhi_epi16(a[8], a[9]);
+        __m256i s2 = _mm256_unpacklo_epi16(a[10], a[11]);
+        __m256i s3 = _mm256_unpackhi_epi16(a[10], a[11]);
+
+        __m256i q[4];
+        q[0] = _mm256_unpacklo_epi32(s0, s2);
+        q[1] = _mm256_unpackhi_epi32(s0, s2);
+        q[2] = _mm256_unpacklo_epi32(s1, s3);
+        q[3] = _mm256_unpackhi_epi32(s1, s3);
+
+        for (unsigned k = 0; k < 8; ++k)
+        {
+            uint8_t *out_lo = dst + (expanded_channel(reg, k) * num_frames + frame_num) * m_adc_size;
+            uint8_t *out_hi = dst + (expanded_channel(reg, k + 8) * num_frames + frame_num) * m_adc_size;
+            const __m128i tail_lo = _mm256_castsi256_si128(q[k / 2]);
+            const __m128i tail_hi = _mm256_extracti128_si256(q[k / 2], 1);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out_lo), _mm256_castsi256_si128(r[k]));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out_hi), _mm256_extracti128_si256(r[k], 1));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out_lo + 16), (k % 2) ? _mm_unpackhi_epi64(tail_lo, tail_lo) : tail_lo);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(out_hi + 16), (k % 2) ? _mm_unpackhi_epi64(tail_hi, tail_hi) : tail_hi);
+        }
+    }
+}
+
+bool FelixReorder::do_avx_expanded_reorder_part(uint8_t *dst, const uint8_t *src, const uint16_t *expanded, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
+{
+    if (!avx_available || (frames_stop - frames_start) % m_num_frames_per_expanded_msg != 0)
+        return false;
     try
     {
-        for (unsigned i = 0; i < frames_stop - frames_start; i += 4)
+        for (unsigned fr = frames_start; fr < frames_stop; fr += m_num_frames_per_expanded_msg)
         {
-            reorder_avx512_handle_four_frames(src + i * m_num_bytes_per_frame, dst, frames_start + i, num_frames, num_faulty);
+            expanded_handle_headers(dst, src, fr, num_frames, num_faulty);
+            expanded_avx_handle_message(dst, expanded, fr, num_frames);
+            src += m_num_frames_per_expanded_msg * m_num_bytes_per_frame;
+            expanded += m_num_expanded_regs_per_frame * m_num_frames_per_expanded_msg * m_num_adcs_per_expanded_reg;
         }
     }
     catch (...)
@@ -372,27 +459,21 @@ bool FelixReorder::do_avx512_reorder_part(uint8_t *dst, const uint8_t *src, cons
     }
     return true;
 }
-#else
-bool FelixReorder::do_avx512_reorder(uint8_t *dst, const uint8_t *src, const unsigned &num_frames, unsigned *num_faulty) noexcept
-{
-    UNUSED(dst);
-    UNUSED(src);
-    UNUSED(num_frames);
-    UNUSED(num_faulty);
 
-    return false;
+/// RUNTIME DISPATCH ///
+namespace {
+bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
 }
 
-bool FelixReorder::do_avx512_reorder_part(uint8_t *dst, const uint8_t *src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept
+bool cpu_has_avx512()
 {
-    UNUSED(dst);
-    UNUSED(src);
-    UNUSED(num_frames);
-    UNUSED(frames_start);
-    UNUSED(frames_stop);
-    UNUSED(num_faulty);
-
-    return false;
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+}
 }
-#endif
 
+const bool FelixReorder::avx_available = cpu_has_avx2();
+const bool FelixReorder::avx512_available = cpu_has_avx512();
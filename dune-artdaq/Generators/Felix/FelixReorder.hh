@@ -66,6 +66,7 @@ class FelixReorder
     /// Framesize public constants
     static constexpr size_t m_num_bytes_per_frame = m_wib_header_size + m_num_blocks_per_frame * (m_coldata_header_size + m_num_bytes_per_block);
     static constexpr size_t m_num_bytes_per_reord_frame = m_wib_header_size + m_num_blocks_per_frame * (m_coldata_header_size + m_num_ch_per_block * 2);
+    static constexpr size_t m_num_frames_per_expanded_msg = 12;
 
     /// METHODS ///
     static bool do_reorder(uint8_t* dst, const uint8_t* src, const unsigned &num_frames, unsigned *num_faulty) noexcept;
@@ -76,6 +77,14 @@ class FelixReorder
     static bool do_avx_reorder_part(uint8_t* dst, const uint8_t* src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept;
     static bool do_avx512_reorder_part(uint8_t* dst, const uint8_t* src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept;
 
+    /// Reorder frames whose ADCs were already expanded to 16 bit by the TP finding
+    /// (expand_message_all_adcs in TriggerPrimitive/frame_expand.h): for every message
+    /// of m_num_frames_per_expanded_msg frames, the times of each of the 16 registers
+    /// of a frame are adjacent. src only provides the headers. The part has to be
+    /// whole messages.
+    static bool do_expanded_reorder_part(uint8_t* dst, const uint8_t* src, const uint16_t* expanded, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept;
+    static bool do_avx_expanded_reorder_part(uint8_t* dst, const uint8_t* src, const uint16_t* expanded, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty) noexcept;
+
     static unsigned calculate_reordered_size(unsigned num_frames, unsigned num_faulty)
     {
         return m_num_bytes_per_data * num_frames + 
@@ -84,17 +93,10 @@ class FelixReorder
             (num_frames + 7) / 8;
     }
 
-#ifdef __AVX2__ 
-    static const bool avx_available = true;
-#else 
-    static const bool avx_available = false;
-#endif 
-
-#ifdef __AVX512__REMOVE_ME_AFTER_GCC_PATCH
-    static const bool avx512_available = true;
-#else 
-    static const bool avx512_available = false;
-#endif 
+    /// Set at startup from the CPU features, so one binary runs the best kernel
+    /// on each host. The do_avx* methods return false if their kernel can not run.
+    static const bool avx_available;
+    static const bool avx512_available;
 
   private:
     /// FRAME OFFSETS ///
@@ -109,18 +111,27 @@ class FelixReorder
     /// BASELINE REORDERING ///
     static void baseline_handle_frames(uint8_t* dst, const uint8_t* src, const unsigned frames_start, const unsigned frames_stop, const unsigned &num_frames, unsigned *num_faulty);
 
-    #ifdef __AVX2__
     /// AVX2 REORDERING ///
     static void reorder_avx_handle_four_segments(const uint8_t* src, uint8_t* dst, const unsigned &num_frames);
     static void reorder_avx_handle_block(const uint8_t* src, uint8_t* dst, const unsigned &num_frames);
     static void reorder_avx_handle_frame(const uint8_t* src, uint8_t* dst, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty); 
-    #endif
-    #ifdef __AVX512__REMOVE_ME_AFTER_GCC_PATCH
+
     /// AVX512 REORDERING /// 
-    static void reorder_avx512_handle_four_frames_two_segments(const uint8_t* src, uint8_t* dst, const unsigned &num_frames);
-    static void reorder_avx512_handle_four_frames_one_block(const uint8_t* src, uint8_t* dst, const unsigned &num_frames); 
+    static void reorder_avx512_handle_four_frames_one_segment(const uint8_t* src, uint8_t* dst, const __m512i &rows);
     static void reorder_avx512_handle_four_frames(const uint8_t* src, uint8_t* dst, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty);
-    #endif
+
+    /// EXPANDED REORDERING ///
+    static constexpr size_t m_num_expanded_regs_per_frame = 16;
+    static constexpr size_t m_num_adcs_per_expanded_reg = 16;
+
+    /// Channel in lane p of expanded register reg: the order of expand_two_segments
+    static constexpr unsigned expanded_channel(unsigned reg, unsigned p) {
+        return (reg / 4) * m_num_ch_per_block + ((reg % 4) * 2 + (p % 8) / 4) * m_num_ch_per_seg + (p / 8) * 4 + p % 4;
+    }
+
+    static void expanded_handle_headers(uint8_t* dst, const uint8_t* src, unsigned frame_num, const unsigned &num_frames, unsigned *num_faulty);
+    static void expanded_handle_message(uint8_t* dst, const uint16_t* expanded, unsigned frame_num, const unsigned &num_frames);
+    static void expanded_avx_handle_message(uint8_t* dst, const uint16_t* expanded, unsigned frame_num, const unsigned &num_frames);
 
 };
 
@@ -0,0 +1,246 @@
+#ifndef LINK_BUFFER_HH_
+#define LINK_BUFFER_HH_
+
+#include "NetioWIBRecords.hh"
+#include "NumaMemory.hh"
+
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+/*
+ * LinkBuffer
+ * Description: Fixed size, timestamp addressable ring of superchunks for one link.
+ *   A single writer keeps overwriting the oldest slot, nothing is ever popped.
+ *   Readers locate a trigger window by timestamp in O(1) and read it in place,
+ *   then validate against the write sequence that the slots were not recycled
+ *   under them. Requests can therefore arrive late, out of order or overlap.
+ *   Optionally keeps the ADCs of each slot expanded to 16 bit next to it, so
+ *   that TP finding and fragment building share one expansion.
+ *   All of it is allocated with NumaMemory, on the node of the device the
+ *   link comes from and of the threads that write and read it.
+ * Date: October 2019
+*/
+class LinkBuffer
+{
+public:
+  enum class Status { Ok, Empty, TooOld, NotYet };
+
+  // numaNode -1 leaves the placement to the allocating thread
+  LinkBuffer(size_t capacity, uint64_t ticksPerMessage, int numaNode = -1)
+    : m_capacity(capacity),
+      m_ticksPerMessage(ticksPerMessage),
+      m_numaNode(numaNode),
+      m_slots(capacity, numaNode),
+      m_timestamps(capacity, numaNode),
+      m_claimed(0), m_written(0), m_flushed(0)
+  {
+    for (size_t i=0; i<m_capacity; ++i) { m_timestamps[i].store(0, std::memory_order_relaxed); }
+  }
+
+  LinkBuffer(LinkBuffer const&) = delete;
+  LinkBuffer& operator=(LinkBuffer const&) = delete;
+
+  size_t capacity() const { return m_capacity; }
+  uint64_t ticksPerMessage() const { return m_ticksPerMessage; }
+
+  // Where the ring and its companions ended up, for the startup report
+  std::string placement() const {
+    std::string ret = "slots " + m_slots.placement() + "; timestamps " + m_timestamps.placement();
+    if (hasExpansion()) { ret += "; expanded ADCs " + m_expanded.placement(); }
+    return ret;
+  }
+
+  // Writer side (single producer only).
+  // claim() hands out the slot of the next sequence number, publish() makes it visible.
+  SUPERCHUNK_CHAR_STRUCT* claim() {
+    uint64_t seq = m_written.load(std::memory_order_relaxed);
+    m_claimed.store(seq+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return &m_slots[seq % m_capacity];
+  }
+
+  void publish() {
+    uint64_t seq = m_written.load(std::memory_order_relaxed);
+    size_t slot = seq % m_capacity;
+    m_timestamps[slot].store(slotTimestamp(&m_slots[slot]), std::memory_order_relaxed);
+    m_written.store(seq+1, std::memory_order_release);
+  }
+
+  void write(const SUPERCHUNK_CHAR_STRUCT& scs) {
+    memcpy(claim(), &scs, sizeof(SUPERCHUNK_CHAR_STRUCT));
+    publish();
+  }
+
+  // Reader side.
+  // Sequence numbers are monotonic; [oldest(), written()) are readable.
+  uint64_t written() const { return m_written.load(std::memory_order_acquire); }
+
+  uint64_t oldest() const {
+    uint64_t claimed = m_claimed.load(std::memory_order_acquire);
+    uint64_t oldest = (claimed > m_capacity) ? claimed - m_capacity : 0;
+    uint64_t flushed = m_flushed.load(std::memory_order_relaxed);
+    return std::max(oldest, flushed);
+  }
+
+  bool isEmpty() const { return written() <= oldest(); }
+
+  // Size in messages, in the same spirit as folly's sizeGuess().
+  size_t sizeGuess() const {
+    uint64_t w = written(), o = oldest();
+    return (w > o) ? w - o : 0;
+  }
+
+  const SUPERCHUNK_CHAR_STRUCT* at(uint64_t seq) const { return &m_slots[seq % m_capacity]; }
+
+  uint64_t timestampAt(uint64_t seq) const {
+    return m_timestamps[seq % m_capacity].load(std::memory_order_relaxed);
+  }
+
+  // Timestamp of the first frame of the newest complete message, 0 if none.
+  uint64_t newestTimestamp() const {
+    uint64_t w = written();
+    return (w == 0) ? 0 : timestampAt(w-1);
+  }
+
+  // True while seq was not (and is not being) overwritten by the writer.
+  // Call it after reading a slot to validate what was read.
+  bool valid(uint64_t seq) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq >= oldest() && seq < written();
+  }
+
+  // Find the message that contains the frame with timestamp ts.
+  // The direct lookup assumes a gapless stream: every message is
+  // ticksPerMessage after the previous one. If the validation of the
+  // candidate fails (dropped or repeated messages), fall back to a binary
+  // search on the monotonic slot timestamps.
+  Status locate(uint64_t ts, uint64_t& seq) const {
+    uint64_t w = written();
+    uint64_t o = oldest();
+    if (w <= o) return Status::Empty;
+    uint64_t newest = w-1;
+    uint64_t newestTs = timestampAt(newest);
+    if (ts >= newestTs + m_ticksPerMessage) return Status::NotYet;
+    if (ts < timestampAt(o)) return Status::TooOld;
+
+    uint64_t back = (ts >= newestTs) ? 0 : (newestTs - ts + m_ticksPerMessage - 1) / m_ticksPerMessage;
+    if (back <= newest - o) {
+      uint64_t cand = newest - back;
+      uint64_t candTs = timestampAt(cand);
+      if (candTs <= ts && ts < candTs + m_ticksPerMessage) {
+        seq = cand;
+        return Status::Ok;
+      }
+    }
+
+    // Last message with timestamp <= ts.
+    uint64_t lo = o, hi = newest;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo + 1) / 2;
+      if (timestampAt(mid) <= ts) { lo = mid; }
+      else { hi = mid - 1; }
+    }
+    seq = lo;
+    return valid(lo) ? Status::Ok : Status::TooOld;
+  }
+
+  // A contiguous run of messages inside the ring.
+  struct Span { const char* data; size_t messages; };
+
+  // Split messages [seq, seq+n) at the wrap point of the ring.
+  // Returns the number of spans filled in out: 1, or 2 if the range wraps.
+  unsigned spans(uint64_t seq, size_t n, Span out[2]) const {
+    size_t first = seq % m_capacity;
+    size_t head = std::min(n, m_capacity - first);
+    out[0] = Span{ m_slots[first].fragments, head };
+    if (head == n) return 1;
+    out[1] = Span{ m_slots[0].fragments, n - head };
+    return 2;
+  }
+
+  // Copy messages [seq, seq+n) to dst, packed by msgSize. When the messages
+  // fill their slots completely this is one bulk copy per span.
+  void copyOut(char* dst, uint64_t seq, size_t n, size_t msgSize) const {
+    if (msgSize == sizeof(SUPERCHUNK_CHAR_STRUCT)) {
+      Span sp[2];
+      unsigned nspans = spans(seq, n, sp);
+      for (unsigned i=0; i<nspans; ++i) {
+        memcpy(dst, sp[i].data, sp[i].messages * msgSize);
+        dst += sp[i].messages * msgSize;
+      }
+    } else {
+      for (size_t i=0; i<n; ++i) {
+        memcpy(dst + i * msgSize, at(seq + i), msgSize);
+      }
+    }
+  }
+
+  // Slots of consecutive sequence numbers are adjacent in memory, for at()
+  // and expandSlot(), up to the end of the ring: how many from seq on.
+  size_t contiguous(uint64_t seq) const { return m_capacity - seq % m_capacity; }
+
+  // Drop everything written so far. Safe while the writer is running.
+  void flush() { m_flushed.store(written(), std::memory_order_relaxed); }
+
+  // Optional companion ring with the 16 bit expanded ADCs of every slot.
+  // A single expansion stage follows the writer in sequence order and may
+  // skip messages. Enable it before the writer starts.
+  void enableExpansion() {
+    m_expanded = NumaArray<MessageAllADCs>(m_capacity, m_numaNode);
+    m_expandedSeq = NumaArray<std::atomic<uint64_t>>(m_capacity, m_numaNode);
+    for (size_t i=0; i<m_capacity; ++i) { m_expandedSeq[i].store(s_notExpanded, std::memory_order_relaxed); }
+    m_expandedUpTo.store(0, std::memory_order_relaxed);
+  }
+
+  bool hasExpansion() const { return m_expanded.get() != nullptr; }
+
+  // Expansion stage side: fill expandSlot(seq), then publishExpanded(seq).
+  MessageAllADCs* expandSlot(uint64_t seq) {
+    m_expandedSeq[seq % m_capacity].store(s_notExpanded, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return &m_expanded[seq % m_capacity];
+  }
+
+  void publishExpanded(uint64_t seq) {
+    m_expandedSeq[seq % m_capacity].store(seq, std::memory_order_release);
+    m_expandedUpTo.store(seq+1, std::memory_order_release);
+  }
+
+  // Reader side.
+  // The expansion stage is done with every message before expandedUpTo().
+  uint64_t expandedUpTo() const { return m_expandedUpTo.load(std::memory_order_acquire); }
+
+  // The expanded ADCs of seq, nullptr if the stage skipped it. As for at(),
+  // validate with valid(seq) after reading.
+  const MessageAllADCs* expandedAt(uint64_t seq) const {
+    size_t slot = seq % m_capacity;
+    return (m_expandedSeq[slot].load(std::memory_order_acquire) == seq) ? &m_expanded[slot] : nullptr;
+  }
+
+private:
+  static uint64_t slotTimestamp(const SUPERCHUNK_CHAR_STRUCT* scs) {
+    return reinterpret_cast<const dune::WIBHeader*>(scs)->timestamp();
+  }
+
+  const size_t m_capacity;
+  const uint64_t m_ticksPerMessage;
+  const int m_numaNode;
+  NumaArray<SUPERCHUNK_CHAR_STRUCT> m_slots;
+  NumaArray<std::atomic<uint64_t>> m_timestamps;
+
+  static constexpr uint64_t s_notExpanded = UINT64_MAX;
+  NumaArray<MessageAllADCs> m_expanded;
+  NumaArray<std::atomic<uint64_t>> m_expandedSeq; // sequence number held by each expanded slot
+
+  // Cache line separation between the writer's and the readers' hot counters.
+  alignas(64) std::atomic<uint64_t> m_claimed;
+  alignas(64) std::atomic<uint64_t> m_written;
+  alignas(64) std::atomic<uint64_t> m_flushed;
+  alignas(64) std::atomic<uint64_t> m_expandedUpTo{0};
+};
+
+#endif
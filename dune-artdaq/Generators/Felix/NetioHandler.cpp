@@ -1,9 +1,11 @@
 #include "dune-artdaq/DAQLogger/DAQLogger.hh"
+#include "artdaq/DAQdata/Globals.hh"
 #include "dune-raw-data/Overlays/FelixFragment.hh"
 #include "NetioHandler.hh"
 #include "NetioWIBRecords.hh"
 #include "ReusableThread.hh"
 #include "FelixReorder.hh"
+#include "CPUPin.hpp"
 
 #include "dune-artdaq/Generators/Felix/TriggerPrimitive/frame_expand.h"
 //#include <libxmlrpc.h>
@@ -13,6 +15,7 @@
 #include <exception>
 #include <pthread.h>
 #include <utility> // For make_pair
+#include <sstream>
 
 #define REORD_DEBUG
 #define QATCOMP_DEBUG
@@ -31,8 +34,10 @@ NetioHandler::NetioHandler()
   //m_bufferPtr=nullptr;
   //m_bytesReadPtr=nullptr;
 
-  m_triggerTimestamp=0;
-  m_triggerSequenceId=0;
+  m_doFuseExpansion=true;
+  m_pipelineDepth=1;
+  m_compressionThreads=4;
+  m_numaNode=-1;
 
   m_turnaround=true;
   m_lastPosition = nullptr;
@@ -56,8 +61,8 @@ NetioHandler::~NetioHandler() {
   //for ( auto sock : m_sub_sockets ) { sock.second->unsubscribe(0, netio::endpoint(m_felixHost, m_felixRXPort)); delete sock.second; }
   //m_sub_sockets.clear();
 
+  m_tp_finders.clear(); // They read from the link buffers
   m_pcqs.clear(); 
-  m_tp_finders.clear();
   if (m_verbose) { 
     DAQLogger::LogInfo("NetioHandler::~NetioHandler")
       << "NIOH terminated. Clean shutdown."; 
@@ -88,23 +93,27 @@ bool NetioHandler::stopContext() {
 
 void NetioHandler::startTriggerMatchers(){
   m_stop_trigger.store(false);
+  m_functors.clear();
+  m_requestQueues.clear();
+  m_matcherLatencyHists.assign(m_activeChannels, PowerTwoHist<24>());
+  m_requestsInFlight.store(0);
+  m_linksSkipped.store(0);
   for (uint32_t i=0; i<m_activeChannels; ++i){
-    m_extractors.emplace_back( new ReusableThread(i) );
-    set_thread_name(m_extractors[i]->get_thread(), "nioh-trm", i);
     uint32_t tid = i;
     uint32_t framesPerMsg = m_msgsize/m_framesize;
-    size_t frameCapacity = m_pcqs[tid]->capacity() * framesPerMsg;
 
-    //bool reset = false;
-    //uint_fast64_t = last_ts = 0x0;
-    m_functors.push_back( [&, tid, frameCapacity, framesPerMsg] {
+    m_functors.push_back( [&, tid, framesPerMsg] (TriggerRequest& req) {
+      const uint64_t triggerTimestamp = req.timestamp;
+      artdaq::Fragment* fragmentPtr = req.frag.get();
+      artdaq::Fragment* fragmentPtrHits = req.fragHits.get();
+
       // segfaults on accessing any member of NIOH if stopDatataking() is issued... (not, when timing is on!)
       // RS -> What is this? It was definitely a hack back at the time. To be checked if can be avoided. 
       //    -> In a clean flow, this should never happen. (maybe good to have it for a safety measure.)
       if (m_stop_trigger.load()) {
         DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") 
           << "Should stop triggers, bailing out.\n";
-        return;
+        return true;
       }
       
       // Trigger matching: 
@@ -112,216 +121,362 @@ void NetioHandler::startTriggerMatchers(){
       //      Doesn't make sense to call triggerMatchers if you don't want to fill the buffer.
       //      Or at least write empty data?
       if (m_extract) {
+        LinkBuffer& buffer = *m_pcqs[tid];
 
-        // Queue is empty?
+        // Buffer is empty?
         // RS -> Keeping this for additional safety measures. 
         //       To be removed when RC ensures that core is running.
-        if (m_pcqs[tid]->isEmpty()) {
+        if (buffer.isEmpty()) {
           DAQLogger::LogWarning("NetioHandler::startTriggerMatchers") 
             << "Queue is empty... Is FelixCore publishing data?\n";
-          return;
+          return true;
         }
 
-	// GLM: if Timestamp is 0, check if the queue is filling up and throw away oldest data
-	if (m_triggerTimestamp == 0) {
-          /*
-          size_t queuedElements = m_pcqs[tid]->sizeGuess() - 2; 
-          DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Remove " << queuedElements << " old fragments.";
-          while(queuedElements) {
-            --queuedElements;
-	  */
-
-          size_t qSize = m_pcqs[tid]->sizeGuess();
-          if (qSize > 0.5 * m_pcqs[tid]->capacity()) {
-	     DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Removing old non requested data; (" << qSize << ") messages in queue.";
-	     m_pcqs[tid]->popXFront(0.8 * qSize);
-	  }
-
-          // Do the same for the timestamp queue
+        // No request: the link buffer recycles its oldest slots by itself,
+        // only the latency bookkeeping needs to be kept from filling up.
+        if (triggerTimestamp == 0) {
           size_t qSizeTS = m_timestamp_map[tid]->sizeGuess();
           if (qSizeTS > 0.5 * m_timestamp_map[tid]->capacity()) {
-	     m_timestamp_map[tid]->popXFront(0.8 * qSize);
-	  }
-
-	  return;
-	}
-
-        // GLM: Try this simplistic approach: do trigger matching and empty the queue until that point
-        //      Requires time ordered trigger requests!!
+            m_timestamp_map[tid]->popXFront(0.8 * qSizeTS);
+          }
+          return true;
+        }
 
-        DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Got request for trigger " << m_triggerTimestamp;
+        DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Got request for trigger " << triggerTimestamp;
 
         std::pair<uint64_t, uint64_t> ts_recv(0ul,0ul);
-        while(m_timestamp_map[tid]->read(ts_recv) && ts_recv.first < m_triggerTimestamp){
+        while(m_timestamp_map[tid]->read(ts_recv) && ts_recv.first < triggerTimestamp){
             m_timestamp_map[tid]->popFront();
         }
         if(ts_recv.second!=0ul){
             const uint64_t now_us=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
             DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Trigger latency was " << (now_us-ts_recv.second) << "us";
         }
-        uint_fast64_t startWindowTimestamp = m_triggerTimestamp - (uint_fast64_t)(m_windowOffset * m_tickdist);
-        dune::WIBHeader wh = *(reinterpret_cast<const dune::WIBHeader*>( m_pcqs[tid]->frontPtr() ));
-        m_lastTimestamp = wh.timestamp();
-        m_positionDepth = 0;
-	//GLM: Check if there is such a delay in trigger requests that data have gone already...
-	if (m_lastTimestamp > startWindowTimestamp ) {
-	  DAQLogger::LogWarning("NetioHandler::startTriggerMatchers") 
-	    << "Requested data are so old that they were dropped. Trigger request TS = " 
-	    << m_triggerTimestamp << ", oldest TS in queue = "  << m_lastTimestamp;
-	  return;
-	}
-
-        uint_fast64_t timeTickDiff = (startWindowTimestamp-m_lastTimestamp)/(uint_fast64_t)m_tickdist;
-        // wait to have enough stuff in the queue
-	uint_fast64_t minQueueSize = (timeTickDiff + m_timeWindow)/framesPerMsg + 10 ; // make sure we don't overtake the write ptr
-        size_t qsize = m_pcqs[tid]->sizeGuess();
-	uint_fast32_t waitingForDataCtr = 0;	
-        while (qsize < minQueueSize) {
-	  std::this_thread::sleep_for(std::chrono::microseconds(100));
-	  qsize = m_pcqs[tid]->sizeGuess(); 
-	  ++waitingForDataCtr;
-	  if (waitingForDataCtr > 20000) {
-	    DAQLogger::LogWarning("NetioHandler::startTriggerMatchers")
-	      << "Data stream delayed by over 2 secs with respect to trigger requests! ";
-	    return;
-	  }
+        uint_fast64_t startWindowTimestamp = triggerTimestamp - (uint_fast64_t)(m_windowOffset * m_tickdist);
+        uint_fast64_t lastMsgTimestamp = startWindowTimestamp + (m_timeWindowNumMessages-1)*framesPerMsg*m_tickdist;
+
+        // Wait until the last message of the window arrived.
+        uint_fast32_t waitingForDataCtr = 0;
+        while (buffer.newestTimestamp() < lastMsgTimestamp) {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+          ++waitingForDataCtr;
+          if (waitingForDataCtr > 20000) {
+            DAQLogger::LogWarning("NetioHandler::startTriggerMatchers")
+              << "Data stream delayed by over 2 secs with respect to trigger requests! ";
+            return true;
+          }
+        }
+
+        // Direct lookup of the first message of the window.
+        uint64_t startSeq = 0;
+        LinkBuffer::Status status = buffer.locate(startWindowTimestamp, startSeq);
+        if (status == LinkBuffer::Status::Ok && startSeq + m_timeWindowNumMessages > buffer.written()) {
+          status = LinkBuffer::Status::NotYet;
+        }
+        if (status == LinkBuffer::Status::NotYet) {
+          DAQLogger::LogWarning("NetioHandler::startTriggerMatchers")
+            << "Requested data are not yet written. Trigger request TS = "
+            << triggerTimestamp << ", newest TS in buffer = "  << buffer.newestTimestamp();
+          return true;
+        }
+        if (status != LinkBuffer::Status::Ok) {
+          DAQLogger::LogWarning("NetioHandler::startTriggerMatchers") 
+            << "Requested data are so old that they were dropped. Trigger request TS = " 
+            << triggerTimestamp << ", oldest TS in buffer = "  << buffer.timestampAt(buffer.oldest());
+          return true;
+        }
+
+        // With compression the window is assembled into a staging buffer, that the
+        // compression stage deflates into the fragment. Otherwise straight into the fragment.
+        const bool compress = m_doCompress && m_compressionStage;
+        uint8_t* dst = nullptr;
+        if (compress) {
+          dst = takeStagingBuffer(tid);
+          if (dst == nullptr) {
+            DAQLogger::LogError("NetioHandler::startTriggerMatchers")
+              << "No free staging buffer on link " << tid << " for trigger " << triggerTimestamp << ", skipping it.";
+            req.linksSkipped.fetch_add(1, std::memory_order_relaxed);
+            return true;
+          }
+        } else {
+          fragmentPtr->resizeBytes(m_timeWindowByteSizeOut);
+          dst = fragmentPtr->dataBeginBytes();
         }
-        // read everything that is older than the TS
-	//DAQLogger::LogInfo("NetioHandler::startTriggerMatchers")
-	//  << "Jumping by " << timeTickDiff/framesPerMsg << " elements in data queue. Queue size is " << m_pcqs[tid]->sizeGuess();       
-        m_pcqs[tid]->popXFront(timeTickDiff/framesPerMsg);
 
         // Roland, Thijs -> Reordering mode.
-        m_fragmentPtr->resizeBytes(m_timeWindowByteSizeOut);
         uint64_t fragSize = m_timeWindowByteSizeOut;
         if (!m_doReorder)
         {
-          for (unsigned i = 0; i < m_timeWindowNumMessages; i++)
-          {
-            memcpy(m_fragmentPtr->dataBeginBytes() + m_msgsize * i, (char *)m_pcqs[tid]->frontPtr(), m_msgsize);
-            m_pcqs[tid]->popFront();
-          }
+          buffer.copyOut((char *)dst, startSeq, m_timeWindowNumMessages, m_msgsize);
         }
         else
         {
 #ifdef REORD_DEBUG
           std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
 #endif
-          m_reorderFacility->do_reorder_start(m_timeWindowNumFrames);
-          for (unsigned i = 0; i < m_timeWindowNumMessages; i++)
-          {
-            m_reorderFacility->do_reorder_part(
-              m_fragmentPtr->dataBeginBytes(),         // dst
-              (uint8_t *)m_pcqs[tid]->frontPtr(),      // src
-              i * framesPerMsg, (i + 1) * framesPerMsg // frame start, frame stop
-            );
-            m_pcqs[tid]->popFront();
+          // The facility keeps per window state: one copy per matcher call.
+          ReorderFacility reorderFacility = *m_reorderFacility;
+          reorderFacility.do_reorder_start(m_timeWindowNumFrames);
+          if (buffer.hasExpansion()) {
+            // The TP finding expanded the messages already. Give it as long as
+            // hitsToFragment would to get past the window, then unpack what it skipped.
+            const uint64_t stopSeq = startSeq + m_timeWindowNumMessages;
+            auto expandStart = std::chrono::steady_clock::now();
+            while (buffer.expandedUpTo() < stopSeq
+                   && std::chrono::steady_clock::now() - expandStart < std::chrono::milliseconds(1500)) {
+              std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            unsigned notExpanded = 0;
+            for (unsigned i = 0; i < m_timeWindowNumMessages; i++)
+            {
+              const uint8_t* src = (const uint8_t *)buffer.at(startSeq + i);
+              const MessageAllADCs* adcs = buffer.expandedAt(startSeq + i);
+              if (adcs) {
+                reorderFacility.do_expanded_reorder_part(dst, src, (const uint16_t *)adcs->fragments,
+                                                         i * framesPerMsg, (i + 1) * framesPerMsg);
+              } else {
+                reorderFacility.do_reorder_part(dst, (uint8_t *)src, i * framesPerMsg, (i + 1) * framesPerMsg);
+                ++notExpanded;
+              }
+            }
+            if (notExpanded) {
+              DAQLogger::LogWarning("NetioHandler::startTriggerMatchers")
+                << notExpanded << " of " << m_timeWindowNumMessages << " messages of trigger " << triggerTimestamp
+                << " were not expanded by the TP finding, reordered from the raw frames.";
+            }
+          } else if (m_msgsize == sizeof(SUPERCHUNK_CHAR_STRUCT)) {
+            // Frames are contiguous within a span: one reorder call per span.
+            LinkBuffer::Span spans[2];
+            unsigned nspans = buffer.spans(startSeq, m_timeWindowNumMessages, spans);
+            unsigned frame = 0;
+            for (unsigned s = 0; s < nspans; ++s)
+            {
+              unsigned nframes = spans[s].messages * framesPerMsg;
+              reorderFacility.do_reorder_part(
+                dst,                                     // dst
+                (uint8_t *)spans[s].data,                // src
+                frame, frame + nframes                   // frame start, frame stop
+              );
+              frame += nframes;
+            }
+          } else {
+            for (unsigned i = 0; i < m_timeWindowNumMessages; i++)
+            {
+              reorderFacility.do_reorder_part(
+                dst,                                     // dst
+                (uint8_t *)buffer.at(startSeq + i),      // src
+                i * framesPerMsg, (i + 1) * framesPerMsg // frame start, frame stop
+              );
+            }
           }
-          fragSize = m_reorderFacility->reorder_final_size();
+          fragSize = reorderFacility.reorder_final_size();
 #ifdef REORD_DEBUG
           auto tdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t1);
           DAQLogger::LogInfo("NetioHandler::reorderTiming") << "reorder took: " << tdelta.count() << " us";
 #endif
         }
 
-        if (m_doCompress) {
-          // RS -> Keep in mind, compFacility does all the fragment size resizes.
-#ifdef QATCOMP_DEBUG
+        // The writer may have lapped us while we were reading in place.
+        if (!buffer.valid(startSeq)) {
+          DAQLogger::LogWarning("NetioHandler::startTriggerMatchers")
+            << "Link buffer overwritten during readout of trigger " << triggerTimestamp << "! Consider a larger queue_size.";
+        }
+
+        if(m_doTPFinding){
+            DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Calling hitsToFragment(" << triggerTimestamp << ", " << (m_tickdist*m_timeWindowNumFrames) << ", " <<  fragmentPtrHits << ")";
+            m_tp_finders[tid]->hitsToFragment(triggerTimestamp, m_tickdist*m_timeWindowNumFrames, fragmentPtrHits);
+        }
+
+        if (compress) {
+          // RS -> Keep in mind, the compression stage does all the fragment size resizes.
           std::chrono::high_resolution_clock::time_point tq1 = std::chrono::high_resolution_clock::now();
-#endif
-          uint_fast32_t compSize = m_compressionFacility->do_compress(m_fragmentPtr, fragSize);
+          m_compressionStage->submit( CompressionStage::Job{ dst, fragSize, fragmentPtr,
+            [this, &req, tid, dst, fragSize, tq1] (size_t compSize) {
 #ifdef QATCOMP_DEBUG
-          auto tqdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - tq1);
-          DAQLogger::LogInfo("NetioHandler::compressionTiming") << "compression took: " << tqdelta.count() << " us";
+              auto tqdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - tq1);
+              DAQLogger::LogInfo("NetioHandler::compressionTiming") << "compression took: " << tqdelta.count() << " us";
 #endif
-          DAQLogger::LogInfo("NetioHandler::startTriggerMatchers")
-            << "Data compressed! Orig:" << fragSize << " Compressed:" << compSize
-            << " ratio:" << float(fragSize)/float(compSize);
+              if (compSize == 0) {
+                req.storedRaw.store(true, std::memory_order_relaxed);
+              } else {
+                DAQLogger::LogInfo("NetioHandler::startTriggerMatchers")
+                  << "Data compressed! Orig:" << fragSize << " Compressed:" << compSize
+                  << " ratio:" << float(fragSize)/float(compSize);
+              }
+              releaseStagingBuffer(tid, dst);
+              finishRequest(req);
+            } } );
+          return false; // the compression stage finishes the request for this link
         } else {
         // Not sure what should happen here. If we have reordered the fragment is too large
           if (m_doReorder) {
             // It should be checked that resizing to smaller size never re-allocs and destroys
             // data in the buffer
-            m_fragmentPtr->resizeBytes(fragSize);
+            fragmentPtr->resizeBytes(fragSize);
           }
         }
-         
-        if(m_doTPFinding){
-            DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "Calling hitsToFragment(" << m_triggerTimestamp << ", " << (m_tickdist*m_timeWindowNumFrames) << ", " <<  m_fragmentPtrHits << ")";
-            m_tp_finders[tid]->hitsToFragment(m_triggerTimestamp, m_tickdist*m_timeWindowNumFrames, m_fragmentPtrHits);
-        }
-        /*m_fragmentPtr->resizeBytes( m_msgsize*(2 + m_timeWindow/framesPerMsg) );
+        /*fragmentPtr->resizeBytes( m_msgsize*(2 + m_timeWindow/framesPerMsg) );
         for(unsigned i=0; i<(m_timeWindow/framesPerMsg)+2; i++) //read out 21 messages
         {
-          memcpy(m_fragmentPtr->dataBeginBytes()+m_msgsize*i,(char*)m_pcqs[tid]->frontPtr(), m_msgsize);
+          memcpy(fragmentPtr->dataBeginBytes()+m_msgsize*i,(char*)m_pcqs[tid]->frontPtr(), m_msgsize);
           m_pcqs[tid]->popFront();
         }*/
 
       } else { // generate fake fragment for emulation
-        if (m_triggerTimestamp == 0) {
+        if (triggerTimestamp == 0) {
           DAQLogger::LogInfo("NetioHandler::startTriggerMatchers") << "no trigger ";
-          return;
+          return true;
         } else {
-          m_fragmentPtr->resizeBytes(m_msgsize*(2 + m_timeWindow/framesPerMsg));
+          fragmentPtr->resizeBytes(m_msgsize*(2 + m_timeWindow/framesPerMsg));
           char *buf = new char[m_msgsize*(2 + m_timeWindow/framesPerMsg)];
-          memcpy(m_fragmentPtr->dataBeginBytes(), buf, 2 + m_timeWindow/framesPerMsg);
+          memcpy(fragmentPtr->dataBeginBytes(), buf, 2 + m_timeWindow/framesPerMsg);
         }
       }
+      return true;
     });
+
+    m_requestQueues.emplace_back( new TriggerRequestQueue(m_pipelineDepth) );
+  }
+  // Staging buffers for the compression stage.
+  m_stagingBuffers.clear();
+  m_stagingBuffers.resize(m_activeChannels);
+  m_stagingFree.assign(m_activeChannels, std::vector<uint8_t*>());
+  if (m_doCompress && m_compressionStage) {
+    for (uint32_t i=0; i<m_activeChannels; ++i){
+      for (size_t d=0; d<m_pipelineDepth; ++d){
+        m_stagingBuffers[i].emplace_back( new uint8_t[m_timeWindowByteSizeOut] );
+        m_stagingFree[i].push_back( m_stagingBuffers[i].back().get() );
+      }
+    }
+  }
+  // Spawn the matchers once their functors and queues are in place.
+  for (uint32_t i=0; i<m_activeChannels; ++i){
+    m_matchers.emplace_back( &NetioHandler::runTriggerMatcher, this, i );
+    set_thread_name(m_matchers[i], "nioh-trm", i);
   }
 }
 
+void NetioHandler::runTriggerMatcher(uint32_t tid){
+  TriggerRequest* req = nullptr;
+  while (m_requestQueues[tid]->pop(req)) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    bool finished = m_functors[tid](*req);
+    if (req->timestamp != 0) {
+      auto tdelta = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t0);
+      m_matcherLatencyHists[tid].fill(tdelta.count());
+    }
+    if (finished) {
+      finishRequest(*req);
+    }
+  }
+}
+
+void NetioHandler::finishRequest(TriggerRequest& req){
+  // The submitter may free the request as soon as the last link released it.
+  if (req.done.count_down()) {
+    m_requestsInFlight.fetch_sub(1);
+    futex_wake(&m_requestsInFlight);
+  }
+}
+
+uint8_t* NetioHandler::takeStagingBuffer(uint32_t tid){
+  std::lock_guard<std::mutex> lock(m_stagingMutex);
+  if (m_stagingFree[tid].empty()) return nullptr;
+  uint8_t* buf = m_stagingFree[tid].back();
+  m_stagingFree[tid].pop_back();
+  return buf;
+}
+
+void NetioHandler::releaseStagingBuffer(uint32_t tid, uint8_t* buf){
+  std::lock_guard<std::mutex> lock(m_stagingMutex);
+  m_stagingFree[tid].push_back(buf);
+}
+
 void NetioHandler::stopTriggerMatchers(){
   DAQLogger::LogInfo("NetioHandler::stopTriggerMatchers")
-    << "Attempt to stop triggerMatchers... Wait until they are busy!";
+    << "Attempt to stop triggerMatchers... Wait until they are done!";
   m_stop_trigger.store(true);
-  bool success = false;
-  while (!success){
-    for (uint32_t i=0; i<m_extractors.size(); ++i){
-      if ( m_extractors[i]->get_readiness() == true ) {
-        success |= true;
-      }  else {
-        std::this_thread::sleep_for(std::chrono::microseconds(50));
-        success |= false;
-      }
-      //std::cout << "  -> " << success << '\n';
-    }
+  futex_wake(&m_requestsInFlight);
+  for (auto& queue : m_requestQueues) {
+    queue->stop();
+  }
+  for (auto& matcher : m_matchers) {
+    matcher.join();
+  }
+  m_matchers.clear();
+  for (uint32_t i=0; i<m_matcherLatencyHists.size(); ++i){
+    printMatcherLatencyHist(i);
   }
-  m_extractors.clear();
 }
 
 bool NetioHandler::busy(){
-  uint32_t busyLinks = 0;
-  for (uint32_t i=0; i<m_extractors.size(); ++i) {
-    bool busy = (m_extractors[i]->get_readiness()==false) ? true : false; 
-    if (busy) { busyLinks++; }
+  return m_requestsInFlight.load() != 0;
+}
+
+void NetioHandler::printMatcherLatencyHist(uint32_t tid) const {
+  const PowerTwoHist<24>& hist = m_matcherLatencyHists[tid];
+  std::stringstream latency_hist_ss;
+  latency_hist_ss << "TriggerMatcher[" << tid << "] latency histogram (bin low edge, microseconds):" << std::endl;
+  for(size_t i=0; i<hist.nbins(); ++i){
+    latency_hist_ss << hist.binLo(i) << "\t" << hist.bin(i) << std::endl;
   }
-  return (busyLinks != 0) ? true : false;
+  DAQLogger::LogInfo("NetioHandler::printMatcherLatencyHist") << latency_hist_ss.str();
 }
 
-bool NetioHandler::triggerWorkers(uint64_t timestamp, uint64_t sequence_id,
-                                  std::unique_ptr<artdaq::Fragment>& frag,
-                                  std::unique_ptr<artdaq::Fragment>& fraghits) {
-  if (m_stop_trigger.load()) return false; // check if we should proceed with the trigger.
- 
-  m_triggerTimestamp = timestamp;
-  m_triggerSequenceId = sequence_id;
-  m_fragmentPtr = frag.get();
-  m_fragmentPtrHits = fraghits.get();
+bool NetioHandler::submitRequest(TriggerRequest& req) {
+  // The link queues and the staging buffers hold m_pipelineDepth requests:
+  // wait for the oldest one to finish before going past that.
+  uint32_t inFlight = m_requestsInFlight.load();
+  for (;;) {
+    if (m_stop_trigger.load()) return false; // check if we should proceed with the trigger.
+    if (inFlight >= m_pipelineDepth) {
+      futex_wait(&m_requestsInFlight, inFlight);
+      inFlight = m_requestsInFlight.load();
+    } else if (m_requestsInFlight.compare_exchange_weak(inFlight, inFlight+1)) {
+      break;
+    }
+  }
 
-  // Set functors for extractors.
+  // Every link matcher counts the request down once it filled its part.
+  req.done.reset(m_activeChannels);
+  req.linksSkipped.store(0, std::memory_order_relaxed);
   for (uint32_t i=0; i<m_activeChannels; ++i){
-    m_extractors[i]->set_work(m_functors[i]);
-  } 
-  while (busy()){
-    std::this_thread::sleep_for(std::chrono::microseconds(50));
-  }
-  if (m_triggerTimestamp == 0) {
-    return false;
+    if (!m_requestQueues[i]->push(&req)) {
+      // The fragment goes out without this link: tell the submitter and the metrics.
+      req.linksSkipped.fetch_add(1, std::memory_order_relaxed);
+      uint64_t skipped = ++m_linksSkipped;
+      DAQLogger::LogWarning("NetioHandler::submitRequest")
+        << "TriggerMatcher[" << i << "] has more than " << m_pipelineDepth << " requests queued, skipping it"
+        << " for trigger TS " << req.timestamp << " (" << skipped << " links skipped so far).";
+      if (artdaq::Globals::metricMan_ && artdaq::Globals::metricMan_->Running()) {
+        artdaq::Globals::metricMan_->sendMetric("FELIX links skipped", 1, "links", 1, artdaq::MetricMode::Accumulate);
+      }
+      if (req.done.count_down()) {
+        m_requestsInFlight.fetch_sub(1);
+      }
+    }
   }
   return true;
 }
 
+bool NetioHandler::triggerWorkers(uint64_t timestamp, uint64_t sequence_id,
+                                  std::unique_ptr<artdaq::Fragment>& frag,
+                                  std::unique_ptr<artdaq::Fragment>& fraghits) {
+  TriggerRequest req;
+  req.timestamp = timestamp;
+  req.sequenceId = sequence_id;
+  req.frag = std::move(frag);
+  req.fragHits = std::move(fraghits);
+
+  bool submitted = submitRequest(req);
+  if (submitted) {
+    req.done.wait();
+  }
+  frag = std::move(req.frag);
+  fraghits = std::move(req.fragHits);
+  return submitted && timestamp != 0;
+}
+
 void NetioHandler::startSubscribers(){
   if (!m_extract) return;
 
@@ -335,8 +490,6 @@ void NetioHandler::startSubscribers(){
         netio::message msg;
         size_t goodOnes=0;
         size_t badOnes=0;
-        size_t lostData=0;
-        size_t lostTPData=0;
 
         std::vector<size_t> badSizes;
         std::vector<size_t> badFrags;
@@ -359,7 +512,8 @@ void NetioHandler::startSubscribers(){
 	    SUPERCHUNK_CHAR_STRUCT ics;
 	    msg.serialize_to_usr_buffer((void*)&ics);
 
-	    bool storeOk = m_pcqs[m_channels[chn]]->write(ics); // RS -> Add possibility for dry_run! (No push mode.)
+	    LinkBuffer& buffer = *m_pcqs[m_channels[chn]];
+	    buffer.write(ics); // RS -> Add possibility for dry_run! (No push mode.)
 
             // The first frame in the message
             dune::FelixFrame* frame=reinterpret_cast<dune::FelixFrame*>(&ics);
@@ -367,21 +521,6 @@ void NetioHandler::startSubscribers(){
             uint64_t now_us=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
             m_timestamp_map[m_channels[chn]]->write(std::make_pair(timestamp, now_us));
 
-            if(m_doTPFinding){
-                if(!m_tp_finders[m_channels[chn]]->addMessage(ics)){
-                    ++lostTPData;
-                }
-            }
-
-	    if (!storeOk) {
-              if(!busy()) {
-                m_pcqs[m_channels[chn]]->popXFront(m_pcqs[m_channels[chn]]->capacity()/2);
-                lostData+= m_pcqs[m_channels[chn]]->capacity()/2;
-              }
-              else {
-                ++lostData;
-              }
-	    }
 	    goodOnes++;
           }
         }
@@ -393,10 +532,12 @@ void NetioHandler::startSubscribers(){
         }
         DAQLogger::LogInfo("NetioHandler::subscriber") 
           << " -> Subscriber joining for link " << chn << '\n' 
-          << " -> Failure summary: sum(BAD) " << badOnes << " sum(GOOD) " << goodOnes << " sum(LOST) " << lostData << '\n'
+          << " -> Failure summary: sum(BAD) " << badOnes << " sum(GOOD) " << goodOnes << '\n'
           << subsummary.str()
           << " -> Failed timestamp distances (expected distance between messages: " << expDist << ")\n";
-        DAQLogger::LogInfo("NetioHandler::subscriber") << lostTPData << " messages failed to push to TriggerPrimitiveFinder";
+        if(m_doTPFinding){
+            DAQLogger::LogInfo("NetioHandler::subscriber") << m_tp_finders[m_channels[chn]]->messagesSkipped() << " messages overwritten before the TriggerPrimitiveFinder got to them";
+        }
 
 	})
 				 );
@@ -405,9 +546,8 @@ void NetioHandler::startSubscribers(){
 }
 
 bool NetioHandler::flushQueues(){
-  // while (!pcq.isEmpty()) { pcq.pop(); }
-  while (!m_pcqs[0]->isEmpty()) { m_pcqs[0]->popFront(); }
-  return true; ///m_pcqs[m_channels[chn]]
+  for (auto& pcq : m_pcqs) { pcq.second->flush(); }
+  return true;
 }
 
 void NetioHandler::stopSubscribers(){
@@ -425,49 +565,30 @@ void NetioHandler::stopSubscribers(){
   m_netioSubscribers.clear();
 }
 
-void NetioHandler::lockSubsToCPUs(uint32_t offset) {
-  DAQLogger::LogInfo("NetioHandler::lockSubsToCPUs") << "Attempt to lock to CPUs. Hardcoded for NUMA0!"; 
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  unsigned short cpuid = offset;
+void NetioHandler::lockSubsToCPUs() {
+  DAQLogger::LogInfo("NetioHandler::lockSubsToCPUs") << "Attempt to lock subscribers to CPUs on NUMA node " << m_numaNode;
   for (unsigned i=0; i< m_netioSubscribers.size(); ++i) {
-    CPU_SET(cpuid, &cpuset);
-    // RS : Not a good attempt.
-    //CPU_SET(cpuid+16, &cpuset);
+    // The subscriber of channel i, next to its link buffer
+    cpu_set_t cpuset = CPUPin::getInstance().cpuSetFor(CPUPin::Role::Subscriber, std::to_string(i), m_numaNode);
     int ret = pthread_setaffinity_np(m_netioSubscribers[i].native_handle(), sizeof(cpu_set_t), &cpuset);
     if (ret!=0) {
       DAQLogger::LogError("NetioHandler::lockSubsToCPUs") 
         << "Error calling pthread_setaffinity! Return code:" << ret; 
-    } else {
-      DAQLogger::LogInfo("NetioHandler::lockSubsToCPUs") 
-        << "Subscriber locked to CPU["<<cpuid<<"]"; 
     }
-//#warning RS: FIXME! Subscriber NUMA specific CPU locks should come from FHiCL configuration!
-    cpuid+=2; // RS: FIXME! This should come from a NUMA node mapping from configuration, or through auto-discovery.
   }
   m_cpu_lock = true;
 }
 
-void NetioHandler::lockTrmsToCPUs(uint32_t offset) {
-  DAQLogger::LogInfo("NetioHandler::lockTrmsToCPUs") << "Attempt to lock TriggerMatchers to CPUs."; 
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  unsigned short cpuid = offset; // Beautiful hardcode.... :)
-  for (unsigned i=0; i< m_extractors.size(); ++i) { //  set_thread_name(m_extractors[i]->get_thread(), "nioh-trm", i);
-    CPU_SET(cpuid-12, &cpuset);
-    CPU_SET(cpuid-12+24, &cpuset);
-    // RS : Not a good attempt.
-    //CPU_SET(cpuid+16, &cpuset);
-    int ret = pthread_setaffinity_np(m_extractors[i]->get_thread().native_handle(), sizeof(cpu_set_t), &cpuset);
+void NetioHandler::lockTrmsToCPUs() {
+  DAQLogger::LogInfo("NetioHandler::lockTrmsToCPUs") << "Attempt to lock TriggerMatchers to CPUs on NUMA node " << m_numaNode;
+  for (unsigned i=0; i< m_matchers.size(); ++i) {
+    // Same CPUs on every run: CPUPin remembers the assignment
+    cpu_set_t cpuset = CPUPin::getInstance().cpuSetFor(CPUPin::Role::Matcher, std::to_string(i), m_numaNode);
+    int ret = pthread_setaffinity_np(m_matchers[i].native_handle(), sizeof(cpu_set_t), &cpuset);
     if (ret!=0) {
       DAQLogger::LogError("NetioHandler::lockTrmsToCPUs") 
         << "Error calling pthread_setaffinity! Return code:" << ret; 
-    } else {
-      DAQLogger::LogInfo("NetioHandler::lockTrmsToCPUs") 
-        << "TriggerMatchers locked to CPU["<<cpuid<<"]"; 
     }
-//#warning RS: FIXME! Subscriber NUMA specific CPU locks should come from FHiCL configuration!
-    cpuid+=2; // RS: FIXME! This should come from a NUMA node mapping from configuration, or through auto-discovery.
   }
 }
 
@@ -476,12 +597,21 @@ bool NetioHandler::addChannel(uint64_t chn, uint16_t tag, std::string host, uint
   m_host=host;
   m_port=port;
   m_channels.push_back(chn);
-  m_pcqs[chn] = std::make_unique<FrameQueue>(queueSize);
+  m_pcqs[chn] = std::make_unique<LinkBuffer>(queueSize, (m_msgsize/m_framesize)*m_tickdist, m_numaNode);
   m_timestamp_map[chn] = std::make_unique<TimestampQueue>(queueSize);
 
   if(m_doTPFinding){
+      // The TP finding expands every message anyway: with reordering, let it keep the result.
+      if(m_doReorder && m_doFuseExpansion && m_msgsize==sizeof(SUPERCHUNK_CHAR_STRUCT)){
+          m_pcqs[chn]->enableExpansion();
+          DAQLogger::LogInfo("NetioHandler::addChannel") << "Reordered fragments of link " << chn << " use the ADCs expanded by the TP finding";
+      }
       try{
-          m_tp_finders[chn]=std::make_unique<TriggerPrimitiveFinder>(tpf_params);
+          // It reads the messages from the link buffer with its own cursor.
+          // With the link number it names its threads for CPUPin
+          fhicl::ParameterSet link_tpf_params(tpf_params);
+          link_tpf_params.put_or_replace<int>("link_id", chn);
+          m_tp_finders[chn]=std::make_unique<TriggerPrimitiveFinder>(link_tpf_params, *m_pcqs[chn]);
       }
       catch(std::bad_alloc& e){
           DAQLogger::LogInfo("NetioHandler::addChannel") << "std::bad_alloc thrown in make_unique: " << e.what();
@@ -496,6 +626,8 @@ bool NetioHandler::addChannel(uint64_t chn, uint16_t tag, std::string host, uint
           throw;
       }
   }
+  // After enableExpansion(), so that the expanded ADCs are in the report too
+  DAQLogger::LogInfo("NetioHandler::addChannel") << "Link buffer of link " << chn << " (NUMA node " << m_numaNode << " requested): " << m_pcqs[chn]->placement();
 
   DAQLogger::LogInfo("NetioHandler::addChannel") << "setting up netio...";
   if (m_extract) {
@@ -4,12 +4,13 @@
 #include "dune-raw-data/Overlays/FragmentType.hh"
 #include "ProducerConsumerQueue.hh"
 #include "ReusableThread.hh"
+#include "TriggerRequest.hh"
 #include "NetioWIBRecords.hh"
 #include "Utilities.hh"
 #include "Types.hh"
 
 #include "ReorderFacility.hh"
-#include "QzCompressor.hh"
+#include "CompressionStage.hh"
 
 #include "netio/netio.hpp"
 
@@ -20,6 +21,7 @@
 #include <algorithm>
 
 #include "TriggerPrimitive/TriggerPrimitiveFinder.h"
+#include "dune-artdaq/Generators/swTrigger/PowerTwoHist.hh"
 
 //#define MSGQ
 //#define QACHECK
@@ -29,7 +31,7 @@
 /*
  * NetioHandler
  * Author: Roland.Sipos@cern.ch
- * Description: Wrapper class for NETIO sockets and folly SPSC circular buffers.
+ * Description: Wrapper class for NETIO sockets and timestamp addressable link buffers.
  *   Makes the communication with the FELIX easier and scalable.
  * Date: November 2017
 */
@@ -57,28 +59,36 @@ public:
   void setMessageSize(size_t messageSize) { m_msgsize = messageSize; }
   void setExtract(bool extract) { m_extract = extract; }
   void setVerbosity(bool v){ m_verbose = v; }
+  void setPipelineDepth(size_t depth) { m_pipelineDepth = (depth > 0) ? depth : 1; }
+  void setNumaNode(int node) { m_numaNode = node; } // Where addChannel() puts the link buffers, -1 for anywhere
 
   uint32_t getMessageSize() { return m_msgsize; }
   uint32_t getFrameSize() { return m_framesize; }
 
   // Compression and reordering
-  void doReorder(bool doIt, bool forceNoAVX) {
+  void doReorder(bool doIt, bool forceNoAVX, bool forceNoAVX512 = false) {
     m_doReorder = doIt;
-    m_reorderFacility = std::make_unique<ReorderFacility>(forceNoAVX);
+    m_reorderFacility = std::make_unique<ReorderFacility>(forceNoAVX, forceNoAVX512);
   }
-  void doCompress(bool doIt) {
-    m_doCompress = doIt;
-    // QzCompressor qzc(QzCompressor::QzAlgo::Deflate, compression_level, hw_bufsize_kb);
-    m_compressionFacility = std::make_unique<QzCompressor>(QzCompressor::QzAlgo::Deflate, 4, 64);
-  }
-  int  initQAT(int engine) {
+  void doCompress(bool doIt) { m_doCompress = doIt; }
+  void setCompressionThreads(unsigned n) { m_compressionThreads = n; }
+  int  initCompression(Compressor::Backend backend, unsigned level, int qatEngine) {
+    // One compressor per worker. QAT falls back to software deflate if there are not enough sessions.
     // If this fails, doCompression will fall back to 0.
-    int ret = m_compressionFacility->init(m_timeWindowByteSizeOut, engine);
-    if (ret!=0) { m_doCompress=false; }
+    m_compressionStage = std::make_unique<CompressionStage>(m_compressionThreads, backend, level, qatEngine, m_numaNode);
+    int ret = m_compressionStage->start();
+    if (ret!=0) { m_doCompress=false; m_compressionStage.reset(); }
     return ret;
   }
+  // Metadata value of the compressed payload, 0 if not compressing.
+  uint8_t getCompressionFormat() {
+    return (m_doCompress && m_compressionStage) ? Compressor::formatId(m_compressionStage->backend()) : 0;
+  }
   void doTPFinding(bool doIt) { m_doTPFinding=doIt; }
-  void shutdownQAT() { m_compressionFacility->shutdown(); }
+  // With both reordering and TP finding, keep the ADCs that the TP finding expands in the
+  // link buffers, and build the reordered fragments from them. Doubles the link buffer memory.
+  void doFuseExpansion(bool doIt) { m_doFuseExpansion=doIt; }
+  void shutdownCompression() { m_compressionStage.reset(); }
   void recalculateByteSizes();
   void recalculateFragmentSizes();
   size_t getTimeWindowNumFrames() { return m_timeWindowNumFrames; }
@@ -91,16 +101,23 @@ public:
   bool addChannel(uint64_t chn, uint16_t tag, std::string host, uint16_t port, size_t queueSize, bool zerocopy, fhicl::ParameterSet const& tpf_params);   
   bool subscribe(uint64_t chn, uint16_t tag); // Subscribe to given tag for elink/channel.
   bool unsubscribe(uint64_t chn, uint16_t tag); // Unsubscribe from a tag for elinkg/channel.
-  bool busy(); // are trigger matchers busy
+  bool busy(); // are there requests in flight
   void startTriggerMatchers(); // Starts trigger matcher threads.
   void stopTriggerMatchers();  // Stops trigger matcher threads.
   void startSubscribers(); // Starts the subscriber threads.
   void stopSubscribers();  // Stops the subscriber threads.
-  void lockSubsToCPUs(uint32_t offset); // Lock subscriber threads to CPUset.
-  void lockTrmsToCPUs(uint32_t offset); // Lock triggerMatcher threads to CPUset: highly experimental. :)
+  void lockSubsToCPUs(); // Lock subscriber threads to CPUs from CPUPin, on the NUMA node of the link buffers.
+  void lockTrmsToCPUs(); // Lock triggerMatcher threads the same way.
+  void printMatcherLatencyHist(uint32_t tid) const; // Per link trigger matcher latency.
  
   // ArtDAQ specific
   //void setReadoutBuffer(char* buffPtr, size_t* bytePtr) { m_bufferPtr=&buffPtr; m_bytesReadPtr=&bytePtr; };
+  // Hand a request to every link matcher and return immediately. The request
+  // must stay alive until req.done is released. Blocks while getPipelineDepth()
+  // requests are outstanding; false once the matchers are stopped.
+  bool submitRequest(TriggerRequest& req);
+  size_t getPipelineDepth() { return m_pipelineDepth; }
+  // Blocking single request: submit and wait.
   bool triggerWorkers(uint64_t timestamp, uint64_t sequence_id,
                       std::unique_ptr<artdaq::Fragment>& frag,
                       std::unique_ptr<artdaq::Fragment>& fraghits);
@@ -119,6 +136,11 @@ protected:
   ~NetioHandler();
 
 private:
+  void runTriggerMatcher(uint32_t tid); // Serves the request queue of one link.
+  void finishRequest(TriggerRequest& req); // One link is done with req.
+  uint8_t* takeStagingBuffer(uint32_t tid); // nullptr if all are with the compression stage
+  void releaseStagingBuffer(uint32_t tid, uint8_t* buf);
+
   // Consts
   const uint32_t m_headersize = sizeof(FromFELIXHeader);
   const uint_fast64_t m_tickdist=25; 
@@ -141,9 +163,11 @@ private:
   bool m_doReorder;
   bool m_doCompress;
   bool m_doTPFinding;
+  bool m_doFuseExpansion;
   bool m_qatReady;
   bool m_extract;
   bool m_verbose;
+  int m_numaNode;
 
   //Precomputed bytesizes - Thijs
   size_t m_timeWindowByteSizeIn;
@@ -151,12 +175,8 @@ private:
   size_t m_timeWindowNumFrames;
   size_t m_timeWindowNumMessages;
 
-  // Queues 
-#ifdef MSGQ
-  std::map<uint64_t, UniqueMessageQueue> m_pcqs; // Queues for elink RX.
-#else 
-  std::map<uint64_t, UniqueFrameQueue> m_pcqs;
-#endif
+  // Timestamp addressable ring buffers for elink RX.
+  std::map<uint64_t, UniqueLinkBuffer> m_pcqs;
 
   // Map from data timestamp to the system time when we received it,
   // so we can measure the selection request latency in the software trigger
@@ -168,13 +188,25 @@ private:
   // Threads
   std::vector<std::thread> m_netioSubscribers;
   //std::vector<std::unique_ptr<NetioSubscriber>> m_subscribers;
-  std::vector<std::unique_ptr<ReusableThread>>  m_extractors;
-  std::vector<std::function<void()>> m_functors; 
+  std::vector<std::thread> m_matchers;
+  std::vector<std::function<bool(TriggerRequest&)>> m_functors; // false: handed over to compression
+  std::vector<std::unique_ptr<TriggerRequestQueue>> m_requestQueues; // per link
+  size_t m_pipelineDepth; // max. outstanding requests
+  std::atomic<uint32_t> m_requestsInFlight;
+  std::atomic<uint64_t> m_linksSkipped; // link parts dropped because the link queue was full
+  std::vector<PowerTwoHist<24>> m_matcherLatencyHists; // per link, microseconds
 
   // Reordering and compression utilities
   bool m_forceNoAVXReorder;
   std::unique_ptr<ReorderFacility> m_reorderFacility;
-  std::unique_ptr<QzCompressor> m_compressionFacility;
+  std::unique_ptr<CompressionStage> m_compressionStage;
+  unsigned m_compressionThreads;
+  // Per link, one staging buffer per outstanding request: the window is assembled
+  // there and read by the compression stage while the matcher moves on. Jobs may
+  // complete out of order, so a buffer is only reused once its job gave it back.
+  std::vector<std::vector<std::unique_ptr<uint8_t[]>>> m_stagingBuffers;
+  std::vector<std::vector<uint8_t*>> m_stagingFree; // per link, guarded by m_stagingMutex
+  std::mutex m_stagingMutex;
 
   // Trigger bookeeping
   bool m_turnaround;
@@ -182,12 +214,6 @@ private:
   char* m_lastPosition; 
   uint_fast64_t m_lastTimestamp;
 
-  // ArtDAQ specific
-  uint64_t m_triggerTimestamp;
-  uint64_t m_triggerSequenceId;
-  artdaq::Fragment* m_fragmentPtr;
-  artdaq::Fragment* m_fragmentPtrHits;
-
   // Thread control
   std::atomic<bool> m_stop_trigger;
   std::atomic<bool> m_stop_subs;
@@ -66,6 +66,18 @@ struct MessageCollectionADCs {
     char fragments[collection_adcs_size];
 };
 
+// How many AVX2 registers hold all the channels of a frame
+static constexpr size_t ALL_REGISTERS_PER_FRAME=16;
+
+// One netio message's worth of all the ADCs after expansion: 12
+// frames per message times 16 registers per frame times 32 bytes per
+// register. Laid out like MessageCollectionADCs: the 12 times of each
+// register are adjacent
+static const size_t all_adcs_size=BYTES_PER_REGISTER*ALL_REGISTERS_PER_FRAME*FRAMES_PER_MSG;
+struct MessageAllADCs {
+    alignas(32) char fragments[all_adcs_size];
+};
+
 /*
 static void printHexChars(const WIB_CHAR_STRUCT& wct){
   //ostringstream oss;
@@ -0,0 +1,200 @@
+#ifndef NUMA_MEMORY_HH_
+#define NUMA_MEMORY_HH_
+
+#include <algorithm>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <cerrno>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <numa.h>
+#include <numaif.h>
+
+#include "dune-artdaq/DAQLogger/DAQLogger.hh"
+
+/*
+ * NumaMemory
+ * Description: Large, long lived buffers placed on a given NUMA node and
+ *   backed by huge pages where the host has them. An allocation first asks
+ *   for hugetlbfs pages (MAP_HUGETLB), and falls back to normal pages with
+ *   transparent huge pages requested. The node is set as the preferred one
+ *   for the range with mbind() before any page is touched, and the range is
+ *   faulted in at allocation time so that the data path never takes a page
+ *   fault.
+ *   A node of -1 means no binding: the pages go wherever the allocating
+ *   thread's policy puts them, usually its own node.
+ * Date: November 2019
+*/
+namespace numa_memory
+{
+  // The huge page size on x86_64. Allocations are rounded up to it
+  constexpr size_t HUGE_PAGE_SIZE = 2*1024*1024;
+  constexpr size_t PAGE_SIZE = 4096;
+  constexpr size_t MAX_NODES = 1024;
+
+  inline bool numaAvailable() {
+    static const bool available = (numa_available() != -1);
+    return available;
+  }
+
+  // The node the memory at p is on, -1 if unknown or not faulted in yet
+  inline int nodeOf(const void* p) {
+    int node = -1;
+    if (get_mempolicy(&node, nullptr, 0, const_cast<void*>(p), MPOL_F_NODE | MPOL_F_ADDR) != 0) { return -1; }
+    return node;
+  }
+
+  // The node of the CPU the calling thread is running on
+  inline int currentNode() {
+    if (!numaAvailable()) { return -1; }
+    int cpu = sched_getcpu();
+    return (cpu < 0) ? -1 : numa_node_of_cpu(cpu);
+  }
+
+  inline int nodeOfCpu(int cpu) {
+    if (!numaAvailable() || cpu < 0) { return -1; }
+    return numa_node_of_cpu(cpu);
+  }
+
+  // The node of a PCI device from sysfs, eg. "/sys/bus/pci/devices/0000:81:00.0".
+  // -1 if the kernel doesn't know, as on single node hosts
+  inline int deviceNode(const std::string& sysfsDevice) {
+    std::ifstream in(sysfsDevice + "/numa_node");
+    int node = -1;
+    if (!(in >> node)) { return -1; }
+    return node;
+  }
+
+  // The sysfs paths of the PCI devices bound to `driver`, eg. "flx", in PCI
+  // address order: the order the driver probes, and so numbers, them in
+  inline std::vector<std::string> pciDriverDevices(const std::string& driver) {
+    const std::string dir = "/sys/bus/pci/drivers/" + driver;
+    std::vector<std::string> devices;
+    DIR* d = opendir(dir.c_str());
+    if (!d) { return devices; }
+    while (dirent* e = readdir(d)) {
+      // The devices are the links named by address, eg. "0000:81:00.0"
+      const std::string name = e->d_name;
+      if (name.find(':') != std::string::npos) { devices.push_back(name); }
+    }
+    closedir(d);
+    std::sort(devices.begin(), devices.end());
+    for (auto& dev : devices) { dev = dir + "/" + dev; }
+    return devices;
+  }
+
+  // The node of the PCI device behind a network interface, eg. "ib0"
+  inline int netInterfaceNode(const std::string& ifname) {
+    return deviceNode("/sys/class/net/" + ifname + "/device");
+  }
+
+  inline size_t mappedSize(size_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  }
+
+  // Map at least `bytes` bytes on `node`, faulted in. hugePages says whether
+  // hugetlbfs pages were had. Throws std::bad_alloc when nothing can be mapped
+  inline void* allocate(size_t bytes, int node, bool& hugePages) {
+    const size_t len = mappedSize(bytes);
+    void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    hugePages = (p != MAP_FAILED);
+    if (!hugePages) {
+      p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) { throw std::bad_alloc(); }
+      // Only a hint: THP may be disabled, or set to "always" anyway
+      madvise(p, len, MADV_HUGEPAGE);
+    }
+    if (node >= 0 && node < int(MAX_NODES) && numaAvailable() && node <= numa_max_node()) {
+      // Preferred rather than bound: a full node falls back to another
+      // instead of failing the allocation
+      const size_t bits = 8*sizeof(unsigned long);
+      unsigned long nodemask[MAX_NODES/bits] = {0};
+      nodemask[node / bits] |= 1ul << (node % bits);
+      if (mbind(p, len, MPOL_PREFERRED, nodemask, MAX_NODES, 0) != 0) {
+        // Not fatal: the pages go where the faulting thread's policy puts them
+        dune::DAQLogger::LogWarning("numa_memory::allocate") << "mbind of " << len << " bytes to NUMA node " << node
+                                                             << " failed: " << strerror(errno);
+      }
+    }
+    // Fault everything in now, on the node just chosen
+    volatile char* c = static_cast<char*>(p);
+    for (size_t off = 0; off < len; off += PAGE_SIZE) { c[off] = 0; }
+    return p;
+  }
+
+  inline void release(void* p, size_t bytes) {
+    if (p) { munmap(p, mappedSize(bytes)); }
+  }
+}
+
+// An array of n default constructed T on a NUMA node, from numa_memory::allocate().
+// Like std::unique_ptr<T[]>, but only for types that need no destruction
+template<typename T>
+class NumaArray
+{
+  static_assert(std::is_trivially_destructible<T>::value, "NumaArray never runs destructors");
+
+public:
+  NumaArray() : m_data(nullptr), m_size(0), m_hugePages(false) {}
+
+  NumaArray(size_t n, int node) : m_data(nullptr), m_size(n), m_hugePages(false) {
+    if (n == 0) { return; }
+    m_data = static_cast<T*>(numa_memory::allocate(n*sizeof(T), node, m_hugePages));
+    for (size_t i=0; i<n; ++i) { new (m_data+i) T; }
+  }
+
+  NumaArray(NumaArray&& other) : m_data(other.m_data), m_size(other.m_size), m_hugePages(other.m_hugePages) {
+    other.m_data = nullptr;
+    other.m_size = 0;
+  }
+
+  NumaArray& operator=(NumaArray&& other) {
+    if (this != &other) {
+      numa_memory::release(m_data, m_size*sizeof(T));
+      m_data = other.m_data;
+      m_size = other.m_size;
+      m_hugePages = other.m_hugePages;
+      other.m_data = nullptr;
+      other.m_size = 0;
+    }
+    return *this;
+  }
+
+  NumaArray(NumaArray const&) = delete;
+  NumaArray& operator=(NumaArray const&) = delete;
+
+  ~NumaArray() { numa_memory::release(m_data, m_size*sizeof(T)); }
+
+  T& operator[](size_t i) { return m_data[i]; }
+  const T& operator[](size_t i) const { return m_data[i]; }
+  T* get() { return m_data; }
+  const T* get() const { return m_data; }
+  size_t size() const { return m_size; }
+  bool hugePages() const { return m_hugePages; }
+
+  // For the startup report, eg. "557.1 MB on node 1, huge pages"
+  std::string placement() const {
+    if (!m_data) { return "not allocated"; }
+    std::ostringstream ss;
+    ss.precision(1);
+    ss << std::fixed << m_size*sizeof(T)/1048576. << " MB on node " << numa_memory::nodeOf(m_data)
+       << (m_hugePages ? ", huge pages" : ", normal pages");
+    return ss.str();
+  }
+
+private:
+  T* m_data;
+  size_t m_size;
+  bool m_hugePages;
+};
+
+#endif
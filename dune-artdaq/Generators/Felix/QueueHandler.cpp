@@ -1,3 +1,4 @@
+#include "dune-artdaq/DAQLogger/DAQLogger.hh"
 #include "QueueHandler.hh"
 #include "NetioWIBRecords.hh"
 
@@ -32,29 +33,6 @@ QueueHandler::QueueHandler()
 //  m_lastPosition = nullptr;
 //  m_lastTimestamp = 0x0;
 
-  m_alloc_thread = std::make_unique<ReusableThread>(5678);
-  m_alloc_func = [&] {
-    for(unsigned i=0; i<m_activeChannels; ++i){
-      SUPERCHUNK_CHAR_STRUCT scs; // copy into a supchunk struct
-      for(unsigned int p=0; p<5568; p++){
-        scs.fragments[p] = 'x';  
-      }
-
-      m_pcqs[i] = std::make_unique<FrameQueue>(m_queueSize);
-
-      for (unsigned n=0; n<1000; ++n){
-        m_pcqs[i]->write(scs);
-      }
-
-      m_pcqs[i]->popXFront(1000);
-    }  
-  };
-
-  // PREPARE THREAD AFFINITY FOR ALLOCATOR
-  cpu_set_t mtset;
-  CPU_ZERO(&mtset);
-  CPU_SET(0, &mtset);
-  pthread_setaffinity_np(m_alloc_thread->get_thread().native_handle(), sizeof(cpu_set_t), &mtset);
 }
 
 QueueHandler::~QueueHandler() {
@@ -62,14 +40,14 @@ QueueHandler::~QueueHandler() {
 }
 
 bool QueueHandler::flushQueues(){
-  // while (!pcq.isEmpty()) { pcq.pop(); }
-  while (!m_pcqs[0]->isEmpty()) { m_pcqs[0]->popFront(); }
-  return true; ///m_pcqs[m_channels[chn]]
+  for (auto& pcq : m_pcqs) { pcq.second->flush(); }
+  return true;
 }
 
-bool QueueHandler::addQueue(uint64_t chn, size_t queueSize){
+bool QueueHandler::addQueue(uint64_t chn, size_t queueSize, int numaNode){
   m_queueSize = queueSize;
   m_channels.push_back(chn);
+  m_numaNodes[chn] = numaNode;
   //m_pcqs[chn] = std::make_unique<FrameQueue>(queueSize);
   m_activeChannels++;
   return true;
@@ -77,9 +55,12 @@ bool QueueHandler::addQueue(uint64_t chn, size_t queueSize){
 } 
 
 void QueueHandler::allocateQueues(){
-  m_alloc_thread->set_work(m_alloc_func);
-  while (!m_alloc_thread->get_readiness()) {
-    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  // The LinkBuffer places and faults in its memory itself, so it no
+  // longer matters which thread allocates it
+  for (uint64_t chn : m_channels) {
+    m_pcqs[chn] = std::make_unique<LinkBuffer>(m_queueSize, FRAMES_PER_MSG*m_tickdist, m_numaNodes[chn]);
+    dune::DAQLogger::LogInfo("QueueHandler::allocateQueues")
+      << "Queue " << chn << " (NUMA node " << m_numaNodes[chn] << " requested): " << m_pcqs[chn]->placement();
   }
 //  for(unsigned i=0; i<m_activeChannels; ++i){
 //    m_pcqs[i] = std::make_unique<FrameQueue>(queueSize);
@@ -24,7 +24,7 @@
 
 /*
  * QueueHandler
- * Description: Queues for onHost mode, with NUMA aware allocation tricks
+ * Description: Queues for onHost mode, each allocated on the NUMA node of its card
  * Author: Roland.Sipos@cern.ch
 */
 class QueueHandler
@@ -55,10 +55,12 @@ public:
   QueueHandler& operator=(QueueHandler &&) = delete;      // Move assign 
 
   // Enable a channel/elink (prepare queue-socket pairs and map it.)
-  bool addQueue(uint64_t chn, size_t queueSize);
+  // numaNode is where the queue goes, -1 for wherever allocateQueues() runs
+  bool addQueue(uint64_t chn, size_t queueSize, int numaNode = -1);
 //  bool addBlockQueue(uint64_t chn, size_t queueSize);
   void allocateQueues();
-  UniqueFrameQueue& getQueue(uint64_t chn) { return std::ref(m_pcqs[chn]); }
+  UniqueLinkBuffer& getQueue(uint64_t chn) { return std::ref(m_pcqs[chn]); }
+  int getNumaNode(uint64_t chn) { return m_numaNodes.count(chn) ? m_numaNodes[chn] : -1; }
 //  UniqueBlockQueue& getBlockQueue(uint64_t chn) { return std::ref(m_bpcqs[chn]); }
 
   // Queue utils if needed
@@ -100,13 +102,10 @@ private:
   size_t m_timeWindowNumMessages;
 
   // Queues 
-  std::map<uint64_t, UniqueFrameQueue> m_pcqs;
+  std::map<uint64_t, UniqueLinkBuffer> m_pcqs;
   std::map<uint64_t, UniqueBlockQueue> m_bpcqs;
+  std::map<uint64_t, int> m_numaNodes;
 
-  // Alloc function for NUMA tricking...
-  std::function<void()> m_alloc_func;
-  std::unique_ptr<ReusableThread> m_alloc_thread;
-  
 };
 
 #endif
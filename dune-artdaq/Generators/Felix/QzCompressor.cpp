@@ -51,7 +51,7 @@ int QzCompressor::init(unsigned max_expected_fragment_size, int engine=-1)
 	int rv = QZ_OK;
 	//qzparams_.inputSzThrshold = 0;
 	rv = qzInit(&qzsession_, qzparams_.swBackup, engine);
-	if (rv != QZ_OK) {
+	if (rv != QZ_OK && rv != QZ_DUPLICATE) { // One qzInit per process, more sessions are fine.
 		return rv;
 	}
 
@@ -63,9 +63,10 @@ int QzCompressor::init(unsigned max_expected_fragment_size, int engine=-1)
 	init_ = true;
 
 	/// Initialized, we can alloc our internal buffer, with margin!
+	/// Not needed if only compress() is used: pass 0 then.
 	internal_buffer_size_ = max_expected_fragment_size * 2;
-	internal_buffer_ = (uint8_t*)malloc(internal_buffer_size_);
-	return rv;
+	internal_buffer_ = (internal_buffer_size_ > 0) ? (uint8_t*)malloc(internal_buffer_size_) : nullptr;
+	return QZ_OK;
 }
 
 int QzCompressor::shutdown()
@@ -128,3 +129,16 @@ uint_fast32_t QzCompressor::do_compress(artdaq::Fragment* fragPtr, uint_fast32_t
 
 	return resultSize;
 }
+
+unsigned QzCompressor::compress(const uint8_t* src, unsigned srcSize, uint8_t* dst, unsigned dstCapacity)
+{
+	unsigned consumed = srcSize;
+	unsigned resultSize = dstCapacity;
+
+	// Whole buffer in one go: always the 'last' piece.
+	int rv = qzCompress(&qzsession_, src, &consumed, dst, &resultSize, 1);
+	if (consumed != srcSize || rv != QZ_OK) {
+		return 0;
+	}
+	return resultSize;
+}
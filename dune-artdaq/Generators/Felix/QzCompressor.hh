@@ -41,6 +41,8 @@ public:
   int shutdown();
 
   uint_fast32_t do_compress(artdaq::Fragment* fragPtr, uint_fast32_t fragSize);
+  // Compress src into a caller provided buffer. Returns the compressed size, 0 on failure.
+  unsigned compress(const uint8_t* src, unsigned srcSize, uint8_t* dst, unsigned dstCapacity);
 
 private:
   QzSession qzsession_;
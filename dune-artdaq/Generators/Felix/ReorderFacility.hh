@@ -17,13 +17,15 @@
 
 class ReorderFacility {
   public:
-    ReorderFacility(bool force_no_avx=false): m_force_no_avx(force_no_avx) {}
+    // force_no_avx512 keeps the AVX2 kernel on hosts where AVX512 would lower the clock of the other cores.
+    ReorderFacility(bool force_no_avx=false, bool force_no_avx512=false)
+      : m_force_no_avx(force_no_avx), m_force_no_avx512(force_no_avx512) {}
 
     bool do_reorder(uint8_t *dst, uint8_t *src, const unsigned num_frames) {
         if (m_force_no_avx) {
             return FelixReorder::do_reorder(dst, src, num_frames, &m_num_faulty_frames);
         }
-        if (FelixReorder::avx512_available) {
+        if (FelixReorder::avx512_available && !m_force_no_avx512) {
             return FelixReorder::do_avx512_reorder(dst, src, num_frames, &m_num_faulty_frames);
         }
         if (FelixReorder::avx_available){
@@ -45,7 +47,7 @@ class ReorderFacility {
         if (m_force_no_avx) {
             return FelixReorder::do_reorder_part(dst, src, frames_start, frames_stop, m_num_frames, &m_num_faulty_frames);  
         }
-        if (FelixReorder::avx512_available) {
+        if (FelixReorder::avx512_available && !m_force_no_avx512) {
             return FelixReorder::do_avx512_reorder_part(dst, src, frames_start, frames_stop, m_num_frames, &m_num_faulty_frames);
         }
         if (FelixReorder::avx_available) {
@@ -54,13 +56,24 @@ class ReorderFacility {
         return FelixReorder::do_reorder_part(dst, src, frames_start, frames_stop, m_num_frames, &m_num_faulty_frames);  
     }
 
+    // For messages that the TP finding already expanded (LinkBuffer::expandedAt): no unpacking left to do.
+    bool do_expanded_reorder_part(uint8_t *dst, const uint8_t *src, const uint16_t *expanded, const unsigned frames_start, const unsigned frames_stop) {
+        if (FelixReorder::avx_available && !m_force_no_avx) {
+            return FelixReorder::do_avx_expanded_reorder_part(dst, src, expanded, frames_start, frames_stop, m_num_frames, &m_num_faulty_frames);
+        }
+        return FelixReorder::do_expanded_reorder_part(dst, src, expanded, frames_start, frames_stop, m_num_frames, &m_num_faulty_frames);
+    }
+
     std::string get_info() {
         if (m_force_no_avx) {
             return "Forced by config to not use AVX.";
         }
-        if (FelixReorder::avx512_available) {
+        if (FelixReorder::avx512_available && !m_force_no_avx512) {
             return "Going to use AVX512.";
         }
+        if (FelixReorder::avx512_available && FelixReorder::avx_available) {
+            return "Forced by config to not use AVX512, going to use AVX2.";
+        }
         if (FelixReorder::avx_available) {
             return "Going to use AVX2.";
         }
@@ -71,6 +84,7 @@ class ReorderFacility {
     unsigned m_num_frames;
   private:
     bool m_force_no_avx; 
+    bool m_force_no_avx512;
 };
 
 #endif /* REORDER_FACILITY_HH_ */
@@ -1,10 +1,12 @@
 #ifndef REUSABLE_THREAD_HH_
 #define REUSABLE_THREAD_HH_
 
+#include "Utilities.hh"
+#include "CompletionLatch.hh"
+
 #include <thread>
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
+#include <functional>
 
 
 /********************************
@@ -14,20 +16,25 @@
  *   // https://codereview.stackexchange.com/questions/134214/reuseable-c11-thread
  * Description: Pausable thread
  * Date: November 2017
+ *
+ * Comments: the worker parks on a futex word instead of a mutex and
+ *   condition variable, so a dispatch is one atomic store and one wake.
+ *   A latch given with the work is counted down only once the thread is
+ *   ready again, so whoever waits on it can hand out the next work at once.
  *********************************/
 
 class ReusableThread
 {
 public:
   ReusableThread(unsigned int threadID)
-    : m_thread_id(threadID), m_thread_pause(true), m_thread_quit(false),
-      m_thread(&ReusableThread::thread_worker, this)
+    : m_thread_id(threadID), m_thread_pause(true), m_state(s_idle),
+      m_done(nullptr), m_thread(&ReusableThread::thread_worker, this)
   { }
 
   ~ReusableThread()
   {
-    m_thread_quit = true;
-    m_cv.notify_all();
+    m_state.store(s_quit, std::memory_order_release);
+    futex_wake(&m_state);
     m_thread.join();
   }
 
@@ -37,38 +44,51 @@ public:
 
   bool get_readiness() const { return m_thread_pause; }
 
-  bool set_work(const std::function<void()>& work_func)
+  bool set_work(const std::function<void()>& work_func, CompletionLatch* done = nullptr)
   {
-    if (!m_function_ready && m_thread_pause.exchange(false)) {
+    if (m_thread_pause.exchange(false)) {
       m_work_func = work_func;
-      m_function_ready = true;
-      m_cv.notify_all();
+      m_done = done;
+      m_state.store(s_work, std::memory_order_release);
+      futex_wake(&m_state, 1);
       return true;
     }
     return false;
   }
 
 private:
+  static constexpr uint32_t s_idle = 0;
+  static constexpr uint32_t s_work = 1;
+  static constexpr uint32_t s_quit = 2;
+  static constexpr unsigned s_spins = 1000;
+
   unsigned int m_thread_id;
   std::atomic<bool> m_thread_pause;
-  std::atomic<bool> m_thread_quit;
-  std::atomic<bool> m_function_ready;
+  std::atomic<uint32_t> m_state;
+  CompletionLatch* m_done;
   std::thread m_thread;
   std::function<void()> m_work_func;
 
-  std::mutex m_mtx;
-  std::condition_variable m_cv;
-
   void thread_worker()
   {
-    std::unique_lock<std::mutex> lock(m_mtx); // <- lock the mutex
-    while (!m_thread_quit){
-      if (!m_thread_pause && m_function_ready){
+    while (true) {
+      uint32_t state = m_state.load(std::memory_order_acquire);
+      for (unsigned i=0; state==s_idle && i<s_spins; ++i) {
+        cpu_relax();
+        state = m_state.load(std::memory_order_acquire);
+      }
+      if (state == s_quit) break;
+      if (state == s_work) {
         m_work_func();
+        // A quit issued while working must not be lost.
+        uint32_t expected = s_work;
+        m_state.compare_exchange_strong(expected, s_idle, std::memory_order_acq_rel);
+        // The next set_work() may replace m_done as soon as we are ready.
+        CompletionLatch* done = m_done;
         m_thread_pause = true;
-        m_function_ready = false;
+        if (done) done->count_down();
       } else {
-        m_cv.wait(lock);
+        futex_wait(&m_state, s_idle);
       }
     }
   }
@@ -76,4 +96,3 @@ private:
 };
 
 #endif
-
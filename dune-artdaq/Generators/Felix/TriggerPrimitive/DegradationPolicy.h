@@ -0,0 +1,98 @@
+#ifndef DEGRADATIONPOLICY_H
+#define DEGRADATIONPOLICY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+ * DegradationPolicy
+ * Description: Decides how much of the hit finding a TriggerPrimitiveFinder
+ *   worker does, from the number of messages waiting for it in the link
+ *   buffer. If the writer laps the worker, whole messages are lost and the
+ *   hits have holes in them, so the worker gives up some sensitivity first:
+ *     level 1: the pedestals are held where they are,
+ *     level 2: as 1, and the hit threshold is raised,
+ *     level 3: as 2, and only some of the worker's registers are processed.
+ *   A level is entered as soon as the backlog reaches its threshold, which
+ *   can skip levels on the way up. On the way down, the level drops by one
+ *   once the backlog is below a fraction of the threshold of the current
+ *   level, and the level has been held for a minimum number of messages,
+ *   so that it doesn't flap.
+ * Date: November 2019
+*/
+class DegradationPolicy
+{
+public:
+    // The bits of the flags of each message, from flags(). What the
+    // worker did differently from full processing
+    enum Flags : uint8_t
+    {
+        FrozenPedestals=1<<0,
+        RaisedThreshold=1<<1,
+        RegisterSubset =1<<2
+    };
+
+    static constexpr unsigned MAX_LEVEL=3;
+
+    // enterBacklog[i] is the backlog, in messages, at which level i+1 is
+    // entered. With fewer than MAX_LEVEL entries the higher levels are
+    // never used, and with none the worker never degrades
+    DegradationPolicy(std::vector<uint64_t> enterBacklog, double leaveFraction, uint64_t minMessages)
+        : m_enterBacklog(enterBacklog),
+          m_leaveFraction(leaveFraction),
+          m_minMessages(minMessages),
+          m_level(0),
+          m_messagesAtLevel(0)
+    {
+        if(m_enterBacklog.size()>MAX_LEVEL) m_enterBacklog.resize(MAX_LEVEL);
+        // Each level needs at least the backlog of the one below
+        for(size_t i=1; i<m_enterBacklog.size(); ++i) m_enterBacklog[i]=std::max(m_enterBacklog[i], m_enterBacklog[i-1]);
+    }
+
+    // Call before processing nmessages messages, with the number of
+    // messages waiting in the link buffer, those included. True if the level changed
+    bool update(uint64_t backlog, uint64_t nmessages)
+    {
+        unsigned level=m_level;
+        while(level<m_enterBacklog.size() && backlog>=m_enterBacklog[level]) ++level;
+        if(level==m_level && m_level>0 && m_messagesAtLevel>=m_minMessages &&
+           backlog<m_leaveFraction*m_enterBacklog[m_level-1]){
+            level=m_level-1;
+        }
+        const bool changed=(level!=m_level);
+        if(changed){
+            m_level=level;
+            m_messagesAtLevel=0;
+        }
+        m_messagesAtLevel+=nmessages;
+        return changed;
+    }
+
+    unsigned level() const { return m_level; }
+
+    uint8_t flags() const { return flagsForLevel(m_level); }
+
+    static uint8_t flagsForLevel(unsigned level)
+    {
+        uint8_t ret=0;
+        if(level>=1) ret|=FrozenPedestals;
+        if(level>=2) ret|=RaisedThreshold;
+        if(level>=3) ret|=RegisterSubset;
+        return ret;
+    }
+
+private:
+    std::vector<uint64_t> m_enterBacklog;
+    const double m_leaveFraction;
+    const uint64_t m_minMessages;
+    unsigned m_level;
+    uint64_t m_messagesAtLevel;
+};
+
+#endif // include guard
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
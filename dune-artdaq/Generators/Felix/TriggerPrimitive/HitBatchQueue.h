@@ -0,0 +1,77 @@
+#ifndef HITBATCHQUEUE_H
+#define HITBATCHQUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/*
+ * HitBatchQueue
+ * Description: Single producer, single consumer queue of the hits that one
+ *   TriggerPrimitiveFinder worker found in each netio message, on their way
+ *   to the merging thread. The slots have room for the worst case output of
+ *   process_window_avx2 for one message, so the worker writes its hits
+ *   straight into the slot it claimed and nothing is allocated or copied.
+ * Date: October 2019
+*/
+class HitBatchQueue
+{
+public:
+    struct Batch
+    {
+        uint64_t seq;       // Sequence number of the message in the LinkBuffer
+        uint64_t timestamp; // Timestamp of the first frame of the message
+        uint16_t* hits;     // As written by process_window_avx2, ending with MAGIC
+        uint8_t flags;      // How the worker processed the message, as for PrimitiveStore::publish()
+    };
+
+    HitBatchQueue(size_t capacity, size_t hitsSize)
+        : m_capacity(capacity),
+          m_batches(new Batch[capacity]),
+          m_hits(new uint16_t[capacity*hitsSize]),
+          m_readIndex(0),
+          m_writeIndex(0)
+    {
+        for(size_t i=0; i<m_capacity; ++i) m_batches[i].hits=&m_hits[i*hitsSize];
+    }
+
+    HitBatchQueue(HitBatchQueue const&) = delete;
+    HitBatchQueue& operator=(HitBatchQueue const&) = delete;
+
+    // Writer side: fill the claimed batches, then publish() them.
+    // claim(i) is the batch i after the next one, nullptr if the queue is too full for it
+    Batch* claim(size_t i=0)
+    {
+        const uint64_t w=m_writeIndex.load(std::memory_order_relaxed)+i;
+        if(w-m_readIndex.load(std::memory_order_acquire)>=m_capacity) return nullptr;
+        return &m_batches[w%m_capacity];
+    }
+
+    void publish(size_t n=1) { m_writeIndex.store(m_writeIndex.load(std::memory_order_relaxed)+n, std::memory_order_release); }
+
+    // Reader side: the oldest batch, nullptr if the queue is empty
+    const Batch* front() const
+    {
+        const uint64_t r=m_readIndex.load(std::memory_order_relaxed);
+        if(r==m_writeIndex.load(std::memory_order_acquire)) return nullptr;
+        return &m_batches[r%m_capacity];
+    }
+
+    void pop() { m_readIndex.store(m_readIndex.load(std::memory_order_relaxed)+1, std::memory_order_release); }
+
+private:
+    const size_t m_capacity;
+    std::unique_ptr<Batch[]> m_batches;
+    std::unique_ptr<uint16_t[]> m_hits;
+
+    // Cache line separation between the writer's and the reader's counters.
+    alignas(64) std::atomic<uint64_t> m_readIndex;
+    alignas(64) std::atomic<uint64_t> m_writeIndex;
+};
+
+#endif // include guard
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
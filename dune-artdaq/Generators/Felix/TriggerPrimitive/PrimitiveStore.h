@@ -0,0 +1,314 @@
+#ifndef PRIMITIVESTORE_H
+#define PRIMITIVESTORE_H
+
+#include "dune-raw-data/Overlays/FelixHitFormat.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+/*
+ * PrimitiveStore
+ * Description: Time ordered store of the trigger primitives found on one link.
+ *   A single writer appends the primitives of each netio message to a ring
+ *   and closes the message with its timestamp, which adds a bucket to an
+ *   index ring. Readers find a window with a binary search over the bucket
+ *   timestamps and copy the primitives out without a lock (at most two
+ *   copies, at the wrap point), then validate that the writer did not
+ *   recycle what they read, as for LinkBuffer. Each message can carry a
+ *   few flags, such as how it was processed.
+ *   Retention is set in time: the primitive ring grows when a burst of hits
+ *   would overwrite primitives from messages younger than the retention,
+ *   up to maxBytes. Past that the oldest primitives are overwritten anyway,
+ *   and counted in droppedPrimitives(). The ring a grow() replaced is freed
+ *   once no reader is copying out of it.
+ * Date: October 2019
+*/
+class PrimitiveStore
+{
+public:
+    static_assert(std::is_trivially_copyable<dune::TriggerPrimitive>::value, "primitives are copied with memcpy");
+
+    enum class Status { Ok, Empty, TooOld, Overwritten };
+
+    // The primitives of the buckets [firstBucket, endBucket), which are
+    // [firstPrim, endPrim) in the primitive ring
+    struct Window
+    {
+        uint64_t firstBucket, endBucket;
+        uint64_t firstPrim, endPrim;
+        size_t size() const { return endPrim-firstPrim; }
+    };
+
+    // The initial size of the primitive ring is for hitsPerMessage hits in
+    // every message of the retention time. It never grows past maxBytes
+    PrimitiveStore(uint64_t retentionTicks, uint64_t ticksPerMessage, size_t hitsPerMessage=1,
+                   size_t maxBytes=std::numeric_limits<size_t>::max())
+        : m_retentionTicks(retentionTicks),
+          m_maxPrimitives(std::max<size_t>(1, maxBytes/sizeof(dune::TriggerPrimitive))),
+          m_bucketCapacity(retentionTicks/ticksPerMessage+2),
+          m_bucketTimestamps(new std::atomic<uint64_t>[m_bucketCapacity]),
+          m_bucketEnds(new std::atomic<uint64_t>[m_bucketCapacity]),
+          m_bucketFlags(new std::atomic<uint8_t>[m_bucketCapacity]),
+          m_nextPrim(0),
+          m_expiredBuckets(0),
+          m_retainedPrim(0),
+          m_bucketsClaimed(0),
+          m_bucketsWritten(0),
+          m_primOldest(0),
+          m_droppedPrim(0),
+          m_copying(0),
+          m_waiters(0)
+    {
+        for(size_t i=0; i<m_bucketCapacity; ++i){
+            m_bucketTimestamps[i].store(0, std::memory_order_relaxed);
+            m_bucketEnds[i].store(0, std::memory_order_relaxed);
+            m_bucketFlags[i].store(0, std::memory_order_relaxed);
+        }
+        m_rings.emplace_back(new Ring(std::min(m_maxPrimitives, std::max<size_t>(1024, m_bucketCapacity*hitsPerMessage))));
+        m_current.store(m_rings.back().get(), std::memory_order_release);
+        m_capacity.store(m_rings.back()->capacity, std::memory_order_relaxed);
+    }
+
+    PrimitiveStore(PrimitiveStore const&) = delete;
+    PrimitiveStore& operator=(PrimitiveStore const&) = delete;
+
+    // Writer side (single producer only).
+    // Add the primitives of a message with emplace(), then close the message with publish().
+    // `flags` are kept with the message, for readers to get back with flags()
+    template<class... Args>
+    void emplace(Args&&... args)
+    {
+        Ring* ring=m_current.load(std::memory_order_relaxed);
+        if(m_nextPrim>=m_retainedPrim+ring->capacity){
+            if(2*ring->capacity<=m_maxPrimitives){
+                ring=grow();
+            }
+            else{
+                // At the size cap: the oldest primitive of the retention makes room
+                ++m_retainedPrim;
+                m_droppedPrim.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        if(m_nextPrim>=ring->capacity){
+            // The slot we're about to write holds m_nextPrim-capacity.
+            // Never lower m_primOldest: after a grow(), readers may still copy from the old ring
+            const uint64_t oldest=m_nextPrim+1-ring->capacity;
+            if(oldest>m_primOldest.load(std::memory_order_relaxed)){
+                m_primOldest.store(oldest, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+            }
+        }
+        ring->data[m_nextPrim%ring->capacity]=dune::TriggerPrimitive(std::forward<Args>(args)...);
+        ++m_nextPrim;
+    }
+
+    void publish(uint64_t messageTimestamp, uint8_t flags=0)
+    {
+        const uint64_t bucket=m_bucketsWritten.load(std::memory_order_relaxed);
+        // The message in the slot we're about to reuse expires, whatever its age
+        if(bucket>=m_bucketCapacity && m_expiredBuckets<=bucket-m_bucketCapacity) expire(bucket-m_bucketCapacity);
+        m_bucketsClaimed.store(bucket+1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        const size_t slot=bucket%m_bucketCapacity;
+        m_bucketTimestamps[slot].store(messageTimestamp, std::memory_order_relaxed);
+        m_bucketEnds[slot].store(m_nextPrim, std::memory_order_relaxed);
+        m_bucketFlags[slot].store(flags, std::memory_order_relaxed);
+        m_bucketsWritten.store(bucket+1, std::memory_order_seq_cst);
+
+        // Readers were still copying out of the old ring when it was replaced
+        if(m_rings.size()>1) releaseOldRings();
+
+        // Messages older than the retention no longer hold back the primitive ring
+        while(m_expiredBuckets<bucket &&
+              bucketTimestamp(m_expiredBuckets)+m_retentionTicks<messageTimestamp){
+            expire(m_expiredBuckets);
+        }
+
+        if(m_waiters.load(std::memory_order_seq_cst)){
+            std::lock_guard<std::mutex> guard(m_waitMutex);
+            m_newMessage.notify_all();
+        }
+    }
+
+    // Reader side.
+    // Timestamp of the newest message that was published, 0 if none
+    uint64_t latestTimestamp() const
+    {
+        const uint64_t w=m_bucketsWritten.load();
+        return (w==0) ? 0 : bucketTimestamp(w-1);
+    }
+
+    // Wait for a message with timestamp >= ts to be published. False on timeout
+    bool waitFor(uint64_t ts, std::chrono::milliseconds timeout) const
+    {
+        if(latestTimestamp()>=ts) return true;
+        std::unique_lock<std::mutex> lock(m_waitMutex);
+        m_waiters.fetch_add(1, std::memory_order_seq_cst);
+        const bool ok=m_newMessage.wait_for(lock, timeout, [&]{ return latestTimestamp()>=ts; });
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return ok;
+    }
+
+    // Find the primitives of the messages with timestamps in [startTs, endTs).
+    // TooOld means the start of the window is no longer kept: w holds what is left
+    Status locate(uint64_t startTs, uint64_t endTs, Window& w) const
+    {
+        const uint64_t written=m_bucketsWritten.load(std::memory_order_acquire);
+        const uint64_t oldest=oldestBucket();
+        if(written<=oldest) return Status::Empty;
+        w.firstBucket=lowerBound(oldest, written, startTs);
+        w.endBucket=std::max(w.firstBucket, lowerBound(w.firstBucket, written, endTs));
+        w.firstPrim=bucketBegin(w.firstBucket, written);
+        w.endPrim=bucketBegin(w.endBucket, written);
+        if(!valid(w)) return Status::Overwritten;
+        if(oldest>0 && w.firstBucket==oldest && bucketTimestamp(oldest)>startTs) return Status::TooOld;
+        return Status::Ok;
+    }
+
+    // Copy the primitives of w to dst. Validate with valid(w) afterwards
+    void copy(const Window& w, dune::TriggerPrimitive* dst) const
+    {
+        const size_t n=w.size();
+        if(n==0) return;
+        // Announce the copy before picking the ring, so that the writer keeps it
+        m_copying.fetch_add(1, std::memory_order_seq_cst);
+        const Ring* ring=m_current.load(std::memory_order_seq_cst);
+        const size_t first=w.firstPrim%ring->capacity;
+        const size_t head=std::min(n, ring->capacity-first);
+        memcpy(dst, &ring->data[first], head*sizeof(dune::TriggerPrimitive));
+        memcpy(dst+head, &ring->data[0], (n-head)*sizeof(dune::TriggerPrimitive));
+        m_copying.fetch_sub(1, std::memory_order_release);
+    }
+
+    // The flags of all the messages in w, or'ed together. Validate with valid(w) afterwards
+    uint8_t flags(const Window& w) const
+    {
+        uint8_t ret=0;
+        for(uint64_t b=w.firstBucket; b<w.endBucket; ++b) ret|=m_bucketFlags[b%m_bucketCapacity].load(std::memory_order_relaxed);
+        return ret;
+    }
+
+    // True while the writer did not (and is not about to) overwrite anything in w
+    bool valid(const Window& w) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return w.firstBucket>=oldestBucket() && w.firstPrim>=m_primOldest.load(std::memory_order_relaxed);
+    }
+
+    size_t primitiveCapacity() const { return m_capacity.load(std::memory_order_relaxed); }
+
+    // Primitives overwritten inside the retention because the ring was at maxBytes
+    uint64_t droppedPrimitives() const { return m_droppedPrim.load(std::memory_order_relaxed); }
+
+private:
+    struct Ring
+    {
+        explicit Ring(size_t cap) : capacity(cap), data(new dune::TriggerPrimitive[cap]) {}
+        const size_t capacity;
+        std::unique_ptr<dune::TriggerPrimitive[]> data;
+    };
+
+    uint64_t bucketTimestamp(uint64_t bucket) const { return m_bucketTimestamps[bucket%m_bucketCapacity].load(std::memory_order_relaxed); }
+
+    // Index of the first primitive of bucket, given that `written` buckets are published
+    uint64_t bucketBegin(uint64_t bucket, uint64_t written) const
+    {
+        if(bucket==written) return m_bucketEnds[(written-1)%m_bucketCapacity].load(std::memory_order_relaxed);
+        if(bucket==0) return 0;
+        return m_bucketEnds[(bucket-1)%m_bucketCapacity].load(std::memory_order_relaxed);
+    }
+
+    // First bucket in [lo, hi) with timestamp >= ts, hi if none
+    uint64_t lowerBound(uint64_t lo, uint64_t hi, uint64_t ts) const
+    {
+        while(lo<hi){
+            const uint64_t mid=lo+(hi-lo)/2;
+            if(bucketTimestamp(mid)<ts) lo=mid+1;
+            else                        hi=mid;
+        }
+        return lo;
+    }
+
+    // The oldest readable bucket. The slot before it has to stay intact
+    // too, as it holds where the primitives of the bucket begin
+    uint64_t oldestBucket() const
+    {
+        const uint64_t claimed=m_bucketsClaimed.load(std::memory_order_acquire);
+        return (claimed+1>m_bucketCapacity) ? claimed+1-m_bucketCapacity : 0;
+    }
+
+    // Writer only: let the primitive ring overwrite the primitives of bucket.
+    // Past the size cap, the ring may have dropped some of the next buckets already
+    void expire(uint64_t bucket)
+    {
+        m_retainedPrim=std::max(m_retainedPrim, m_bucketEnds[bucket%m_bucketCapacity].load(std::memory_order_relaxed));
+        m_expiredBuckets=bucket+1;
+    }
+
+    // Writer only: double the primitive ring, keeping everything in it.
+    // Readers may still be copying from the old ring, which the writer no
+    // longer touches, so it is only freed by releaseOldRings()
+    Ring* grow()
+    {
+        const Ring* old=m_current.load(std::memory_order_relaxed);
+        Ring* ring=new Ring(2*old->capacity);
+        const uint64_t first=(m_nextPrim>old->capacity) ? m_nextPrim-old->capacity : 0;
+        for(uint64_t i=first; i<m_nextPrim; ++i) ring->data[i%ring->capacity]=old->data[i%old->capacity];
+        m_rings.emplace_back(ring);
+        m_current.store(ring, std::memory_order_seq_cst);
+        m_capacity.store(ring->capacity, std::memory_order_relaxed);
+        releaseOldRings();
+        return ring;
+    }
+
+    // Writer only: free the rings before the current one if no reader is
+    // copying. A reader that starts after this saw m_copying at zero
+    // already picks the current ring, as both sides are seq_cst
+    void releaseOldRings()
+    {
+        if(m_copying.load(std::memory_order_seq_cst)!=0) return;
+        m_rings.erase(m_rings.begin(), m_rings.end()-1);
+    }
+
+    const uint64_t m_retentionTicks;
+    const size_t m_maxPrimitives; // The ring does not grow past this
+    const size_t m_bucketCapacity;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_bucketTimestamps; // Timestamp of the message of each bucket
+    std::unique_ptr<std::atomic<uint64_t>[]> m_bucketEnds;       // One past the last primitive of each bucket
+    std::unique_ptr<std::atomic<uint8_t>[]> m_bucketFlags;       // The flags the message of each bucket was published with
+    std::vector<std::unique_ptr<Ring>> m_rings; // The current ring is the last one
+    std::atomic<Ring*> m_current;
+    std::atomic<size_t> m_capacity; // Of the current ring
+
+    // Writer only
+    uint64_t m_nextPrim;
+    uint64_t m_expiredBuckets; // Buckets before this are older than the retention
+    uint64_t m_retainedPrim;   // The first primitive that may not be overwritten yet
+
+    // Cache line separation between the writer's and the readers' hot counters.
+    alignas(64) std::atomic<uint64_t> m_bucketsClaimed;
+    alignas(64) std::atomic<uint64_t> m_bucketsWritten;
+    alignas(64) std::atomic<uint64_t> m_primOldest; // Primitives before this may be overwritten
+    std::atomic<uint64_t> m_droppedPrim;
+    mutable std::atomic<unsigned> m_copying; // Readers inside copy()
+
+    mutable std::mutex m_waitMutex;
+    mutable std::condition_variable m_newMessage;
+    mutable std::atomic<size_t> m_waiters;
+};
+
+#endif // include guard
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -5,13 +5,18 @@
 #include <boost/thread/future.hpp>
 
 #include "frame_expand.h"
+#include "constants.h"
 
-// The state variables for each channel in the link, saved from the last time
+#include <algorithm>
+
+// The state variables for each channel in the link, saved from the
+// last time. Sized for all the channels, so that it works for
+// process_window_all_avx2() too
 struct ChanState
 {
     ChanState()
     {
-        for(size_t i=0; i<REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER; ++i){
+        for(size_t i=0; i<NCHANS; ++i){
             pedestals[i]=0;
             accum[i]=0;
             accum25[i]=0;
@@ -19,28 +24,43 @@ struct ChanState
             prev_was_over[i]=0;
             hit_charge[i]=0;
             hit_tover[i]=0;
-            for(size_t j=0; j<NTAPS; ++j) prev_samp[i*NTAPS+j]=0;
+            for(size_t j=0; j<MAX_NTAPS; ++j) prev_samp[i*MAX_NTAPS+j]=0;
+        }
+    }
+
+    // Forget the filter history and any hit in progress on channels
+    // [first, last), whose samples were skipped for a while. The
+    // pedestals are kept, as they change slowly. prev_samp is laid out
+    // by register, so first and last have to be on register boundaries
+    void resetFilter(size_t first, size_t last)
+    {
+        for(size_t i=first; i<last; ++i){
+            prev_was_over[i]=0;
+            hit_charge[i]=0;
+            hit_tover[i]=0;
         }
+        std::fill(prev_samp+first*MAX_NTAPS, prev_samp+last*MAX_NTAPS, 0);
     }
 
-    // TODO: DRY
-    static const int NTAPS=8;
+    // The longest filter the hit finding can run, as a power of two
+    static const int MAX_NTAPS=64;
+    static const size_t NCHANS=ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER;
 
-    alignas(32) int16_t __restrict__ pedestals[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
-    alignas(32) int16_t __restrict__ quantile25[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
-    alignas(32) int16_t __restrict__ quantile75[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
+    alignas(32) int16_t __restrict__ pedestals[NCHANS];
+    alignas(32) int16_t __restrict__ quantile25[NCHANS];
+    alignas(32) int16_t __restrict__ quantile75[NCHANS];
 
-    alignas(32) int16_t __restrict__ accum[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
-    alignas(32) int16_t __restrict__ accum25[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
-    alignas(32) int16_t __restrict__ accum75[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
+    alignas(32) int16_t __restrict__ accum[NCHANS];
+    alignas(32) int16_t __restrict__ accum25[NCHANS];
+    alignas(32) int16_t __restrict__ accum75[NCHANS];
 
-    // Variables for filtering
-    alignas(32) int16_t __restrict__ prev_samp[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER*NTAPS];
+    // Variables for filtering. The first ProcessingInfo::ntaps of each channel's MAX_NTAPS are used
+    alignas(32) int16_t __restrict__ prev_samp[NCHANS*MAX_NTAPS];
 
     // Variables for hit finding
-    alignas(32) int16_t __restrict__ prev_was_over[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER]; // was the previous sample over threshold?
-    alignas(32) int16_t __restrict__ hit_charge[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
-    alignas(32) int16_t __restrict__ hit_tover[REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER]; // time over threshold
+    alignas(32) int16_t __restrict__ prev_was_over[NCHANS]; // was the previous sample over threshold?
+    alignas(32) int16_t __restrict__ hit_charge[NCHANS];
+    alignas(32) int16_t __restrict__ hit_tover[NCHANS]; // time over threshold
 };
 
 struct ProcessingInfo
@@ -54,8 +74,10 @@ struct ProcessingInfo
                    int16_t ntaps_,
                    const uint8_t tap_exponent_,
                    size_t nhits_,
-                   uint16_t absTimeModNTAPS_)
+                   uint16_t absTimeModNTAPS_,
+                   int16_t threshold_=default_threshold)
         : input(input_),
+          all_input(nullptr),
           timeWindowNumFrames(timeWindowNumFrames_),
           first_register(first_register_),
           last_register(last_register_),
@@ -66,7 +88,9 @@ struct ProcessingInfo
           multiplier(1 << tap_exponent),
           adcMax(INT16_MAX/multiplier),
           nhits(nhits_),
-          absTimeModNTAPS(absTimeModNTAPS_)
+          absTimeModNTAPS(absTimeModNTAPS_),
+          threshold(threshold_),
+          update_pedestals(true)
     {
     }
 
@@ -83,18 +107,40 @@ struct ProcessingInfo
         }
     }
 
+    // As above, for process_window_all_avx2(), from all the channels
+    // of the first message
+    void setState(const MessageAllADCs* first_msg_p)
+    {
+        const uint16_t* adcs=reinterpret_cast<const uint16_t*>(first_msg_p->fragments);
+        for(size_t j=0; j<ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER; ++j){
+            // Time 0 of channel j: the times of each register are adjacent
+            const int16_t ped=adcs[(j/SAMPLES_PER_REGISTER)*SAMPLES_PER_REGISTER*FRAMES_PER_MSG+j%SAMPLES_PER_REGISTER];
+            chanState.pedestals[j]=ped;
+            chanState.quantile25[j]=ped-3;
+            chanState.quantile75[j]=ped+3;
+        }
+    }
+
     const MessageCollectionADCs* __restrict__ input;
+    // The input of process_window_all_avx2()
+    const MessageAllADCs* __restrict__ all_input;
     size_t timeWindowNumFrames;
     uint8_t first_register;
     uint8_t last_register;
     uint16_t* __restrict__ output;
     const int16_t* __restrict__ taps;
-    int16_t ntaps;
+    int16_t ntaps; // A power of two, up to ChanState::MAX_NTAPS. Pad the taps with zeros to get there
     uint8_t tap_exponent;
     int16_t multiplier;
     int16_t adcMax;
     size_t nhits;
     uint16_t absTimeModNTAPS;
+    // Hits are where the filtered signal goes over threshold times the
+    // interquartile range of the pedestal. threshold*multiplier has to fit in 16 bits
+    int16_t threshold;
+    // False to hold the pedestals and quantiles where they are, to save
+    // time when the finder is behind
+    bool update_pedestals;
     ChanState chanState;
 };
 
@@ -0,0 +1,122 @@
+#include "TPSetBuilder.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <pthread.h>
+
+//======================================================================
+TPSetBuilder::TPSetBuilder(SendFunction send, uint64_t spanTicks, size_t maxHits, size_t poolSize)
+    : m_send(send),
+      m_spanTicks(std::max<uint64_t>(1, spanTicks)),
+      m_maxHits(maxHits),
+      // One set is always being filled, and a ProducerConsumerQueue
+      // holds one less than its size, so there's always room for the rest
+      m_freeSets(std::max<size_t>(2, poolSize)+1),
+      m_fullSets(std::max<size_t>(2, poolSize)+1),
+      m_current(nullptr),
+      m_isOpen(false),
+      m_currentEnd(0),
+      m_nClosed(0),
+      m_shouldStop(false),
+      m_nSent(0),
+      m_nDropped(0)
+{
+    for(size_t i=0; i<std::max<size_t>(2, poolSize); ++i){
+        m_pool.emplace_back(new ptmp::data::TPSet);
+        if(i==0) m_current=m_pool.back().get();
+        else     m_freeSets.write(m_pool.back().get());
+    }
+    m_sendingThread=std::thread(&TPSetBuilder::sending_thread, this);
+}
+
+//======================================================================
+TPSetBuilder::~TPSetBuilder()
+{
+    stop();
+}
+
+//======================================================================
+void TPSetBuilder::stop()
+{
+    m_shouldStop.store(true);
+    if(m_sendingThread.joinable()) m_sendingThread.join();
+}
+
+//======================================================================
+void TPSetBuilder::startMessage(uint64_t timestamp, uint32_t detid)
+{
+    if(m_isOpen && timestamp>=m_current->tstart() && timestamp<m_currentEnd){
+        if(m_maxHits==0 || size_t(m_current->tps_size())<m_maxHits) return;
+        // Full: the rest of the span goes in the next set
+        const uint64_t end=m_currentEnd;
+        close(timestamp-m_current->tstart());
+        open(timestamp, end, detid);
+        return;
+    }
+    if(m_isOpen) close(m_currentEnd-m_current->tstart());
+    const uint64_t tstart=timestamp-timestamp%m_spanTicks;
+    open(tstart, tstart+m_spanTicks, detid);
+}
+
+//======================================================================
+void TPSetBuilder::close(uint64_t tspan)
+{
+    m_isOpen=false;
+    if(m_current->tps_size()==0) return;
+
+    const uint32_t count=m_nClosed++;
+    ptmp::data::TPSet* next=nullptr;
+    if(!m_freeSets.read(next)){
+        // The sending thread can't keep up: drop this set and reuse it
+        m_current->Clear();
+        m_nDropped.fetch_add(1);
+        return;
+    }
+    m_current->set_tspan(tspan);
+    m_current->set_count(count);
+    m_fullSets.write(m_current);
+    m_current=next;
+}
+
+//======================================================================
+void TPSetBuilder::open(uint64_t tstart, uint64_t end, uint32_t detid)
+{
+    m_current->set_detid(detid);
+    m_current->set_tstart(tstart);
+    std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+    // Brett asked for TPSet creation time in microseconds, not timing system ticks
+    auto ticks = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch());
+    m_current->set_created(ticks.count());
+    m_currentEnd=end;
+    m_isOpen=true;
+}
+
+//======================================================================
+void TPSetBuilder::sending_thread()
+{
+    pthread_setname_np(pthread_self(), "tpset-sender");
+
+    while(true){
+        ptmp::data::TPSet* tpset=nullptr;
+        if(m_fullSets.read(tpset)){
+            m_send(*tpset);
+            m_nSent.fetch_add(1);
+            // Clear() keeps the memory of the hits for the next time round
+            tpset->Clear();
+            m_freeSets.write(tpset);
+        }
+        else if(m_shouldStop.load()){
+            // Everything closed before stop() was called has been sent
+            if(m_fullSets.isEmpty()) break;
+        }
+        else{
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
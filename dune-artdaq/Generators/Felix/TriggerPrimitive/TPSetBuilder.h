@@ -0,0 +1,93 @@
+#ifndef TPSETBUILDER_H
+#define TPSETBUILDER_H
+
+#include "ptmp/api.h"
+
+#include "ProducerConsumerQueue.hh"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+/*
+ * TPSetBuilder
+ * Description: Groups the hits of one link into ptmp TPSets, and sends
+ *   them out from a thread of its own, so that the protobuf encoding and
+ *   the zmq send don't hold up the hit finding. Each TPSet covers the
+ *   messages whose timestamps are in one span of `spanTicks`, with the
+ *   spans lined up on multiples of `spanTicks`, so the sets from all the
+ *   links start at the same times. A set is closed early if it has
+ *   `maxHits` hits (0 for no limit) at the start of a message, and the
+ *   rest of the span goes in a new set. The sets come from a pool of
+ *   `poolSize` and are cleared and reused once they're sent, so the
+ *   memory for their hits is only allocated once. If the sending thread
+ *   falls so far behind that the pool is empty, the set being closed is
+ *   dropped. Dropped sets still use up their count, so a receiver sees
+ *   the gap. Empty sets are not sent.
+ *
+ *   startMessage() and addHit() must only be called from one thread.
+ * Date: November 2019
+*/
+class TPSetBuilder
+{
+public:
+    typedef std::function<void(ptmp::data::TPSet&)> SendFunction;
+
+    TPSetBuilder(SendFunction send, uint64_t spanTicks, size_t maxHits, size_t poolSize=64);
+
+    ~TPSetBuilder();
+
+    TPSetBuilder(TPSetBuilder const&) = delete;
+    TPSetBuilder& operator=(TPSetBuilder const&) = delete;
+
+    // The next hits are from the message starting at `timestamp`, from
+    // the link with ptmp id `detid`. Closes the current set if the
+    // message is outside its span, or the set is full
+    void startMessage(uint64_t timestamp, uint32_t detid);
+
+    // Room for a hit in the current set, for the caller to fill in
+    ptmp::data::TrigPrim* addHit() { return m_current->add_tps(); }
+
+    // Send the sets that are already closed, and stop the sending
+    // thread. The set being filled is not sent
+    void stop();
+
+    size_t setsSent() const { return m_nSent.load(); }
+    size_t setsDropped() const { return m_nDropped.load(); }
+
+private:
+    // Hand the current set, covering `tspan` ticks, to the sending
+    // thread (unless it's empty), and take the next one from the pool
+    void close(uint64_t tspan);
+    // Start filling the current set with the span [tstart, end)
+    void open(uint64_t tstart, uint64_t end, uint32_t detid);
+
+    void sending_thread();
+
+    SendFunction m_send;
+    const uint64_t m_spanTicks;
+    const size_t m_maxHits;
+
+    std::vector<std::unique_ptr<ptmp::data::TPSet>> m_pool;
+    folly::ProducerConsumerQueue<ptmp::data::TPSet*> m_freeSets; // Sending thread -> builder
+    folly::ProducerConsumerQueue<ptmp::data::TPSet*> m_fullSets; // Builder -> sending thread
+
+    ptmp::data::TPSet* m_current;
+    bool m_isOpen;
+    uint64_t m_currentEnd; // The end of the span of the current set
+    uint32_t m_nClosed;    // The count of the next set closed, whether it's sent or dropped
+
+    std::atomic<bool> m_shouldStop;
+    std::atomic<size_t> m_nSent;
+    std::atomic<size_t> m_nDropped;
+    std::thread m_sendingThread;
+};
+
+#endif
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
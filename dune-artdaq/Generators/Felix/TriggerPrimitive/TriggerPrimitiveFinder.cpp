@@ -1,50 +1,197 @@
 #include "TriggerPrimitiveFinder.h"
 
 #include "dune-artdaq/DAQLogger/DAQLogger.hh"
+#include "dune-artdaq/Generators/Felix/NumaMemory.hh"
+#include "dune-artdaq/Generators/Felix/CPUPin.hpp"
 #include "dune-artdaq/Generators/swTrigger/ptmp_util.hh"
 #include "artdaq-core/Data/Fragment.hh"
 #include "dune-raw-data/Overlays/CPUHitsFragment.hh"
 #include "artdaq/DAQdata/Globals.hh"
 
+#include <algorithm>
+#include <cmath>
 #include <cstddef> // For offsetof
+#include <fstream>
 #include <sstream>
+#include <stdexcept>
 
 #include <sys/time.h>
+#include <time.h> // for clock_gettime()
 #include <sys/resource.h>
 
-#include "numa.h"
-#include "numaif.h"
-
 #include "sched.h" // for sched_getcpu()
 
 #include "tests/frames2array.h"
 
 const int64_t clocksPerTPCTick=25;
+const uint64_t clocksPerMs=50000;
+
+namespace
+{
+    void pin_to_cpus(const std::vector<int32_t>& cpus_to_pin)
+    {
+        if(cpus_to_pin.empty()) return;
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for(auto const& cpu: cpus_to_pin){
+            CPU_SET(cpu, &cpuset);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    }
+
+    // CPU time used by the calling thread so far
+    uint64_t thread_cpu_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return uint64_t(ts.tv_sec)*1000000000ull+ts.tv_nsec;
+    }
+
+    // How often the threads add their CPU time to the metric
+    constexpr unsigned cpuMetricMessages=1024;
+
+    // The integer lowpass filter taps from the "fir_num_taps" and
+    // "fir_cutoff" parameters, padded with zeros to a power of two, as
+    // the hit finding needs. Common lengths get their own kernel
+    std::vector<int16_t> make_taps(fhicl::ParameterSet const& ps, uint8_t tap_exponent)
+    {
+        const int ntaps=std::min(std::max(1, ps.get<int>("fir_num_taps", 7)), int(ChanState::MAX_NTAPS));
+        std::vector<int16_t> taps=firwin_int(ntaps, ps.get<double>("fir_cutoff", 0.1), 1<<tap_exponent);
+        size_t padded=8;
+        while(padded<taps.size()) padded*=2;
+        taps.resize(padded, 0);
+        return taps;
+    }
+
+    // The backlogs at which the workers degrade, from the fractions of
+    // the link buffer capacity in "degrade_backlog_fractions"
+    std::vector<uint64_t> make_degrade_backlog(fhicl::ParameterSet const& ps, size_t capacity)
+    {
+        std::vector<uint64_t> ret;
+        for(double fraction: ps.get<std::vector<double>>("degrade_backlog_fractions", std::vector<double>{0.1, 0.25, 0.5})){
+            ret.push_back(std::max<uint64_t>(1, fraction*capacity));
+        }
+        return ret;
+    }
+
+    // The channel map file in parameter `key`. There is no default: a
+    // config without it, or naming a file that can't be read, is an error
+    std::string channel_map_file(fhicl::ParameterSet const& ps, std::string const& key)
+    {
+        std::string file;
+        if(!ps.get_if_present<std::string>(key, file)){
+            throw std::runtime_error("TriggerPrimitiveFinder: \""+key+"\" is not set. It must name a channel map file, "
+                                     "eg. TriggerPrimitive/protoDUNETPCChannelMap_"+(key=="channel_map_rce" ? "RCE" : "FELIX")+"_v4.txt");
+        }
+        if(!std::ifstream(file)){
+            throw std::runtime_error("TriggerPrimitiveFinder: can't read the channel map file \""+file+"\" in \""+key+"\"");
+        }
+        return file;
+    }
+}
 
 
 //======================================================================
-TriggerPrimitiveFinder::TriggerPrimitiveFinder(fhicl::ParameterSet const & ps)
+TriggerPrimitiveFinder::TriggerPrimitiveFinder(fhicl::ParameterSet const & ps, LinkBuffer& buffer)
 //std::string zmq_hit_send_connection, uint32_t window_offset, int32_t cpu_offset, int item_queue_size)
-    : m_readyForMessages(false),
+    : m_retentionMs(ps.get<size_t>("tp_retention_ms", 2000)),
+      m_triggerPrimitives(m_retentionMs*clocksPerMs, FRAMES_PER_MSG*clocksPerTPCTick, 1,
+                          ps.get<size_t>("max_primitive_bytes", size_t(256)<<20)),
+      m_readyForMessages(false),
+      m_workersReady(0),
+      m_buffer(buffer),
+      m_firstSeq(buffer.written()),
+      m_nextSeq(m_firstSeq),
+      m_findInductionHits(ps.get<bool>("find_induction_hits", false)),
+      m_registersPerFrame(m_findInductionHits ? ALL_REGISTERS_PER_FRAME : REGISTERS_PER_FRAME),
+      m_numWorkers(std::min<unsigned>(std::max(1u, ps.get<unsigned>("num_workers", 1)), m_registersPerFrame)),
+      m_maxBatchMessages(std::min<unsigned>(std::max(1u, ps.get<unsigned>("max_batch_messages", 16)), MAX_SPLIT_MESSAGES)),
+      m_tapExponent(std::min(ps.get<unsigned>("fir_tap_exponent", 6), 10u)),
+      m_taps(make_taps(ps, m_tapExponent)),
+      m_hitThreshold(std::min(std::max(1, ps.get<int>("hit_threshold", default_threshold)), INT16_MAX/(1<<m_tapExponent))),
+      m_findHits(select_hit_finder(m_findInductionHits, ps.get<bool>("tp_avx512", true), ps.get<bool>("tp_avx2", true))),
+      m_degradeBacklog(make_degrade_backlog(ps, buffer.capacity())),
+      m_degradeLeaveFraction(ps.get<double>("degrade_leave_fraction", 0.5)),
+      m_degradeMinMessages(ps.get<uint64_t>("degrade_min_messages", 5000)),
+      m_degradedThreshold(std::min<double>(m_hitThreshold*std::max(1.0, ps.get<double>("degrade_threshold_factor", 2)), INT16_MAX/(1<<m_tapExponent))),
+      m_degradeRegisterFraction(std::min(std::max(ps.get<double>("degrade_register_fraction", 0.5), 0.0), 1.0)),
+      m_messagesSkipped(0),
+      m_messagesPartial(0),
       m_fiber_no(0xff),
       m_slot_no(0xff),
       m_crate_no(0xff),
       m_TPSender(std::make_unique<ptmp::TPSender>(ptmp_util::make_ptmp_socket_string("PUB", "bind", {ps.get<std::string>("zmq_hit_send_connection")}))),
-      m_current_tpset(new ptmp::data::TPSet),
       m_send_ptmp_msgs(ps.get<bool>("send_ptmp_messages", true)),
       m_msgs_per_tpset(ps.get<unsigned int>("messages_per_tpset", 20)),
+      m_tpsetBuilder(m_send_ptmp_msgs ?
+                     new TPSetBuilder([this](ptmp::data::TPSet& tpset){ (*m_TPSender)(tpset); },
+                                      ps.get<uint64_t>("tpset_span_ticks", m_msgs_per_tpset*FRAMES_PER_MSG*clocksPerTPCTick),
+                                      ps.get<size_t>("tpset_max_hits", 0),
+                                      ps.get<size_t>("tpset_pool_size", 64)) :
+                     nullptr),
       m_should_stop(false),
       m_windowOffset(ps.get<uint32_t>("window_offset")),
       m_channels_to_suppress(ps.get<std::vector<uint32_t>>("channels_to_suppress", std::vector<uint32_t>())),
-      m_offline_channel_base(0),
-      m_n_tpsets_sent(0),
+      m_channelMap(new PdspChannelMapService(channel_map_file(ps, "channel_map_rce"), channel_map_file(ps, "channel_map_felix"))),
+      m_latencyWasBehind(false),
+      m_enteredLateUs(0),
+      m_lastPrintedLatency(0),
+      m_nLatencyPrinted(0),
+      m_nhitsTotal(0),
+      m_cpuNsTotal(0),
+      m_degradationLevels(new std::atomic<unsigned>[m_numWorkers]),
+      m_degradationTransitionsTotal(0),
+      m_degradedMessages(0),
       m_nhits_for_metric(0),
       m_adcsum_for_metric(0),
+      m_cpu_ns_for_metric(0),
+      m_degradation_transitions_for_metric(0),
       m_metric_reporting_interval_seconds(ps.get<size_t>("metric_reporting_interval_seconds", 10))
 {
     std::vector<int32_t> cpus_to_pin=ps.get<std::vector<int32_t>>("cpus_to_pin", std::vector<int32_t>());
-    size_t qsize=ps.get<size_t>("item_queue_size", 100000);
-    m_processingThread=std::thread(&TriggerPrimitiveFinder::processing_thread, this, 0, REGISTERS_PER_FRAME, qsize, cpus_to_pin);
+    // With a CPU listed for each worker, each worker gets its own. Otherwise they share them all
+    const bool cpu_per_worker=m_numWorkers>1 && cpus_to_pin.size()>=m_numWorkers;
+    // Without a list, the TP finder of a link (NetioHandler sets "link_id")
+    // gets a CPU for each thread from CPUPin, next to the link buffer
+    const int link_id=ps.get<int>("link_id", -1);
+    const bool auto_pin=cpus_to_pin.empty() && link_id>=0;
+    const int numa_node=numa_memory::nodeOf(buffer.at(0));
+    auto cpus_for=[link_id, numa_node](const std::string& thread){
+        std::vector<unsigned> cpus=CPUPin::getInstance().cpusFor(CPUPin::Role::TPF, std::to_string(link_id)+"/"+thread, numa_node);
+        return std::vector<int32_t>(cpus.begin(), cpus.end());
+    };
+    if(m_numWorkers>1){
+        // Room for a hit store at every time of every register, plus the MAGIC end marker
+        const size_t max_hits_size=(m_registersPerFrame*FRAMES_PER_MSG+1)*4*SAMPLES_PER_REGISTER;
+        for(unsigned i=0; i<m_numWorkers; ++i){
+            m_workerHits.emplace_back(new HitBatchQueue(std::max(64u, 2*m_maxBatchMessages), max_hits_size));
+        }
+    }
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::TriggerPrimitiveFinder") << "Creating " << m_numWorkers << " processing thread(s) for "
+                                                                               << (m_findInductionHits ? "all" : "collection") << " channels";
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::TriggerPrimitiveFinder") << "Filter has " << m_taps.size() << " taps (padded), multiplier " << (1<<m_tapExponent)
+                                                                               << ". Hit threshold is " << m_hitThreshold << " times the pedestal interquartile range. Using the "
+                                                                               << hit_finder_name(m_findHits) << " hit finding";
+    if(m_degradeBacklog.empty()){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::TriggerPrimitiveFinder") << "Hit finding never degrades when behind";
+    }
+    else{
+        std::stringstream ss;
+        for(size_t i=0; i<m_degradeBacklog.size(); ++i) ss << (i ? ", " : "") << m_degradeBacklog[i];
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::TriggerPrimitiveFinder") << "Hit finding degrades with a backlog of " << ss.str() << " messages, of a link buffer of "
+                                                                                   << buffer.capacity() << ". Degraded threshold is " << m_degradedThreshold;
+    }
+    for(unsigned i=0; i<m_numWorkers; ++i) m_degradationLevels[i].store(0);
+    for(unsigned i=0; i<m_numWorkers; ++i){
+        const uint8_t first_register=m_registersPerFrame*i/m_numWorkers;
+        const uint8_t last_register=m_registersPerFrame*(i+1)/m_numWorkers;
+        m_processingThreads.emplace_back(&TriggerPrimitiveFinder::processing_thread, this, i, first_register, last_register,
+                                         auto_pin ? cpus_for(std::to_string(i)) :
+                                         cpu_per_worker ? std::vector<int32_t>{cpus_to_pin[i]} : cpus_to_pin);
+    }
+    if(m_numWorkers>1){
+        m_mergingThread=std::thread(&TriggerPrimitiveFinder::merging_thread, this, auto_pin ? cpus_for("merging") : cpus_to_pin);
+    }
     dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::metrics_thread") << "Creating metrics thread";
     m_metricsThread=std::thread(&TriggerPrimitiveFinder::metrics_thread, this);
 }
@@ -53,18 +200,21 @@ TriggerPrimitiveFinder::TriggerPrimitiveFinder(fhicl::ParameterSet const & ps)
 TriggerPrimitiveFinder::~TriggerPrimitiveFinder()
 {
     dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "TriggerPrimitiveFinder dtor entered";
-    m_should_stop.store(false);
-    // Superstition: add multiple "end of messages" messages
-    for(int i=0; i<5; ++i){
-        m_itemsToProcess->write(ProcessingTasks::ItemToProcess{ProcessingTasks::END_OF_MESSAGES, SUPERCHUNK_CHAR_STRUCT{}, ProcessingTasks::now_us()});
-    }
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Joining processing thread";
-    m_processingThread.join(); // Wait for it to actually stop
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Processing thread joined";
+    m_should_stop.store(true);
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Joining processing threads";
+    for(auto& t: m_processingThreads) t.join(); // Wait for them to actually stop
+    if(m_mergingThread.joinable()) m_mergingThread.join();
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Processing threads joined";
 
     m_metricsThread.join();
 
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Sent a total of " << m_n_tpsets_sent << " TPSets";
+    if(m_tpsetBuilder){
+        m_tpsetBuilder->stop();
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Sent a total of " << m_tpsetBuilder->setsSent() << " TPSets. Dropped "
+                                                                                       << m_tpsetBuilder->setsDropped() << " because the sending thread was behind";
+    }
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::~TriggerPrimitiveFinder") << "Hit finding changed degradation level " << m_degradationTransitionsTotal.load() << " times. "
+                                                                                   << m_degradedMessages.load() << " messages were processed degraded";
 }
 
 //======================================================================
@@ -72,227 +222,248 @@ void TriggerPrimitiveFinder::stop()
 {
     dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::stop") << "Setting stop flag";
     m_should_stop.store(true);
-    // delete the TPSender so it closes its socket, hopefully before zsys_shutdown gets called
+    // Stop sending, and delete the TPSender so it closes its socket,
+    // hopefully before zsys_shutdown gets called
+    if(m_tpsetBuilder) m_tpsetBuilder->stop();
     m_TPSender.reset();
 }
 
-//======================================================================
-bool TriggerPrimitiveFinder::addMessage(SUPERCHUNK_CHAR_STRUCT& ucs)
-{
-    static size_t nPrinted=0;
-    if(m_readyForMessages.load()){
-        // The first frame in the message
-        dune::FelixFrame* frame=reinterpret_cast<dune::FelixFrame*>(&ucs);
-        const uint64_t timestamp=frame->timestamp();
-        if(timestamp==0 && nPrinted<10){
-            dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::addMessage") << "Got frame with timestamp zero!";
-            frame->print();
-            ++nPrinted;
-        }
-        return m_itemsToProcess->write(ProcessingTasks::ItemToProcess{timestamp, ucs, ProcessingTasks::now_us()});
-    }
-    return true;
-}
-
 //======================================================================
 void TriggerPrimitiveFinder::hitsToFragment(uint64_t timestamp, uint32_t window_size, artdaq::Fragment* fragPtr)
 {
     dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::hitsToFragment") << "Creating fragment for timestamp " << timestamp << " window_size " << window_size;
-    std::vector<dune::TriggerPrimitive> tps=getHitsForWindow(m_triggerPrimitives,
-                                                             timestamp-m_windowOffset*clocksPerTPCTick,
-                                                             timestamp+window_size-m_windowOffset*clocksPerTPCTick);
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::hitsToFragment") << "Got " << tps.size() << " hits for timestamp 0x" << std::hex << timestamp << std::dec;
+    const uint64_t start_ts=timestamp-m_windowOffset*clocksPerTPCTick;
+    PrimitiveStore::Window window;
+    uint8_t flags=0;
+    const size_t n_found=findHitsForWindow(start_ts, start_ts+window_size, window, flags) ? window.size() : 0;
 
     // The data payload of the fragment will be:
     // dune::CPUHitsFragment::Body
     // N*TriggerPrimitive
-    fragPtr->resizeBytes(sizeof(dune::CPUHitsFragment::Body)+tps.size()*sizeof(dune::TriggerPrimitive));
+    // DegradedTrailer, if flags is set
+    const size_t trailer_size=flags ? sizeof(DegradedTrailer) : 0;
+    fragPtr->resizeBytes(sizeof(dune::CPUHitsFragment::Body)+n_found*sizeof(dune::TriggerPrimitive)+trailer_size);
     dune::CPUHitsFragment hitFrag(*fragPtr);
 
+    // The hits are contiguous in the store, so they go straight into the fragment
+    size_t nhits=0;
+    if(n_found){
+        m_triggerPrimitives.copy(window, &hitFrag.get_primitive(0));
+        if(m_triggerPrimitives.valid(window)){
+            nhits=n_found;
+        }
+        else{
+            dune::DAQLogger::LogWarning("TriggerPrimitiveFinder::hitsToFragment") << "Hits for timestamp 0x" << std::hex << timestamp << std::dec << " were overwritten while copying them. Consider a larger tp_retention_ms";
+            fragPtr->resizeBytes(sizeof(dune::CPUHitsFragment::Body)+trailer_size);
+        }
+    }
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::hitsToFragment") << "Got " << nhits << " hits for timestamp 0x" << std::hex << timestamp << std::dec;
+    if(flags){
+        DegradedTrailer trailer{DegradedTrailer::MARKER, flags};
+        memcpy(fragPtr->dataBeginBytes()+sizeof(dune::CPUHitsFragment::Body)+nhits*sizeof(dune::TriggerPrimitive), &trailer, sizeof(trailer));
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::hitsToFragment") << "Hits for timestamp 0x" << std::hex << timestamp << " are from degraded hit finding (flags 0x" << int(flags) << ")" << std::dec;
+    }
+
     hitFrag.set_timestamp(timestamp);
-    hitFrag.set_nhits(tps.size());
+    hitFrag.set_nhits(nhits);
     hitFrag.set_window_offset(m_windowOffset);
 
     hitFrag.set_fiber_no(m_fiber_no);
     hitFrag.set_slot_no(m_slot_no);
     hitFrag.set_crate_no(m_crate_no);
-
-    for(size_t i=0; i<tps.size(); ++i){
-        hitFrag.get_primitive(i)=tps[i];
-    }
-
 }
 
 //======================================================================
 std::vector<dune::TriggerPrimitive>
-TriggerPrimitiveFinder::getHitsForWindow(const std::deque<dune::TriggerPrimitive>& primitive_queue,
-                                         uint64_t start_ts, uint64_t end_ts)
+TriggerPrimitiveFinder::getHitsForWindow(uint64_t start_ts, uint64_t end_ts, uint8_t* flags)
 {
     std::vector<dune::TriggerPrimitive> ret;
-    auto startTime=std::chrono::steady_clock::now();
-    auto now=std::chrono::steady_clock::now();
+    PrimitiveStore::Window window;
+    uint8_t window_flags=0;
+    if(findHitsForWindow(start_ts, end_ts, window, window_flags)){
+        ret.resize(window.size());
+        m_triggerPrimitives.copy(window, ret.data());
+        if(!m_triggerPrimitives.valid(window)){
+            dune::DAQLogger::LogWarning("TriggerPrimitiveFinder::getHitsForWindow") << "Hits were overwritten while copying them. Consider a larger tp_retention_ms";
+            ret.clear();
+        }
+    }
+    if(flags) *flags=window_flags;
+    return ret;
+}
+
+//======================================================================
+bool TriggerPrimitiveFinder::findHitsForWindow(uint64_t start_ts, uint64_t end_ts, PrimitiveStore::Window& window, uint8_t& flags)
+{
+    flags=0;
     // Wait for the processing to catch up, up to 1.5 second
     const size_t timeout_ms=1500;
-    int nloops=0;
-    while(m_latestProcessedTimestamp.load()<end_ts && (now - startTime) < std::chrono::milliseconds(timeout_ms)){
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        now=std::chrono::steady_clock::now();
-        ++nloops;
-    }
-    // We timed out
-    if(m_latestProcessedTimestamp.load()<end_ts){
-        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::getHitsForWindow") << "getHitsForWindow timed out waiting for timestamp " << end_ts << ". Latest processed timestamp is " << m_latestProcessedTimestamp.load() << ". waiting loop went " << nloops << " times";
-        return ret;
+    if(!m_triggerPrimitives.waitFor(end_ts, std::chrono::milliseconds(timeout_ms))){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::findHitsForWindow") << "Timed out waiting for timestamp " << end_ts << ". Latest processed timestamp is " << m_triggerPrimitives.latestTimestamp();
+        return false;
     }
 
-    ret.reserve(5000);
+    switch(m_triggerPrimitives.locate(start_ts, end_ts, window)){
+    case PrimitiveStore::Status::Ok:
+        flags=m_triggerPrimitives.flags(window);
+        return window.size()!=0;
+    case PrimitiveStore::Status::TooOld:
+        dune::DAQLogger::LogWarning("TriggerPrimitiveFinder::findHitsForWindow") << "Hits from timestamp " << start_ts << " are older than the retention of " << m_retentionMs << "ms. Only returning the newer ones";
+        flags=m_triggerPrimitives.flags(window);
+        return window.size()!=0;
+    case PrimitiveStore::Status::Overwritten:
+        dune::DAQLogger::LogWarning("TriggerPrimitiveFinder::findHitsForWindow") << "Hits from timestamp " << start_ts << " were overwritten while looking for them";
+        return false;
+    case PrimitiveStore::Status::Empty:
+        break;
+    }
+    return false;
+}
 
-    {
-        std::lock_guard<std::mutex> guard(m_triggerPrimitiveMutex);
+//======================================================================
+void TriggerPrimitiveFinder::build_channel_table(const dune::FelixFrame* frame)
+{
+    m_channelTable.resize(m_registersPerFrame*SAMPLES_PER_REGISTER);
+    if(m_findInductionHits){
+        for(size_t i=0; i<m_channelTable.size(); ++i){
+            m_channelTable[i].online=all_index_to_channel(i);
+            // getOfflineChannel comes from frames2array.h
+            m_channelTable[i].offline=getOfflineChannel(*m_channelMap, frame, all_index_to_channel(i));
+        }
+    }
+    else{
+        // The magic "48" is (maybe) the online channel number of the
+        // lowest-numbered collection channel in the link. Found by
+        // comparing the `offlines` and `index_to_chan` arrays in
+        // frame_expand.h`: the [16] entry is 0 in offlines, and 48 in
+        // `index_to_chan`
+        const uint32_t offline_channel_base=getOfflineChannel(*m_channelMap, frame, 48);
+        // It looks like the collection channel -> offline mapping has
+        // the same pattern, but is the other way round for fiber 2, so
+        // deal with that
+        const int multiplier=(frame->fiber_no()==1) ? 1 : -1;
+        for(size_t i=0; i<m_channelTable.size(); ++i){
+            m_channelTable[i].online=collection_index_to_channel(i);
+            m_channelTable[i].offline=offline_channel_base+multiplier*collection_index_to_offline(i);
+        }
+    }
 
-        for(auto const& prim: primitive_queue){
-            if(prim.messageTimestamp>start_ts && prim.messageTimestamp<end_ts){
-                ret.push_back(prim);
-            }
+    m_suppressedLanes.assign(m_registersPerFrame, 0);
+    size_t n_suppressed=0;
+    for(size_t i=0; i<m_channelTable.size(); ++i){
+        if(std::find(m_channels_to_suppress.begin(), m_channels_to_suppress.end(), m_channelTable[i].offline)!=m_channels_to_suppress.end()){
+            m_suppressedLanes[i/SAMPLES_PER_REGISTER]|=uint16_t(1) << (i%SAMPLES_PER_REGISTER);
+            ++n_suppressed;
         }
     }
-    return ret;
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::build_channel_table") << "Not sending hits from " << n_suppressed << " of the " << m_channelTable.size() << " channels";
 }
 
 //======================================================================
 unsigned int
 TriggerPrimitiveFinder::addHitsToQueue(uint64_t timestamp,
-                                       const uint16_t* input_loc,
-                                       std::deque<dune::TriggerPrimitive>& primitive_queue)
+                                       const uint16_t* const* inputs,
+                                       size_t ninputs,
+                                       uint8_t flags)
 {
-    uint16_t chan[16], hit_end[16], hit_charge[16], hit_tover[16];
     unsigned int nhits=0;
-    std::lock_guard<std::mutex> guard(m_triggerPrimitiveMutex);
 
-    static unsigned int msgs_in_tpset=0;
-    ptmp::data::TPSet& tpset=*m_current_tpset.get();
-    
-    if(m_send_ptmp_msgs && msgs_in_tpset==0){
-        tpset.set_count(m_n_tpsets_sent);
+    if(m_send_ptmp_msgs){
         // m_*_no are uint8_t, so maybe the casts to uint32_t before shifting are necessary?
-        tpset.set_detid((uint32_t(m_fiber_no) << 16) | (uint32_t(m_slot_no) << 8) | (uint32_t(m_crate_no) << 0));
-        tpset.set_tstart(timestamp);
-        std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
-        // Brett asked for TPSet creation time in microseconds, not timing system ticks
-        auto ticks = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch());
-        tpset.set_created(ticks.count());
+        m_tpsetBuilder->startMessage(timestamp, (uint32_t(m_fiber_no) << 16) | (uint32_t(m_slot_no) << 8) | (uint32_t(m_crate_no) << 0));
     }
 
     size_t n_sent_hits=0; // The number of hits we actually sent (ie, that weren't suppressed as bad/noisy)
     size_t sent_adcsum=0;
-    while(*input_loc!=MAGIC){
-        for(int i=0; i<16; ++i) chan[i]       = *input_loc++;
-        for(int i=0; i<16; ++i) hit_end[i]    = *input_loc++;
-        for(int i=0; i<16; ++i) hit_charge[i] = *input_loc++;
-        for(int i=0; i<16; ++i) hit_tover[i]  = *input_loc++;
-        
-        for(int i=0; i<16; ++i){
-            if(hit_charge[i] && chan[i]!=MAGIC){
-                const uint16_t online_channel=collection_index_to_channel(chan[i]);
-                // It looks like the collection channel -> offline
-                // mapping has the same pattern, but is the other way
-                // round for fiber 2, so deal with that
-                int multiplier=(m_fiber_no==1) ? 1 : -1;
-                const uint32_t offline_channel=m_offline_channel_base+multiplier*collection_index_to_offline(chan[i]);
-                // Hack for now, to exclude high TP rate (>10kHz) channels. -JLS June 2019
-                // if (offline_channel==9691 || offline_channel==5296 || offline_channel==5010 || offline_channel==4387
-                // || offline_channel==4381 || offline_channel==4383 || offline_channel==5006 || offline_channel==9689) { continue; }
-                primitive_queue.emplace_back(timestamp, online_channel, hit_end[i], hit_charge[i], hit_tover[i]);
-                if(m_send_ptmp_msgs){
-                    bool should_send_this=true;
-                    for(auto const bad_ch: m_channels_to_suppress){
-                        if(offline_channel==bad_ch) should_send_this=false;
-                    }
-                    if(should_send_this){
-                        // hit_end is the end time of the hit in TPC clock
-                        // ticks after the start of the netio message in which
-                        // the hit ended
-                        uint64_t hit_start=timestamp+clocksPerTPCTick*(int64_t(hit_end[i])-hit_tover[i]);
-                        ptmp::data::TrigPrim* ptmp_prim=tpset.add_tps();
-                        ptmp_prim->set_channel(offline_channel);
-                        ptmp_prim->set_tstart(hit_start);
-                        // Convert time-over-threshold to 50MHz clock ticks, so all the ptmp quantities are in the same units
-                        ptmp_prim->set_tspan(clocksPerTPCTick*hit_tover[i]);
-                        ptmp_prim->set_adcsum(hit_charge[i]);
-                        ++n_sent_hits;
-                        sent_adcsum+=hit_charge[i];
-                    }
-                }
-                ++nhits;
-
+    for(size_t iinput=0; iinput<ninputs; ++iinput){
+        const uint16_t* input_loc=inputs[iinput];
+        while(*input_loc!=MAGIC){
+            const uint16_t* chan       = input_loc;
+            const uint16_t* hit_end    = input_loc+SAMPLES_PER_REGISTER;
+            const uint16_t* hit_charge = input_loc+2*SAMPLES_PER_REGISTER;
+            const uint16_t* hit_tover  = input_loc+3*SAMPLES_PER_REGISTER;
+            input_loc+=4*SAMPLES_PER_REGISTER;
+
+            // The lanes of the register with a hit (the charge is only
+            // set in those), and the ones of those we send out. The
+            // lanes of a register are consecutive channel indices
+            uint32_t hit_lanes=0;
+            for(size_t i=0; i<SAMPLES_PER_REGISTER; ++i) hit_lanes|=uint32_t(hit_charge[i]!=0) << i;
+            const ChannelInfo* channels=&m_channelTable[chan[0]];
+            uint32_t send_lanes=m_send_ptmp_msgs ? (hit_lanes & ~uint32_t(m_suppressedLanes[chan[0]/SAMPLES_PER_REGISTER])) : 0;
+
+            nhits+=__builtin_popcount(hit_lanes);
+            while(hit_lanes){
+                const int i=__builtin_ctz(hit_lanes);
+                hit_lanes&=hit_lanes-1;
+                m_triggerPrimitives.emplace(timestamp, channels[i].online, hit_end[i], hit_charge[i], hit_tover[i]);
+            }
+            n_sent_hits+=__builtin_popcount(send_lanes);
+            while(send_lanes){
+                const int i=__builtin_ctz(send_lanes);
+                send_lanes&=send_lanes-1;
+                // hit_end is the end time of the hit in TPC clock
+                // ticks after the start of the netio message in which
+                // the hit ended
+                uint64_t hit_start=timestamp+clocksPerTPCTick*(int64_t(hit_end[i])-hit_tover[i]);
+                ptmp::data::TrigPrim* ptmp_prim=m_tpsetBuilder->addHit();
+                ptmp_prim->set_channel(channels[i].offline);
+                ptmp_prim->set_tstart(hit_start);
+                // Convert time-over-threshold to 50MHz clock ticks, so all the ptmp quantities are in the same units
+                ptmp_prim->set_tspan(clocksPerTPCTick*hit_tover[i]);
+                ptmp_prim->set_adcsum(hit_charge[i]);
+                sent_adcsum+=hit_charge[i];
             }
         }
     }
 
+    m_nhitsTotal.fetch_add(nhits);
     m_nhits_for_metric.fetch_add(n_sent_hits);
     m_adcsum_for_metric.fetch_add(sent_adcsum);
 
-    ++msgs_in_tpset;
-
-    // Send out the TPSet every m_msgs_per_tpset messages
-    if(m_send_ptmp_msgs && msgs_in_tpset==m_msgs_per_tpset){
-        tpset.set_tspan(timestamp+FRAMES_PER_MSG*clocksPerTPCTick-tpset.tstart());
-        // Don't send empty TPSets
-        if(tpset.tps_size()!=0 && m_TPSender){
-            ptmp::TPSender& tpsender=*m_TPSender;
-            tpsender(tpset);
-            ++m_n_tpsets_sent;
-        }
-        msgs_in_tpset=0;
-        m_current_tpset.reset(new ptmp::data::TPSet);
-    }
-
-    while(primitive_queue.size()>20000) primitive_queue.pop_front();
+    // Make the hits of this message visible to hitsToFragment()
+    m_triggerPrimitives.publish(timestamp, flags);
     return nhits;
 }
 
 //======================================================================
-void TriggerPrimitiveFinder::measure_latency(const ProcessingTasks::ItemToProcess& item)
+void TriggerPrimitiveFinder::measure_latency(uint64_t timestamp, uint64_t backlog)
 {
-    // All these statics mean this function can only be called from one thread, I assume
+    // The state is in members, so this function can only be called from one thread
     static constexpr int latencyThresholdEnter=100000; // us
     static constexpr int latencyThresholdLeave=latencyThresholdEnter/2;
-    static bool was_behind=false;
-    static uint64_t entered_late_time=0;
 
     uint64_t now=ProcessingTasks::now_us();
     // The time in us between the timestamp on the data and now. In
     // principle, the full latency to get from the detector to this
     // hit-finding processing, on the assumption that the timing
     // system clock is in sync with this machine's clock
-    int64_t full_latency=now-item.timestamp/50;
-    // The time in us between the item being queued in addMessage()
-    // and it starting processing. This is (sort of) the latency added
-    // by TPF
-    int64_t tpf_latency=now-item.timeQueued;
-
-    static size_t nitem=0;
-    if(nitem++ < 50){
-        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Item with TS " << item.timestamp << " (ticks) queued at " << item.timeQueued << " (us), processed at " << now << " (us), full latency " << full_latency << "us, TPF latency " << tpf_latency << "us";
+    int64_t full_latency=now-timestamp/50;
+    // The time in us it takes the link to deliver the messages that
+    // are waiting in the link buffer behind this one. This is (sort
+    // of) the latency added by TPF
+    int64_t tpf_latency=backlog*FRAMES_PER_MSG*clocksPerTPCTick/50;
+
+    if(m_nLatencyPrinted++ < 50){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Message with TS " << timestamp << " (ticks) processed at " << now << " (us) with " << backlog << " messages waiting, full latency " << full_latency << "us, TPF latency " << tpf_latency << "us";
     }
 
     m_full_latency_hist.fill((uint64_t)std::max(0L, full_latency));
     m_tpf_latency_hist.fill((uint64_t)std::max(0L, tpf_latency));
 
-    static int64_t last_printed_latency=0;
-    if(!was_behind && full_latency > latencyThresholdEnter){
-        entered_late_time=now;
-        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Processing late by " << (full_latency/1000) << "ms (threshold is " << (latencyThresholdEnter/1000) << "ms). Latency since queueing: " << (tpf_latency/1000) << "ms";
-        was_behind=true;
-        last_printed_latency=full_latency;
+    if(!m_latencyWasBehind && full_latency > latencyThresholdEnter){
+        m_enteredLateUs=now;
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Processing late by " << (full_latency/1000) << "ms (threshold is " << (latencyThresholdEnter/1000) << "ms). Backlog latency: " << (tpf_latency/1000) << "ms";
+        m_latencyWasBehind=true;
+        m_lastPrintedLatency=full_latency;
     }
-    if(full_latency < latencyThresholdLeave && was_behind){
-        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Processing caught up. Was late for " << ((now-entered_late_time)/1000) << "ms";
-        was_behind=false;
+    if(full_latency < latencyThresholdLeave && m_latencyWasBehind){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Processing caught up. Was late for " << ((now-m_enteredLateUs)/1000) << "ms";
+        m_latencyWasBehind=false;
     }
-    if(was_behind && full_latency>last_printed_latency+latencyThresholdEnter){
-        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Processing now late by " << (full_latency/1000) << "ms (threshold is " << (latencyThresholdEnter/1000) << "ms). Latency since queueing: " << tpf_latency << "us";
-        last_printed_latency+=latencyThresholdEnter;
+    if(m_latencyWasBehind && full_latency>m_lastPrintedLatency+latencyThresholdEnter){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::measure_latency") << "Processing now late by " << (full_latency/1000) << "ms (threshold is " << (latencyThresholdEnter/1000) << "ms). Backlog latency: " << tpf_latency << "us";
+        m_lastPrintedLatency+=latencyThresholdEnter;
     }
 }
 
@@ -301,17 +472,45 @@ void TriggerPrimitiveFinder::metrics_thread()
 {
     dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::metrics_thread") << "metrics thread starting";
     
+    uint64_t dropped_last=0;
+    size_t tpsets_dropped_last=0;
     while(!m_should_stop.load()){
         // Get the number of hits, then reset it to zero
         size_t nhits=m_nhits_for_metric.exchange(0);
         size_t adcsum=m_adcsum_for_metric.exchange(0);
+        uint64_t cpu_ns=m_cpu_ns_for_metric.exchange(0);
+        size_t transitions=m_degradation_transitions_for_metric.exchange(0);
+        // Primitives the store overwrote inside the retention, at its size cap
+        uint64_t dropped_total=m_triggerPrimitives.droppedPrimitives();
+        uint64_t dropped=dropped_total-dropped_last;
+        dropped_last=dropped_total;
+        if(dropped){
+            dune::DAQLogger::LogWarning("TriggerPrimitiveFinder::metrics_thread") << dropped << " primitives dropped at the max_primitive_bytes cap of the store";
+        }
+        // TPSets closed while the sending thread had none free
+        size_t tpsets_dropped_total=m_tpsetBuilder ? m_tpsetBuilder->setsDropped() : 0;
+        size_t tpsets_dropped=tpsets_dropped_total-tpsets_dropped_last;
+        tpsets_dropped_last=tpsets_dropped_total;
+        if(tpsets_dropped){
+            dune::DAQLogger::LogWarning("TriggerPrimitiveFinder::metrics_thread") << tpsets_dropped << " TPSets dropped because the sending thread was behind";
+        }
+        unsigned level=0;
+        for(unsigned i=0; i<m_numWorkers; ++i) level=std::max(level, m_degradationLevels[i].load());
         double hitrate=double(nhits)/m_metric_reporting_interval_seconds;
         double adcsumrate=double(adcsum)/m_metric_reporting_interval_seconds;
+        // The CPU cost of the hit finding on this link, in units of one core
+        double cpu_percent=100*1e-9*cpu_ns/m_metric_reporting_interval_seconds;
 
         if(artdaq::Globals::metricMan_ && artdaq::Globals::metricMan_->Running()) {
-            dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::metrics_thread") << "Publishing metrics hitrate: " << hitrate << " adcsumrate: " << adcsumrate;
+            dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::metrics_thread") << "Publishing metrics hitrate: " << hitrate << " adcsumrate: " << adcsumrate << " cpu: " << cpu_percent << "%";
             artdaq::Globals::metricMan_->sendMetric("Hit Rate",  hitrate   ,  "Hz", 1, artdaq::MetricMode::LastPoint);
             artdaq::Globals::metricMan_->sendMetric("ADC sum rate", adcsumrate, "ADC/s", 1, artdaq::MetricMode::LastPoint);
+            artdaq::Globals::metricMan_->sendMetric("TPF CPU usage", cpu_percent, "%", 1, artdaq::MetricMode::LastPoint);
+            // The most degraded worker, and how many times the workers changed level since last time
+            artdaq::Globals::metricMan_->sendMetric("TPF degradation level", int(level), "level", 1, artdaq::MetricMode::LastPoint);
+            artdaq::Globals::metricMan_->sendMetric("TPF degradation transitions", int(transitions), "transitions", 1, artdaq::MetricMode::Accumulate);
+            artdaq::Globals::metricMan_->sendMetric("TPF primitives dropped", double(dropped), "primitives", 1, artdaq::MetricMode::Accumulate);
+            artdaq::Globals::metricMan_->sendMetric("TPF TPSets dropped", int(tpsets_dropped), "sets", 1, artdaq::MetricMode::Accumulate);
         }
         else{
             dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::metrics_thread") << "metricMan is null, so not publishing this go-round";
@@ -327,144 +526,343 @@ void TriggerPrimitiveFinder::metrics_thread()
 
 
 //======================================================================
-void TriggerPrimitiveFinder::processing_thread(uint8_t first_register, uint8_t last_register,
-                                               size_t qsize, std::vector<int32_t> cpus_to_pin)
+void TriggerPrimitiveFinder::processing_thread(unsigned iworker, uint8_t first_register, uint8_t last_register,
+                                               std::vector<int32_t> cpus_to_pin)
 {
     pthread_setname_np(pthread_self(), "processing");
 
-    if(!cpus_to_pin.empty()){
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        for(auto const& cpu: cpus_to_pin){
-            CPU_SET(cpu, &cpuset);
-        }
-        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    pin_to_cpus(cpus_to_pin);
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "processing thread " << iworker << " (registers [" << int(first_register) << ", " << int(last_register) << ")) running on cpu " << sched_getcpu();
+
+    if(iworker==0){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Link buffer: " << m_buffer.placement();
     }
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "processing thread running on cpu " << sched_getcpu();
-
-    // We allocate the queue of items in this thread *after* pinning
-    // with the hope of making sure the allocation is on NUMA1 not
-    // NUMA0, to spread the memory bandwidth load across NUMA cores
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Allocating item queue of size " << qsize;
-    m_itemsToProcess=std::make_unique<folly::ProducerConsumerQueue<ProcessingTasks::ItemToProcess>>(qsize);
-    // numa(3) says: "All numa memory allocation policy only takes
-    // effect when a page is actually faulted into the address space
-    // of a process by accessing it". So write to all the slots in the
-    // queue so the memory allocated definitely gets faulted in
-    for(size_t i=0; i<qsize-1; ++i){
-        m_itemsToProcess->write(ProcessingTasks::ItemToProcess{ProcessingTasks::END_OF_MESSAGES, SUPERCHUNK_CHAR_STRUCT{}, 0});
-    }
-    int node_counts[2]={0};
-    for(size_t i=0; i<qsize-1; ++i){
-        ProcessingTasks::ItemToProcess* item=m_itemsToProcess->frontPtr();
-        node_counts[which_numa_node(item)]++;
-        m_itemsToProcess->popFront();
-    }
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "items on node 0: " << node_counts[0] << ", node 1: " << node_counts[1];
+    // The thread's own buffers go on the node it's pinned to
+    const int numa_node=numa_memory::currentNode();
     uint64_t first_msg_us=0;
 
+    // With several workers, each one sends the hits in its registers
+    // to the merging thread, which puts them in the store
+    const bool multi_worker=m_numWorkers>1;
+    HitBatchQueue* hit_queue=multi_worker ? m_workerHits[iworker].get() : nullptr;
+
     // -------------------------------------------------------- 
     // Set up the processing info
     
-    const uint8_t tap_exponent=6;
-    const int multiplier=1<<tap_exponent; // 64
-    std::vector<int16_t> taps=firwin_int(7, 0.1, multiplier);
-    taps.push_back(0); // Make it 8 long so it's a power of two
-
-    // TODO: ProcessingInfo points to but doesn't copy the taps it's
-    // passed, so we make a long-lived copy here. We ought to not leak
-    // this (and also do it properly)
-    int16_t* taps_p=new int16_t[taps.size()];
-    for(size_t i=0; i<taps.size(); ++i) taps_p[i]=taps[i];
-
-    // Temporary place to stash the hits
-    uint16_t* primfind_dest=new uint16_t[100000];
+    // The messages waiting in the link buffer are processed in
+    // batches of up to m_maxBatchMessages, so that the hit finding
+    // state stays in registers across the whole batch when we're
+    // behind. When we're keeping up, the batches are one message.
+    // For each batch, the collection ADCs of all its messages, one after the other
+    NumaArray<MessageCollectionADCs> batch_adcs(m_maxBatchMessages, numa_node);
+    // All the ADCs of the batch, when they don't go to the link
+    // buffer. Only worker 0 needs them, unless we're finding hits on
+    // the induction channels too
+    const bool needs_all_adcs=(iworker==0 || m_findInductionHits);
+    const bool all_adcs_in_buffer=(iworker==0 && m_buffer.hasExpansion());
+    NumaArray<MessageAllADCs> local_all_adcs((needs_all_adcs && !all_adcs_in_buffer) ? m_maxBatchMessages : 0, numa_node);
+    std::vector<uint64_t> timestamps(m_maxBatchMessages);
+
+    // Temporary place to stash the hits of a batch, and then of each message
+    const size_t max_msg_hits_size=(m_registersPerFrame*FRAMES_PER_MSG+1)*4*SAMPLES_PER_REGISTER;
+    NumaArray<uint16_t> primfind_buffer(max_msg_hits_size*m_maxBatchMessages, numa_node);
+    uint16_t* primfind_dest=primfind_buffer.get();
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "processing thread " << iworker << " buffers: batch ADCs " << batch_adcs.placement()
+                                                                          << "; hits " << primfind_buffer.placement();
+    std::vector<uint16_t> msg_hits(multi_worker ? 0 : max_msg_hits_size*m_maxBatchMessages);
+    std::vector<uint16_t*> msg_outputs(m_maxBatchMessages);
     
-    // Place to put the hits more tidily for later retrieval
-    std::deque<dune::TriggerPrimitive> primitive_queue;
-      
     ProcessingInfo pi(nullptr,
-                      FRAMES_PER_MSG, // We'll just process one message
+                      FRAMES_PER_MSG, // Set for each batch
                       first_register, // First register
                       last_register, // Last register
                       primfind_dest,
-                      taps_p, (uint8_t)taps.size(),
-                      tap_exponent,
+                      m_taps.data(), (uint8_t)m_taps.size(), // ProcessingInfo doesn't copy the taps
+                      m_tapExponent,
+                      0,
                       0,
-                      0);
+                      m_hitThreshold);
 
-    // TODO: hardcoded paths :-O
-    PdspChannelMapService channelMap("/nfs/sw/work_dirs/phrodrig/march2019-felix-trigger-primitive/srcs/dune_artdaq/dune-artdaq/Generators/Felix/TriggerPrimitive/protoDUNETPCChannelMap_RCE_v4.txt",
-                                     "/nfs/sw/work_dirs/phrodrig/march2019-felix-trigger-primitive/srcs/dune_artdaq/dune-artdaq/Generators/Felix/TriggerPrimitive/protoDUNETPCChannelMap_FELIX_v4.txt");
+    // How much of the hit finding to give up when we're behind. At the
+    // worst, only the registers before subset_last_register are processed
+    DegradationPolicy degradation(m_degradeBacklog, m_degradeLeaveFraction, m_degradeMinMessages);
+    const uint8_t subset_last_register=first_register+std::max(1, int(std::ceil((last_register-first_register)*m_degradeRegisterFraction)));
+
+    // The number of batches of each size, and the time they took from
+    // expansion to storing the hits
+    std::vector<size_t> batches_of_size(m_maxBatchMessages+1, 0);
+    std::vector<uint64_t> ns_for_size(m_maxBatchMessages+1, 0);
 
     size_t nhits=0;
     // -------------------------------------------------------- 
     // Actually process
-    int nmsg=0;
+    size_t nmsg=0;
     bool first=true;
 
-    m_readyForMessages.store(true);
+    // Start with the first message written after the finder was
+    // created, as the writer may have been running for a while
+    // already. All the workers start at the same message
+    uint64_t seq=m_firstSeq;
+    size_t nZeroTimestamps=0;
+
+    uint64_t last_cpu_ns=thread_cpu_ns();
+
+    if(m_workersReady.fetch_add(1)+1==m_numWorkers) m_readyForMessages.store(true);
 
     while(true){
-        ProcessingTasks::ItemToProcess* item=nullptr;
-        while(!(item=m_itemsToProcess->frontPtr()) && !m_should_stop.load()){ 
+        uint64_t written;
+        while((written=m_buffer.written())<=seq && !m_should_stop.load()){
             std::this_thread::sleep_for(std::chrono::microseconds(10));
         }
-        ++nmsg;
-        if(first_msg_us==0) first_msg_us=ProcessingTasks::now_us();
         if(m_should_stop.load()){
             dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "m_should_stop is true. Exiting";
             break;
         }
-        if(item->timestamp==ProcessingTasks::END_OF_MESSAGES){
-            dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Got END_OF_MESSAGES. Exiting";
-            m_itemsToProcess->popFront();
-            break;
+        // The writer lapped us, or the buffer was flushed: carry on
+        // from the oldest message still there
+        const uint64_t oldest=m_buffer.oldest();
+        if(seq<oldest){
+            // The merging thread counts the messages that no worker processed
+            if(!multi_worker){
+                m_messagesSkipped.fetch_add(oldest-seq);
+                m_nextSeq.store(oldest, std::memory_order_release);
+            }
+            seq=oldest;
+            continue;
         }
-        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expanded=expand_message_adcs(item->scs);
-        MessageCollectionADCs* mcadc=reinterpret_cast<MessageCollectionADCs*>(expanded.data());
+        if(first_msg_us==0) first_msg_us=ProcessingTasks::now_us();
+        const auto batch_start=std::chrono::steady_clock::now();
+
+        // As many of the waiting messages as we can take. The expanded
+        // ADCs in the link buffer have to be contiguous
+        size_t nbatch=std::min<uint64_t>(m_maxBatchMessages, written-seq);
+        if(all_adcs_in_buffer) nbatch=std::min(nbatch, m_buffer.contiguous(seq));
+
+        // Worker 0 expands all the channels once, straight from the
+        // link buffer. With expansion enabled, they stay in the link
+        // buffer for the fragment building too. The other workers
+        // only need the collection channels, unless we're finding
+        // hits on the induction channels
+        MessageAllADCs* all_adcs=nullptr;
+        if(all_adcs_in_buffer)  all_adcs=m_buffer.expandSlot(seq);
+        else if(needs_all_adcs) all_adcs=local_all_adcs.get();
+        for(size_t k=0; k<nbatch; ++k){
+            const SUPERCHUNK_CHAR_STRUCT* scs=m_buffer.at(seq+k);
+            timestamps[k]=m_buffer.timestampAt(seq+k);
+            if(all_adcs_in_buffer && k>0) m_buffer.expandSlot(seq+k);
+            RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expanded=all_adcs ? expand_message_all_adcs(*scs, all_adcs[k]) : expand_message_adcs(*scs);
+            if(!m_findInductionHits) memcpy(&batch_adcs[k], expanded.data(), sizeof(MessageCollectionADCs));
+        }
+        const dune::FelixFrame* frame=reinterpret_cast<const dune::FelixFrame*>(m_buffer.at(seq));
+        uint8_t fiber_no=0, crate_no=0, slot_no=0;
         if(first){
-            pi.setState(mcadc);
-            dune::FelixFrame* frame=reinterpret_cast<dune::FelixFrame*>(&item->scs);
-            m_fiber_no=frame->fiber_no();
-            m_crate_no=frame->crate_no();
-            m_slot_no=frame->slot_no();
-            // getOfflineChannel comes from frames2array.h. The magic
-            // "48" is (maybe) the online channel number of the
-            // lowest-numbered collection channel in the link. Found
-            // by comparing the `offlines` and `index_to_chan` arrays
-            // in frame_expand.h`: the [16] entry is 0 in offlines,
-            // and 48 in `index_to_chan`
-            m_offline_channel_base=getOfflineChannel(channelMap, frame, 48);
+            fiber_no=frame->fiber_no();
+            crate_no=frame->crate_no();
+            slot_no=frame->slot_no();
+        }
+        // Nothing we read counts if the writer recycled the oldest slot
+        // of the batch under us (and so maybe the others)
+        if(!m_buffer.valid(seq)){
+            continue;
+        }
+        if(all_adcs_in_buffer){
+            for(size_t k=0; k<nbatch; ++k) m_buffer.publishExpanded(seq+k);
+        }
+        if((nmsg+nbatch)/cpuMetricMessages!=nmsg/cpuMetricMessages){
+            const uint64_t cpu_ns=thread_cpu_ns();
+            add_cpu_ns(cpu_ns-last_cpu_ns);
+            last_cpu_ns=cpu_ns;
+        }
+        nmsg+=nbatch;
 
+        for(size_t k=0; k<nbatch; ++k){
+            if(timestamps[k]==0 && nZeroTimestamps<10 && iworker==0){
+                dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Got frame with timestamp zero!";
+                ++nZeroTimestamps;
+            }
+        }
+        if(first){
+            if(m_findInductionHits) pi.setState(all_adcs);
+            else                    pi.setState(&batch_adcs[0]);
+            if(iworker==0){
+                m_fiber_no=fiber_no;
+                m_crate_no=crate_no;
+                m_slot_no=slot_no;
+                build_channel_table(frame);
+            }
             first=false;
         }
-        pi.input=mcadc;
+        pi.input=batch_adcs.get();
+        pi.all_input=all_adcs;
+        pi.timeWindowNumFrames=nbatch*FRAMES_PER_MSG;
+
+        // Give up some sensitivity, rather than fall so far behind that
+        // the writer overwrites messages and leaves holes in the hits
+        if(degradation.update(written-seq, nbatch)){
+            const uint8_t flags=degradation.flags();
+            pi.update_pedestals=!(flags & DegradationPolicy::FrozenPedestals);
+            pi.threshold=(flags & DegradationPolicy::RaisedThreshold) ? m_degradedThreshold : m_hitThreshold;
+            const uint8_t new_last_register=(flags & DegradationPolicy::RegisterSubset) ? subset_last_register : last_register;
+            // The registers coming back were skipped for a while, so their filters start again
+            if(new_last_register>pi.last_register){
+                pi.chanState.resetFilter(pi.last_register*SAMPLES_PER_REGISTER, new_last_register*SAMPLES_PER_REGISTER);
+            }
+            pi.last_register=new_last_register;
+            dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Worker " << iworker << " going from degradation level " << m_degradationLevels[iworker].load()
+                                                                                  << " to " << degradation.level() << " with " << (written-seq) << " messages waiting";
+            m_degradationLevels[iworker].store(degradation.level());
+            m_degradationTransitionsTotal.fetch_add(1);
+            m_degradation_transitions_for_metric.fetch_add(1);
+        }
+        if(degradation.level()) m_degradedMessages.fetch_add(nbatch);
+
         // "Empty" the list of hits
         *primfind_dest=MAGIC;
         // Do the processing
-        process_window_avx2(pi);
-        // Create dune::TriggerPrimitives from the hits and put them in the queue for later retrieval
-        size_t this_nhits=addHitsToQueue(item->timestamp, primfind_dest, m_triggerPrimitives);
-        nhits+=this_nhits;
-        m_latestProcessedTimestamp.store(item->timestamp);
-        measure_latency(*item);
-        m_itemsToProcess->popFront();
+        m_findHits(pi);
+
+        if(multi_worker){
+            // Split the hits straight into the next batches for the merging thread
+            while(hit_queue->claim(nbatch-1)==nullptr && !m_should_stop.load()){
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+            }
+            if(m_should_stop.load()) continue; // The check at the top of the loop exits
+            for(size_t k=0; k<nbatch; ++k){
+                HitBatchQueue::Batch* batch=hit_queue->claim(k);
+                batch->seq=seq+k;
+                batch->timestamp=timestamps[k];
+                batch->flags=degradation.flags();
+                msg_outputs[k]=batch->hits;
+            }
+            split_hits_by_message(primfind_dest, nbatch, msg_outputs.data());
+            hit_queue->publish(nbatch);
+        }
+        else{
+            if(nbatch==1){
+                msg_outputs[0]=primfind_dest;
+            }
+            else{
+                for(size_t k=0; k<nbatch; ++k) msg_outputs[k]=&msg_hits[k*max_msg_hits_size];
+                split_hits_by_message(primfind_dest, nbatch, msg_outputs.data());
+            }
+            for(size_t k=0; k<nbatch; ++k){
+                // Create dune::TriggerPrimitives from the hits and put them in the store for later retrieval
+                size_t this_nhits=addHitsToQueue(timestamps[k], &msg_outputs[k], 1, degradation.flags());
+                nhits+=this_nhits;
+                measure_latency(timestamps[k], written-(seq+k)-1);
+                m_nextSeq.store(seq+k+1, std::memory_order_release);
+            }
+        }
+        seq+=nbatch;
+
+        ++batches_of_size[nbatch];
+        ns_for_size[nbatch]+=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-batch_start).count();
     }
     uint64_t end_us=ProcessingTasks::now_us();
     int64_t walltime_us=end_us-first_msg_us;
     rusage r;
     getrusage(RUSAGE_THREAD, &r);
-    double hitsPerMsg=double(nhits)/nmsg;
     double cputime_us=1e6*double(r.ru_utime.tv_sec)+double(r.ru_utime.tv_usec);
-    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Received " << nmsg << " messages. Found " << nhits << " hits. hits/msg=" << hitsPerMsg << ". CPU time / wall time (from first message received) = " << (1e-6*cputime_us) << "s / " << (1e-6*walltime_us) << "s. Avg CPU % = " << (100*cputime_us/walltime_us);
+    if(multi_worker){
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Worker " << iworker << " processed " << nmsg << " messages. CPU time / wall time (from first message received) = " << (1e-6*cputime_us) << "s / " << (1e-6*walltime_us) << "s. Avg CPU % = " << (100*cputime_us/walltime_us);
+    }
+    else{
+        double hitsPerMsg=double(nhits)/nmsg;
+        dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << "Received " << nmsg << " messages. Found " << nhits << " hits. hits/msg=" << hitsPerMsg << ". CPU time / wall time (from first message received) = " << (1e-6*cputime_us) << "s / " << (1e-6*walltime_us) << "s. Avg CPU % = " << (100*cputime_us/walltime_us);
+
+        // Print the histograms of latencies
+        print_latency_hist(m_full_latency_hist, "Full");
+        print_latency_hist(m_tpf_latency_hist, "TPF");
+    }
+    // The processing time per message for each batch size
+    std::stringstream batch_ss;
+    batch_ss << "Worker " << iworker << " batch sizes (messages, batches, us/message):" << std::endl;
+    for(size_t k=1; k<batches_of_size.size(); ++k){
+        if(batches_of_size[k]==0) continue;
+        batch_ss << k << "\t" << batches_of_size[k] << "\t" << (1e-3*ns_for_size[k]/(k*batches_of_size[k])) << std::endl;
+    }
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::processing_thread") << batch_ss.str();
+    // -------------------------------------------------------- 
+    // Cleanup
+}
+
+//======================================================================
+void TriggerPrimitiveFinder::merging_thread(std::vector<int32_t> cpus_to_pin)
+{
+    pthread_setname_np(pthread_self(), "tp-merging");
+
+    pin_to_cpus(cpus_to_pin);
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::merging_thread") << "merging thread running on cpu " << sched_getcpu();
+
+    std::vector<const HitBatchQueue::Batch*> fronts(m_numWorkers);
+    std::vector<const uint16_t*> inputs;
+    inputs.reserve(m_numWorkers);
+    size_t nhits=0;
+    size_t nmsg=0;
+    size_t npartial=0;
+    uint64_t seq=m_firstSeq;
+    uint64_t last_cpu_ns=thread_cpu_ns();
+
+    while(true){
+        // Wait for every worker to have something for us. The workers
+        // process messages in order, so their oldest batches are the
+        // candidates for the next message
+        bool all_ready=false;
+        while(!(all_ready=std::all_of(m_workerHits.begin(), m_workerHits.end(),
+                                      [](const std::unique_ptr<HitBatchQueue>& q){ return q->front()!=nullptr; }))
+              && !m_should_stop.load()){
+            std::this_thread::sleep_for(std::chrono::microseconds(10));
+        }
+        if(!all_ready) break;
+
+        uint64_t next=UINT64_MAX;
+        for(unsigned i=0; i<m_numWorkers; ++i){
+            fronts[i]=m_workerHits[i]->front();
+            next=std::min(next, fronts[i]->seq);
+        }
+        if(next>seq) m_messagesSkipped.fetch_add(next-seq);
+        seq=next;
+
+        // Join the registers in worker order, which is the order a
+        // single worker would have found them in. A worker that was
+        // lapped may not have this message at all
+        inputs.clear();
+        uint64_t timestamp=0;
+        uint8_t flags=0;
+        for(unsigned i=0; i<m_numWorkers; ++i){
+            if(fronts[i]->seq!=seq) continue;
+            inputs.push_back(fronts[i]->hits);
+            timestamp=fronts[i]->timestamp;
+            flags|=fronts[i]->flags;
+        }
+        if(inputs.size()!=m_numWorkers){
+            // The fragments of this message have to say that hits are missing
+            flags|=DegradedTrailer::MissingRegisters;
+            ++npartial;
+            m_messagesPartial.fetch_add(1, std::memory_order_relaxed);
+        }
+        nhits+=addHitsToQueue(timestamp, inputs.data(), inputs.size(), flags);
+        ++nmsg;
+        if(nmsg%cpuMetricMessages==0){
+            const uint64_t cpu_ns=thread_cpu_ns();
+            add_cpu_ns(cpu_ns-last_cpu_ns);
+            last_cpu_ns=cpu_ns;
+        }
+        measure_latency(timestamp, m_buffer.written()-seq-1);
+
+        for(unsigned i=0; i<m_numWorkers; ++i){
+            if(fronts[i]->seq==seq) m_workerHits[i]->pop();
+        }
+        ++seq;
+        m_nextSeq.store(seq, std::memory_order_release);
+    }
+
+    double hitsPerMsg=double(nhits)/nmsg;
+    dune::DAQLogger::LogInfo("TriggerPrimitiveFinder::merging_thread") << "Merged " << nmsg << " messages from " << m_numWorkers << " workers (" << npartial << " missing some registers). Found " << nhits << " hits. hits/msg=" << hitsPerMsg;
 
     // Print the histograms of latencies
     print_latency_hist(m_full_latency_hist, "Full");
     print_latency_hist(m_tpf_latency_hist, "TPF");
-    // -------------------------------------------------------- 
-    // Cleanup
-    delete[] primfind_dest;
 }
 
 void TriggerPrimitiveFinder::print_latency_hist(const PowerTwoHist<24>& hist, const std::string name) const
@@ -478,14 +876,6 @@ void TriggerPrimitiveFinder::print_latency_hist(const PowerTwoHist<24>& hist, co
 
 }
 
-int TriggerPrimitiveFinder::which_numa_node(void* p) const
-{
-    int get_mempolicy_node = -1;
-    int ret=get_mempolicy(&get_mempolicy_node, NULL, 0, p, MPOL_F_NODE | MPOL_F_ADDR);
-    if(ret==-1) return -1;
-    return get_mempolicy_node;
-}
-
 /* Local Variables:  */
 /* mode: c++         */
 /* c-basic-offset: 4 */
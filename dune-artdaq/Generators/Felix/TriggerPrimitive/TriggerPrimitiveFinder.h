@@ -3,8 +3,13 @@
 
 #include "frame_expand.h"
 #include "process_avx2.h"
+#include "hit_finder.h"
 #include "design_fir.h"
 #include "ProcessingTasks.h"
+#include "PrimitiveStore.h"
+#include "HitBatchQueue.h"
+#include "DegradationPolicy.h"
+#include "TPSetBuilder.h"
 
 #include "dune-artdaq/Generators/Felix/Types.hh"
 #include "dune-raw-data/Overlays/FelixHitFormat.hh"
@@ -15,8 +20,6 @@
 
 #include "ptmp/api.h"
 
-#include <deque>
-#include <mutex>
 
 #include "zmq.h"
 
@@ -30,32 +33,116 @@ namespace artdaq
 class TriggerPrimitiveFinder
 {
 public:
+    // Appended to the CPUHitsFragment after the hits when any of the
+    // messages in the window was processed with degraded hit finding.
+    // flags is the DegradationPolicy::Flags of those messages, or'ed
+    // together, plus MissingRegisters if the hits of some registers of
+    // a message are missing because their worker was lapped
+    struct DegradedTrailer
+    {
+        static constexpr uint32_t MARKER=0x44454752; // "DEGR"
+        static constexpr uint8_t MissingRegisters=1<<7;
+        uint32_t marker;
+        uint32_t flags;
+    };
+
     //TriggerPrimitiveFinder(std::string zmq_hit_send_connection, uint32_t window_offset, int32_t cpu_offset=-1, int item_queue_size=100000);
-    TriggerPrimitiveFinder(fhicl::ParameterSet const & ps);
+    // The processing threads read the messages of the link from `buffer`
+    // in place, starting with the first message written after the
+    // constructor. With "num_workers" > 1, each worker thread finds the
+    // hits on its own range of registers, and a merging thread puts the
+    // hits of each message back together in register order. If the
+    // buffer has expansion enabled (LinkBuffer::enableExpansion), the
+    // expanded ADCs of every message are kept there, so that reordered
+    // fragments can be built without expanding the frames again.
+    // `buffer` has to outlive the TriggerPrimitiveFinder.
+    // With "find_induction_hits", hits are found on all the channels
+    // of the link (process_window_all_avx2) instead of only the
+    // collection channels. The hit finding then has 16 registers per
+    // frame to do instead of 6, so it may need num_workers > 1 to keep up.
+    // When messages pile up in the buffer, each worker takes up to
+    // "max_batch_messages" of them in one hit finding call.
+    // The lowpass filter is set by "fir_num_taps", "fir_cutoff" and
+    // "fir_tap_exponent", and hits are over "hit_threshold" times the
+    // interquartile range of the pedestal. 8, 16 and 32 taps (after
+    // padding to a power of two) have their own unrolled kernels.
+    // The hit finding uses AVX-512BW if the CPU has it, else AVX2, else
+    // the portable version. Set "tp_avx512" or "tp_avx2" false to rule them out
+    // The hits are sent out in TPSets covering "tpset_span_ticks" (50MHz
+    // clock ticks, default the length of "messages_per_tpset" messages),
+    // closed early once they have "tpset_max_hits" hits (0, the default,
+    // for no limit). Sets dropped because the sending thread was behind
+    // are counted in the "TPF TPSets dropped" metric. See TPSetBuilder
+    // The channel map is read from "channel_map_rce" and
+    // "channel_map_felix", which have no default (the maps are
+    // protoDUNETPCChannelMap_*_v4.txt in this directory). Hits on the
+    // offline channels in "channels_to_suppress" are stored, but not sent out
+    // When a worker falls behind, it degrades the hit finding rather
+    // than let messages be overwritten (see DegradationPolicy). Level i
+    // is entered with a backlog of "degrade_backlog_fractions"[i] of the
+    // link buffer capacity (default 0.1, 0.25, 0.5; empty to never
+    // degrade), and left below "degrade_leave_fraction" of that, after
+    // at least "degrade_min_messages" messages. The raised threshold is
+    // "degrade_threshold_factor" times "hit_threshold", and the subset is
+    // the first "degrade_register_fraction" of each worker's registers.
+    // Fragments with hits from degraded messages, or from messages that
+    // lack the hits of a lapped worker, end with a DegradedTrailer
+    // The hits are kept for "tp_retention_ms" (default 2000) in a store
+    // that grows with bursts of hits, up to "max_primitive_bytes"
+    // (default 256MB). Past that the oldest hits are dropped early,
+    // and counted in the "TPF primitives dropped" metric
+    TriggerPrimitiveFinder(fhicl::ParameterSet const & ps, LinkBuffer& buffer);
   
     ~TriggerPrimitiveFinder();
 
-    // Returns true if message was successfully added, false if message queue was full because we're too far behind
-    bool addMessage(SUPERCHUNK_CHAR_STRUCT& ucs);
+    // Sequence number in the link buffer of the next message whose hits
+    // are not in the store yet. Writers must not get more than the buffer capacity
+    // ahead of it if they don't want messages to be skipped
+    uint64_t nextSequence() const { return m_nextSeq.load(std::memory_order_acquire); }
+
+    // Number of messages the writer overwrote before they could be processed
+    size_t messagesSkipped() const { return m_messagesSkipped.load(); }
+
+    // Number of messages merged without the hits of every worker
+    size_t messagesPartial() const { return m_messagesPartial.load(); }
 
     // Find all the hits around `timestamp` and write them into the fragment at fragPtr
     void hitsToFragment(uint64_t timestamp, uint32_t windowSize, artdaq::Fragment* fragPtr);
 
-    std::vector<dune::TriggerPrimitive> getHitsForWindow(uint64_t start_ts, uint64_t end_ts)
-    {
-        return getHitsForWindow(m_triggerPrimitives, start_ts, end_ts);
-    }
+    // The hits from the messages with timestamps in [start_ts, end_ts).
+    // If `flags` is given, it is set to the DegradedTrailer flags of the window
+    std::vector<dune::TriggerPrimitive> getHitsForWindow(uint64_t start_ts, uint64_t end_ts, uint8_t* flags=nullptr);
 
     void stop();
 
-    // Are we ready to receive data? (ie, has the processing thread successfully started up?)
+    // Are we ready to receive data? (ie, have the processing threads successfully started up?)
     bool readyForMessages() const { return m_readyForMessages.load(); }
+
+    // Totals since the finder was created, for benchmarks: the hits
+    // found, and the CPU time of the processing and merging threads
+    // (which they add every thousand or so messages)
+    size_t hitsFound() const { return m_nhitsTotal.load(); }
+    uint64_t cpuNs() const { return m_cpuNsTotal.load(); }
+
+    // The latencies of the messages processed so far, in microseconds
+    const PowerTwoHist<24>& fullLatencyHist() const { return m_full_latency_hist; }
+    const PowerTwoHist<24>& tpfLatencyHist() const { return m_tpf_latency_hist; }
+
+    // The changes of degradation level of all the workers, and the
+    // messages they processed at some level of degradation
+    size_t degradationTransitions() const { return m_degradationTransitionsTotal.load(); }
+    size_t degradedMessages() const { return m_degradedMessages.load(); }
 private:
 
-    void processing_thread(uint8_t first_register, uint8_t last_register, size_t qsize, std::vector<int32_t> cpus_to_pin);
+    // Worker iworker finds the hits on registers [first_register, last_register)
+    void processing_thread(unsigned iworker, uint8_t first_register, uint8_t last_register, std::vector<int32_t> cpus_to_pin);
+
+    // Combine the hits the workers found in each message, when there is more than one worker
+    void merging_thread(std::vector<int32_t> cpus_to_pin);
 
-    std::vector<dune::TriggerPrimitive> getHitsForWindow(const std::deque<dune::TriggerPrimitive>& primitive_queue,
-                                                         uint64_t start_ts, uint64_t end_ts);
+    // Wait for the processing to get to end_ts and find the hits in [start_ts, end_ts).
+    // False if there is nothing to copy. `flags` is set to the flags of the messages in the window
+    bool findHitsForWindow(uint64_t start_ts, uint64_t end_ts, PrimitiveStore::Window& window, uint8_t& flags);
 
     // Update a maximum counter atomically
     // From https://stackoverflow.com/questions/16190078
@@ -67,28 +154,61 @@ private:
             ;
     }
 
+    // Fill m_channelTable and m_suppressedLanes for the link that sent `frame`
+    void build_channel_table(const dune::FelixFrame* frame);
+
+    // Add the hits of one message to the store (and the TPSet). They
+    // come in ninputs lists, one from each worker, in register order.
+    // `flags` are the DegradationPolicy::Flags the message was processed with
     unsigned int addHitsToQueue(uint64_t timestamp,
-                                const uint16_t* input_loc,
-                                std::deque<dune::TriggerPrimitive>& primitive_queue);
+                                const uint16_t* const* inputs,
+                                size_t ninputs,
+                                uint8_t flags);
 
 
-    void measure_latency(const ProcessingTasks::ItemToProcess& item);
+    // backlog is the number of messages in the link buffer waiting behind the one being processed
+    void measure_latency(uint64_t timestamp, uint64_t backlog);
 
     void print_latency_hist(const PowerTwoHist<24>& hist, const std::string name) const;
 
+    void add_cpu_ns(uint64_t ns)
+    {
+        m_cpu_ns_for_metric.fetch_add(ns);
+        m_cpuNsTotal.fetch_add(ns);
+    }
+
     void metrics_thread();
-    // Which numa node is the memory pointed to by `p` allocated on?
-    int which_numa_node(void *p) const;
 
-    // The queue of trigger primitives found, and a mutex to protect it
-    std::deque<dune::TriggerPrimitive> m_triggerPrimitives;
-    std::mutex m_triggerPrimitiveMutex;
+    // The trigger primitives found, kept for m_retentionMs (the "tp_retention_ms" parameter)
+    size_t m_retentionMs;
+    PrimitiveStore m_triggerPrimitives;
 
-    std::atomic<uint64_t> m_latestProcessedTimestamp;
-    std::thread m_processingThread;
+    std::vector<std::thread> m_processingThreads;
+    std::thread m_mergingThread;
     std::thread m_metricsThread;
     std::atomic<bool> m_readyForMessages;
-    std::unique_ptr<folly::ProducerConsumerQueue<ProcessingTasks::ItemToProcess>> m_itemsToProcess;
+    std::atomic<unsigned> m_workersReady;
+    LinkBuffer& m_buffer; // The link's messages, read in place
+    const uint64_t m_firstSeq; // Where all the workers start reading
+    std::atomic<uint64_t> m_nextSeq;
+    const bool m_findInductionHits;
+    const unsigned m_registersPerFrame; // The registers processed per frame: REGISTERS_PER_FRAME, or ALL_REGISTERS_PER_FRAME with m_findInductionHits
+    unsigned m_numWorkers;
+    const unsigned m_maxBatchMessages; // Most messages processed in one hit finding call, when we're behind
+    // The hit finding parameters, shared by all the workers
+    const uint8_t m_tapExponent; // The filter taps add up to 2**m_tapExponent
+    const std::vector<int16_t> m_taps;
+    const int16_t m_hitThreshold;
+    const HitFinder m_findHits; // The fastest kernel the CPU has, unless "tp_avx512" or "tp_avx2" are false
+    // The degradation parameters, as in the constructor comment
+    const std::vector<uint64_t> m_degradeBacklog; // Messages
+    const double m_degradeLeaveFraction;
+    const uint64_t m_degradeMinMessages;
+    const int16_t m_degradedThreshold;
+    const double m_degradeRegisterFraction;
+    std::vector<std::unique_ptr<HitBatchQueue>> m_workerHits; // From each worker to the merging thread
+    std::atomic<size_t> m_messagesSkipped;
+    std::atomic<size_t> m_messagesPartial;
     // The electronics co-ordinates of the link we're getting data
     // from. We assume that this class will only deal with data from
     // one link
@@ -96,20 +216,41 @@ private:
     uint8_t m_slot_no;
     uint8_t m_crate_no;
     std::unique_ptr<ptmp::TPSender> m_TPSender;
-    std::unique_ptr<ptmp::data::TPSet> m_current_tpset;
     bool m_send_ptmp_msgs;
     unsigned int m_msgs_per_tpset;
+    std::unique_ptr<TPSetBuilder> m_tpsetBuilder; // Sends through m_TPSender, so has to go first
     std::atomic<bool> m_should_stop;
     uint32_t m_windowOffset;
     std::vector<uint32_t> m_channels_to_suppress; // Channels for which hits shouldn't be sent out (eg because they're bad in some way)
-    uint32_t m_offline_channel_base;
-    size_t m_n_tpsets_sent;
+    std::unique_ptr<PdspChannelMapService> m_channelMap;
+    // The channels of each index in the hit finding output: the
+    // collection channels, or all of them with m_findInductionHits.
+    // Filled in from the first message by worker 0
+    struct ChannelInfo
+    {
+        uint16_t online;
+        uint32_t offline;
+    };
+    std::vector<ChannelInfo> m_channelTable;
+    std::vector<uint16_t> m_suppressedLanes; // For each register, a bit for each lane whose channel is in m_channels_to_suppress
     PowerTwoHist<24> m_full_latency_hist; // Latencies calculated from time processed - data timestamp
-    PowerTwoHist<24> m_tpf_latency_hist;  // Latencies calculated from time processed - time queued
+    PowerTwoHist<24> m_tpf_latency_hist;  // Latencies estimated from the backlog in the link buffer
+    // The state of measure_latency(), which is only called from one thread
+    bool m_latencyWasBehind;
+    uint64_t m_enteredLateUs;
+    int64_t m_lastPrintedLatency;
+    size_t m_nLatencyPrinted;
+    std::atomic<size_t> m_nhitsTotal;
+    std::atomic<uint64_t> m_cpuNsTotal;
+    std::unique_ptr<std::atomic<unsigned>[]> m_degradationLevels; // The current level of each worker
+    std::atomic<size_t> m_degradationTransitionsTotal;
+    std::atomic<size_t> m_degradedMessages;
 
     // Variables for metrics
     std::atomic<size_t> m_nhits_for_metric;
     std::atomic<size_t> m_adcsum_for_metric;
+    std::atomic<uint64_t> m_cpu_ns_for_metric; // CPU time used by the processing and merging threads
+    std::atomic<size_t> m_degradation_transitions_for_metric;
     size_t m_metric_reporting_interval_seconds;
 };
 
@@ -1,9 +1,11 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+#include <cstdint>
 #include <limits>
 
 const unsigned short MAGIC = std::numeric_limits<unsigned short>::max();
-const int16_t threshold=2000;
+// The default hit threshold, in units of the interquartile range of the pedestal
+const int16_t default_threshold=5;
 
 #endif
@@ -2,7 +2,7 @@
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 8-bit values
-void print256(__m256i var)
+TARGET_AVX2 void print256(__m256i var)
 {
     uint8_t *val = (uint8_t*) &var;
     for(int i=0; i<32; ++i) printf("%02x ", val[i]);
@@ -10,7 +10,7 @@ void print256(__m256i var)
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 8-bit values, in reverse order
-void printr256(__m256i var)
+TARGET_AVX2 void printr256(__m256i var)
 {
     uint8_t *val = (uint8_t*) &var;
     for(int i=31; i>=0; --i) printf("%02x ", val[i]);
@@ -18,7 +18,7 @@ void printr256(__m256i var)
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 16-bit values
-void print256_as16(__m256i var)
+TARGET_AVX2 void print256_as16(__m256i var)
 {
     uint16_t *val = (uint16_t*) &var;
     for(int i=0; i<16; ++i) printf("%04x ", val[i]);
@@ -26,7 +26,7 @@ void print256_as16(__m256i var)
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 16-bit values
-void print256_as16_dec(__m256i var)
+TARGET_AVX2 void print256_as16_dec(__m256i var)
 {
     int16_t *val = (int16_t*) &var;
     for(int i=0; i<16; ++i) printf("%+6d ", val[i]);
@@ -36,7 +36,7 @@ void print256_as16_dec(__m256i var)
 // Abortive attempt at expanding just the collection channels, instead
 // of expanding all channels and then picking out just the collection
 // ones.
-RegisterArray<2> expand_segment_collection(const dune::ColdataBlock& __restrict__ block)
+TARGET_AVX2 RegisterArray<2> expand_segment_collection(const dune::ColdataBlock& __restrict__ block)
 {
     const __m256i* __restrict__ coldata_start=reinterpret_cast<const __m256i*>(&block.segments[0]);
     __m256i raw0=_mm256_lddqu_si256(coldata_start+0);
@@ -126,7 +126,7 @@ RegisterArray<2> expand_segment_collection(const dune::ColdataBlock& __restrict_
 // format and rearrange them into 16-bit values in channel order. A
 // 256-bit register holds 21-and-a-bit 12-bit values: we expand 16 of
 // them into 16-bit values
-__m256i expand_two_segments(const dune::ColdataSegment* __restrict__ first_segment)
+TARGET_AVX2 __m256i expand_two_segments(const dune::ColdataSegment* __restrict__ first_segment)
 {
     const __m256i* __restrict__ segments_start=reinterpret_cast<const __m256i*>(first_segment);
     __m256i raw=_mm256_lddqu_si256(segments_start);
@@ -191,13 +191,21 @@ __m256i expand_two_segments(const dune::ColdataSegment* __restrict__ first_segme
 // channels in a dune::ColdataBlock, so we shuffle valid values into the
 // 0-11 entries of the register, and leave 4 invalid values at the end of each
 // register
-RegisterArray<2> get_block_collection_adcs(const dune::ColdataBlock& __restrict__ block)
+TARGET_AVX2 RegisterArray<2> get_block_collection_adcs(const dune::ColdataBlock& __restrict__ block)
 {
     // First expand all of the channels into `expanded_all`
     __m256i expanded_all[4];
     for(int j=0; j<4; ++j){
         expanded_all[j]=expand_two_segments(&block.segments[2*j]);
     }
+    return select_block_collection_adcs(expanded_all);
+}
+
+//==============================================================================
+// The blend and shuffle part of get_block_collection_adcs(), for a
+// block whose 4 registers are already expanded
+TARGET_AVX2 RegisterArray<2> select_block_collection_adcs(const __m256i* __restrict__ expanded_all)
+{
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Woverflow"
     // Now select just the collection channels, using a blend
@@ -226,7 +234,7 @@ RegisterArray<2> get_block_collection_adcs(const dune::ColdataBlock& __restrict_
 }
 
 //==============================================================================
-RegisterArray<4> get_block_all_adcs(const dune::ColdataBlock& __restrict__ block)
+TARGET_AVX2 RegisterArray<4> get_block_all_adcs(const dune::ColdataBlock& __restrict__ block)
 {
     RegisterArray<4> expanded_all;
     for(int j=0; j<4; ++j){
@@ -237,7 +245,7 @@ RegisterArray<4> get_block_all_adcs(const dune::ColdataBlock& __restrict__ block
 
 //==============================================================================
 //
-RegisterArray<REGISTERS_PER_FRAME> get_frame_collection_adcs(const dune::FelixFrame* __restrict__ frame)
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME> get_frame_collection_adcs(const dune::FelixFrame* __restrict__ frame)
 {
     // Each coldata block has 24 collection channels, so we have to
     // put it in two registers, using 12 of the 16 slots in each
@@ -247,7 +255,26 @@ RegisterArray<REGISTERS_PER_FRAME> get_frame_collection_adcs(const dune::FelixFr
         adcs_tmp.set_ymm(2*i, block_adcs.ymm(0));
         adcs_tmp.set_ymm(2*i+1, block_adcs.ymm(1));
     }
+    return pack_frame_collection_adcs(adcs_tmp);
+}
+
+//==============================================================================
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME> select_frame_collection_adcs(const __m256i* __restrict__ all_adcs)
+{
+    RegisterArray<8> adcs_tmp;
+    for(int i=0; i<4; ++i){
+        RegisterArray<2> block_adcs=select_block_collection_adcs(all_adcs+4*i);
+        adcs_tmp.set_ymm(2*i, block_adcs.ymm(0));
+        adcs_tmp.set_ymm(2*i+1, block_adcs.ymm(1));
+    }
+    return pack_frame_collection_adcs(adcs_tmp);
+}
 
+//==============================================================================
+// Move the 96 collection values in 8 registers (12 per register) from
+// select_block_collection_adcs() into 6 registers
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME> pack_frame_collection_adcs(RegisterArray<8>& adcs_tmp)
+{
     // Now adcs_tmp contains 96 values in 8 registers, but we can fit
     // those values in 6 registers, so do that. This way, the
     // downstream processing code has less to do.
@@ -291,7 +318,7 @@ RegisterArray<REGISTERS_PER_FRAME> get_frame_collection_adcs(const dune::FelixFr
 }
 
 //==============================================================================
-RegisterArray<16> get_frame_all_adcs(const dune::FelixFrame* __restrict__ frame)
+TARGET_AVX2 RegisterArray<16> get_frame_all_adcs(const dune::FelixFrame* __restrict__ frame)
 {
     RegisterArray<16> adcs;
     for(int i=0; i<4; ++i){
@@ -352,8 +379,32 @@ int collection_index_to_channel(int index)
     else                     return index_to_chan[index];
 }
 
+//==============================================================================
+int all_index_to_channel(int index)
+{
+    if(index<0 || index>=int(ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER)) return -1;
+    // expand_two_segments() puts the 8 channels of the first segment
+    // of each pair, 4 at a time, in the even-numbered quarters of the
+    // register, and those of the second segment in the odd-numbered
+    // ones. Segments have 8 channels and blocks have 64
+    const int reg=index/SAMPLES_PER_REGISTER;
+    const int lane=index%SAMPLES_PER_REGISTER;
+    return (reg/4)*64 + ((reg%4)*2 + (lane%8)/4)*8 + (lane/8)*4 + lane%4;
+}
+
+//==============================================================================
+bool all_index_is_collection(int index)
+{
+    const int chan=all_index_to_channel(index);
+    if(chan<0) return false;
+    for(int i=0; i<96; ++i){
+        if(index_to_chan[i]==chan) return true;
+    }
+    return false;
+}
+
 //======================================================================
-RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs)
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs_avx2(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs)
 {
     RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> adcs;
     for(size_t iframe=0; iframe<FRAMES_PER_MSG; ++iframe){
@@ -374,3 +425,143 @@ RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs(const SUPE
     }
     return adcs;
 }
+
+//======================================================================
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_all_adcs_avx2(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs, MessageAllADCs& __restrict__ all_adcs)
+{
+    __m256i* out=reinterpret_cast<__m256i*>(all_adcs.fragments);
+    RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> adcs;
+    for(size_t iframe=0; iframe<FRAMES_PER_MSG; ++iframe){
+        const dune::FelixFrame* frame=reinterpret_cast<const dune::FelixFrame*>(&ucs) + iframe;
+        __m256i frame_adcs[ALL_REGISTERS_PER_FRAME];
+        for(size_t iblock=0; iblock<4; ++iblock){
+            const dune::ColdataBlock& block=frame->block(iblock);
+            for(size_t j=0; j<4; ++j){
+                frame_adcs[4*iblock+j]=expand_two_segments(&block.segments[2*j]);
+            }
+        }
+        // Same arrangement as expand_message_adcs_avx2(), for both outputs:
+        // (register 0, time 0) ... (register 0, time 11) (register 1, time 0) ...
+        for(size_t ireg=0; ireg<ALL_REGISTERS_PER_FRAME; ++ireg){
+            _mm256_store_si256(out+ireg*FRAMES_PER_MSG+iframe, frame_adcs[ireg]);
+        }
+        RegisterArray<REGISTERS_PER_FRAME> collection_adcs=select_frame_collection_adcs(frame_adcs);
+        for(size_t iblock=0; iblock<REGISTERS_PER_FRAME; ++iblock){
+            adcs.set_ymm(iframe+iblock*FRAMES_PER_MSG, collection_adcs.ymm(iblock));
+        }
+    }
+    return adcs;
+}
+
+//======================================================================
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> collection_adcs_from_all_avx2(const MessageAllADCs& __restrict__ all_adcs)
+{
+    const __m256i* in=reinterpret_cast<const __m256i*>(all_adcs.fragments);
+    RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> adcs;
+    for(size_t iframe=0; iframe<FRAMES_PER_MSG; ++iframe){
+        __m256i frame_adcs[ALL_REGISTERS_PER_FRAME];
+        for(size_t ireg=0; ireg<ALL_REGISTERS_PER_FRAME; ++ireg){
+            frame_adcs[ireg]=_mm256_load_si256(in+ireg*FRAMES_PER_MSG+iframe);
+        }
+        RegisterArray<REGISTERS_PER_FRAME> collection_adcs=select_frame_collection_adcs(frame_adcs);
+        for(size_t iblock=0; iblock<REGISTERS_PER_FRAME; ++iblock){
+            adcs.set_ymm(iframe+iblock*FRAMES_PER_MSG, collection_adcs.ymm(iblock));
+        }
+    }
+    return adcs;
+}
+
+//======================================================================
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs_scalar(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs)
+{
+    RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> adcs;
+    for(size_t iframe=0; iframe<FRAMES_PER_MSG; ++iframe){
+        const dune::FelixFrame* frame=reinterpret_cast<const dune::FelixFrame*>(&ucs) + iframe;
+        for(size_t ireg=0; ireg<REGISTERS_PER_FRAME; ++ireg){
+            for(size_t j=0; j<SAMPLES_PER_REGISTER; ++j){
+                adcs.set_uint16(iframe+ireg*FRAMES_PER_MSG, j, frame->channel(index_to_chan[ireg*SAMPLES_PER_REGISTER+j]));
+            }
+        }
+    }
+    return adcs;
+}
+
+//======================================================================
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_all_adcs_scalar(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs, MessageAllADCs& __restrict__ all_adcs)
+{
+    uint16_t* out=reinterpret_cast<uint16_t*>(all_adcs.fragments);
+    for(size_t iframe=0; iframe<FRAMES_PER_MSG; ++iframe){
+        const dune::FelixFrame* frame=reinterpret_cast<const dune::FelixFrame*>(&ucs) + iframe;
+        for(size_t ireg=0; ireg<ALL_REGISTERS_PER_FRAME; ++ireg){
+            for(size_t j=0; j<SAMPLES_PER_REGISTER; ++j){
+                out[(ireg*FRAMES_PER_MSG+iframe)*SAMPLES_PER_REGISTER+j]=frame->channel(all_index_to_channel(ireg*SAMPLES_PER_REGISTER+j));
+            }
+        }
+    }
+    return collection_adcs_from_all_scalar(all_adcs);
+}
+
+//======================================================================
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> collection_adcs_from_all_scalar(const MessageAllADCs& __restrict__ all_adcs)
+{
+    // The index in get_frame_all_adcs() of each collection channel
+    struct CollectionToAll
+    {
+        CollectionToAll()
+        {
+            for(int i=0; i<int(ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER); ++i){
+                for(int j=0; j<96; ++j){
+                    if(index_to_chan[j]==all_index_to_channel(i)) index[j]=i;
+                }
+            }
+        }
+        int index[96];
+    };
+    static const CollectionToAll collection_to_all;
+
+    const uint16_t* in=reinterpret_cast<const uint16_t*>(all_adcs.fragments);
+    RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> adcs;
+    for(size_t iframe=0; iframe<FRAMES_PER_MSG; ++iframe){
+        for(size_t ireg=0; ireg<REGISTERS_PER_FRAME; ++ireg){
+            for(size_t j=0; j<SAMPLES_PER_REGISTER; ++j){
+                const int iall=collection_to_all.index[ireg*SAMPLES_PER_REGISTER+j];
+                const size_t all_reg=iall/SAMPLES_PER_REGISTER;
+                adcs.set_uint16(iframe+ireg*FRAMES_PER_MSG, j, in[(all_reg*FRAMES_PER_MSG+iframe)*SAMPLES_PER_REGISTER+iall%SAMPLES_PER_REGISTER]);
+            }
+        }
+    }
+    return adcs;
+}
+
+//======================================================================
+bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+namespace {
+    bool use_avx2()
+    {
+        static const bool avx2=cpu_has_avx2();
+        return avx2;
+    }
+}
+
+//======================================================================
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs)
+{
+    return use_avx2() ? expand_message_adcs_avx2(ucs) : expand_message_adcs_scalar(ucs);
+}
+
+//======================================================================
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_all_adcs(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs, MessageAllADCs& __restrict__ all_adcs)
+{
+    return use_avx2() ? expand_message_all_adcs_avx2(ucs, all_adcs) : expand_message_all_adcs_scalar(ucs, all_adcs);
+}
+
+//======================================================================
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> collection_adcs_from_all(const MessageAllADCs& __restrict__ all_adcs)
+{
+    return use_avx2() ? collection_adcs_from_all_avx2(all_adcs) : collection_adcs_from_all_scalar(all_adcs);
+}
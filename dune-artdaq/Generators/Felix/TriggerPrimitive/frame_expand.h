@@ -6,6 +6,11 @@
 
 #include "immintrin.h"
 
+// The AVX2 code is compiled for AVX2 whatever the build flags say, and
+// only runs when the CPU has it: see cpu_has_avx2(). Same as in
+// FelixReorder.cc
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
 struct WindowCollectionADCs {
     WindowCollectionADCs(size_t numMessages_, MessageCollectionADCs* fragments_)
         : numMessages(numMessages_),
@@ -48,8 +53,8 @@ class RegisterArray
 {
 public:
     // Get the value at the ith position as a 256-bit register
-    __m256i ymm(size_t i) { return _mm256_lddqu_si256(reinterpret_cast<__m256i*>(m_array)+i); }
-    void set_ymm(size_t i, __m256i val) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(m_array)+i, val); }
+    TARGET_AVX2 __m256i ymm(size_t i) { return _mm256_lddqu_si256(reinterpret_cast<__m256i*>(m_array)+i); }
+    TARGET_AVX2 void set_ymm(size_t i, __m256i val) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(m_array)+i, val); }
 
     uint16_t uint16(size_t i) { return m_array[i]; }
     void set_uint16(size_t i, uint16_t val) { m_array[i]=val; }
@@ -66,28 +71,28 @@ private:
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 8-bit values
-void print256(__m256i var);
+TARGET_AVX2 void print256(__m256i var);
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 16-bit values
-void print256_as16(__m256i var);
+TARGET_AVX2 void print256_as16(__m256i var);
 
 //==============================================================================
 // Print a 256-bit register interpreting it as packed 16-bit values
-void print256_as16_dec(__m256i var);
+TARGET_AVX2 void print256_as16_dec(__m256i var);
 
 //==============================================================================
 // Abortive attempt at expanding just the collection channels, instead
 // of expanding all channels and then picking out just the collection
 // ones. 
-RegisterArray<2> expand_segment_collection(const dune::ColdataBlock& block);
+TARGET_AVX2 RegisterArray<2> expand_segment_collection(const dune::ColdataBlock& block);
 
 //==============================================================================
 // Take the raw memory containing 12-bit ADCs in the shuffled WIB
 // format and rearrange them into 16-bit values in channel order. A
 // 256-bit register holds 21-and-a-bit 12-bit values: we expand 16 of
 // them into 16-bit values
-inline __m256i expand_two_segments(const dune::ColdataSegment* __restrict__ first_segment);
+TARGET_AVX2 __m256i expand_two_segments(const dune::ColdataSegment* __restrict__ first_segment);
 
 //==============================================================================
 
@@ -98,19 +103,34 @@ inline __m256i expand_two_segments(const dune::ColdataSegment* __restrict__ firs
 // channels in a dune::ColdataBlock, so we shuffle valid values into the
 // 0-11 entries of the register, and leave 4 invalid values at the end of each
 // register
-inline RegisterArray<2> get_block_collection_adcs(const dune::ColdataBlock& __restrict__ block);
+TARGET_AVX2 RegisterArray<2> get_block_collection_adcs(const dune::ColdataBlock& __restrict__ block);
+
+//==============================================================================
+// The collection channels of a block whose 4 registers were already
+// expanded with expand_two_segments(), as in get_block_collection_adcs()
+TARGET_AVX2 RegisterArray<2> select_block_collection_adcs(const __m256i* __restrict__ expanded_all);
 
 //==============================================================================
 // As above, for all collection and induction ADCs
-RegisterArray<4> get_block_all_adcs(const dune::ColdataBlock& __restrict__ block);
+TARGET_AVX2 RegisterArray<4> get_block_all_adcs(const dune::ColdataBlock& __restrict__ block);
 
 //==============================================================================
 // Expand all the collection channels into 6 AVX2 registers
-RegisterArray<REGISTERS_PER_FRAME> get_frame_collection_adcs(const dune::FelixFrame* __restrict__ frame);
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME> get_frame_collection_adcs(const dune::FelixFrame* __restrict__ frame);
 
 //==============================================================================
 // As above, for all collection and induction ADCs
-RegisterArray<16> get_frame_all_adcs(const dune::FelixFrame* __restrict__ frame);
+TARGET_AVX2 RegisterArray<16> get_frame_all_adcs(const dune::FelixFrame* __restrict__ frame);
+
+//==============================================================================
+// The collection channels of a frame from its 16 registers as given by
+// get_frame_all_adcs(). Same result as get_frame_collection_adcs()
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME> select_frame_collection_adcs(const __m256i* __restrict__ all_adcs);
+
+//==============================================================================
+// Pack the 8 registers of 12 collection values from
+// select_block_collection_adcs() into 6 full registers
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME> pack_frame_collection_adcs(RegisterArray<8>& adcs_tmp);
 
 //==============================================================================
 int collection_index_to_offline(int index);
@@ -118,9 +138,51 @@ int collection_index_to_offline(int index);
 //==============================================================================
 int collection_index_to_channel(int index);
 
+//==============================================================================
+// The online channel number, within the (crate,fiber,slot), of each
+// item in the RegisterArray<16> returned by get_frame_all_adcs()
+int all_index_to_channel(int index);
+
+//==============================================================================
+// Is item `index` of get_frame_all_adcs() a collection channel?
+bool all_index_is_collection(int index);
+
 //======================================================================
+// Does the CPU have AVX2? The functions above, and the _avx2 versions
+// below, may only be called if so
+bool cpu_has_avx2();
+
+//======================================================================
+// The message expansions: these pick the AVX2 or the scalar version
+// below, whichever the CPU can run. Both give the same output
 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs);
 
+//======================================================================
+// Expand all the channels of a message into `all_adcs`, in the layout
+// of MessageAllADCs, and return the collection channels as
+// expand_message_adcs() does. This is the one expansion of a message
+// when both TP finding and reordered fragments need it (see
+// LinkBuffer::expandSlot)
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_all_adcs(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs, MessageAllADCs& __restrict__ all_adcs);
+
+//======================================================================
+// The collection channels of a message expanded by
+// expand_message_all_adcs(), without expanding it again. Same result
+// as expand_message_adcs() on the raw message
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> collection_adcs_from_all(const MessageAllADCs& __restrict__ all_adcs);
+
+//======================================================================
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs_avx2(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs);
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_all_adcs_avx2(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs, MessageAllADCs& __restrict__ all_adcs);
+TARGET_AVX2 RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> collection_adcs_from_all_avx2(const MessageAllADCs& __restrict__ all_adcs);
+
+//======================================================================
+// One channel at a time, with dune::FelixFrame::channel() and the
+// maps collection_index_to_channel() and all_index_to_channel()
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_adcs_scalar(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs);
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expand_message_all_adcs_scalar(const SUPERCHUNK_CHAR_STRUCT& __restrict__ ucs, MessageAllADCs& __restrict__ all_adcs);
+RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> collection_adcs_from_all_scalar(const MessageAllADCs& __restrict__ all_adcs);
+
 #endif // include guard
 
 /* Local Variables:  */
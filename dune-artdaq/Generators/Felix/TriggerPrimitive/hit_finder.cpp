@@ -0,0 +1,27 @@
+#include "hit_finder.h"
+#include "process_avx2.h"
+#include "process_avx512.h"
+#include "process_scalar.h"
+
+//======================================================================
+HitFinder
+select_hit_finder(bool all_channels, bool allow_avx512, bool allow_avx2)
+{
+    if(allow_avx512 && cpu_has_avx512bw()) return all_channels ? process_window_all_avx512 : process_window_avx512;
+    if(allow_avx2 && cpu_has_avx2())       return all_channels ? process_window_all_avx2   : process_window_avx2;
+    return all_channels ? process_window_all_scalar : process_window_scalar;
+}
+
+//======================================================================
+const char*
+hit_finder_name(HitFinder finder)
+{
+    if(finder==process_window_avx512 || finder==process_window_all_avx512) return "avx512";
+    if(finder==process_window_avx2 || finder==process_window_all_avx2)     return "avx2";
+    return "scalar";
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,26 @@
+#ifndef HIT_FINDER_H
+#define HIT_FINDER_H
+
+#include "ProcessingInfo.h"
+
+// The hit finding kernels all take a ProcessingInfo and write the
+// same output, in the format of process_window_avx2()
+typedef void (*HitFinder)(ProcessingInfo&);
+
+// The fastest kernel that the CPU runs, for all the channels or only
+// the collection channels: AVX-512BW, then AVX2, then the portable one.
+// allow_avx512 and allow_avx2 rule those out, eg on hosts where
+// AVX-512 would lower the clock of the other cores
+HitFinder
+select_hit_finder(bool all_channels, bool allow_avx512=true, bool allow_avx2=true);
+
+// "avx512", "avx2" or "scalar"
+const char*
+hit_finder_name(HitFinder finder);
+
+#endif
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -1,10 +1,12 @@
 #include "process_avx2.h"
 
+#include <cstring>
+
 namespace{
-inline void frugal_accum_update_avx2(__m256i&  __restrict__  median, const __m256i s, __m256i&  __restrict__  accum, const int16_t acclimit,
+TARGET_AVX2 inline void frugal_accum_update_avx2(__m256i&  __restrict__  median, const __m256i s, __m256i&  __restrict__  accum, const int16_t acclimit,
                               const __m256i mask) __attribute__((always_inline));
 
-inline void frugal_accum_update_avx2(__m256i&  __restrict__  median, const __m256i s, __m256i&  __restrict__  accum, const int16_t acclimit,
+TARGET_AVX2 inline void frugal_accum_update_avx2(__m256i&  __restrict__  median, const __m256i s, __m256i&  __restrict__  accum, const int16_t acclimit,
                               const __m256i mask)
 {
     // if the sample is greater than the median, add one to the accumulator
@@ -50,22 +52,36 @@ inline void frugal_accum_update_avx2(__m256i&  __restrict__  median, const __m25
     need_reset = _mm256_and_si256(need_reset, mask);
     accum = _mm256_blendv_epi8(accum, _mm256_setzero_si256(), need_reset);
 }
-}
-void
-process_window_avx2(ProcessingInfo& info)
+
+// The hit finding for process_window_avx2() (ALL_CHANNELS=false),
+// reading MessageCollectionADCs, and for process_window_all_avx2()
+// (ALL_CHANNELS=true), reading MessageAllADCs. The only difference
+// in the processing is that the induction channels get a threshold
+// on the magnitude of the filtered signal, since it is bipolar.
+// FIXED_NTAPS is the number of filter taps when it's one of the
+// common lengths, so that the filter loop unrolls, or 0 to take
+// info.ntaps at run time
+template<bool ALL_CHANNELS, size_t FIXED_NTAPS>
+TARGET_AVX2 void
+process_window_impl(ProcessingInfo& info, const __m256i* __restrict__ input)
 {
+    // How many registers there are for each time in the input
+    constexpr size_t NREGISTERS=ALL_CHANNELS ? ALL_REGISTERS_PER_FRAME : REGISTERS_PER_FRAME;
+
     // Start with taps as floats that add to 1. Multiply by some
     // power of two (2**N) and round to int. Before filtering, cap the
     // value of the input to INT16_MAX/(2**N)
-    const size_t NTAPS=8;
-    // int16_t taps[NTAPS]={0};
-    //for(size_t i=0; i<std::min(NTAPS, info.tapsv.size()); ++i) taps[i]=info.tapsv[i];
+    const size_t NTAPS=FIXED_NTAPS ? FIXED_NTAPS : info.ntaps;
+    constexpr size_t TAPS_SIZE=FIXED_NTAPS ? FIXED_NTAPS : ChanState::MAX_NTAPS;
 
     const __m256i adcMax=_mm256_set1_epi16(info.adcMax);
     // The maximum value that sigma can have before the threshold overflows a 16-bit signed integer
-    const __m256i sigmaMax=_mm256_set1_epi16((1<<15)/(info.multiplier*5));
+    const __m256i sigmaMax=_mm256_set1_epi16((1<<15)/(info.multiplier*info.threshold));
+    const bool update_pedestals=info.update_pedestals;
+    // The threshold is sigma times this
+    const __m256i thresholdScale=_mm256_set1_epi16(info.multiplier*info.threshold);
 
-    __m256i tap_256[NTAPS];
+    __m256i tap_256[TAPS_SIZE];
     for(size_t i=0; i<NTAPS; ++i){
         tap_256[i]= _mm256_set1_epi16(info.taps[i]);
     }
@@ -103,8 +119,8 @@ process_window_avx2(ProcessingInfo& info)
         // Variables for filtering
 
         // The (unfiltered) samples `n` places before the current one
-        __m256i prev_samp[NTAPS];
-        for(size_t j=0; j<NTAPS; ++j) prev_samp[j]=_mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_samp)+NTAPS*ireg+j);
+        __m256i prev_samp[TAPS_SIZE];
+        for(size_t j=0; j<NTAPS; ++j) prev_samp[j]=_mm256_lddqu_si256(reinterpret_cast<__m256i*>(state.prev_samp)+ChanState::MAX_NTAPS*ireg+j);
 
         // ------------------------------------
         // Variables for hit finding
@@ -120,11 +136,16 @@ process_window_avx2(ProcessingInfo& info)
         __m256i channel_base=_mm256_set1_epi16(ireg*SAMPLES_PER_REGISTER);
         __m256i channels=_mm256_add_epi16(channel_base, iota);
 
+        // Which lanes take the collection (unipolar) threshold
+        const __m256i is_collection=ALL_CHANNELS ?
+            _mm256_load_si256(reinterpret_cast<const __m256i*>(collection_lane_mask())+ireg) :
+            _mm256_set1_epi16(-1);
+
         for(size_t itime=0; itime<info.timeWindowNumFrames; ++itime){
             const size_t msg_index=itime/12;
             const size_t msg_time_offset=itime%12;
-            const size_t index=msg_index*REGISTERS_PER_FRAME*FRAMES_PER_MSG + FRAMES_PER_MSG*ireg + msg_time_offset;
-            const __m256i* rawp=reinterpret_cast<const __m256i*>(info.input)+index;
+            const size_t index=msg_index*NREGISTERS*FRAMES_PER_MSG + FRAMES_PER_MSG*ireg + msg_time_offset;
+            const __m256i* rawp=input+index;
 
             // The current sample
             __m256i s=_mm256_lddqu_si256(rawp);
@@ -141,22 +162,25 @@ process_window_avx2(ProcessingInfo& info)
 #pragma GCC diagnostic ignored "-Woverflow"
             __m256i is_lt=_mm256_xor_si256(gt_or_eq, _mm256_set1_epi16(0xffff));
 #pragma GCC diagnostic pop
-            // Update the 25th percentile in the channels that are below the median
-            frugal_accum_update_avx2(quantile25, s, accum25, 10, is_lt);
-            // Update the 75th percentile in the channels that are above the median
-            frugal_accum_update_avx2(quantile75, s, accum75, 10, is_gt);
-            // Update the median itself in all channels
+            // The pedestals stay as they are while the finder is behind (see ProcessingInfo::update_pedestals)
+            if(update_pedestals){
+                // Update the 25th percentile in the channels that are below the median
+                frugal_accum_update_avx2(quantile25, s, accum25, 10, is_lt);
+                // Update the 75th percentile in the channels that are above the median
+                frugal_accum_update_avx2(quantile75, s, accum75, 10, is_gt);
+                // Update the median itself in all channels
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Woverflow"
-            frugal_accum_update_avx2(median,     s, accum,   10, _mm256_set1_epi16(0xffff));
+                frugal_accum_update_avx2(median,     s, accum,   10, _mm256_set1_epi16(0xffff));
 #pragma GCC diagnostic pop
+            }
             // Actually subtract the pedestal
             s = _mm256_sub_epi16(s, median);
 
             // Find the interquartile range
             __m256i sigma = _mm256_sub_epi16(quantile75, quantile25);
             // Clamp sigma to a range where it won't overflow when
-            // multiplied by info.multiplier*5
+            // multiplied by info.multiplier*info.threshold
             sigma=_mm256_min_epi16(sigma, sigmaMax);
 
             // __m256i sigma = _mm256_set1_epi16(2000); // 20 ADC
@@ -178,31 +202,22 @@ process_window_avx2(ProcessingInfo& info)
             // approach might be to make the filter coeffs so large
             // that we _always_ overflow, and use `mulhi` instead
 
-            // Try pipelining this with multiple accumulators, but it doesn't really make any difference
+            // Four accumulators, to pipeline the additions
             //
             // TODO: Do the multiplication then right-shift before
             // adding the items together, to try to save us from
             // overflow
-            __m256i filt0 = _mm256_setzero_si256();
-            __m256i filt1 = _mm256_setzero_si256();
-            __m256i filt2 = _mm256_setzero_si256();
-            __m256i filt3 = _mm256_setzero_si256();
-
-            // % would be slow, but we're making sure that NTAPS is a power of two so the optimizer ought to save us
-#define ADDTAP0(x) filt0 = _mm256_add_epi16(filt0, _mm256_mullo_epi16(tap_256[x], prev_samp[(x+absTimeModNTAPS)%NTAPS]));
-#define ADDTAP1(x) filt1 = _mm256_add_epi16(filt1, _mm256_mullo_epi16(tap_256[x], prev_samp[(x+absTimeModNTAPS)%NTAPS]));
-#define ADDTAP2(x) filt2 = _mm256_add_epi16(filt2, _mm256_mullo_epi16(tap_256[x], prev_samp[(x+absTimeModNTAPS)%NTAPS]));
-#define ADDTAP3(x) filt3 = _mm256_add_epi16(filt3, _mm256_mullo_epi16(tap_256[x], prev_samp[(x+absTimeModNTAPS)%NTAPS]));
-
-            ADDTAP0(0);
-            ADDTAP1(1);
-            ADDTAP2(2);
-            ADDTAP3(3);
-            ADDTAP0(4);
-            ADDTAP1(5);
-            ADDTAP2(6);
-
-            __m256i filt = _mm256_add_epi16(_mm256_add_epi16(filt0, filt1), _mm256_add_epi16(filt2, filt3));
+            __m256i filt_part[4]={_mm256_setzero_si256(), _mm256_setzero_si256(),
+                                  _mm256_setzero_si256(), _mm256_setzero_si256()};
+
+            // NTAPS is a power of two, so the % is cheap, and with
+            // FIXED_NTAPS the loop unrolls into registers
+#pragma GCC unroll 32
+            for(size_t j=0; j<NTAPS; ++j){
+                filt_part[j%4]=_mm256_add_epi16(filt_part[j%4], _mm256_mullo_epi16(tap_256[j], prev_samp[(j+absTimeModNTAPS)%NTAPS]));
+            }
+
+            __m256i filt = _mm256_add_epi16(_mm256_add_epi16(filt_part[0], filt_part[1]), _mm256_add_epi16(filt_part[2], filt_part[3]));
             prev_samp[absTimeModNTAPS]=s;
             // This is a reference to the value in the ProcessingInfo,
             // so this line has the effect of directly modifying the
@@ -211,9 +226,14 @@ process_window_avx2(ProcessingInfo& info)
             // --------------------------------------------------------------
             // Hit finding
             // --------------------------------------------------------------
+            // Induction signals are bipolar, so their two lobes both
+            // make hits: threshold on the magnitude. The magnitude of
+            // INT16_MIN is still INT16_MIN, which is never over
+            // threshold, but the filter can't get there anyway
+            __m256i mag=filt;
+            if(ALL_CHANNELS) mag=_mm256_blendv_epi8(_mm256_abs_epi16(filt), filt, is_collection);
             // Mask for channels that are over the threshold in this step
-            // const uint16_t threshold=2000;
-            __m256i is_over=_mm256_cmpgt_epi16(filt, sigma*info.multiplier*5);
+            __m256i is_over=_mm256_cmpgt_epi16(mag, _mm256_mullo_epi16(sigma, thresholdScale));
             // Mask for channels that left "over threshold" state this step
             __m256i left=_mm256_andnot_si256(is_over, prev_was_over);
 
@@ -226,7 +246,7 @@ process_window_avx2(ProcessingInfo& info)
             // Really want an epi16 version of this, but the cmpgt and
             // cmplt functions set their epi16 parts to 0xff or 0x0,
             // so treating everything as epi8 works the same
-            __m256i to_add_charge=_mm256_blendv_epi8(_mm256_set1_epi16(0), filt, is_over);
+            __m256i to_add_charge=_mm256_blendv_epi8(_mm256_set1_epi16(0), mag, is_over);
             // Divide by the multiplier before adding (implemented as a shift-right)
             hit_charge=_mm256_adds_epi16(hit_charge, _mm256_srai_epi16(to_add_charge, info.tap_exponent));
 
@@ -296,15 +316,84 @@ process_window_avx2(ProcessingInfo& info)
         _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum25)+ireg, accum25);
         _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.accum75)+ireg, accum75);
         for(size_t j=0; j<NTAPS; ++j){
-            _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_samp)+NTAPS*ireg+j, prev_samp[j]);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_samp)+ChanState::MAX_NTAPS*ireg+j, prev_samp[j]);
         }
         _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.prev_was_over)+ireg, prev_was_over);
         _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_charge)+ireg, hit_charge);
         _mm256_storeu_si256(reinterpret_cast<__m256i*>(state.hit_tover)+ireg, hit_tover);
 
-    } // end loop over ireg (the 8 registers in this frame)
+    } // end loop over ireg (the registers in this frame)
     info.absTimeModNTAPS=(info.absTimeModNTAPS+info.timeWindowNumFrames)%NTAPS;
     // Store the output
     for(int i=0; i<4; ++i) _mm256_storeu_si256(output_loc++, _mm256_set1_epi16(MAGIC));
     info.nhits=nhits;
 }
+
+// Pick the kernel for the filter length in info
+template<bool ALL_CHANNELS>
+TARGET_AVX2 void
+dispatch_ntaps(ProcessingInfo& info, const __m256i* __restrict__ input)
+{
+    switch(info.ntaps){
+    case 8:  process_window_impl<ALL_CHANNELS, 8>(info, input);  break;
+    case 16: process_window_impl<ALL_CHANNELS, 16>(info, input); break;
+    case 32: process_window_impl<ALL_CHANNELS, 32>(info, input); break;
+    default: process_window_impl<ALL_CHANNELS, 0>(info, input);  break;
+    }
+}
+}
+
+//======================================================================
+const int16_t*
+collection_lane_mask()
+{
+    struct CollectionLanes
+    {
+        CollectionLanes()
+        {
+            for(size_t i=0; i<ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER; ++i){
+                mask[i]=all_index_is_collection(i) ? -1 : 0;
+            }
+        }
+        alignas(32) int16_t mask[ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER];
+    };
+    static const CollectionLanes lanes;
+    return lanes.mask;
+}
+
+//======================================================================
+void
+process_window_avx2(ProcessingInfo& info)
+{
+    dispatch_ntaps<false>(info, reinterpret_cast<const __m256i*>(info.input));
+}
+
+//======================================================================
+void
+process_window_all_avx2(ProcessingInfo& info)
+{
+    dispatch_ntaps<true>(info, reinterpret_cast<const __m256i*>(info.all_input));
+}
+
+//======================================================================
+void
+split_hits_by_message(const uint16_t* hits, size_t nmsgs, uint16_t* const* outputs)
+{
+    // Each group of hits is the channels, end times, charges and
+    // times over threshold of one register, all ending at the same
+    // time, so the whole group goes to one message
+    const size_t group_size=4*SAMPLES_PER_REGISTER;
+    uint16_t* output_loc[MAX_SPLIT_MESSAGES];
+    for(size_t i=0; i<nmsgs; ++i) output_loc[i]=outputs[i];
+    while(*hits!=MAGIC){
+        const uint16_t itime=hits[SAMPLES_PER_REGISTER];
+        uint16_t*& out=output_loc[itime/FRAMES_PER_MSG];
+        memcpy(out, hits, group_size*sizeof(uint16_t));
+        for(size_t i=0; i<SAMPLES_PER_REGISTER; ++i) out[SAMPLES_PER_REGISTER+i]=itime%FRAMES_PER_MSG;
+        out+=group_size;
+        hits+=group_size;
+    }
+    for(size_t i=0; i<nmsgs; ++i){
+        for(size_t j=0; j<group_size; ++j) *output_loc[i]++=MAGIC;
+    }
+}
@@ -10,7 +10,34 @@
 frugal_accum_update_avx2(__m256i& __restrict__ median, const __m256i s, __m256i&  __restrict__ accum, const int16_t acclimit,
                          const __m256i mask) __attribute__((always_inline));
 */
+// Find hits on the collection channels of info.input, in registers
+// [first_register, last_register) of REGISTERS_PER_FRAME. Compiled for
+// AVX2 whatever the build flags, so only call these if cpu_has_avx2()
 void
 process_window_avx2(ProcessingInfo& info);
 
+// Find hits on all the channels, collection and induction, of
+// info.all_input, in registers [first_register, last_register) of
+// ALL_REGISTERS_PER_FRAME. The channel numbers in the output are
+// indices in get_frame_all_adcs() (see all_index_to_channel())
+void
+process_window_all_avx2(ProcessingInfo& info);
+
+// -1 (all bits set) in the lanes of get_frame_all_adcs() that are
+// collection channels, 0 elsewhere, for the ALL_REGISTERS_PER_FRAME
+// registers. 32-byte aligned
+const int16_t*
+collection_lane_mask();
+
+// The most messages split_hits_by_message() takes
+const size_t MAX_SPLIT_MESSAGES=256;
+
+// Split the hits that the functions above found in a window of nmsgs
+// messages into one list per message, the same as if each message had
+// been processed on its own: the end times in outputs[i] are relative
+// to the start of message i. Each output needs room for the hits of
+// one message
+void
+split_hits_by_message(const uint16_t* hits, size_t nmsgs, uint16_t* const* outputs);
+
 #endif
@@ -0,0 +1,286 @@
+#include "process_avx512.h"
+#include "process_avx2.h"
+
+#include <cstring>
+#include <vector>
+
+// The build turns AVX-512 off (see ../CMakeLists.txt), so the kernels
+// here ask for it themselves, as in FelixReorder.cc
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+namespace{
+// The plain 256 <-> 512-bit inserts, extracts and casts pass an undefined
+// register through, which gcc reports (-Wmaybe-uninitialized, '__Y') at
+// every inlined use. Their zero-masking forms with a full mask give the
+// same instructions without it
+TARGET_AVX512 inline __m256i low_half(__m512i v)
+{
+    return _mm512_maskz_extracti64x4_epi64(0xf, v, 0);
+}
+
+TARGET_AVX512 inline __m256i high_half(__m512i v)
+{
+    return _mm512_maskz_extracti64x4_epi64(0xf, v, 1);
+}
+
+// Registers lo and hi (each 16 channels) side by side in one 512-bit register
+TARGET_AVX512 inline __m512i load_pair(const void* lo, const void* hi)
+{
+    const __m512i v=_mm512_maskz_inserti64x4(0xff, _mm512_setzero_si512(), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lo)), 0);
+    return _mm512_maskz_inserti64x4(0xff, v, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hi)), 1);
+}
+
+// The inverse of load_pair(). The high half is only stored if has_hi
+TARGET_AVX512 inline void store_pair(void* lo, void* hi, __m512i v, bool has_hi)
+{
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lo), low_half(v));
+    if(has_hi) _mm256_storeu_si256(reinterpret_cast<__m256i*>(hi), high_half(v));
+}
+
+// As frugal_accum_update_avx2(), with a mask register for the channels to update
+TARGET_AVX512 inline void frugal_accum_update_avx512(__m512i& __restrict__ median, const __m512i s, __m512i& __restrict__ accum, const int16_t acclimit,
+                                                     const __mmask32 mask)
+{
+    const __m512i zero=_mm512_setzero_si512();
+    const __m512i one=_mm512_set1_epi16(1);
+    const __m512i minus_one=_mm512_set1_epi16(-1);
+
+    // +1 where the sample is above the median, -1 below, nothing in the masked out channels
+    __m512i to_add=_mm512_mask_mov_epi16(minus_one, _mm512_cmpgt_epi16_mask(s, median), one);
+    to_add=_mm512_mask_mov_epi16(to_add, _mm512_cmpeq_epi16_mask(s, median), zero);
+    accum=_mm512_add_epi16(accum, _mm512_maskz_mov_epi16(mask, to_add));
+
+    // Move the median by one where the accumulator got past the limit
+    // either way, and reset the accumulator there. The AVX2 version
+    // negates the accumulator with sign_epi16, which wraps the same way
+    const __mmask32 is_gt=_mm512_cmpgt_epi16_mask(accum, _mm512_set1_epi16(acclimit));
+    const __mmask32 is_lt=_mm512_cmpgt_epi16_mask(_mm512_sub_epi16(zero, accum), _mm512_set1_epi16(acclimit));
+    to_add=_mm512_mask_mov_epi16(_mm512_maskz_mov_epi16(is_gt, one), is_lt, minus_one);
+    median=_mm512_adds_epi16(median, _mm512_maskz_mov_epi16(mask, to_add));
+    accum=_mm512_mask_mov_epi16(accum, (is_gt | is_lt) & mask, zero);
+}
+
+// The hit finding of process_window_impl() in process_avx2.cpp, for
+// the registers in pairs. The hits of the second register of a pair
+// go to a buffer that is appended after the hits of the first, so
+// that the output is in the same order as the AVX2 version's
+template<bool ALL_CHANNELS, size_t FIXED_NTAPS>
+TARGET_AVX512 void
+process_window_impl(ProcessingInfo& info, const __m256i* __restrict__ input)
+{
+    // How many registers there are for each time in the input
+    constexpr size_t NREGISTERS=ALL_CHANNELS ? ALL_REGISTERS_PER_FRAME : REGISTERS_PER_FRAME;
+    const size_t NTAPS=FIXED_NTAPS ? FIXED_NTAPS : info.ntaps;
+    constexpr size_t TAPS_SIZE=FIXED_NTAPS ? FIXED_NTAPS : ChanState::MAX_NTAPS;
+
+    const __m512i adcMax=_mm512_set1_epi16(info.adcMax);
+    // The maximum value that sigma can have before the threshold overflows a 16-bit signed integer
+    const __m512i sigmaMax=_mm512_set1_epi16((1<<15)/(info.multiplier*info.threshold));
+    const bool update_pedestals=info.update_pedestals;
+    const __m512i thresholdScale=_mm512_set1_epi16(info.multiplier*info.threshold);
+
+    __m512i tap_512[TAPS_SIZE];
+    for(size_t i=0; i<NTAPS; ++i){
+        tap_512[i]=_mm512_set1_epi16(info.taps[i]);
+    }
+    // Pointer to keep track of where we'll write the next output hit
+    __m256i* output_loc=(__m256i*)(info.output);
+    // The hits of the second register of a pair, until the first one is done
+    thread_local std::vector<uint16_t> hi_hits;
+    if(hi_hits.size()<4*SAMPLES_PER_REGISTER*info.timeWindowNumFrames) hi_hits.resize(4*SAMPLES_PER_REGISTER*info.timeWindowNumFrames);
+
+    const __m256i iota=_mm256_set_epi16(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512i zero=_mm512_setzero_si512();
+    const __m512i one=_mm512_set1_epi16(1);
+
+    int nhits=0;
+
+    ChanState& state=info.chanState;
+
+    for(uint16_t ireg=info.first_register; ireg<info.last_register; ireg+=2){
+        // With an odd number of registers, the last one is paired with
+        // itself, and the second copy isn't stored
+        const bool has_hi=(ireg+1<info.last_register);
+        const uint16_t hireg=has_hi ? ireg+1 : ireg;
+
+        uint16_t absTimeModNTAPS=info.absTimeModNTAPS;
+
+        // ------------------------------------
+        // Variables for pedestal subtraction
+#define LOAD_STATE(x) load_pair(state.x+ireg*SAMPLES_PER_REGISTER, state.x+hireg*SAMPLES_PER_REGISTER)
+        __m512i median=LOAD_STATE(pedestals);
+        __m512i quantile25=LOAD_STATE(quantile25);
+        __m512i quantile75=LOAD_STATE(quantile75);
+        __m512i accum=LOAD_STATE(accum);
+        __m512i accum25=LOAD_STATE(accum25);
+        __m512i accum75=LOAD_STATE(accum75);
+
+        // ------------------------------------
+        // Variables for filtering
+        __m512i prev_samp[TAPS_SIZE];
+        for(size_t j=0; j<NTAPS; ++j){
+            prev_samp[j]=load_pair(state.prev_samp+(ChanState::MAX_NTAPS*ireg+j)*SAMPLES_PER_REGISTER,
+                                   state.prev_samp+(ChanState::MAX_NTAPS*hireg+j)*SAMPLES_PER_REGISTER);
+        }
+
+        // ------------------------------------
+        // Variables for hit finding
+        __mmask32 prev_was_over=_mm512_movepi16_mask(LOAD_STATE(prev_was_over));
+        __m512i hit_charge=LOAD_STATE(hit_charge);
+        __m512i hit_tover=LOAD_STATE(hit_tover);
+
+        const __m256i channels_lo=_mm256_add_epi16(_mm256_set1_epi16(ireg*SAMPLES_PER_REGISTER), iota);
+        const __m256i channels_hi=_mm256_add_epi16(_mm256_set1_epi16(hireg*SAMPLES_PER_REGISTER), iota);
+
+        // Which lanes take the collection (unipolar) threshold
+        const __mmask32 is_collection=ALL_CHANNELS ?
+            _mm512_movepi16_mask(load_pair(collection_lane_mask()+ireg*SAMPLES_PER_REGISTER, collection_lane_mask()+hireg*SAMPLES_PER_REGISTER)) :
+            __mmask32(0xffffffff);
+
+        __m256i* hi_loc=reinterpret_cast<__m256i*>(hi_hits.data());
+
+        for(size_t itime=0; itime<info.timeWindowNumFrames; ++itime){
+            const size_t msg_index=itime/12;
+            const size_t msg_time_offset=itime%12;
+            const size_t index=msg_index*NREGISTERS*FRAMES_PER_MSG + FRAMES_PER_MSG*ireg + msg_time_offset;
+            const size_t hi_index=index+FRAMES_PER_MSG*(hireg-ireg);
+
+            // The current sample
+            __m512i s=load_pair(input+index, input+hi_index);
+
+            // Update the quantiles and the median as in process_avx2.cpp
+            const __mmask32 is_gt=_mm512_cmpgt_epi16_mask(s, median);
+            const __mmask32 is_eq=_mm512_cmpeq_epi16_mask(s, median);
+            const __mmask32 is_lt=~(is_gt | is_eq);
+            if(update_pedestals){
+                frugal_accum_update_avx512(quantile25, s, accum25, 10, is_lt);
+                frugal_accum_update_avx512(quantile75, s, accum75, 10, is_gt);
+                frugal_accum_update_avx512(median,     s, accum,   10, 0xffffffff);
+            }
+            // Actually subtract the pedestal
+            s=_mm512_sub_epi16(s, median);
+
+            // Find the interquartile range, clamped so the threshold doesn't overflow
+            const __m512i sigma=_mm512_min_epi16(_mm512_sub_epi16(quantile75, quantile25), sigmaMax);
+
+            // --------------------------------------------------------------
+            // Filtering
+            // --------------------------------------------------------------
+            s=_mm512_min_epi16(s, adcMax);
+            __m512i filt_part[4]={zero, zero, zero, zero};
+#pragma GCC unroll 32
+            for(size_t j=0; j<NTAPS; ++j){
+                filt_part[j%4]=_mm512_add_epi16(filt_part[j%4], _mm512_mullo_epi16(tap_512[j], prev_samp[(j+absTimeModNTAPS)%NTAPS]));
+            }
+            const __m512i filt=_mm512_add_epi16(_mm512_add_epi16(filt_part[0], filt_part[1]), _mm512_add_epi16(filt_part[2], filt_part[3]));
+            prev_samp[absTimeModNTAPS]=s;
+            absTimeModNTAPS=(absTimeModNTAPS+1)%NTAPS;
+
+            // --------------------------------------------------------------
+            // Hit finding
+            // --------------------------------------------------------------
+            // Induction signals are bipolar: threshold on the magnitude
+            const __m512i mag=ALL_CHANNELS ? _mm512_mask_mov_epi16(_mm512_abs_epi16(filt), is_collection, filt) : filt;
+            const __mmask32 is_over=_mm512_cmpgt_epi16_mask(mag, _mm512_mullo_epi16(sigma, thresholdScale));
+            // Channels that left "over threshold" state this step
+            const __mmask32 left=~is_over & prev_was_over;
+
+            // Accumulate charge and time-over-threshold in the is_over channels
+            hit_charge=_mm512_adds_epi16(hit_charge, _mm512_srai_epi16(_mm512_maskz_mov_epi16(is_over, mag), info.tap_exponent));
+            hit_tover=_mm512_adds_epi16(hit_tover, _mm512_maskz_mov_epi16(is_over, one));
+
+            if(left){
+                // Store each register that has hits ending now, as process_window_avx2() does
+                const __m256i timenow=_mm256_set1_epi16(itime);
+                const __m512i left_charge=_mm512_maskz_mov_epi16(left, hit_charge);
+                if(left & 0xffff){
+                    ++nhits;
+                    _mm256_storeu_si256(output_loc++, channels_lo);
+                    _mm256_storeu_si256(output_loc++, timenow);
+                    _mm256_storeu_si256(output_loc++, low_half(left_charge));
+                    _mm256_storeu_si256(output_loc++, low_half(hit_tover));
+                }
+                if(has_hi && (left>>16)){
+                    ++nhits;
+                    _mm256_storeu_si256(hi_loc++, channels_hi);
+                    _mm256_storeu_si256(hi_loc++, timenow);
+                    _mm256_storeu_si256(hi_loc++, high_half(left_charge));
+                    _mm256_storeu_si256(hi_loc++, high_half(hit_tover));
+                }
+                // Reset the charge and time over threshold in the channels we saved
+                hit_charge=_mm512_mask_mov_epi16(hit_charge, left, zero);
+                hit_tover=_mm512_mask_mov_epi16(hit_tover, left, zero);
+            }
+
+            prev_was_over=is_over;
+        } // end loop over itime (times for this pair of registers)
+
+        // The second register's hits go after the first's
+        const size_t n_hi=hi_loc-reinterpret_cast<__m256i*>(hi_hits.data());
+        memcpy(output_loc, hi_hits.data(), n_hi*sizeof(__m256i));
+        output_loc+=n_hi;
+
+        // Store the state, ready for the next time round
+#define STORE_STATE(x, v) store_pair(state.x+ireg*SAMPLES_PER_REGISTER, state.x+hireg*SAMPLES_PER_REGISTER, v, has_hi)
+        STORE_STATE(pedestals, median);
+        STORE_STATE(quantile25, quantile25);
+        STORE_STATE(quantile75, quantile75);
+        STORE_STATE(accum, accum);
+        STORE_STATE(accum25, accum25);
+        STORE_STATE(accum75, accum75);
+        for(size_t j=0; j<NTAPS; ++j){
+            store_pair(state.prev_samp+(ChanState::MAX_NTAPS*ireg+j)*SAMPLES_PER_REGISTER,
+                       state.prev_samp+(ChanState::MAX_NTAPS*hireg+j)*SAMPLES_PER_REGISTER, prev_samp[j], has_hi);
+        }
+        STORE_STATE(prev_was_over, _mm512_movm_epi16(prev_was_over));
+        STORE_STATE(hit_charge, hit_charge);
+        STORE_STATE(hit_tover, hit_tover);
+#undef LOAD_STATE
+#undef STORE_STATE
+    } // end loop over ireg (the pairs of registers in this frame)
+    info.absTimeModNTAPS=(info.absTimeModNTAPS+info.timeWindowNumFrames)%NTAPS;
+    // Store the output
+    for(int i=0; i<4; ++i) _mm256_storeu_si256(output_loc++, _mm256_set1_epi16(MAGIC));
+    info.nhits=nhits;
+}
+
+// Pick the kernel for the filter length in info
+template<bool ALL_CHANNELS>
+TARGET_AVX512 void
+dispatch_ntaps(ProcessingInfo& info, const __m256i* __restrict__ input)
+{
+    switch(info.ntaps){
+    case 8:  process_window_impl<ALL_CHANNELS, 8>(info, input);  break;
+    case 16: process_window_impl<ALL_CHANNELS, 16>(info, input); break;
+    case 32: process_window_impl<ALL_CHANNELS, 32>(info, input); break;
+    default: process_window_impl<ALL_CHANNELS, 0>(info, input);  break;
+    }
+}
+}
+
+//======================================================================
+void
+process_window_avx512(ProcessingInfo& info)
+{
+    dispatch_ntaps<false>(info, reinterpret_cast<const __m256i*>(info.input));
+}
+
+//======================================================================
+void
+process_window_all_avx512(ProcessingInfo& info)
+{
+    dispatch_ntaps<true>(info, reinterpret_cast<const __m256i*>(info.all_input));
+}
+
+//======================================================================
+bool
+cpu_has_avx512bw()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,24 @@
+#ifndef PROCESS_AVX512_H
+#define PROCESS_AVX512_H
+
+#include "ProcessingInfo.h"
+
+// The same as process_window_avx2() and process_window_all_avx2(),
+// with the output in the same order, but two registers at a time
+// with AVX-512BW. Compiled for AVX-512BW whatever the build flags,
+// so only call them if cpu_has_avx512bw()
+void
+process_window_avx512(ProcessingInfo& info);
+
+void
+process_window_all_avx512(ProcessingInfo& info);
+
+bool
+cpu_has_avx512bw();
+
+#endif
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
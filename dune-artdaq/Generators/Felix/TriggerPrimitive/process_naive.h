@@ -5,6 +5,8 @@
 #include "constants.h"
 #include "ProcessingInfo.h"
 
+#include <cstdlib>
+
 void frugal_accum_update(int16_t& m, const int16_t s, int16_t& acc, const int16_t acclimit)
 {
     if(s>m) ++acc;
@@ -22,21 +24,30 @@ void frugal_accum_update(int16_t& m, const int16_t s, int16_t& acc, const int16_
 }
 
 
+// Scalar version of process_window_impl() in process_avx2.cpp, for
+// checking it. ALL_CHANNELS=false is process_window_avx2(), reading
+// MessageCollectionADCs, and ALL_CHANNELS=true is
+// process_window_all_avx2(), reading MessageAllADCs
+template<bool ALL_CHANNELS>
 void
-process_window_naive(ProcessingInfo& info)
+process_window_naive_impl(ProcessingInfo& info, const uint16_t* input16)
 {
+    const size_t NREGISTERS=ALL_CHANNELS ? ALL_REGISTERS_PER_FRAME : REGISTERS_PER_FRAME;
+    const size_t MSG_SIZE=ALL_CHANNELS ? sizeof(MessageAllADCs) : sizeof(MessageCollectionADCs);
+
     // Start with taps as floats that add to 1. Multiply by some
     // power of two (2**N) and round to int. Before filtering, cap the
     // value of the input to INT16_MAX/(2**N)
-    const size_t NTAPS=8;
+    const size_t NTAPS=info.ntaps;
     const int16_t adcMax=info.adcMax;
+    const int16_t sigmaMax=(1<<15)/(info.multiplier*info.threshold);
+    const bool update_pedestals=info.update_pedestals;
 
     uint16_t* output_loc=info.output;
-    uint16_t* input16=(uint16_t*)info.input;
     int nhits=0;
 
 
-    for(size_t ichan=0; ichan<REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER; ++ichan){
+    for(size_t ichan=0; ichan<NREGISTERS*SAMPLES_PER_REGISTER; ++ichan){
         const size_t register_index=ichan/SAMPLES_PER_REGISTER;
         if(register_index<info.first_register || register_index>=info.last_register) continue;
         const size_t register_offset=ichan%SAMPLES_PER_REGISTER;
@@ -53,20 +64,23 @@ process_window_naive(ProcessingInfo& info)
         int16_t& accum75=state.accum75[ichan];
 
         // Variables for filtering
-        int16_t* prev_samp=state.prev_samp+NTAPS*ichan;
+        int16_t* prev_samp=state.prev_samp+ChanState::MAX_NTAPS*ichan;
 
         // Variables for hit finding
         int16_t& prev_was_over=state.prev_was_over[ichan]; // was the previous sample over threshold?
         int16_t& hit_charge=state.hit_charge[ichan];
         int16_t& hit_tover=state.hit_tover[ichan]; // time over threshold
 
+        // Induction signals are bipolar: threshold on their magnitude
+        const bool bipolar=ALL_CHANNELS && !all_index_is_collection(ichan);
+
         uint16_t absTimeModNTAPS=info.absTimeModNTAPS;
 
         for(size_t itime=0; itime<info.timeWindowNumFrames; ++itime){
             const size_t msg_index=itime/12;
             const size_t msg_time_offset=itime%12;
             // The index in uint16_t of the start of the message we want
-            const size_t msg_start_index=msg_index*sizeof(MessageCollectionADCs)/sizeof(uint16_t);
+            const size_t msg_start_index=msg_index*MSG_SIZE/sizeof(uint16_t);
             const size_t offset_within_msg=register_t0_start+SAMPLES_PER_REGISTER*msg_time_offset+register_offset;
             const size_t index=msg_start_index+offset_within_msg;
 
@@ -75,11 +89,14 @@ process_window_naive(ProcessingInfo& info)
             // --------------------------------------------------------------
             int16_t sample=input16[index];
             
-            if(sample<median) frugal_accum_update(quantile25, sample, accum25, 10);
-            if(sample>median) frugal_accum_update(quantile75, sample, accum75, 10);
-            frugal_accum_update(median, sample, accum, 10);
+            if(update_pedestals){
+                if(sample<median) frugal_accum_update(quantile25, sample, accum25, 10);
+                if(sample>median) frugal_accum_update(quantile75, sample, accum75, 10);
+                frugal_accum_update(median, sample, accum, 10);
+            }
 
-            const int16_t sigma=quantile75-quantile25;
+            // Clamped as in process_window_avx2(), so that the threshold fits in 16 bits
+            const int16_t sigma=std::min<int16_t>(quantile75-quantile25, sigmaMax);
 
             sample-=median;
 
@@ -102,21 +119,19 @@ process_window_naive(ProcessingInfo& info)
             // --------------------------------------------------------------
             // Hit finding
             // --------------------------------------------------------------
-            bool is_over=filt > 5*sigma*info.multiplier;
+            // Same overflow as _mm256_abs_epi16 for INT16_MIN
+            const int16_t mag=bipolar ? int16_t(std::abs(filt)) : filt;
+            bool is_over=mag > info.threshold*sigma*info.multiplier;
             if(is_over){
                 // Simulate saturated add
                 int32_t tmp_charge=hit_charge;
-                tmp_charge+=filt >> info.tap_exponent;
+                tmp_charge+=mag >> info.tap_exponent;
                 tmp_charge=std::min(tmp_charge,(int32_t)std::numeric_limits<int16_t>::max());
                 hit_charge=(int16_t)tmp_charge;
                 hit_tover++;
                 prev_was_over=true;
             }
             if(prev_was_over && !is_over){
-                if(hit_tover==1){
-                    printf("% 5d % 5d % 5d % 5d\n", (uint16_t)ichan, (uint16_t)itime, hit_charge, hit_tover);
-                }
-
                 // We reached the end of the hit: write it out
                 (*output_loc++) = (uint16_t)ichan;
                 (*output_loc++) = itime;
@@ -139,6 +154,18 @@ process_window_naive(ProcessingInfo& info)
     // Write a magic "end-of-hits" value into the list of hits
     for(int i=0; i<4; ++i) (*output_loc++) = MAGIC;
 }
+
+void
+process_window_naive(ProcessingInfo& info)
+{
+    process_window_naive_impl<false>(info, reinterpret_cast<const uint16_t*>(info.input));
+}
+
+void
+process_window_all_naive(ProcessingInfo& info)
+{
+    process_window_naive_impl<true>(info, reinterpret_cast<const uint16_t*>(info.all_input));
+}
 #endif
 
 /* Local Variables:  */
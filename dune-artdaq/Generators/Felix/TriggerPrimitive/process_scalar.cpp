@@ -0,0 +1,161 @@
+#include "process_scalar.h"
+#include "process_avx2.h" // For collection_lane_mask()
+
+#include <algorithm>
+#include <cstring>
+
+namespace{
+// The 16-bit arithmetic of the AVX2 instructions that the hit finding uses
+inline int16_t add16(int16_t a, int16_t b) { return int16_t(uint16_t(a)+uint16_t(b)); } // add_epi16
+inline int16_t sub16(int16_t a, int16_t b) { return int16_t(uint16_t(a)-uint16_t(b)); } // sub_epi16
+inline int16_t mul16(int16_t a, int16_t b) { return int16_t(uint16_t(int32_t(a)*int32_t(b))); } // mullo_epi16
+inline int16_t adds16(int16_t a, int16_t b) // adds_epi16
+{
+    return int16_t(std::min<int32_t>(INT16_MAX, std::max<int32_t>(INT16_MIN, int32_t(a)+int32_t(b))));
+}
+inline int16_t abs16(int16_t a) { return (a<0) ? sub16(0, a) : a; } // abs_epi16
+
+constexpr size_t NLANES=SAMPLES_PER_REGISTER;
+
+// frugal_accum_update_avx2(), with a loop over the lanes of a register
+// in place of each instruction, which the compiler can vectorise
+inline void frugal_accum_update(int16_t* __restrict__ median, const int16_t* __restrict__ s, int16_t* __restrict__ accum, const int16_t acclimit,
+                                const int16_t* __restrict__ mask)
+{
+    for(size_t i=0; i<NLANES; ++i){
+        const int16_t to_add=(s[i]>median[i]) ? 1 : ((s[i]==median[i]) ? 0 : -1);
+        accum[i]=add16(accum[i], to_add & mask[i]);
+        const bool is_gt=accum[i]>acclimit;
+        const bool is_lt=sub16(0, accum[i])>acclimit;
+        const int16_t step=is_lt ? -1 : (is_gt ? 1 : 0);
+        median[i]=adds16(median[i], step & mask[i]);
+        accum[i]=((is_gt || is_lt) && mask[i]) ? 0 : accum[i];
+    }
+}
+
+template<bool ALL_CHANNELS>
+void
+process_window_impl(ProcessingInfo& info, const int16_t* __restrict__ input)
+{
+    // How many registers there are for each time in the input
+    constexpr size_t NREGISTERS=ALL_CHANNELS ? ALL_REGISTERS_PER_FRAME : REGISTERS_PER_FRAME;
+    const size_t NTAPS=info.ntaps;
+
+    const int16_t sigmaMax=(1<<15)/(info.multiplier*info.threshold);
+    const bool update_pedestals=info.update_pedestals;
+    const int16_t thresholdScale=info.multiplier*info.threshold;
+    const int16_t adcMax=info.adcMax;
+    const uint8_t tap_exponent=info.tap_exponent;
+
+    uint16_t* output_loc=info.output;
+    int nhits=0;
+
+    ChanState& state=info.chanState;
+
+    for(size_t ireg=info.first_register; ireg<info.last_register; ++ireg){
+        const size_t first_chan=ireg*NLANES;
+        int16_t* __restrict__ median=state.pedestals+first_chan;
+        int16_t* __restrict__ quantile25=state.quantile25+first_chan;
+        int16_t* __restrict__ quantile75=state.quantile75+first_chan;
+        int16_t* __restrict__ accum=state.accum+first_chan;
+        int16_t* __restrict__ accum25=state.accum25+first_chan;
+        int16_t* __restrict__ accum75=state.accum75+first_chan;
+        // Tap j of lane i is prev_samp[j*NLANES+i], as in the AVX2 version
+        int16_t* __restrict__ prev_samp=state.prev_samp+ChanState::MAX_NTAPS*first_chan;
+        int16_t* __restrict__ prev_was_over=state.prev_was_over+first_chan;
+        int16_t* __restrict__ hit_charge=state.hit_charge+first_chan;
+        int16_t* __restrict__ hit_tover=state.hit_tover+first_chan;
+
+        // Which lanes take the collection (unipolar) threshold
+        int16_t is_collection[NLANES];
+        for(size_t i=0; i<NLANES; ++i) is_collection[i]=ALL_CHANNELS ? collection_lane_mask()[first_chan+i] : -1;
+        const int16_t all_lanes[NLANES]={-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+
+        uint16_t absTimeModNTAPS=info.absTimeModNTAPS;
+
+        for(size_t itime=0; itime<info.timeWindowNumFrames; ++itime){
+            const size_t msg_index=itime/12;
+            const size_t msg_time_offset=itime%12;
+            const int16_t* samples=input+(msg_index*NREGISTERS*FRAMES_PER_MSG + FRAMES_PER_MSG*ireg + msg_time_offset)*NLANES;
+
+            int16_t s[NLANES], is_gt[NLANES], is_lt[NLANES];
+            for(size_t i=0; i<NLANES; ++i){
+                s[i]=samples[i];
+                is_gt[i]=(s[i]>median[i]) ? -1 : 0;
+                is_lt[i]=(s[i]<median[i]) ? -1 : 0;
+            }
+            if(update_pedestals){
+                frugal_accum_update(quantile25, s, accum25, 10, is_lt);
+                frugal_accum_update(quantile75, s, accum75, 10, is_gt);
+                frugal_accum_update(median,     s, accum,   10, all_lanes);
+            }
+
+            int16_t sigma[NLANES];
+            for(size_t i=0; i<NLANES; ++i){
+                // Subtract the pedestal, and clamp so the filter and threshold don't overflow
+                s[i]=std::min(sub16(s[i], median[i]), adcMax);
+                sigma[i]=std::min(sub16(quantile75[i], quantile25[i]), sigmaMax);
+            }
+
+            int16_t filt[NLANES]={0};
+            for(size_t j=0; j<NTAPS; ++j){
+                const int16_t tap=info.taps[j];
+                const int16_t* prev=prev_samp+((j+absTimeModNTAPS)%NTAPS)*NLANES;
+                for(size_t i=0; i<NLANES; ++i) filt[i]=add16(filt[i], mul16(tap, prev[i]));
+            }
+            for(size_t i=0; i<NLANES; ++i) prev_samp[absTimeModNTAPS*NLANES+i]=s[i];
+            absTimeModNTAPS=(absTimeModNTAPS+1)%NTAPS;
+
+            int16_t left[NLANES];
+            int16_t any_left=0;
+            for(size_t i=0; i<NLANES; ++i){
+                // Induction signals are bipolar: threshold on the magnitude
+                const int16_t mag=is_collection[i] ? filt[i] : abs16(filt[i]);
+                const int16_t is_over=(mag>mul16(sigma[i], thresholdScale)) ? -1 : 0;
+                left[i]=~is_over & prev_was_over[i];
+                any_left|=left[i];
+                hit_charge[i]=adds16(hit_charge[i], int16_t(mag & is_over)>>tap_exponent);
+                hit_tover[i]=adds16(hit_tover[i], is_over & 1);
+                prev_was_over[i]=is_over;
+            }
+
+            if(any_left){
+                ++nhits;
+                // The channels, end time, charge (only in the channels
+                // that have a hit) and time over threshold of the register
+                for(size_t i=0; i<NLANES; ++i){
+                    output_loc[i]=first_chan+i;
+                    output_loc[NLANES+i]=itime;
+                    output_loc[2*NLANES+i]=hit_charge[i] & left[i];
+                    output_loc[3*NLANES+i]=hit_tover[i];
+                    hit_charge[i]&=~left[i];
+                    hit_tover[i]&=~left[i];
+                }
+                output_loc+=4*NLANES;
+            }
+        } // end loop over itime (times for this register)
+    } // end loop over ireg (the registers in this frame)
+    info.absTimeModNTAPS=(info.absTimeModNTAPS+info.timeWindowNumFrames)%NTAPS;
+    for(size_t i=0; i<4*NLANES; ++i) *output_loc++=MAGIC;
+    info.nhits=nhits;
+}
+}
+
+//======================================================================
+void
+process_window_scalar(ProcessingInfo& info)
+{
+    process_window_impl<false>(info, reinterpret_cast<const int16_t*>(info.input));
+}
+
+//======================================================================
+void
+process_window_all_scalar(ProcessingInfo& info)
+{
+    process_window_impl<true>(info, reinterpret_cast<const int16_t*>(info.all_input));
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,25 @@
+#ifndef PROCESS_SCALAR_H
+#define PROCESS_SCALAR_H
+
+#include "ProcessingInfo.h"
+
+// Portable versions of process_window_avx2() and
+// process_window_all_avx2(), with no intrinsics: each instruction is a
+// loop over the lanes of a register, with the same 16-bit arithmetic
+// (wrapping or saturating where the AVX2 instructions are), so the
+// compiler can vectorise it for whatever the CPU has. The output
+// format and order are the same. For CPUs without AVX2, and as a
+// reference for the SIMD versions. Unlike process_window_naive(), the
+// output can go straight to TriggerPrimitiveFinder
+void
+process_window_scalar(ProcessingInfo& info);
+
+void
+process_window_all_scalar(ProcessingInfo& info);
+
+#endif
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,154 @@
+#ifndef WIBGENERATOR_H
+#define WIBGENERATOR_H
+
+#include "../frame_expand.h"
+
+#include "dune-raw-data/Overlays/FelixFormat.hh"
+#include "dune-artdaq/Generators/Felix/NetioWIBRecords.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+
+// Makes FelixFrames for one link in memory, so that the TPF can be
+// run without a FrameFile. Each channel has its own pedestal, with
+// gaussian noise on top, and a few channels are much noisier than the
+// rest. Tracks cross the link at random times: a straight line across
+// a range of neighbouring wires, giving a unipolar pulse on each
+// collection channel and a bipolar one on each induction channel.
+//
+// The frames are made once, for `n_messages` messages, and copy()
+// replays them with whatever timestamps the caller wants, so making
+// the data costs nothing in a benchmark
+class WIBGenerator
+{
+public:
+    struct Config
+    {
+        uint8_t crate_no=1;
+        uint8_t slot_no=0;
+        uint8_t fiber_no=1;                   // 1 or 2, as the channel map expects
+        double collection_pedestal=900;       // ADC
+        double induction_pedestal=2000;       // ADC
+        double pedestal_spread=50;            // RMS of the pedestals of the channels around those
+        double noise_rms=3;                   // ADC
+        unsigned n_noisy_channels=4;
+        double noisy_factor=10;               // Noise of the noisy channels, relative to noise_rms
+        double track_rate_hz=200;             // Tracks crossing the link per second
+        double track_amplitude=150;           // Peak of a collection pulse, ADC. Induction pulses are half that
+        double pulse_width_ticks=3;           // Sigma of a collection pulse, TPC clock ticks
+        unsigned seed=1;
+    };
+
+    WIBGenerator(Config const& config, size_t n_messages)
+        : m_frames(n_messages*FRAMES_PER_MSG)
+    {
+        std::mt19937 rng(config.seed);
+        std::normal_distribution<double> gaus(0, 1);
+        std::uniform_real_distribution<double> uniform(0, 1);
+
+        const size_t nchan=dune::FelixFrame::num_ch_per_frame;
+        // Whether each frame channel is collection, and its position
+        // across the link: neighbouring wires are neighbouring positions
+        std::vector<bool> is_collection(nchan, false);
+        std::vector<double> position(nchan, 0);
+        const size_t n_collection=REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER;
+        // The collection channels in order of offline channel number
+        std::vector<size_t> by_offline(n_collection);
+        for(size_t i=0; i<n_collection; ++i) by_offline[i]=i;
+        std::sort(by_offline.begin(), by_offline.end(), [](size_t a, size_t b){ return collection_index_to_offline(a)<collection_index_to_offline(b); });
+        for(size_t rank=0; rank<n_collection; ++rank){
+            const int ch=collection_index_to_channel(by_offline[rank]);
+            is_collection[ch]=true;
+            position[ch]=rank/double(n_collection);
+        }
+        const size_t n_induction_total=nchan-n_collection;
+        size_t n_induction=0;
+        for(size_t i=0; i<nchan; ++i){
+            const int ch=all_index_to_channel(i);
+            if(is_collection[ch]) continue;
+            position[ch]=n_induction++/double(n_induction_total);
+        }
+
+        std::vector<double> pedestal(nchan), noise(nchan, config.noise_rms);
+        for(size_t ch=0; ch<nchan; ++ch){
+            pedestal[ch]=(is_collection[ch] ? config.collection_pedestal : config.induction_pedestal)+config.pedestal_spread*gaus(rng);
+        }
+        for(unsigned i=0; i<config.n_noisy_channels; ++i){
+            noise[size_t(uniform(rng)*nchan)%nchan]*=config.noisy_factor;
+        }
+
+        std::vector<double> adcs(m_frames.size()*nchan);
+        for(size_t itime=0; itime<m_frames.size(); ++itime){
+            for(size_t ch=0; ch<nchan; ++ch){
+                adcs[itime*nchan+ch]=pedestal[ch]+noise[ch]*gaus(rng);
+            }
+        }
+
+        // A track starts at a random time and covers a random range of
+        // the link's wires, drifting at a random slope
+        const double ticks=m_frames.size();
+        const double n_tracks_mean=config.track_rate_hz*ticks*500e-9;
+        const size_t n_tracks=std::poisson_distribution<size_t>(n_tracks_mean)(rng);
+        const double width=config.pulse_width_ticks;
+        for(size_t itrack=0; itrack<n_tracks; ++itrack){
+            const double t0=uniform(rng)*ticks;
+            const double first=uniform(rng);
+            const double last=std::min(1.0, first+0.1+0.9*uniform(rng));
+            const double slope=(2*uniform(rng)-1)*2000; // Ticks across the whole link
+            for(size_t ch=0; ch<nchan; ++ch){
+                if(position[ch]<first || position[ch]>last) continue;
+                const double tpeak=t0+slope*(position[ch]-first);
+                const int tlo=std::max(0, int(tpeak-5*width));
+                const int thi=std::min(int(ticks)-1, int(tpeak+5*width));
+                for(int t=tlo; t<=thi; ++t){
+                    const double x=(t-tpeak)/width;
+                    const double pulse=is_collection[ch] ?
+                        config.track_amplitude*std::exp(-0.5*x*x) :
+                        // The derivative of a gaussian, with the same width, scaled to peak at amplitude/2
+                        -0.5*config.track_amplitude*std::exp(0.5)*x*std::exp(-0.5*x*x);
+                    adcs[t*nchan+ch]+=pulse;
+                }
+            }
+        }
+
+        for(size_t itime=0; itime<m_frames.size(); ++itime){
+            dune::FelixFrame& frame=m_frames[itime];
+            memset(&frame, 0, sizeof(dune::FelixFrame));
+            frame.set_crate_no(config.crate_no);
+            frame.set_slot_no(config.slot_no);
+            frame.set_fiber_no(config.fiber_no);
+            for(size_t ch=0; ch<nchan; ++ch){
+                // The ADCs are 12 bits
+                const long adc=std::lround(adcs[itime*nchan+ch]);
+                frame.set_channel(ch, uint16_t(std::min(4095L, std::max(0L, adc))));
+            }
+        }
+        m_nTracks=n_tracks;
+    }
+
+    size_t size() const { return m_frames.size()/FRAMES_PER_MSG; }
+    size_t nTracks() const { return m_nTracks; }
+
+    // Copy message `imessage` into `scs`, with the timestamp of the
+    // first frame `timestamp`, and 25 ticks more for each frame after
+    void copy(size_t imessage, SUPERCHUNK_CHAR_STRUCT& scs, uint64_t timestamp) const
+    {
+        dune::FelixFrame* frames=reinterpret_cast<dune::FelixFrame*>(&scs);
+        memcpy(frames, &m_frames[imessage*FRAMES_PER_MSG], FRAMES_PER_MSG*sizeof(dune::FelixFrame));
+        for(size_t i=0; i<FRAMES_PER_MSG; ++i) frames[i].set_timestamp(timestamp+25*i);
+    }
+
+private:
+    std::vector<dune::FelixFrame> m_frames;
+    size_t m_nTracks;
+};
+
+#endif
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,156 @@
+// Replay readout windows through every compression backend, on the
+// raw WIB frames and on the FelixReorder layout, and print the
+// throughput and compression ratio per backend and level. The windows
+// come from WIBGenerator, or from the fragments of a FrameFile with -f.
+// Every output is decoded again with Compressor::decompressFragment(),
+// as the fragment readers do, and checked against its input.
+// Meant to pick compression_backend/compression_level per host.
+
+#include "../../Compressor.hh"
+#include "../../FelixReorder.hh"
+#include "FrameFile.h"
+#include "WIBGenerator.h"
+#include "CLI11.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+std::vector<std::string> split(const std::string& s)
+{
+    std::vector<std::string> ret;
+    std::stringstream ss(s);
+    std::string item;
+    while(std::getline(ss, item, ',')) ret.push_back(item);
+    return ret;
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Benchmark the FELIX fragment compression backends"};
+
+    std::string input_file;
+    app.add_option("-f", input_file, "Input FrameFile. Generated frames are used without it");
+    int n_repeats=3;
+    app.add_option("-n", n_repeats, "Number of passes over the windows", true);
+    int n_fragments=10;
+    app.add_option("-m", n_fragments, "Number of windows, at most the number of fragments in the file", true);
+    unsigned window_frames=6024;
+    app.add_option("-w", window_frames, "Frames per readout window, as in a trigger fragment", true);
+    std::string backends{"qat,deflate,lz4,zstd,deltapack"};
+    app.add_option("-b", backends, "Comma separated list of backends", true);
+    std::string levels{"1,4,6,9"};
+    app.add_option("-l", levels, "Comma separated list of compression levels", true);
+    int qat_engine=-1;
+    app.add_option("-e", qat_engine, "QAT engine", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    size_t frames_per_window=window_frames;
+    size_t n_windows=std::max(n_fragments, 0);
+    // Keep raw and reordered copies of the windows in memory, so the
+    // timing only covers the compression
+    std::vector<std::vector<uint8_t>> raw;
+    if(input_file.empty()){
+        const size_t n_messages=(frames_per_window*n_windows+FRAMES_PER_MSG-1)/FRAMES_PER_MSG;
+        WIBGenerator generator(WIBGenerator::Config(), n_messages);
+        std::vector<dune::FelixFrame> frames(n_messages*FRAMES_PER_MSG);
+        for(size_t i=0; i<n_messages; ++i){
+            generator.copy(i, *reinterpret_cast<SUPERCHUNK_CHAR_STRUCT*>(&frames[i*FRAMES_PER_MSG]), 25*FRAMES_PER_MSG*i);
+        }
+        printf("Generated %zu frames, with %zu tracks\n", frames.size(), generator.nTracks());
+        for(size_t i=0; i<n_windows; ++i){
+            const uint8_t* window=reinterpret_cast<const uint8_t*>(&frames[i*frames_per_window]);
+            raw.emplace_back(window, window+frames_per_window*FelixReorder::m_num_bytes_per_frame);
+        }
+    }
+    else{
+        FrameFile f(input_file.c_str());
+        frames_per_window=std::min<size_t>(frames_per_window, FrameFile::frames_per_fragment);
+        n_windows=std::min<size_t>(n_windows, f.num_fragments());
+        for(size_t i=0; i<n_windows; ++i){
+            const uint8_t* window=reinterpret_cast<const uint8_t*>(f.fragment(i));
+            raw.emplace_back(window, window+frames_per_window*FelixReorder::m_num_bytes_per_frame);
+        }
+    }
+    if(n_windows==0){
+        fprintf(stderr, "No complete window to compress\n");
+        return 1;
+    }
+    const size_t raw_size=frames_per_window*FelixReorder::m_num_bytes_per_frame;
+
+    std::vector<std::vector<uint8_t>> reordered(n_windows);
+    for(size_t i=0; i<n_windows; ++i){
+        const uint8_t* frames=raw[i].data();
+        reordered[i].resize(FelixReorder::calculate_reordered_size(frames_per_window, frames_per_window));
+        unsigned num_faulty=0;
+        FelixReorder::do_reorder(reordered[i].data(), frames, frames_per_window, &num_faulty);
+        reordered[i].resize(FelixReorder::calculate_reordered_size(frames_per_window, num_faulty));
+    }
+
+    printf("%zu windows of %zu frames, %zu bytes raw, %zu bytes reordered\n",
+           n_windows, frames_per_window, raw_size, reordered[0].size());
+    printf("%-8s %5s %-9s %10s %8s\n", "backend", "level", "layout", "MB/s", "ratio");
+
+    std::vector<uint8_t> out, back;
+    for(auto const& name: split(backends)){
+        Compressor::Backend backend;
+        if(!Compressor::parseBackend(name, backend)){
+            fprintf(stderr, "Unknown backend %s\n", name.c_str());
+            continue;
+        }
+        if(!Compressor::available(backend)){
+            printf("%-8s not built in\n", name.c_str());
+            continue;
+        }
+        for(auto const& level_str: split(levels)){
+            unsigned level=std::stoul(level_str);
+            std::unique_ptr<Compressor> compressor=Compressor::create(backend, level, qat_engine);
+            if(!compressor){
+                printf("%-8s %5u could not be initialised\n", name.c_str(), level);
+                break;
+            }
+            for(int layout=0; layout<2; ++layout){
+                std::vector<std::vector<uint8_t>>& windows=layout ? reordered : raw;
+                size_t bytes_in=0, bytes_out=0;
+                bool failed=false;
+                auto t0=std::chrono::steady_clock::now();
+                for(int irepeat=0; irepeat<n_repeats; ++irepeat){
+                    for(auto const& window: windows){
+                        out.resize(compressor->bound(window.size()));
+                        size_t comp_size=compressor->compress(window.data(), window.size(), out.data(), out.size());
+                        if(comp_size==0) failed=true;
+                        bytes_in+=window.size();
+                        bytes_out+=comp_size;
+                    }
+                }
+                auto t1=std::chrono::steady_clock::now();
+                double us=std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count();
+                if(failed){
+                    printf("%-8s %5u %-9s compression failed\n", name.c_str(), level, layout ? "reordered" : "raw");
+                    continue;
+                }
+                for(auto const& window: windows){
+                    out.resize(compressor->bound(window.size()));
+                    size_t comp_size=compressor->compress(window.data(), window.size(), out.data(), out.size());
+                    back.resize(window.size());
+                    const uint8_t format=compressor->formatId();
+                    size_t size=Compressor::decompressFragment(Compressor::metadataVersion(format), format,
+                                                               out.data(), comp_size, back.data(), back.size());
+                    if(size!=window.size() || memcmp(back.data(), window.data(), size)!=0) failed=true;
+                }
+                if(failed){
+                    printf("%-8s %5u %-9s decompression does not give the input back\n", name.c_str(), level, layout ? "reordered" : "raw");
+                    continue;
+                }
+                printf("%-8s %5u %-9s %10.1f %8.2f\n", name.c_str(), level, layout ? "reordered" : "raw",
+                       bytes_in/us, double(bytes_in)/bytes_out);
+            }
+        }
+    }
+}
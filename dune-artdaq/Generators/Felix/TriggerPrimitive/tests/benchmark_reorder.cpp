@@ -0,0 +1,82 @@
+// Reorder the fragments of a FrameFile with every FelixReorder kernel
+// that this CPU can run, and print the throughput of each. The windows
+// are reordered in parts of -p frames, as the trigger matchers do with
+// the spans of the link buffer.
+
+#include "../../FelixReorder.hh"
+#include "FrameFile.h"
+#include "CLI11.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Benchmark the FelixReorder kernels"};
+
+    std::string input_file{"/nfs/sw/work_dirs/phrodrig/felixcosmics.dat"};
+    app.add_option("-f", input_file, "Input file", true);
+    int n_repeats=20;
+    app.add_option("-n", n_repeats, "Number of passes over the fragments in the file", true);
+    int n_fragments=4;
+    app.add_option("-m", n_fragments, "Maximum number of fragments to use from the file", true);
+    unsigned window_frames=6024;
+    app.add_option("-w", window_frames, "Frames per readout window, as in a trigger fragment", true);
+    unsigned part_frames=0;
+    app.add_option("-p", part_frames, "Frames per do_reorder_part call, 0 for the whole window in one call", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    FrameFile f(input_file.c_str());
+    const unsigned frames_per_window=std::min<size_t>(window_frames, FrameFile::frames_per_fragment);
+    const size_t raw_size=frames_per_window*FelixReorder::m_num_bytes_per_frame;
+    const size_t n_windows=std::min<size_t>(n_fragments, f.num_fragments());
+    if(n_windows==0){
+        fprintf(stderr, "No complete fragment in %s\n", input_file.c_str());
+        return 1;
+    }
+    if(part_frames==0) part_frames=frames_per_window;
+
+    std::vector<std::vector<uint8_t>> windows(n_windows);
+    for(size_t i=0; i<n_windows; ++i){
+        const uint8_t* frames=reinterpret_cast<const uint8_t*>(f.fragment(i));
+        windows[i].assign(frames, frames+raw_size);
+    }
+    std::vector<uint8_t> out(FelixReorder::calculate_reordered_size(frames_per_window, frames_per_window));
+
+    struct Kernel {
+        const char* name;
+        bool available;
+        bool (*fn)(uint8_t*, const uint8_t*, const unsigned, const unsigned, const unsigned&, unsigned*);
+    };
+    const Kernel kernels[]={
+        {"baseline", true, FelixReorder::do_reorder_part},
+        {"AVX2", FelixReorder::avx_available, FelixReorder::do_avx_reorder_part},
+        {"AVX512", FelixReorder::avx512_available, FelixReorder::do_avx512_reorder_part},
+    };
+
+    printf("%zu windows of %u frames, %u frames per part\n", n_windows, frames_per_window, part_frames);
+    printf("%-9s %10s %12s\n", "kernel", "MB/s", "Mframes/s");
+    for(auto const& kernel: kernels){
+        if(!kernel.available){
+            printf("%-9s not supported by this CPU\n", kernel.name);
+            continue;
+        }
+        auto t0=std::chrono::steady_clock::now();
+        for(int irepeat=0; irepeat<n_repeats; ++irepeat){
+            for(auto const& window: windows){
+                unsigned num_faulty=0;
+                for(unsigned start=0; start<frames_per_window; start+=part_frames){
+                    const unsigned stop=std::min(frames_per_window, start+part_frames);
+                    kernel.fn(out.data(), window.data()+start*FelixReorder::m_num_bytes_per_frame,
+                              start, stop, frames_per_window, &num_faulty);
+                }
+            }
+        }
+        auto t1=std::chrono::steady_clock::now();
+        double us=std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count();
+        double n_frames=double(n_repeats)*n_windows*frames_per_window;
+        printf("%-9s %10.1f %12.2f\n", kernel.name, n_frames*FelixReorder::m_num_bytes_per_frame/us, n_frames/us);
+    }
+}
@@ -0,0 +1,259 @@
+// Run a TriggerPrimitiveFinder on each of several links of synthetic
+// data from WIBGenerator, fed at the line rate (or as fast as they'll
+// take it), and report what each one costs and keeps up with: hits/s,
+// CPU use, the backlog in the link buffer, messages skipped or
+// processed with degraded hit finding, and the latency percentiles.
+// This is what the hit finding servers are sized from, and it doesn't
+// need a FrameFile.
+
+#include "../TriggerPrimitiveFinder.h"
+#include "WIBGenerator.h"
+#include "channel_maps.h"
+#include "CLI11.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+const uint64_t clocksPerTPCTick=25;
+const uint64_t ticksPerMessage=FRAMES_PER_MSG*clocksPerTPCTick;
+
+void pin_to_cpu(int32_t cpu)
+{
+    if(cpu<0) return;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+}
+
+uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// The upper edge of the bin of `hist` where the fraction `q` of the entries is reached
+uint64_t percentile(const PowerTwoHist<24>& hist, double q)
+{
+    uint64_t total=0;
+    for(size_t i=0; i<hist.nbins(); ++i) total+=hist.bin(i);
+    if(total==0) return 0;
+    uint64_t sum=0;
+    for(size_t i=0; i<hist.nbins(); ++i){
+        sum+=hist.bin(i);
+        if(sum>=q*total) return hist.binHi(i);
+    }
+    return hist.binHi(hist.nbins()-1);
+}
+
+struct Link
+{
+    Link(WIBGenerator::Config const& config, size_t pool_messages, size_t buffer_messages)
+        : generator(config, pool_messages),
+          buffer(buffer_messages, ticksPerMessage),
+          messages_written(0),
+          depth_sum(0), depth_max(0), depth_samples(0)
+    {}
+
+    WIBGenerator generator;
+    LinkBuffer buffer;
+    std::unique_ptr<TriggerPrimitiveFinder> tpf;
+    std::thread feeder;
+    std::atomic<uint64_t> messages_written;
+    // The messages waiting in the buffer for the TPF, sampled by the main thread
+    uint64_t depth_sum, depth_max, depth_samples;
+};
+
+// Write the messages of `link` into its buffer, with timestamps that
+// follow the clock, at `frame_rate` frames per second. With a rate of
+// zero, as fast as the TPF takes them, without lapping it
+void feed(Link& link, double frame_rate, int32_t cpu, uint64_t start_us, const std::atomic<bool>& stop)
+{
+    pthread_setname_np(pthread_self(), "feeder");
+    pin_to_cpu(cpu);
+    const uint64_t first_timestamp=start_us*50;
+    const auto start=std::chrono::steady_clock::now();
+    uint64_t imessage=0;
+    while(!stop.load()){
+        if(frame_rate>0){
+            // Write all the messages that are due, then wait for the next ones
+            const double elapsed_s=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            const uint64_t due=elapsed_s*frame_rate/FRAMES_PER_MSG;
+            if(imessage>=due){
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+                continue;
+            }
+        }
+        else if(link.buffer.written()-link.tpf->nextSequence()>=link.buffer.capacity()-1){
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+            continue;
+        }
+        SUPERCHUNK_CHAR_STRUCT* scs=link.buffer.claim();
+        link.generator.copy(imessage%link.generator.size(), *scs, first_timestamp+imessage*ticksPerMessage);
+        link.buffer.publish();
+        ++imessage;
+        link.messages_written.store(imessage, std::memory_order_relaxed);
+    }
+}
+}
+
+int main(int argc, char** argv)
+{
+    pthread_setname_np(pthread_self(), "main");
+
+    CLI::App app{"Benchmark TriggerPrimitiveFinders on several links of synthetic data"};
+
+    unsigned n_links=1;
+    app.add_option("-l", n_links, "Number of links", true);
+    std::string channel_map_dir{TPF_CHANNEL_MAP_DIR};
+    app.add_option("--channel-maps", channel_map_dir, "Directory of the channel map files", true);
+    unsigned n_workers=1;
+    app.add_option("-w", n_workers, "Number of TPF processing threads per link", true);
+    double seconds=10;
+    app.add_option("-t", seconds, "Seconds to run for", true);
+    double frame_rate=2e6;
+    app.add_option("-r", frame_rate, "Frames per second per link (0 for as fast as the TPF takes them)", true);
+    std::vector<int32_t> cpus;
+    app.add_option("-c", cpus, "CPUs for the TPF threads: each link gets the next num_workers of them, or shares them all if there aren't enough");
+    std::vector<int32_t> feeder_cpus;
+    app.add_option("--feeder-cpus", feeder_cpus, "CPU for the feeding thread of each link");
+    bool induction=false;
+    app.add_flag("-i", induction, "Find hits on the induction channels too");
+    bool send_tpsets=false;
+    app.add_flag("-p", send_tpsets, "Build and send TPSets too");
+    unsigned max_batch=16;
+    app.add_option("-k", max_batch, "Largest number of messages per hit finding call", true);
+    bool no_avx512=false;
+    app.add_flag("--no-avx512", no_avx512, "Don't use the AVX-512 hit finding");
+    bool no_avx2=false;
+    app.add_flag("--no-avx2", no_avx2, "Don't use the AVX2 hit finding either");
+    bool no_degrade=false;
+    app.add_flag("--no-degrade", no_degrade, "Let messages be skipped rather than degrade the hit finding when behind");
+    bool show_output=false;
+    app.add_flag("-v", show_output, "Show DAQLogger output from TPF");
+
+    WIBGenerator::Config gen;
+    app.add_option("--noise", gen.noise_rms, "Noise RMS, ADC", true);
+    app.add_option("--pedestal-spread", gen.pedestal_spread, "RMS of the channel pedestals, ADC", true);
+    app.add_option("--noisy-channels", gen.n_noisy_channels, "Number of noisy channels per link", true);
+    app.add_option("--noisy-factor", gen.noisy_factor, "Noise of the noisy channels relative to the others", true);
+    app.add_option("--track-rate", gen.track_rate_hz, "Tracks per second per link", true);
+    app.add_option("--track-amplitude", gen.track_amplitude, "Peak of the collection pulses, ADC", true);
+    size_t pool_messages=4096;
+    app.add_option("--pool", pool_messages, "Number of distinct messages generated per link", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    if(!show_output) mf::setStandAloneMessageThreshold({"ERROR"});
+
+    std::vector<std::unique_ptr<Link>> links;
+    for(unsigned ilink=0; ilink<n_links; ++ilink){
+        WIBGenerator::Config config=gen;
+        // Links of the same APA have different crate, slot and fiber numbers
+        config.crate_no=1+(ilink/10)%6;
+        config.slot_no=(ilink/2)%5;
+        config.fiber_no=1+ilink%2;
+        config.seed=gen.seed+ilink;
+        // A second of messages in the buffer, as in the boardreader
+        links.emplace_back(new Link(config, pool_messages, 2e6/FRAMES_PER_MSG));
+        if(ilink==0) printf("Generated %zu messages per link, with %zu tracks on the first link\n", pool_messages, links[0]->generator.nTracks());
+    }
+
+    fhicl::ParameterSet ps;
+    ps.put<bool>("send_ptmp_messages", send_tpsets);
+    put_channel_maps(ps, channel_map_dir);
+    ps.put<uint32_t>("window_offset", 500);
+    ps.put<unsigned>("num_workers", n_workers);
+    ps.put<bool>("find_induction_hits", induction);
+    ps.put<unsigned>("max_batch_messages", max_batch);
+    ps.put<bool>("tp_avx512", !no_avx512);
+    ps.put<bool>("tp_avx2", !no_avx2);
+    if(no_degrade) ps.put<std::vector<double>>("degrade_backlog_fractions", std::vector<double>());
+    ps.put<std::string>("zmq_hit_send_connection", "");
+    ps.put<std::vector<int32_t>>("cpus_to_pin", std::vector<int32_t>());
+    const bool cpu_per_worker=cpus.size()>=n_links*n_workers;
+    for(unsigned ilink=0; ilink<n_links; ++ilink){
+        ps.put_or_replace<std::string>("zmq_hit_send_connection", "tcp://*:"+std::to_string(54321+ilink));
+        if(cpu_per_worker) ps.put_or_replace<std::vector<int32_t>>("cpus_to_pin", std::vector<int32_t>(cpus.begin()+ilink*n_workers, cpus.begin()+(ilink+1)*n_workers));
+        else               ps.put_or_replace<std::vector<int32_t>>("cpus_to_pin", cpus);
+        links[ilink]->tpf.reset(new TriggerPrimitiveFinder(ps, links[ilink]->buffer));
+    }
+    for(auto& link: links){
+        while(!link->tpf->readyForMessages()) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    printf("Running %u link(s) with %u worker(s) each for %.0fs at %s\n", n_links, n_workers, seconds,
+           frame_rate>0 ? (std::to_string(frame_rate/1e6)+" MHz of frames per link").c_str() : "the rate the TPFs take");
+
+    std::atomic<bool> stop{false};
+    const uint64_t start_us=now_us();
+    std::vector<uint64_t> cpu_ns_start;
+    for(unsigned ilink=0; ilink<n_links; ++ilink){
+        cpu_ns_start.push_back(links[ilink]->tpf->cpuNs());
+        const int32_t feeder_cpu=ilink<feeder_cpus.size() ? feeder_cpus[ilink] : -1;
+        links[ilink]->feeder=std::thread(feed, std::ref(*links[ilink]), frame_rate, feeder_cpu, start_us, std::cref(stop));
+    }
+
+    const auto start=std::chrono::steady_clock::now();
+    while(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count()<seconds){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        for(auto& link: links){
+            const uint64_t written=link->buffer.written();
+            const uint64_t next=link->tpf->nextSequence();
+            const uint64_t depth=written>next ? written-next : 0;
+            link->depth_sum+=depth;
+            link->depth_max=std::max(link->depth_max, depth);
+            ++link->depth_samples;
+        }
+    }
+    stop.store(true);
+    for(auto& link: links) link->feeder.join();
+    const double elapsed_s=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    // Give the TPFs a moment to finish what's in the buffers
+    for(auto& link: links){
+        for(int i=0; i<1000 && link->tpf->nextSequence()<link->buffer.written(); ++i){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    printf("link\tMHz\thits/s\tCPU%%\tskipped\tdegraded\tdepth\tmax\tfull latency us (50%%/99%%/max)\tTPF latency us (50%%/99%%/max)\n");
+    double total_hits=0, total_cpu=0;
+    size_t total_skipped=0, total_degraded=0, total_transitions=0;
+    for(unsigned ilink=0; ilink<n_links; ++ilink){
+        Link& link=*links[ilink];
+        const double mhz=1e-6*link.messages_written.load()*FRAMES_PER_MSG/elapsed_s;
+        const double hits=link.tpf->hitsFound()/elapsed_s;
+        const double cpu=100*1e-9*(link.tpf->cpuNs()-cpu_ns_start[ilink])/elapsed_s;
+        const PowerTwoHist<24>& full=link.tpf->fullLatencyHist();
+        const PowerTwoHist<24>& backlog=link.tpf->tpfLatencyHist();
+        printf("%u\t%.2f\t%.0f\t%.0f\t%zu\t%zu\t\t%.1f\t%lu\t%lu/%lu/%lu\t\t\t%lu/%lu/%lu\n", ilink, mhz, hits, cpu, link.tpf->messagesSkipped(),
+               link.tpf->degradedMessages(),
+               double(link.depth_sum)/std::max<uint64_t>(1, link.depth_samples), link.depth_max,
+               percentile(full, 0.5), percentile(full, 0.99), percentile(full, 1),
+               percentile(backlog, 0.5), percentile(backlog, 0.99), percentile(backlog, 1));
+        total_hits+=hits;
+        total_cpu+=cpu;
+        total_skipped+=link.tpf->messagesSkipped();
+        total_degraded+=link.tpf->degradedMessages();
+        total_transitions+=link.tpf->degradationTransitions();
+    }
+    printf("Total: %.0f hits/s, %.0f%% CPU (%.2f cores per link), %zu messages skipped, %zu processed degraded (%zu changes of level)\n",
+           total_hits, total_cpu, 0.01*total_cpu/n_links, total_skipped, total_degraded, total_transitions);
+    if(frame_rate==0){
+        printf("The feeding was flat out, so the timestamps don't follow the clock, and the full latencies are meaningless\n");
+    }
+    printf("Latencies are in bins of powers of two, and the histograms include the messages processed while stopping\n");
+
+    for(auto& link: links) link->tpf.reset();
+    return 0;
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
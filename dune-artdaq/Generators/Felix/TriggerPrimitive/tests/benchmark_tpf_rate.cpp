@@ -1,8 +1,55 @@
 #include <map>
 #include "../TriggerPrimitiveFinder.h"
 #include "FrameFile.h"
+#include "channel_maps.h"
 #include "CLI11.hpp"
 
+// Time, in ms, for a TPF with parameters ps to get through n_repeats
+// copies of the messages in fragment
+long run_tpf(fhicl::ParameterSet const& ps, char* fragment, size_t n_messages, int n_repeats)
+{
+    // The TPF reads the messages from here, as it does from the link buffer in NetioHandler
+    const int clocksPerTPCTick=25;
+    LinkBuffer buffer(10000, FRAMES_PER_MSG*clocksPerTPCTick);
+
+    TriggerPrimitiveFinder* tpf=new TriggerPrimitiveFinder(ps, buffer);
+    // Wait a bit so the processing thread has a chance to start up
+    while(!tpf->readyForMessages()) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    auto t0=std::chrono::steady_clock::now();
+
+    std::cout << "Running " << n_repeats << " repeats" << std::endl;
+    for(int irepeat=0; irepeat<n_repeats; ++irepeat){
+        for(size_t imessage=0; imessage<n_messages; ++imessage){
+            SUPERCHUNK_CHAR_STRUCT* scs=reinterpret_cast<SUPERCHUNK_CHAR_STRUCT*>(fragment+imessage*NETIO_MSG_SIZE);
+            // Don't lap the TPF
+            while(buffer.written()-tpf->nextSequence()>=buffer.capacity()){
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            buffer.write(*scs);
+        }
+    }
+    // Let the TPF finish what's in the buffer
+    while(tpf->nextSequence()<buffer.written()){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    // Stop the clock before the destructor, which waits for the metrics thread
+    auto t1=std::chrono::steady_clock::now();
+    // This bit is to test that the "behindness" detection in
+    // TriggerPrimitiveFinder is working: with nrepeats=1000, we'll
+    // end up behind in the loop above. We wait for the processing
+    // thread to catch up, then send another message, which should get
+    // processed straight away, and take the processing thread out of
+    // the lateness state
+
+    // std::this_thread::sleep_for(std::chrono::seconds(8));
+    // SUPERCHUNK_CHAR_STRUCT* scs=reinterpret_cast<SUPERCHUNK_CHAR_STRUCT*>(fragment);
+    // buffer.write(*scs);
+    
+    delete tpf; // To force the destructor to run
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
+}
+
 int main(int argc, char** argv)
 {
     pthread_setname_np(pthread_self(), "main");
@@ -15,6 +62,20 @@ int main(int argc, char** argv)
     app.add_flag("-v", show_output, "Show DAQLogger output from TPF");
     std::string input_file{"/nfs/sw/work_dirs/phrodrig/felixcosmics.dat"};
     app.add_option("-f", input_file, "Input file", true);
+    std::string channel_map_dir{TPF_CHANNEL_MAP_DIR};
+    app.add_option("--channel-maps", channel_map_dir, "Directory of the channel map files", true);
+    unsigned n_workers=1;
+    app.add_option("-w", n_workers, "Number of TPF processing threads", true);
+    bool induction=false;
+    app.add_flag("-i", induction, "Find hits on the induction channels too");
+    bool no_avx512=false;
+    app.add_flag("--no-avx512", no_avx512, "Don't use the AVX-512 hit finding");
+    bool no_avx2=false;
+    app.add_flag("--no-avx2", no_avx2, "Don't use the AVX2 hit finding either");
+    bool send_tpsets=false;
+    app.add_flag("-p", send_tpsets, "Build and send TPSets too");
+    std::vector<unsigned> batch_sizes{1, 4, 16};
+    app.add_option("-k", batch_sizes, "Largest numbers of messages per hit finding call to compare", true);
 
     CLI11_PARSE(app, argc, argv);
 
@@ -31,37 +92,28 @@ int main(int argc, char** argv)
 
     fhicl::ParameterSet ps;
     ps.put<std::string>("zmq_hit_send_connection", "tcp://*:54321");
-    ps.put<bool>("send_ptmp_messages", false);
+    ps.put<bool>("send_ptmp_messages", send_tpsets);
+    put_channel_maps(ps, channel_map_dir);
     ps.put<uint32_t>("window_offset", 500);
-    TriggerPrimitiveFinder* tpf=new TriggerPrimitiveFinder(ps);
-    // Wait a bit so the processing thread has a chance to start up
-    while(!tpf->readyForMessages()) std::this_thread::sleep_for(std::chrono::milliseconds(10));
-
-    auto t0=std::chrono::steady_clock::now();
+    ps.put<unsigned>("num_workers", n_workers);
+    ps.put<bool>("find_induction_hits", induction);
+    ps.put<bool>("tp_avx512", !no_avx512);
+    ps.put<bool>("tp_avx2", !no_avx2);
 
-    std::cout << "Running " << n_repeats << " repeats" << std::endl;
-    for(int irepeat=0; irepeat<n_repeats; ++irepeat){
-        for(size_t imessage=0; imessage<n_messages; ++imessage){
-            SUPERCHUNK_CHAR_STRUCT* scs=reinterpret_cast<SUPERCHUNK_CHAR_STRUCT*>(fragment+imessage*NETIO_MSG_SIZE);
-            while(!tpf->addMessage(*scs)){
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
-        }
+    // The messages arrive much faster than they're processed, so the
+    // TPF always has a full batch waiting. That would have it degrade
+    // the hit finding, and we want the time the full hit finding takes
+    ps.put<std::vector<double>>("degrade_backlog_fractions", std::vector<double>());
+    const double ms_processed=1000*n_repeats*n_messages*FRAMES_PER_MSG/2e6;
+    std::vector<std::pair<unsigned, long>> results;
+    for(unsigned batch: batch_sizes){
+        ps.put_or_replace<unsigned>("max_batch_messages", batch);
+        const long ms=run_tpf(ps, fragment, n_messages, n_repeats);
+        printf("Processed %.0fms of data in %ldms with batches of up to %u messages. Ratio %.0f%%\n", ms_processed, ms, batch, 100.*ms/ms_processed);
+        results.emplace_back(batch, ms);
+    }
+    printf("max batch\tus/message\tratio\n");
+    for(auto const& r: results){
+        printf("%9u\t%10.2f\t%4.0f%%\n", r.first, 1000.*r.second/(n_repeats*n_messages), 100.*r.second/ms_processed);
     }
-    // This bit is to test that the "behindness" detection in
-    // TriggerPrimitiveFinder is working: with nrepeats=1000, we'll
-    // end up behind in the loop above. We wait for the processing
-    // thread to catch up, then send another message, which should get
-    // processed straight away, and take the processing thread out of
-    // the lateness state
-
-    // std::this_thread::sleep_for(std::chrono::seconds(8));
-    // SUPERCHUNK_CHAR_STRUCT* scs=reinterpret_cast<SUPERCHUNK_CHAR_STRUCT*>(fragment);
-    // tpf->addMessage(*scs);
-    
-    delete tpf; // To force the destructor to run
-    auto t1=std::chrono::steady_clock::now();
-    auto ms=std::chrono::duration_cast<std::chrono::milliseconds>(t1-t0).count();
-    auto ms_processed=1000*n_repeats*n_messages*FRAMES_PER_MSG/2e6;
-    printf("Processed %.0fms of data in %ldms. Ratio %.0f%%\n", ms_processed, ms, 100.*float(ms)/ms_processed);
 }
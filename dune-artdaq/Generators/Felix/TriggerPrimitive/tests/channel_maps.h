@@ -0,0 +1,21 @@
+#ifndef CHANNEL_MAPS_H
+#define CHANNEL_MAPS_H
+
+#include "fhiclcpp/ParameterSet.h"
+
+#include <string>
+
+// The TriggerPrimitive directory of the source tree, where the channel
+// map files are. tests/CMakeLists.txt sets it
+#ifndef TPF_CHANNEL_MAP_DIR
+#define TPF_CHANNEL_MAP_DIR ".."
+#endif
+
+// Point the TriggerPrimitiveFinder parameters at the channel maps in dir
+inline void put_channel_maps(fhicl::ParameterSet& ps, std::string const& dir=TPF_CHANNEL_MAP_DIR)
+{
+    ps.put<std::string>("channel_map_rce", dir+"/protoDUNETPCChannelMap_RCE_v4.txt");
+    ps.put<std::string>("channel_map_felix", dir+"/protoDUNETPCChannelMap_FELIX_v4.txt");
+}
+
+#endif
@@ -98,7 +98,7 @@ void fragment_frames_to_array(const dune::FelixFrame* frames, size_t nframes,
 }
 
 //======================================================================
-void fragment_frames_to_array_collection(const dune::FelixFrame* frames, size_t nframes, uint16_t* array)
+TARGET_AVX2 void fragment_frames_to_array_collection(const dune::FelixFrame* frames, size_t nframes, uint16_t* array)
 {
     PdspChannelMapService channelMap("protoDUNETPCChannelMap_RCE_v4.txt", "protoDUNETPCChannelMap_FELIX_v4.txt");
     
@@ -4,6 +4,7 @@
 #include "../TriggerPrimitiveFinder.h"
 #include "../PdspChannelMapService.h"
 #include "frames2array.h"
+#include "channel_maps.h"
 #include <thread>
 #include <fstream>
 #include <iostream>
@@ -40,12 +41,15 @@ int main(int argc, char** argv)
     // buffer to hold all the data. This means we can run indefinitely
     // if we're not writing output
     const size_t buffer_size=write_output ? n_msgs : 1024000;
-    SUPERCHUNK_CHAR_STRUCT* ics=new SUPERCHUNK_CHAR_STRUCT[buffer_size];
+    const int clocksPerTPCTick=25;
+    // The TPF reads the messages straight from here
+    LinkBuffer buffer(buffer_size, FRAMES_PER_MSG*clocksPerTPCTick);
 
     fhicl::ParameterSet ps;
     ps.put<std::string>("zmq_hit_send_connection", "tcp://*:54321");
     ps.put<uint32_t>("window_offset", 500);
-    TriggerPrimitiveFinder* tpf=new TriggerPrimitiveFinder(ps);
+    put_channel_maps(ps);
+    TriggerPrimitiveFinder* tpf=new TriggerPrimitiveFinder(ps, buffer);
     // Wait for the processing thread to start up
     while(!tpf->readyForMessages()) std::this_thread::sleep_for(std::chrono::milliseconds(10));
 
@@ -72,12 +76,10 @@ int main(int argc, char** argv)
         netio::message msg;
         sub_socket->recv(std::ref(msg));
         if (msg.size()!=SUPERCHUNK_FRAME_SIZE) break;
-        const size_t index=i%buffer_size;
-        msg.serialize_to_usr_buffer((void*)&ics[index]);
-        tpf->addMessage(ics[index]);
+        msg.serialize_to_usr_buffer((void*)buffer.claim());
+        buffer.publish();
         if(i==0){
-            dune::FelixFrame* frame=reinterpret_cast<dune::FelixFrame*>(ics);
-            first_ts=frame->timestamp();
+            first_ts=buffer.timestampAt(0);
         }
     }
 
@@ -92,16 +94,16 @@ int main(int argc, char** argv)
     netio_bg_thread.join();
     std::cout << "joined netio thread" << std::endl;
 
-    const int clocksPerTPCTick=25;
     uint64_t last_ts=first_ts+clocksPerTPCTick*n_msgs*FRAMES_PER_MSG/2;
     std::cout << "Retrieving hits from getHitsForWindow(" << first_ts << ", " << last_ts << ")..." << std::flush;
     std::vector<dune::TriggerPrimitive> hits=tpf->getHitsForWindow(first_ts, last_ts);
     std::cout << " got " << hits.size() << " of them" << std::endl;
     std::cout << "Finished listening to messages. Waiting for processing to finish" << std::endl;
+    while(tpf->nextSequence()<buffer.written()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
     delete tpf;
     std::cout << "Processing finished" << std::endl;
 
-    const dune::FelixFrame* framearray=reinterpret_cast<const dune::FelixFrame*>(&ics[0]);
+    const dune::FelixFrame* framearray=reinterpret_cast<const dune::FelixFrame*>(buffer.at(0));
 
     // =============================================================================
     // Write output files
@@ -149,6 +151,5 @@ int main(int argc, char** argv)
 
     delete context;
     delete sub_socket;
-    delete[] ics;
 
 }
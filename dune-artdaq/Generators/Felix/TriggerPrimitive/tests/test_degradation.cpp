@@ -0,0 +1,120 @@
+// Check the levels DegradationPolicy picks as the backlog goes up and
+// down: each level is entered at its threshold, several at once if the
+// backlog jumps, and left one level at a time, only once the backlog is
+// below the leave fraction and the level has been held long enough.
+// Also check that ChanState::resetFilter() only clears the filter and
+// hit state of the channels it's given.
+
+#include "../DegradationPolicy.h"
+#include "../ProcessingInfo.h"
+
+#include <cstdio>
+#include <memory>
+
+namespace
+{
+int n_failures=0;
+
+void expect(bool ok, const char* what)
+{
+    printf("%s %s\n", ok ? "OK  " : "FAIL", what);
+    if(!ok) ++n_failures;
+}
+
+// Feed `backlog` to the policy for n_updates batches of batch_size messages. The level it ends up at
+unsigned run(DegradationPolicy& policy, uint64_t backlog, size_t n_updates, uint64_t batch_size=1)
+{
+    for(size_t i=0; i<n_updates; ++i) policy.update(backlog, batch_size);
+    return policy.level();
+}
+
+void check_levels()
+{
+    const uint64_t min_messages=100;
+    DegradationPolicy policy({100, 200, 400}, 0.5, min_messages);
+
+    expect(run(policy, 0, 1000)==0 && policy.flags()==0, "no backlog: level 0, no flags");
+    expect(run(policy, 99, 1000)==0, "just under the first threshold: level 0");
+    expect(policy.update(100, 1) && policy.level()==1, "at the first threshold: level 1");
+    expect(policy.flags()==DegradationPolicy::FrozenPedestals, "level 1 only freezes the pedestals");
+    expect(run(policy, 60, 1000)==1, "above the leave fraction: stays at level 1");
+    expect(run(policy, 1000, 1)==3, "a jump in the backlog goes straight to level 3");
+    expect(policy.flags()==(DegradationPolicy::FrozenPedestals | DegradationPolicy::RaisedThreshold | DegradationPolicy::RegisterSubset),
+           "level 3 has all the flags");
+
+    // Way down: one level at a time, each held for min_messages
+    expect(run(policy, 0, min_messages-1)==3, "backlog gone: level 3 held for min_messages");
+    expect(run(policy, 0, 1)==2, "then down one level");
+    expect(run(policy, 0, min_messages-1)==2, "held for min_messages before the next level down");
+    expect(run(policy, 0, 1)==1, "then down another");
+    expect(run(policy, 0, min_messages)==0, "and back to level 0");
+
+    // Dropping a level needs the backlog below half the threshold of the current level
+    run(policy, 200, 1);
+    expect(policy.level()==2, "back up to level 2");
+    expect(run(policy, 100, 10*min_messages)==2, "at half the level 2 threshold: stays at level 2");
+    expect(run(policy, 99, 1)==1, "below half the level 2 threshold: level 1");
+
+    // Batches count all their messages towards the holding time
+    DegradationPolicy batched({100, 200, 400}, 0.5, min_messages);
+    batched.update(400, 16);
+    expect(run(batched, 0, min_messages/16+1, 16)==2, "batches of 16 messages count 16 each");
+
+    DegradationPolicy never({}, 0.5, min_messages);
+    expect(run(never, 1000000, 10)==0, "no thresholds: never degrades");
+
+    DegradationPolicy two_levels({100, 200}, 0.5, min_messages);
+    expect(run(two_levels, 1000000, 10)==2, "two thresholds: at most level 2");
+
+    DegradationPolicy out_of_order({100, 50}, 0.5, min_messages);
+    expect(run(out_of_order, 75, 1)==0 && run(out_of_order, 100, 1)==2, "a threshold below the one before is raised to it");
+}
+
+void check_reset_filter()
+{
+    std::unique_ptr<ChanState> state(new ChanState);
+    for(size_t i=0; i<ChanState::NCHANS; ++i){
+        state->pedestals[i]=900;
+        state->prev_was_over[i]=-1;
+        state->hit_charge[i]=10;
+        state->hit_tover[i]=2;
+        for(size_t j=0; j<ChanState::MAX_NTAPS; ++j) state->prev_samp[i*ChanState::MAX_NTAPS+j]=5;
+    }
+    // Registers [3, 6)
+    const size_t first=3*SAMPLES_PER_REGISTER, last=6*SAMPLES_PER_REGISTER;
+    state->resetFilter(first, last);
+
+    bool ok=true;
+    for(size_t i=0; i<ChanState::NCHANS; ++i){
+        const bool reset=(i>=first && i<last);
+        if(state->pedestals[i]!=900) ok=false;
+        if(state->prev_was_over[i]!=(reset ? 0 : -1) || state->hit_charge[i]!=(reset ? 0 : 10) || state->hit_tover[i]!=(reset ? 0 : 2)) ok=false;
+    }
+    // prev_samp is laid out by register: tap j of lane i of register r is prev_samp[(r*MAX_NTAPS+j)*SAMPLES_PER_REGISTER+i]
+    for(size_t r=0; r<ALL_REGISTERS_PER_FRAME; ++r){
+        const bool reset=(r>=3 && r<6);
+        for(size_t k=0; k<ChanState::MAX_NTAPS*SAMPLES_PER_REGISTER; ++k){
+            if(state->prev_samp[r*ChanState::MAX_NTAPS*SAMPLES_PER_REGISTER+k]!=(reset ? 0 : 5)) ok=false;
+        }
+    }
+    expect(ok, "resetFilter() clears the filter and hits of its registers only, and keeps the pedestals");
+}
+}
+
+int main()
+{
+    check_levels();
+    check_reset_filter();
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("DegradationPolicy picks the expected levels\n");
+    return 0;
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,114 @@
+// Round trip test of DeltaPackCodec: encode with the baseline and the
+// AVX2 encoder, check that both write the same bytes and that decode
+// gives back the input. Runs on synthetic reordered-like data (a noisy
+// 12 bit baseline per channel), on random bytes, and on sizes that do
+// not fill the last block. With -f, the first fragment of a FrameFile
+// is also reordered and round tripped.
+
+#include "../../DeltaPackCodec.hh"
+#include "../../FelixReorder.hh"
+#include "FrameFile.h"
+#include "CLI11.hpp"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+void check(const char* name, const std::vector<uint8_t>& input)
+{
+    std::vector<uint8_t> enc(DeltaPackCodec::bound(input.size()));
+    const size_t enc_size=DeltaPackCodec::encode_baseline(enc.data(), enc.size(), input.data(), input.size());
+    if(enc_size==0){
+        printf("FAIL %s: baseline encode failed\n", name);
+        ++n_failures;
+        return;
+    }
+    enc.resize(enc_size);
+
+#ifdef __AVX2__
+    std::vector<uint8_t> enc_avx(DeltaPackCodec::bound(input.size()));
+    const size_t enc_avx_size=DeltaPackCodec::encode_avx(enc_avx.data(), enc_avx.size(), input.data(), input.size());
+    enc_avx.resize(enc_avx_size);
+    if(enc_avx!=enc){
+        printf("FAIL %s: AVX2 and baseline encoders differ\n", name);
+        ++n_failures;
+    }
+#endif
+
+    std::vector<uint8_t> dec(DeltaPackCodec::decoded_size(enc.data(), enc.size()));
+    const size_t dec_size=DeltaPackCodec::decode(dec.data(), dec.size(), enc.data(), enc.size());
+    if(dec_size!=input.size() || dec!=input){
+        printf("FAIL %s: decoded data differs from the input\n", name);
+        ++n_failures;
+        return;
+    }
+    printf("OK   %s: %zu -> %zu bytes, ratio %.2f\n", name, input.size(), enc_size, double(input.size())/enc_size);
+}
+
+// num_channels blocks of num_samples 12 bit samples, as in FelixReorder output
+std::vector<uint8_t> make_channels(std::mt19937& rng, size_t num_channels, size_t num_samples, double sigma)
+{
+    std::vector<uint16_t> samples(num_channels*num_samples);
+    std::uniform_int_distribution<int> pedestal(500, 3500);
+    std::normal_distribution<double> noise(0, sigma);
+    for(size_t ch=0; ch<num_channels; ++ch){
+        const int ped=pedestal(rng);
+        for(size_t i=0; i<num_samples; ++i){
+            int v=ped+int(noise(rng));
+            samples[ch*num_samples+i]=std::min(std::max(v, 0), 0xfff);
+        }
+    }
+    const uint8_t* bytes=reinterpret_cast<const uint8_t*>(samples.data());
+    return std::vector<uint8_t>(bytes, bytes+2*samples.size());
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Round trip test of the DeltaPackCodec"};
+
+    std::string input_file;
+    app.add_option("-f", input_file, "Optional FrameFile to round trip", false);
+
+    CLI11_PARSE(app, argc, argv);
+
+    std::mt19937 rng(12345);
+
+    check("empty", {});
+    check("one byte", {0x42});
+    check("flat", std::vector<uint8_t>(2*4096, 0));
+    check("noise sigma 3", make_channels(rng, 256, 6024, 3));
+    check("noise sigma 30", make_channels(rng, 16, 1000, 30));
+    check("partial block", make_channels(rng, 3, 101, 5));
+
+    std::vector<uint8_t> odd=make_channels(rng, 7, 77, 5);
+    odd.push_back(0xab);
+    check("odd size", odd);
+
+    // Full 16 bit deltas, including the wrap around
+    std::vector<uint8_t> random(100003);
+    std::uniform_int_distribution<int> byte(0, 255);
+    for(auto& b: random) b=byte(rng);
+    check("random bytes", random);
+
+    if(!input_file.empty()){
+        FrameFile f(input_file.c_str());
+        const unsigned num_frames=FrameFile::frames_per_fragment;
+        std::vector<uint8_t> reordered(FelixReorder::calculate_reordered_size(num_frames, num_frames));
+        unsigned num_faulty=0;
+        FelixReorder::do_reorder(reordered.data(), reinterpret_cast<const uint8_t*>(f.fragment(0)), num_frames, &num_faulty);
+        reordered.resize(FelixReorder::calculate_reordered_size(num_frames, num_faulty));
+        check("reordered fragment", reordered);
+    }
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("All round trips OK\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Check the fused expansion path: expand every message once with
+// expand_message_all_adcs, then
+//  - the collection channels it returns, and those picked out of the
+//    expanded message, have to be identical to expand_message_adcs on
+//    the raw message (the TP finding input), and
+//  - the reordered fragment built from it (baseline and AVX2) has to be
+//    identical to FelixReorder::do_reorder on the raw frames.
+// Runs on synthetic frames with some corrupt headers, and on the first
+// fragment of a FrameFile with -f.
+
+#include "../frame_expand.h"
+#include "../../FelixReorder.hh"
+#include "FrameFile.h"
+#include "CLI11.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+typedef bool (*ExpandedReorderFn)(uint8_t*, const uint8_t*, const uint16_t*, const unsigned, const unsigned, const unsigned&, unsigned*);
+
+void check(const char* data_name, const uint8_t* frames, unsigned num_messages)
+{
+    const unsigned num_frames=num_messages*FRAMES_PER_MSG;
+    const SUPERCHUNK_CHAR_STRUCT* messages=reinterpret_cast<const SUPERCHUNK_CHAR_STRUCT*>(frames);
+
+    std::vector<MessageAllADCs> all_adcs(num_messages);
+    unsigned collection_mismatches=0;
+    for(unsigned i=0; i<num_messages; ++i){
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> expected=expand_message_adcs(messages[i]);
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> got=expand_message_all_adcs(messages[i], all_adcs[i]);
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> got_again=collection_adcs_from_all(all_adcs[i]);
+        if(memcmp(expected.data(), got.data(), collection_adcs_size)!=0
+           || memcmp(expected.data(), got_again.data(), collection_adcs_size)!=0) ++collection_mismatches;
+    }
+    if(collection_mismatches){
+        printf("FAIL %s collection: %u of %u messages differ from expand_message_adcs\n", data_name, collection_mismatches, num_messages);
+        ++n_failures;
+    }
+    else{
+        printf("OK   %s collection\n", data_name);
+    }
+
+    std::vector<uint8_t> expected(FelixReorder::calculate_reordered_size(num_frames, num_frames));
+    unsigned expected_faulty=0;
+    FelixReorder::do_reorder(expected.data(), frames, num_frames, &expected_faulty);
+    expected.resize(FelixReorder::calculate_reordered_size(num_frames, expected_faulty));
+    printf("%s: %u frames, %u faulty\n", data_name, num_frames, expected_faulty);
+
+    struct Kernel { const char* name; bool available; ExpandedReorderFn fn; };
+    const Kernel kernels[]={
+        {"baseline", true, FelixReorder::do_expanded_reorder_part},
+        {"AVX2", FelixReorder::avx_available, FelixReorder::do_avx_expanded_reorder_part},
+    };
+    for(auto const& kernel: kernels){
+        if(!kernel.available){
+            printf("SKIP %s %s: not supported by this CPU\n", data_name, kernel.name);
+            continue;
+        }
+        // One call per message, as the trigger matchers do
+        std::vector<uint8_t> got(FelixReorder::calculate_reordered_size(num_frames, num_frames));
+        unsigned faulty=0;
+        bool ok=true;
+        for(unsigned i=0; i<num_messages && ok; ++i){
+            ok=kernel.fn(got.data(), frames+i*sizeof(SUPERCHUNK_CHAR_STRUCT),
+                         reinterpret_cast<const uint16_t*>(all_adcs[i].fragments),
+                         i*FRAMES_PER_MSG, (i+1)*FRAMES_PER_MSG, num_frames, &faulty);
+        }
+        got.resize(FelixReorder::calculate_reordered_size(num_frames, faulty));
+        if(!ok){
+            printf("FAIL %s %s: kernel returned false\n", data_name, kernel.name);
+            ++n_failures;
+        }
+        else if(faulty!=expected_faulty || got!=expected){
+            size_t first_diff=0;
+            while(first_diff<std::min(got.size(), expected.size()) && got[first_diff]==expected[first_diff]) ++first_diff;
+            printf("FAIL %s %s: %u faulty frames instead of %u, first difference at byte %zu\n",
+                   data_name, kernel.name, faulty, expected_faulty, first_diff);
+            ++n_failures;
+        }
+        else{
+            printf("OK   %s %s\n", data_name, kernel.name);
+        }
+    }
+
+    // A part that is not whole messages is refused
+    std::vector<uint8_t> out(FelixReorder::calculate_reordered_size(num_frames, num_frames));
+    unsigned faulty=0;
+    if(FelixReorder::do_expanded_reorder_part(out.data(), frames, reinterpret_cast<const uint16_t*>(all_adcs[0].fragments),
+                                              0, FRAMES_PER_MSG-1, num_frames, &faulty)){
+        printf("FAIL %s: partial message accepted\n", data_name);
+        ++n_failures;
+    }
+}
+
+// Frames with random ADC values and consistent headers, except for a
+// few frames with a timestamp or a convert count that is off
+std::vector<dune::FelixFrame> make_frames(unsigned num_frames)
+{
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<uint16_t> adc(0, 0xfff);
+    std::uniform_int_distribution<unsigned> corrupt(0, 99);
+    std::vector<dune::FelixFrame> frames(num_frames);
+    memset(frames.data(), 0, num_frames*sizeof(dune::FelixFrame));
+    for(unsigned i=0; i<num_frames; ++i){
+        dune::FelixFrame& frame=frames[i];
+        frame.set_fiber_no(1);
+        frame.set_crate_no(6);
+        frame.set_slot_no(2);
+        frame.set_timestamp(0x1234567800ull+25*i+(corrupt(rng)==0 ? 1 : 0));
+        for(uint8_t b=0; b<4; ++b){
+            frame.set_coldata_convert_count(b, i+(corrupt(rng)==0 ? 7 : 0));
+        }
+        for(unsigned ch=0; ch<dune::FelixFrame::num_ch_per_frame; ++ch){
+            frame.set_channel(ch, adc(rng));
+        }
+    }
+    return frames;
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Compare reordering from expanded ADCs with the baseline reorder"};
+
+    std::string input_file;
+    app.add_option("-f", input_file, "Optional FrameFile to check as well", false);
+    unsigned num_messages=502;
+    app.add_option("-n", num_messages, "Number of synthetic messages", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    std::vector<dune::FelixFrame> frames=make_frames(num_messages*FRAMES_PER_MSG);
+    check("synthetic", reinterpret_cast<const uint8_t*>(frames.data()), num_messages);
+
+    if(!input_file.empty()){
+        FrameFile f(input_file.c_str());
+        check("file", reinterpret_cast<const uint8_t*>(f.fragment(0)), FrameFile::frames_per_fragment/FRAMES_PER_MSG);
+    }
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("Expanded reordering agrees with the baseline\n");
+    return 0;
+}
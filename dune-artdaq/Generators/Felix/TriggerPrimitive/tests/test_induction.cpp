@@ -0,0 +1,249 @@
+// Check the all-channel hit finding, process_window_all_avx2():
+//  - it has to find the same hits as the scalar version,
+//    process_window_all_naive(),
+//  - on the collection channels, it has to find the same hits as
+//    process_window_avx2() on the collection channels alone, and
+//  - it has to find the unipolar pulses injected on collection
+//    channels and the bipolar pulses injected on induction channels.
+// Runs on synthetic frames, and on the first fragment of a FrameFile
+// with -f (where only the first two checks apply), with the default
+// filter and with longer ones, which take the other kernels.
+
+#include "../process_avx2.h"
+#include "../process_naive.h"
+#include "../design_fir.h"
+#include "FrameFile.h"
+#include "CLI11.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+const size_t NCHANS=ALL_REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER;
+
+// A hit, with the channel as an online channel number and the time
+// counted from the start of the data
+struct Hit
+{
+    uint16_t chan;
+    uint32_t end;
+    uint16_t charge, tover;
+    bool operator<(const Hit& rhs) const {
+        if(chan!=rhs.chan)     return chan<rhs.chan;
+        if(end!=rhs.end)       return end<rhs.end;
+        if(charge!=rhs.charge) return charge<rhs.charge;
+        return tover<rhs.tover;
+    }
+    bool operator==(const Hit& rhs) const {
+        return chan==rhs.chan && end==rhs.end && charge==rhs.charge && tover==rhs.tover;
+    }
+};
+
+struct Pulse
+{
+    uint16_t chan;
+    uint32_t time;
+};
+
+// Hits in the format of process_window_avx2(). index_to_channel maps
+// the channel index in the output to the online channel
+template<class F>
+void add_avx2_hits(const uint16_t* input_loc, uint32_t time_offset, F index_to_channel, std::set<Hit>& hits)
+{
+    while(*input_loc!=MAGIC){
+        const uint16_t* chan=input_loc;
+        const uint16_t* end=input_loc+16;
+        const uint16_t* charge=input_loc+32;
+        const uint16_t* tover=input_loc+48;
+        for(int i=0; i<16; ++i){
+            if(charge[i] && chan[i]!=MAGIC){
+                hits.insert(Hit{uint16_t(index_to_channel(chan[i])), time_offset+end[i], charge[i], tover[i]});
+            }
+        }
+        input_loc+=64;
+    }
+}
+
+// Hits in the format of process_window_naive()
+void add_naive_hits(const uint16_t* input_loc, uint32_t time_offset, std::set<Hit>& hits)
+{
+    while(*input_loc!=MAGIC){
+        hits.insert(Hit{uint16_t(all_index_to_channel(input_loc[0])), time_offset+input_loc[1], input_loc[2], input_loc[3]});
+        input_loc+=4;
+    }
+}
+
+ProcessingInfo make_processing_info(const int16_t* taps, uint8_t ntaps, uint8_t tap_exponent, uint8_t last_register, uint16_t* output)
+{
+    return ProcessingInfo(nullptr, FRAMES_PER_MSG, 0, last_register, output, taps, ntaps, tap_exponent, 0, 0);
+}
+
+void expect(bool ok, const char* data_name, const char* what)
+{
+    printf("%s %s %s\n", ok ? "OK  " : "FAIL", data_name, what);
+    if(!ok) ++n_failures;
+}
+
+// The filter with num_taps taps, padded with zeros to padded_taps, a power of two
+std::vector<int16_t> make_taps(int num_taps, size_t padded_taps, uint8_t tap_exponent)
+{
+    std::vector<int16_t> taps=firwin_int(num_taps, 0.1, 1<<tap_exponent);
+    taps.resize(padded_taps, 0);
+    return taps;
+}
+
+void check(const char* data_name, const dune::FelixFrame* frames, unsigned num_messages, const std::vector<Pulse>& pulses,
+           const std::vector<int16_t>& taps=make_taps(7, 8, 6), uint8_t tap_exponent=6)
+{
+    std::vector<uint16_t> out_all(100000), out_naive(100000), out_coll(100000);
+    ProcessingInfo pi_all=make_processing_info(taps.data(), taps.size(), tap_exponent, ALL_REGISTERS_PER_FRAME, out_all.data());
+    ProcessingInfo pi_naive=make_processing_info(taps.data(), taps.size(), tap_exponent, ALL_REGISTERS_PER_FRAME, out_naive.data());
+    ProcessingInfo pi_coll=make_processing_info(taps.data(), taps.size(), tap_exponent, REGISTERS_PER_FRAME, out_coll.data());
+
+    std::set<Hit> all_hits, naive_hits, coll_hits;
+    std::unique_ptr<MessageAllADCs> all_adcs(new MessageAllADCs);
+    for(unsigned imsg=0; imsg<num_messages; ++imsg){
+        const SUPERCHUNK_CHAR_STRUCT* scs=reinterpret_cast<const SUPERCHUNK_CHAR_STRUCT*>(frames+imsg*FRAMES_PER_MSG);
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> coll=expand_message_all_adcs(*scs, *all_adcs);
+        MessageCollectionADCs* mcadc=reinterpret_cast<MessageCollectionADCs*>(coll.data());
+        if(imsg==0){
+            pi_all.setState(all_adcs.get());
+            pi_naive.setState(all_adcs.get());
+            pi_coll.setState(mcadc);
+        }
+        pi_all.all_input=all_adcs.get();
+        pi_naive.all_input=all_adcs.get();
+        pi_coll.input=mcadc;
+        process_window_all_avx2(pi_all);
+        process_window_all_naive(pi_naive);
+        process_window_avx2(pi_coll);
+        const uint32_t t0=imsg*FRAMES_PER_MSG;
+        add_avx2_hits(out_all.data(), t0, all_index_to_channel, all_hits);
+        add_naive_hits(out_naive.data(), t0, naive_hits);
+        add_avx2_hits(out_coll.data(), t0, collection_index_to_channel, coll_hits);
+    }
+    printf("     %s: %zu taps: %zu hits on all channels, %zu on collection channels\n", data_name, taps.size(), all_hits.size(), coll_hits.size());
+
+    expect(all_hits==naive_hits, data_name, "AVX2 and scalar hits agree");
+
+    std::set<uint16_t> collection_channels;
+    for(int i=0; i<int(REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER); ++i) collection_channels.insert(collection_index_to_channel(i));
+    std::set<Hit> all_hits_coll;
+    for(auto const& hit: all_hits){
+        if(collection_channels.count(hit.chan)) all_hits_coll.insert(hit);
+    }
+    expect(all_hits_coll==coll_hits, data_name, "collection hits agree with process_window_avx2");
+
+    if(pulses.empty()) return;
+    // Every pulse has to give a hit ending in the pulse or a little after
+    std::multimap<uint16_t, uint32_t> hit_ends;
+    for(auto const& hit: all_hits) hit_ends.emplace(hit.chan, hit.end);
+    size_t n_found=0, n_found_induction=0, n_induction=0;
+    for(auto const& pulse: pulses){
+        const bool induction=collection_channels.count(pulse.chan)==0;
+        n_induction+=induction;
+        auto range=hit_ends.equal_range(pulse.chan);
+        for(auto it=range.first; it!=range.second; ++it){
+            if(it->second+10>=pulse.time && it->second<=pulse.time+20){
+                ++n_found;
+                n_found_induction+=induction;
+                break;
+            }
+        }
+    }
+    printf("     %s: found %zu of %zu pulses (%zu of %zu on induction channels)\n", data_name, n_found, pulses.size(), n_found_induction, n_induction);
+    expect(n_found==pulses.size() && n_induction>0, data_name, "injected pulses found");
+}
+
+// Frames with a pedestal and a little noise in each channel, and a
+// pulse every few ticks on a random channel: unipolar on collection
+// channels and bipolar on induction channels
+std::vector<dune::FelixFrame> make_frames(unsigned num_frames, std::vector<Pulse>& pulses)
+{
+    std::mt19937 rng(13);
+    std::uniform_int_distribution<int> noise(-3, 3);
+    std::uniform_int_distribution<int> pedestal(400, 900);
+    std::uniform_int_distribution<unsigned> channel(0, NCHANS-1);
+
+    std::set<uint16_t> collection_channels;
+    for(int i=0; i<int(REGISTERS_PER_FRAME*SAMPLES_PER_REGISTER); ++i) collection_channels.insert(collection_index_to_channel(i));
+
+    std::vector<std::vector<float>> signal(NCHANS, std::vector<float>(num_frames, 0));
+    // Leave the pedestal finding some time to settle at the start
+    for(uint32_t t=600; t+50<num_frames; t+=7){
+        const uint16_t ch=channel(rng);
+        // Not too close to the previous pulse on the channel
+        bool clash=false;
+        for(auto const& p: pulses) if(p.chan==ch && p.time+60>t) clash=true;
+        if(clash) continue;
+        pulses.push_back(Pulse{ch, t});
+        const bool induction=collection_channels.count(ch)==0;
+        for(int dt=-10; dt<=10; ++dt){
+            const float x=dt/3.f;
+            signal[ch][t+dt]+=induction ? -150*x*std::exp(-x*x/2) : 200*std::exp(-x*x/2);
+        }
+    }
+
+    std::vector<int> peds(NCHANS);
+    for(auto& p: peds) p=pedestal(rng);
+    std::vector<dune::FelixFrame> frames(num_frames);
+    memset(frames.data(), 0, num_frames*sizeof(dune::FelixFrame));
+    for(unsigned i=0; i<num_frames; ++i){
+        dune::FelixFrame& frame=frames[i];
+        frame.set_fiber_no(1);
+        frame.set_crate_no(6);
+        frame.set_slot_no(2);
+        frame.set_timestamp(0x1234567800ull+25*i);
+        for(unsigned ch=0; ch<NCHANS; ++ch){
+            const int adc=peds[ch]+noise(rng)+int(std::lround(signal[ch][i]));
+            frame.set_channel(ch, std::min(0xfff, std::max(0, adc)));
+        }
+    }
+    return frames;
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Check hit finding on all channels against the scalar and collection-only versions"};
+
+    std::string input_file;
+    app.add_option("-f", input_file, "Optional FrameFile to check as well", false);
+    unsigned num_messages=1000;
+    app.add_option("-n", num_messages, "Number of synthetic messages", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    std::vector<Pulse> pulses;
+    std::vector<dune::FelixFrame> frames=make_frames(num_messages*FRAMES_PER_MSG, pulses);
+    check("synthetic", frames.data(), num_messages, pulses);
+    // 16 taps, and 64, which has no kernel of its own
+    check("synthetic", frames.data(), num_messages, std::vector<Pulse>(), make_taps(13, 16, 6), 6);
+    check("synthetic", frames.data(), num_messages, std::vector<Pulse>(), make_taps(40, 64, 7), 7);
+
+    if(!input_file.empty()){
+        FrameFile f(input_file.c_str());
+        check("file", f.fragment(0), FrameFile::frames_per_fragment/FRAMES_PER_MSG, std::vector<Pulse>());
+        check("file", f.fragment(0), FrameFile::frames_per_fragment/FRAMES_PER_MSG, std::vector<Pulse>(), make_taps(20, 32, 6), 6);
+    }
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("All-channel hit finding agrees with the references\n");
+    return 0;
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,200 @@
+// Check that the AVX-512 and portable hit finding kernels give exactly
+// the same output as the AVX2 ones on synthetic frames from
+// WIBGenerator, and on the data in a FrameFile with -f: the same words
+// in the same order, window by window. Covers collection and all
+// channels, filter lengths with and without their own kernels, windows
+// of one and several messages, and register ranges that don't split
+// into pairs, and the pedestals held still, as when the finder is
+// behind. Also checks that the scalar frame expansion gives the same
+// ADCs as the AVX2 one. The AVX-512 kernels are skipped on CPUs
+// without AVX-512BW.
+
+#include "../process_avx2.h"
+#include "../process_avx512.h"
+#include "../process_scalar.h"
+#include "../hit_finder.h"
+#include "../design_fir.h"
+#include "FrameFile.h"
+#include "WIBGenerator.h"
+#include "CLI11.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+struct Config
+{
+    bool all_channels;
+    int num_taps;     // Before padding
+    size_t padded_taps;
+    uint8_t first_register, last_register;
+    size_t window_messages;
+    bool update_pedestals=true;
+};
+
+// The output up to and including the MAGIC group at the end
+std::vector<uint16_t> hits_of(const std::vector<uint16_t>& output)
+{
+    size_t n=0;
+    while(output[n]!=MAGIC) n+=4*SAMPLES_PER_REGISTER;
+    return std::vector<uint16_t>(output.begin(), output.begin()+n+4*SAMPLES_PER_REGISTER);
+}
+
+// Run `finder` and the AVX2 kernel side by side over the messages, and compare every window
+void check(const char* name, HitFinder finder, const Config& c,
+           MessageCollectionADCs* coll_adcs, MessageAllADCs* all_adcs, size_t num_messages)
+{
+    const uint8_t tap_exponent=6;
+    std::vector<int16_t> taps=firwin_int(c.num_taps, 0.1, 1<<tap_exponent);
+    taps.resize(c.padded_taps, 0);
+
+    const size_t output_size=(ALL_REGISTERS_PER_FRAME*FRAMES_PER_MSG*c.window_messages+1)*4*SAMPLES_PER_REGISTER;
+    std::vector<uint16_t> out_ref(output_size), out_test(output_size);
+    std::unique_ptr<ProcessingInfo> pi_ref(new ProcessingInfo(nullptr, FRAMES_PER_MSG*c.window_messages, c.first_register, c.last_register,
+                                                              out_ref.data(), taps.data(), taps.size(), tap_exponent, 0, 0));
+    std::unique_ptr<ProcessingInfo> pi_test(new ProcessingInfo(nullptr, FRAMES_PER_MSG*c.window_messages, c.first_register, c.last_register,
+                                                               out_test.data(), taps.data(), taps.size(), tap_exponent, 0, 0));
+    HitFinder reference=c.all_channels ? process_window_all_avx2 : process_window_avx2;
+    for(ProcessingInfo* pi: {pi_ref.get(), pi_test.get()}){
+        if(c.all_channels) pi->setState(&all_adcs[0]);
+        else               pi->setState(&coll_adcs[0]);
+        pi->update_pedestals=c.update_pedestals;
+    }
+    const std::vector<int16_t> initial_pedestals(pi_test->chanState.pedestals, pi_test->chanState.pedestals+ChanState::NCHANS);
+
+    size_t n_hit_groups=0;
+    bool ok=true;
+    for(size_t imsg=0; imsg+c.window_messages<=num_messages; imsg+=c.window_messages){
+        for(ProcessingInfo* pi: {pi_ref.get(), pi_test.get()}){
+            pi->input=&coll_adcs[imsg];
+            pi->all_input=&all_adcs[imsg];
+        }
+        reference(*pi_ref);
+        finder(*pi_test);
+        const std::vector<uint16_t> hits_ref=hits_of(out_ref);
+        if(hits_ref!=hits_of(out_test) || pi_ref->nhits!=pi_test->nhits){
+            if(ok) printf("     first difference in the window starting at message %zu\n", imsg);
+            ok=false;
+        }
+        n_hit_groups+=hits_ref.size()/(4*SAMPLES_PER_REGISTER)-1;
+    }
+    if(!c.update_pedestals &&
+       !std::equal(initial_pedestals.begin(), initial_pedestals.end(), pi_test->chanState.pedestals)){
+        printf("     the pedestals changed\n");
+        ok=false;
+    }
+    char what[200];
+    snprintf(what, sizeof(what), "%s %s channels, %d taps padded to %zu, registers [%d, %d), %zu message windows%s: %zu hit groups",
+             name, c.all_channels ? "all" : "collection", c.num_taps, c.padded_taps,
+             c.first_register, c.last_register, c.window_messages,
+             c.update_pedestals ? "" : ", fixed pedestals", n_hit_groups);
+    printf("%s %s\n", ok ? "OK  " : "FAIL", what);
+    if(!ok) ++n_failures;
+}
+
+// The scalar expansions give the same ADCs as the AVX2 ones
+void check_expansion(const char* source, const SUPERCHUNK_CHAR_STRUCT* messages, size_t num_messages)
+{
+    std::unique_ptr<MessageAllADCs> all_avx2(new MessageAllADCs), all_scalar(new MessageAllADCs);
+    bool ok=true;
+    for(size_t imsg=0; imsg<num_messages; ++imsg){
+        const SUPERCHUNK_CHAR_STRUCT& scs=messages[imsg];
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> coll_avx2=expand_message_adcs_avx2(scs);
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> coll_scalar=expand_message_adcs_scalar(scs);
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> from_all_avx2=expand_message_all_adcs_avx2(scs, *all_avx2);
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> from_all_scalar=expand_message_all_adcs_scalar(scs, *all_scalar);
+        if(memcmp(coll_avx2.data(), coll_scalar.data(), sizeof(MessageCollectionADCs)) ||
+           memcmp(coll_avx2.data(), from_all_avx2.data(), sizeof(MessageCollectionADCs)) ||
+           memcmp(coll_avx2.data(), from_all_scalar.data(), sizeof(MessageCollectionADCs)) ||
+           memcmp(coll_avx2.data(), collection_adcs_from_all_avx2(*all_scalar).data(), sizeof(MessageCollectionADCs)) ||
+           memcmp(all_avx2.get(), all_scalar.get(), sizeof(MessageAllADCs))){
+            if(ok) printf("     first difference in message %zu\n", imsg);
+            ok=false;
+        }
+    }
+    printf("%s %s: scalar expansion of %zu messages\n", ok ? "OK  " : "FAIL", source, num_messages);
+    if(!ok) ++n_failures;
+}
+
+// Expand the messages, and check every kernel on them
+void check_messages(const char* source, const SUPERCHUNK_CHAR_STRUCT* messages, size_t num_messages)
+{
+    printf("     %s frames\n", source);
+    check_expansion(source, messages, num_messages);
+
+    std::unique_ptr<MessageCollectionADCs[]> coll_adcs(new MessageCollectionADCs[num_messages]);
+    std::unique_ptr<MessageAllADCs[]> all_adcs(new MessageAllADCs[num_messages]);
+    for(size_t imsg=0; imsg<num_messages; ++imsg){
+        RegisterArray<REGISTERS_PER_FRAME*FRAMES_PER_MSG> coll=expand_message_all_adcs(messages[imsg], all_adcs[imsg]);
+        memcpy(&coll_adcs[imsg], coll.data(), sizeof(MessageCollectionADCs));
+    }
+
+    const std::vector<Config> configs{
+        {false, 7,  8,  0, REGISTERS_PER_FRAME,     1},
+        {false, 7,  8,  0, REGISTERS_PER_FRAME,     5},
+        {false, 13, 16, 1, 4,                       1},
+        {false, 40, 64, 0, REGISTERS_PER_FRAME,     3},
+        {true,  7,  8,  0, ALL_REGISTERS_PER_FRAME, 1},
+        {true,  7,  8,  3, 14,                      4},
+        {true,  20, 32, 0, ALL_REGISTERS_PER_FRAME, 2},
+        {true,  40, 64, 5, 6,                       1},
+        {false, 7,  8,  0, REGISTERS_PER_FRAME,     2, false},
+        {true,  7,  8,  0, ALL_REGISTERS_PER_FRAME, 2, false},
+    };
+    const bool has_avx512=cpu_has_avx512bw();
+    if(!has_avx512) printf("     no AVX-512BW on this CPU: only checking the portable kernels\n");
+    for(auto const& c: configs){
+        if(has_avx512) check("avx512", c.all_channels ? process_window_all_avx512 : process_window_avx512, c, coll_adcs.get(), all_adcs.get(), num_messages);
+        check("scalar", c.all_channels ? process_window_all_scalar : process_window_scalar, c, coll_adcs.get(), all_adcs.get(), num_messages);
+    }
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Check the AVX-512 and portable hit finding against the AVX2 version"};
+
+    std::string input_file;
+    app.add_option("-f", input_file, "Optional FrameFile to check as well", false);
+    size_t num_messages=FrameFile::frames_per_fragment/FRAMES_PER_MSG;
+    app.add_option("-n", num_messages, "Number of synthetic messages", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    if(!cpu_has_avx2()){
+        printf("     no AVX2 on this CPU: no reference to check against\n");
+        return 0;
+    }
+
+    // Enough tracks that every window has hits
+    WIBGenerator::Config config;
+    config.track_rate_hz=2000;
+    WIBGenerator generator(config, num_messages);
+    std::vector<SUPERCHUNK_CHAR_STRUCT> messages(num_messages);
+    for(size_t imsg=0; imsg<num_messages; ++imsg) generator.copy(imsg, messages[imsg], 0x1234567800ull+imsg*FRAMES_PER_MSG*25);
+    check_messages("synthetic", messages.data(), num_messages);
+
+    if(!input_file.empty()){
+        FrameFile f(input_file.c_str());
+        check_messages("file", reinterpret_cast<const SUPERCHUNK_CHAR_STRUCT*>(f.fragment(0)), FrameFile::frames_per_fragment/FRAMES_PER_MSG);
+    }
+    printf("     select_hit_finder() picks %s on this CPU\n", hit_finder_name(select_hit_finder(false)));
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("The AVX-512 and portable kernels agree with the AVX2 ones\n");
+    return 0;
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
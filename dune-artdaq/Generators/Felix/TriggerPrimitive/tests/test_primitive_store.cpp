@@ -0,0 +1,222 @@
+// Check PrimitiveStore against a reference: the store is filled with
+// a known pattern of hits per message (with occasional bursts much
+// bigger than the initial size of the primitive ring), then
+//  - windows inside the retention have to give exactly the hits of
+//    the messages in [start, end),
+//  - windows older than the retention have to be refused or clipped,
+//  - readers running alongside the writer may fail validation or
+//    fall behind the retention, but whatever they accept has to be right,
+//  - with a size cap, the ring stays under it and the bursts drop the
+//    oldest hits, which readers see as overwritten, never as wrong hits.
+
+#include "../PrimitiveStore.h"
+#include "CLI11.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+constexpr uint64_t ticksPerMessage=300;
+constexpr uint64_t firstTimestamp=0x1234567800ull;
+
+uint64_t message_timestamp(uint64_t imsg) { return firstTimestamp+imsg*ticksPerMessage; }
+
+// Hits in message imsg: a few usually, a burst every 1000 messages
+unsigned hits_in_message(uint64_t imsg) { return (imsg%1000==999) ? 5000 : imsg%5; }
+
+void fill_message(PrimitiveStore& store, uint64_t imsg)
+{
+    for(unsigned i=0; i<hits_in_message(imsg); ++i){
+        store.emplace(message_timestamp(imsg), uint16_t(imsg), uint16_t(i), uint16_t(i+1), uint16_t(imsg%7));
+    }
+    store.publish(message_timestamp(imsg));
+}
+
+// Are the hits exactly those of messages [first_msg, end_msg)?
+bool hits_match(const std::vector<dune::TriggerPrimitive>& hits, uint64_t first_msg, uint64_t end_msg)
+{
+    size_t ihit=0;
+    for(uint64_t imsg=first_msg; imsg<end_msg; ++imsg){
+        for(unsigned i=0; i<hits_in_message(imsg); ++i, ++ihit){
+            if(ihit>=hits.size()) return false;
+            const dune::TriggerPrimitive& p=hits[ihit];
+            if(p.messageTimestamp!=message_timestamp(imsg) || p.channel!=uint16_t(imsg) ||
+               p.endTime!=uint16_t(i) || p.charge!=uint16_t(i+1) || p.timeOverThreshold!=uint16_t(imsg%7)) return false;
+        }
+    }
+    return ihit==hits.size();
+}
+
+PrimitiveStore::Status get_window(const PrimitiveStore& store, uint64_t start_ts, uint64_t end_ts,
+                                  std::vector<dune::TriggerPrimitive>& hits)
+{
+    PrimitiveStore::Window w;
+    PrimitiveStore::Status status=store.locate(start_ts, end_ts, w);
+    hits.clear();
+    if(status!=PrimitiveStore::Status::Ok && status!=PrimitiveStore::Status::TooOld) return status;
+    hits.resize(w.size());
+    store.copy(w, hits.data());
+    if(!store.valid(w)) return PrimitiveStore::Status::Overwritten;
+    return status;
+}
+
+void expect(bool ok, const char* what)
+{
+    printf("%s %s\n", ok ? "OK  " : "FAIL", what);
+    if(!ok) ++n_failures;
+}
+
+void check_sequential(uint64_t retention_messages, uint64_t n_messages)
+{
+    PrimitiveStore store(retention_messages*ticksPerMessage, ticksPerMessage);
+    const size_t initial_capacity=store.primitiveCapacity();
+    for(uint64_t imsg=0; imsg<n_messages; ++imsg) fill_message(store, imsg);
+    const uint64_t newest=n_messages-1;
+
+    expect(store.latestTimestamp()==message_timestamp(newest), "latest timestamp");
+    expect(store.primitiveCapacity()>initial_capacity, "primitive ring grew for the bursts");
+
+    // Every window of up to 30 messages inside the retention, with
+    // start and end both on and between message timestamps
+    std::vector<dune::TriggerPrimitive> hits;
+    bool all_ok=true;
+    for(uint64_t first=newest-retention_messages+1; first<=newest; first+=7){
+        for(uint64_t len=0; len<30 && first+len<=newest+1; len+=3){
+            for(uint64_t shift: {uint64_t(0), ticksPerMessage/2}){
+                // Messages with timestamps in [start, end)
+                const uint64_t start_ts=message_timestamp(first)-shift;
+                const uint64_t end_ts=message_timestamp(first+len)-shift;
+                const uint64_t first_msg=first;
+                const uint64_t end_msg=first+len;
+                if(get_window(store, start_ts, end_ts, hits)!=PrimitiveStore::Status::Ok ||
+                   !hits_match(hits, first_msg, end_msg)){
+                    printf("    window [%lu, %lu) messages, shift %lu: %zu hits\n", first_msg, end_msg, shift, hits.size());
+                    all_ok=false;
+                }
+            }
+        }
+    }
+    expect(all_ok, "windows inside the retention");
+
+    // Older than the retention, but perhaps still in the bucket ring: refused or clipped
+    const uint64_t old_first=newest-2*retention_messages;
+    PrimitiveStore::Status status=get_window(store, message_timestamp(old_first), message_timestamp(old_first+10), hits);
+    expect(status==PrimitiveStore::Status::TooOld || status==PrimitiveStore::Status::Ok, "window older than the retention");
+
+    // A window that starts before the oldest message and ends in the
+    // retention gives what is left, flagged TooOld
+    const uint64_t end_msg=newest-retention_messages/2;
+    status=get_window(store, message_timestamp(0), message_timestamp(end_msg), hits);
+    bool clipped_ok=(status==PrimitiveStore::Status::TooOld && !hits.empty() && hits.back().messageTimestamp==message_timestamp(end_msg-1));
+    expect(clipped_ok, "window clipped at the oldest message");
+
+    // A window after the newest message is empty
+    status=get_window(store, message_timestamp(newest+1), message_timestamp(newest+10), hits);
+    expect(status==PrimitiveStore::Status::Ok && hits.empty(), "window after the newest message");
+}
+
+void check_capped(uint64_t retention_messages, uint64_t n_messages)
+{
+    // Room for the hits of the retention, but not for a burst on top
+    const size_t max_primitives=3*retention_messages;
+    PrimitiveStore store(retention_messages*ticksPerMessage, ticksPerMessage, 1, max_primitives*sizeof(dune::TriggerPrimitive));
+    // Stop half way between two bursts
+    const uint64_t n_filled=n_messages-n_messages%1000+500;
+    for(uint64_t imsg=0; imsg<n_filled; ++imsg) fill_message(store, imsg);
+    const uint64_t newest=n_filled-1;
+
+    expect(store.primitiveCapacity()<=max_primitives, "capped ring stays under the cap");
+    expect(store.droppedPrimitives()>0, "capped ring drops hits in the bursts");
+
+    // Windows inside the retention are right, or refused as overwritten
+    std::vector<dune::TriggerPrimitive> hits;
+    bool all_ok=true;
+    size_t n_ok=0;
+    for(uint64_t first=newest-retention_messages+1; first<=newest; first+=7){
+        const uint64_t end=std::min(first+20, newest+1);
+        PrimitiveStore::Status status=get_window(store, message_timestamp(first), message_timestamp(end), hits);
+        if(status==PrimitiveStore::Status::Ok){
+            if(hits_match(hits, first, end)) ++n_ok;
+            else all_ok=false;
+        }
+        else if(status!=PrimitiveStore::Status::Overwritten){
+            all_ok=false;
+        }
+    }
+    expect(all_ok && n_ok>0, "windows inside the retention of a capped ring");
+}
+
+void check_concurrent(uint64_t retention_messages, uint64_t n_messages, unsigned n_readers,
+                      size_t max_bytes=std::numeric_limits<size_t>::max())
+{
+    PrimitiveStore store(retention_messages*ticksPerMessage, ticksPerMessage, 1, max_bytes);
+    std::atomic<bool> done{false};
+    std::atomic<size_t> n_checked{0}, n_overwritten{0}, n_wrong{0}, n_timeouts{0};
+
+    std::vector<std::thread> readers;
+    for(unsigned ireader=0; ireader<n_readers; ++ireader){
+        readers.emplace_back([&, ireader](){
+                std::vector<dune::TriggerPrimitive> hits;
+                uint64_t k=ireader;
+                while(!done.load()){
+                    // A window a little way back from the newest message, as hitsToFragment would ask for
+                    const uint64_t latest=store.latestTimestamp();
+                    if(latest<message_timestamp(100)) continue;
+                    const uint64_t newest=(latest-firstTimestamp)/ticksPerMessage;
+                    const uint64_t first=newest-(k++%90);
+                    const uint64_t len=k%20;
+                    if(!store.waitFor(message_timestamp(first+len), std::chrono::milliseconds(1000))){
+                        ++n_timeouts;
+                        continue;
+                    }
+                    PrimitiveStore::Status status=get_window(store, message_timestamp(first), message_timestamp(first+len), hits);
+                    // The writer may get past the retention of a slow reader
+                    if(status==PrimitiveStore::Status::Overwritten || status==PrimitiveStore::Status::TooOld) ++n_overwritten;
+                    else if(status!=PrimitiveStore::Status::Ok || !hits_match(hits, first, first+len)) ++n_wrong;
+                    else ++n_checked;
+                }
+            });
+    }
+    for(uint64_t imsg=0; imsg<n_messages; ++imsg) fill_message(store, imsg);
+    done.store(true);
+    for(auto& t: readers) t.join();
+
+    printf("     concurrent: %zu windows checked, %zu overwritten or too old, %zu timeouts\n",
+           n_checked.load(), n_overwritten.load(), n_timeouts.load());
+    expect(n_wrong.load()==0 && n_checked.load()>0, "windows read alongside the writer");
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Check PrimitiveStore against a reference"};
+
+    uint64_t n_messages=200000;
+    app.add_option("-n", n_messages, "Number of messages to write", true);
+    uint64_t retention_messages=5000;
+    app.add_option("-r", retention_messages, "Retention in messages", true);
+    unsigned n_readers=3;
+    app.add_option("-t", n_readers, "Number of concurrent readers", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    check_sequential(retention_messages, n_messages);
+    // A short retention, so that readers race with the writer
+    check_concurrent(100, n_messages, n_readers);
+    check_capped(retention_messages, n_messages);
+    // Readers alongside a writer that keeps dropping hits at the cap
+    check_concurrent(2000, n_messages, n_readers, 4096*sizeof(dune::TriggerPrimitive));
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("PrimitiveStore agrees with the reference\n");
+    return 0;
+}
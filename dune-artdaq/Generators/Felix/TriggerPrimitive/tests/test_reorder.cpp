@@ -0,0 +1,158 @@
+// Check the AVX2 and AVX512 FelixReorder kernels against the baseline
+// do_reorder: the whole output (ADCs, bitfield of faulty frames and
+// the copied headers) has to be identical, both for a whole window at
+// once and for a window reordered in parts of uneven size. Runs on
+// synthetic frames with some corrupt headers, and on the first
+// fragment of a FrameFile with -f. Kernels that the CPU can not run
+// are skipped.
+
+#include "../../FelixReorder.hh"
+#include "FrameFile.h"
+#include "CLI11.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+typedef bool (*ReorderFn)(uint8_t*, const uint8_t*, const unsigned&, unsigned*);
+typedef bool (*ReorderPartFn)(uint8_t*, const uint8_t*, const unsigned, const unsigned, const unsigned&, unsigned*);
+
+std::vector<uint8_t> run_whole(ReorderFn fn, const uint8_t* frames, unsigned num_frames, unsigned& num_faulty)
+{
+    std::vector<uint8_t> out(FelixReorder::calculate_reordered_size(num_frames, num_frames));
+    num_faulty=0;
+    if(!fn(out.data(), frames, num_frames, &num_faulty)) out.clear();
+    else out.resize(FelixReorder::calculate_reordered_size(num_frames, num_faulty));
+    return out;
+}
+
+// Parts of 1 to 29 frames, so most of them are not a multiple of four
+std::vector<uint8_t> run_parts(ReorderPartFn fn, const uint8_t* frames, unsigned num_frames, unsigned& num_faulty)
+{
+    std::vector<uint8_t> out(FelixReorder::calculate_reordered_size(num_frames, num_frames));
+    std::mt19937 rng(num_frames);
+    std::uniform_int_distribution<unsigned> part_size(1, 29);
+    num_faulty=0;
+    for(unsigned start=0; start<num_frames; ){
+        unsigned stop=std::min(num_frames, start+part_size(rng));
+        if(!fn(out.data(), frames+start*FelixReorder::m_num_bytes_per_frame, start, stop, num_frames, &num_faulty)){
+            out.clear();
+            return out;
+        }
+        start=stop;
+    }
+    out.resize(FelixReorder::calculate_reordered_size(num_frames, num_faulty));
+    return out;
+}
+
+void compare(const char* data_name, const char* kernel, const std::vector<uint8_t>& expected, unsigned expected_faulty,
+             const std::vector<uint8_t>& got, unsigned got_faulty)
+{
+    if(got.empty()){
+        printf("FAIL %s %s: kernel returned false\n", data_name, kernel);
+        ++n_failures;
+    }
+    else if(got_faulty!=expected_faulty || got!=expected){
+        size_t first_diff=0;
+        while(first_diff<std::min(got.size(), expected.size()) && got[first_diff]==expected[first_diff]) ++first_diff;
+        printf("FAIL %s %s: %u faulty frames instead of %u, first difference at byte %zu\n",
+               data_name, kernel, got_faulty, expected_faulty, first_diff);
+        ++n_failures;
+    }
+    else{
+        printf("OK   %s %s\n", data_name, kernel);
+    }
+}
+
+void check(const char* data_name, const uint8_t* frames, unsigned num_frames)
+{
+    unsigned expected_faulty=0;
+    const std::vector<uint8_t> expected=run_whole(FelixReorder::do_reorder, frames, num_frames, expected_faulty);
+    printf("%s: %u frames, %u faulty\n", data_name, num_frames, expected_faulty);
+
+    unsigned faulty=0;
+    std::vector<uint8_t> got=run_parts(FelixReorder::do_reorder_part, frames, num_frames, faulty);
+    compare(data_name, "baseline parts", expected, expected_faulty, got, faulty);
+
+    if(FelixReorder::avx_available){
+        got=run_whole(FelixReorder::do_avx_reorder, frames, num_frames, faulty);
+        compare(data_name, "AVX2", expected, expected_faulty, got, faulty);
+        got=run_parts(FelixReorder::do_avx_reorder_part, frames, num_frames, faulty);
+        compare(data_name, "AVX2 parts", expected, expected_faulty, got, faulty);
+    }
+    else{
+        printf("SKIP %s AVX2: not supported by this CPU\n", data_name);
+    }
+
+    if(FelixReorder::avx512_available){
+        got=run_whole(FelixReorder::do_avx512_reorder, frames, num_frames, faulty);
+        compare(data_name, "AVX512", expected, expected_faulty, got, faulty);
+        got=run_parts(FelixReorder::do_avx512_reorder_part, frames, num_frames, faulty);
+        compare(data_name, "AVX512 parts", expected, expected_faulty, got, faulty);
+    }
+    else{
+        printf("SKIP %s AVX512: not supported by this CPU\n", data_name);
+    }
+}
+
+// Frames with random ADC values and consistent headers, except for a
+// few frames with a timestamp or a convert count that is off
+std::vector<dune::FelixFrame> make_frames(unsigned num_frames)
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<uint16_t> adc(0, 0xfff);
+    std::uniform_int_distribution<unsigned> corrupt(0, 99);
+    std::vector<dune::FelixFrame> frames(num_frames);
+    memset(frames.data(), 0, num_frames*sizeof(dune::FelixFrame));
+    for(unsigned i=0; i<num_frames; ++i){
+        dune::FelixFrame& frame=frames[i];
+        frame.set_fiber_no(1);
+        frame.set_crate_no(6);
+        frame.set_slot_no(2);
+        frame.set_timestamp(0x1234567800ull+25*i+(corrupt(rng)==0 ? 1 : 0));
+        for(uint8_t b=0; b<4; ++b){
+            frame.set_coldata_convert_count(b, i+(corrupt(rng)==0 ? 7 : 0));
+        }
+        for(unsigned ch=0; ch<dune::FelixFrame::num_ch_per_frame; ++ch){
+            frame.set_channel(ch, adc(rng));
+        }
+    }
+    return frames;
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Compare the FelixReorder kernels with the baseline"};
+
+    std::string input_file;
+    app.add_option("-f", input_file, "Optional FrameFile to check as well", false);
+    unsigned num_frames=6024;
+    app.add_option("-n", num_frames, "Number of synthetic frames", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    printf("CPU: AVX2 %s, AVX512 %s\n", FelixReorder::avx_available ? "yes" : "no", FelixReorder::avx512_available ? "yes" : "no");
+
+    std::vector<dune::FelixFrame> frames=make_frames(num_frames);
+    check("synthetic", reinterpret_cast<const uint8_t*>(frames.data()), num_frames);
+    // A window that does not end on a multiple of four frames
+    check("synthetic odd", reinterpret_cast<const uint8_t*>(frames.data()), 1001);
+
+    if(!input_file.empty()){
+        FrameFile f(input_file.c_str());
+        check("file", reinterpret_cast<const uint8_t*>(f.fragment(0)), FrameFile::frames_per_fragment);
+    }
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("All kernels agree with the baseline\n");
+    return 0;
+}
@@ -0,0 +1,171 @@
+// Check the merging of the hits of several workers (num_workers > 1):
+//  - when every worker gets every message, the merged hits of each
+//    message are exactly those a single worker finds, and no message
+//    is flagged, and
+//  - when the writer laps the workers, the messages merged without
+//    the hits of some worker, and only those, carry
+//    DegradedTrailer::MissingRegisters.
+// Runs on synthetic frames from WIBGenerator.
+
+#include "../TriggerPrimitiveFinder.h"
+#include "WIBGenerator.h"
+#include "channel_maps.h"
+#include "CLI11.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+const uint64_t clocksPerTPCTick=25;
+const uint64_t ticksPerMessage=FRAMES_PER_MSG*clocksPerTPCTick;
+const uint64_t firstTimestamp=0x1234567800ull;
+
+uint64_t message_timestamp(uint64_t imsg) { return firstTimestamp+imsg*ticksPerMessage; }
+
+void expect(bool ok, const char* what)
+{
+    printf("%s %s\n", ok ? "OK  " : "FAIL", what);
+    if(!ok) ++n_failures;
+}
+
+bool same_hits(const std::vector<dune::TriggerPrimitive>& a, const std::vector<dune::TriggerPrimitive>& b)
+{
+    if(a.size()!=b.size()) return false;
+    for(size_t i=0; i<a.size(); ++i){
+        if(a[i].messageTimestamp!=b[i].messageTimestamp || a[i].channel!=b[i].channel ||
+           a[i].endTime!=b[i].endTime || a[i].charge!=b[i].charge || a[i].timeOverThreshold!=b[i].timeOverThreshold) return false;
+    }
+    return true;
+}
+
+// What a TPF made of the messages
+struct Result
+{
+    std::vector<std::vector<dune::TriggerPrimitive>> hits; // per message
+    std::vector<uint8_t> flags;                            // per message
+    size_t skipped=0, partial=0;
+};
+
+// Write n_messages messages of `generator` through a TPF with n_workers
+// workers. With `paced`, the writer never gets a buffer's length ahead
+// of the TPF, else it writes as fast as it can into a small buffer
+Result run(const WIBGenerator& generator, unsigned n_workers, uint64_t n_messages, bool paced, bool induction)
+{
+    LinkBuffer buffer(paced ? 1024 : 16, ticksPerMessage);
+
+    fhicl::ParameterSet ps;
+    ps.put<bool>("send_ptmp_messages", false);
+    put_channel_maps(ps);
+    ps.put<uint32_t>("window_offset", 500);
+    ps.put<unsigned>("num_workers", n_workers);
+    ps.put<bool>("find_induction_hits", induction);
+    // Lapped workers have to skip messages rather than degrade
+    ps.put<std::vector<double>>("degrade_backlog_fractions", std::vector<double>());
+    ps.put<std::string>("zmq_hit_send_connection", "");
+    ps.put<std::vector<int32_t>>("cpus_to_pin", std::vector<int32_t>());
+    ps.put<size_t>("metric_reporting_interval_seconds", 1);
+
+    Result result;
+    std::unique_ptr<TriggerPrimitiveFinder> tpf(new TriggerPrimitiveFinder(ps, buffer));
+    while(!tpf->readyForMessages()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    for(uint64_t imsg=0; imsg<n_messages; ++imsg){
+        while(paced && buffer.written()-tpf->nextSequence()>=buffer.capacity()-1){
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+        SUPERCHUNK_CHAR_STRUCT* scs=buffer.claim();
+        generator.copy(imsg%generator.size(), *scs, message_timestamp(imsg));
+        buffer.publish();
+    }
+    for(int i=0; i<5000 && tpf->nextSequence()<buffer.written(); ++i){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    for(uint64_t imsg=0; imsg<n_messages; ++imsg){
+        uint8_t flags=0;
+        result.hits.push_back(tpf->getHitsForWindow(message_timestamp(imsg), message_timestamp(imsg+1), &flags));
+        result.flags.push_back(flags);
+    }
+    result.skipped=tpf->messagesSkipped();
+    result.partial=tpf->messagesPartial();
+    tpf->stop();
+    return result;
+}
+
+void check_paced(const WIBGenerator& generator, uint64_t n_messages, bool induction)
+{
+    const Result reference=run(generator, 1, n_messages, true, induction);
+    size_t n_hits=0;
+    for(auto const& hits: reference.hits) n_hits+=hits.size();
+    printf("     %s: %zu hits from one worker\n", induction ? "all channels" : "collection", n_hits);
+    expect(reference.skipped==0 && n_hits>0, "one worker gets every message, and finds hits");
+
+    for(unsigned n_workers: {2u, 3u, 6u}){
+        const Result merged=run(generator, n_workers, n_messages, true, induction);
+        bool same=merged.skipped==0;
+        bool flagged=merged.partial!=0;
+        for(uint64_t imsg=0; imsg<n_messages; ++imsg){
+            if(!same_hits(merged.hits[imsg], reference.hits[imsg])) same=false;
+            if(merged.flags[imsg]) flagged=true;
+        }
+        printf("     %u workers\n", n_workers);
+        expect(same, "merged hits of every message are those of one worker");
+        expect(!flagged, "no message is flagged");
+    }
+}
+
+void check_lapped(const WIBGenerator& generator, uint64_t n_messages)
+{
+    const Result lapped=run(generator, 3, n_messages, false, true);
+    size_t n_flagged=0;
+    for(uint8_t flags: lapped.flags){
+        if(flags & TriggerPrimitiveFinder::DegradedTrailer::MissingRegisters) ++n_flagged;
+    }
+    printf("     lapped: %zu messages skipped, %zu merged without every worker, %zu flagged\n",
+           lapped.skipped, lapped.partial, n_flagged);
+    expect(lapped.skipped>0 && lapped.partial>0, "the writer lapped the workers, some more than others");
+    expect(n_flagged==lapped.partial, "exactly the partly merged messages are flagged MissingRegisters");
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Check the merging of the hits of several TPF workers"};
+
+    uint64_t n_messages=5000;
+    app.add_option("-n", n_messages, "Number of messages", true);
+    uint64_t n_lapped=100000;
+    app.add_option("-l", n_lapped, "Number of messages for the lapped workers", true);
+    bool show_output=false;
+    app.add_flag("-v", show_output, "Show DAQLogger output from TPF");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if(!show_output) mf::setStandAloneMessageThreshold({"ERROR"});
+
+    WIBGenerator::Config config;
+    config.track_rate_hz=2000;
+    WIBGenerator generator(config, 4096);
+
+    check_paced(generator, n_messages, false);
+    check_paced(generator, n_messages, true);
+    check_lapped(generator, n_lapped);
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("The hits of several workers merge into those of one\n");
+    return 0;
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
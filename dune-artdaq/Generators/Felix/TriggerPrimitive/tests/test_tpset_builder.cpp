@@ -0,0 +1,170 @@
+// Check the TPSets that TPSetBuilder sends: a stream of messages with
+// a known pattern of hits is added, and
+//  - every hit has to be sent once, in order, in a set whose span
+//    contains its message,
+//  - the sets have to start on multiples of the span and cover it all,
+//    unless they were closed early for having too many hits, in which
+//    case the sets of that span have to follow on from each other,
+//  - the counts have to go up by one, and empty spans not be sent,
+//  - with a sending thread too slow for the pool, every set has to be
+//    either sent or counted as dropped, the dropped ones leaving gaps
+//    in the counts of the sets sent after them.
+
+#include "../TPSetBuilder.h"
+#include "CLI11.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace
+{
+int n_failures=0;
+
+constexpr uint64_t ticksPerMessage=300;
+constexpr uint64_t firstTimestamp=0x1234567800ull+1234; // Not on a span boundary
+
+void expect(bool ok, const char* what)
+{
+    printf("%s %s\n", ok ? "OK  " : "FAIL", what);
+    if(!ok) ++n_failures;
+}
+
+// Hits in message imsg: none for a long stretch every 100 messages, so some spans are empty
+unsigned hits_in_message(uint64_t imsg) { return (imsg%100<60) ? imsg%7 : 0; }
+
+// Add n_messages messages to `builder`, starting at message first_msg. The channel of each hit is its message number
+void add_messages(TPSetBuilder& builder, uint64_t first_msg, uint64_t n_messages, size_t& n_hits)
+{
+    for(uint64_t imsg=first_msg; imsg<first_msg+n_messages; ++imsg){
+        const uint64_t timestamp=firstTimestamp+imsg*ticksPerMessage;
+        builder.startMessage(timestamp, 0x010203);
+        for(unsigned i=0; i<hits_in_message(imsg); ++i){
+            ptmp::data::TrigPrim* tp=builder.addHit();
+            tp->set_channel(imsg);
+            tp->set_tstart(timestamp);
+            tp->set_adcsum(i);
+        }
+        n_hits+=hits_in_message(imsg);
+    }
+}
+
+void check_sets(uint64_t span, size_t max_hits, uint64_t n_messages)
+{
+    std::vector<ptmp::data::TPSet> sent;
+    size_t n_hits=0;
+    {
+        // A pool big enough that nothing is dropped, however far behind the sending thread gets
+        TPSetBuilder builder([&sent](ptmp::data::TPSet& tpset){ sent.push_back(tpset); }, span, max_hits, n_messages+2);
+        add_messages(builder, 0, n_messages, n_hits);
+        // Start one more span so the last one with hits is closed
+        builder.startMessage(firstTimestamp+(n_messages+span/ticksPerMessage+1)*ticksPerMessage, 0x010203);
+        builder.stop();
+        expect(builder.setsSent()==sent.size() && builder.setsDropped()==0, "  all the closed sets were sent");
+    }
+
+    bool in_span=true, full_spans=true, followed_on=true, counts=true, not_empty=true, not_too_full=true;
+    size_t n_sent_hits=0;
+    uint64_t next_msg=0; // The message of the next hit we expect
+    bool hits_in_order=true;
+    for(size_t iset=0; iset<sent.size(); ++iset){
+        const ptmp::data::TPSet& tpset=sent[iset];
+        const uint64_t span_start=tpset.tstart()-tpset.tstart()%span;
+        const bool ends_span=(tpset.tstart()+tpset.tspan()==span_start+span);
+        if(tpset.count()!=iset) counts=false;
+        if(tpset.tps_size()==0) not_empty=false;
+        if(max_hits==0){
+            if(tpset.tstart()%span!=0 || tpset.tspan()!=span) full_spans=false;
+        }
+        else{
+            // A set that was closed early is followed by the rest of its span
+            if(!ends_span && (iset+1==sent.size() || sent[iset+1].tstart()!=tpset.tstart()+tpset.tspan())) followed_on=false;
+            // The hit limit is checked at the start of each message, so a set can go over by less than a message's worth
+            if(size_t(tpset.tps_size())>=max_hits+7) not_too_full=false;
+            if(!ends_span && size_t(tpset.tps_size())<max_hits) not_too_full=false;
+        }
+        for(int i=0; i<tpset.tps_size(); ++i){
+            const ptmp::data::TrigPrim& tp=tpset.tps(i);
+            if(tp.tstart()<tpset.tstart() || tp.tstart()>=tpset.tstart()+tpset.tspan()) in_span=false;
+            if(tp.channel()<next_msg) hits_in_order=false;
+            next_msg=tp.channel();
+        }
+        n_sent_hits+=tpset.tps_size();
+    }
+    printf("     span %lu ticks, max %zu hits: %zu sets, %zu hits\n", span, max_hits, sent.size(), n_sent_hits);
+    expect(n_sent_hits==n_hits && hits_in_order, "  every hit sent once, in order");
+    expect(in_span, "  hits in the span of their set");
+    expect(counts, "  counts go up by one");
+    expect(not_empty, "  no empty sets");
+    if(max_hits==0) expect(full_spans, "  sets cover whole spans");
+    else            expect(followed_on && not_too_full, "  sets closed early at the hit limit and followed on");
+}
+
+// A sending thread much slower than the hits come in, then a last few
+// messages once it has caught up
+void check_slow_sender()
+{
+    size_t n_sent=0;
+    size_t n_hits=0;
+    const uint64_t n_messages=2000, n_late_messages=100;
+    // The count of each set sent, and the message of its hits (their channel)
+    std::vector<std::pair<uint32_t, uint64_t>> counts;
+    TPSetBuilder builder([&n_sent, &counts](ptmp::data::TPSet& tpset){
+                             std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                             ++n_sent;
+                             counts.emplace_back(tpset.count(), tpset.tps(0).channel());
+                         },
+                         ticksPerMessage, 0, 4);
+    add_messages(builder, 0, n_messages, n_hits);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    add_messages(builder, n_messages, n_late_messages, n_hits);
+    builder.startMessage(firstTimestamp+(n_messages+n_late_messages+10)*ticksPerMessage, 0x010203);
+    builder.stop();
+    // One set per message with hits, so the count of a set is the
+    // number of messages with hits before its message
+    std::vector<uint32_t> expected_count;
+    size_t n_nonempty=0;
+    for(uint64_t imsg=0; imsg<n_messages+n_late_messages; ++imsg){
+        expected_count.push_back(n_nonempty);
+        if(hits_in_message(imsg)) ++n_nonempty;
+    }
+    printf("     slow sender: %zu sets sent, %zu dropped\n", builder.setsSent(), builder.setsDropped());
+    expect(builder.setsSent()==n_sent && builder.setsSent()+builder.setsDropped()==n_nonempty && builder.setsDropped()>0,
+           "slow sender: every set sent or counted as dropped");
+    bool counts_ok=!counts.empty() && counts.back().second>=n_messages;
+    for(auto const& c: counts){
+        if(c.first!=expected_count.at(c.second)) counts_ok=false;
+    }
+    expect(counts_ok, "slow sender: the dropped sets leave gaps in the counts of those sent after them");
+}
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app{"Check the TPSets from TPSetBuilder"};
+
+    uint64_t n_messages=100000;
+    app.add_option("-n", n_messages, "Number of messages to add", true);
+
+    CLI11_PARSE(app, argc, argv);
+
+    // The default span of 20 messages, and one that isn't a whole number of messages
+    for(uint64_t span: {20*ticksPerMessage, 1000ul}){
+        check_sets(span, 0, n_messages);
+        check_sets(span, 25, n_messages);
+    }
+    check_slow_sender();
+
+    if(n_failures){
+        printf("%d failure(s)\n", n_failures);
+        return 1;
+    }
+    printf("TPSetBuilder sends the expected TPSets\n");
+    return 0;
+}
+
+/* Local Variables:  */
+/* mode: c++         */
+/* c-basic-offset: 4 */
+/* End:              */
@@ -0,0 +1,94 @@
+#ifndef TRIGGER_REQUEST_HH_
+#define TRIGGER_REQUEST_HH_
+
+#include "artdaq-core/Data/Fragment.hh"
+
+#include "CompletionLatch.hh"
+#include "Utilities.hh"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+/*
+ * TriggerRequest
+ * Description: State of one in-flight trigger request. It owns the fragments
+ *   that the per-link trigger matchers fill, so several requests can be
+ *   served at the same time without sharing any per-request members.
+ *   The latch is armed with the number of links on submission.
+ * Date: October 2019
+*/
+struct TriggerRequest
+{
+  uint64_t timestamp = 0;
+  uint64_t sequenceId = 0;
+  std::unique_ptr<artdaq::Fragment> frag;
+  std::unique_ptr<artdaq::Fragment> fragHits;
+  CompletionLatch done;
+  // Set when the compression failed and the payload was stored as is
+  std::atomic<bool> storedRaw{false};
+  // Links whose queue was full on submission: their part of the fragment is missing
+  std::atomic<uint32_t> linksSkipped{0};
+};
+
+/*
+ * TriggerRequestQueue
+ * Description: Bounded SPSC queue of requests for the matcher of one link.
+ *   The dispatcher pushes, the matcher thread pops and parks on a futex
+ *   while there is nothing to do. Requests are served in submission order.
+ * Date: October 2019
+*/
+class TriggerRequestQueue
+{
+public:
+  explicit TriggerRequestQueue(size_t capacity)
+    : m_slots(capacity), m_head(0), m_tail(0), m_signal(0), m_stop(false) { }
+
+  TriggerRequestQueue(TriggerRequestQueue const&) = delete;
+  TriggerRequestQueue& operator=(TriggerRequestQueue const&) = delete;
+
+  // Producer side. False if the queue is full.
+  bool push(TriggerRequest* req) {
+    uint32_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) >= m_slots.size()) return false;
+    m_slots[tail % m_slots.size()] = req;
+    m_tail.store(tail+1, std::memory_order_release);
+    m_signal.fetch_add(1, std::memory_order_release);
+    futex_wake(&m_signal, 1);
+    return true;
+  }
+
+  // Consumer side. Blocks until a request arrives; false once stopped and drained.
+  bool pop(TriggerRequest*& req) {
+    uint32_t head = m_head.load(std::memory_order_relaxed);
+    for (;;) {
+      uint32_t signal = m_signal.load(std::memory_order_acquire);
+      if (m_tail.load(std::memory_order_acquire) != head) break;
+      if (m_stop.load(std::memory_order_acquire)) return false;
+      futex_wait(&m_signal, signal);
+    }
+    req = m_slots[head % m_slots.size()];
+    m_head.store(head+1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+  }
+
+  void stop() {
+    m_stop.store(true, std::memory_order_release);
+    m_signal.fetch_add(1, std::memory_order_release);
+    futex_wake(&m_signal);
+  }
+
+private:
+  std::vector<TriggerRequest*> m_slots;
+  alignas(64) std::atomic<uint32_t> m_head;
+  alignas(64) std::atomic<uint32_t> m_tail;
+  std::atomic<uint32_t> m_signal; // futex word, bumped on every push and on stop
+  std::atomic<bool> m_stop;
+};
+
+#endif
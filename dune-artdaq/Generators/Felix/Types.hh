@@ -5,6 +5,7 @@
 
 #include "ProducerConsumerQueue.hh"
 #include "NetioWIBRecords.hh"
+#include "LinkBuffer.hh"
 #include "netio/netio.hpp"
 
 /*
@@ -18,6 +19,8 @@
 typedef folly::ProducerConsumerQueue<SUPERCHUNK_CHAR_STRUCT> FrameQueue;
 typedef std::unique_ptr<FrameQueue> UniqueFrameQueue;
 
+typedef std::unique_ptr<LinkBuffer> UniqueLinkBuffer;
+
 typedef folly::ProducerConsumerQueue<felix::packetformat::block> BlockQueue;
 typedef std::unique_ptr<BlockQueue> UniqueBlockQueue;
 
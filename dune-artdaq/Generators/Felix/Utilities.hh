@@ -2,6 +2,17 @@
 #define UTILITIES_HH_
 
 #include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdint>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 inline void set_thread_name(std::thread& thread, const char* name, uint32_t tid)
 {
@@ -11,5 +22,61 @@ inline void set_thread_name(std::thread& thread, const char* name, uint32_t tid)
     pthread_setname_np(handle, tname);
 }
 
-#endif
+// Thin futex wrappers on a 32 bit atomic word (process private).
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+// Sleep as long as *word == expected. May return spuriously.
+inline void futex_wait(std::atomic<uint32_t>* word, uint32_t expected)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futex_wake(std::atomic<uint32_t>* word, int count = INT_MAX)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
 
+// Pause hint for spin-wait loops.
+inline void cpu_relax() { __builtin_ia32_pause(); }
+
+// How a polling loop waits when there was nothing to do: busy-poll with
+// cpu_relax() for spinFor after the last time there was work, then sleep
+// for 1us, 2us, 4us... up to maxSleep. Call reset() whenever there was
+// work, so the loop spins while data is flowing and costs little when idle.
+class AdaptiveBackoff
+{
+public:
+    AdaptiveBackoff(std::chrono::microseconds spinFor, std::chrono::microseconds maxSleep)
+        : m_spinFor(spinFor), m_maxSleep(maxSleep), m_sleep(1), m_idle(false)
+    {}
+
+    void reset()
+    {
+        m_idle = false;
+        m_sleep = std::chrono::microseconds(1);
+    }
+
+    void wait()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (!m_idle) {
+            m_idle = true;
+            m_idleSince = now;
+        }
+        if (now - m_idleSince < m_spinFor) {
+            cpu_relax();
+            return;
+        }
+        std::this_thread::sleep_for(m_sleep);
+        m_sleep = std::min(2*m_sleep, m_maxSleep);
+    }
+
+private:
+    const std::chrono::microseconds m_spinFor;
+    const std::chrono::microseconds m_maxSleep;
+    std::chrono::microseconds m_sleep;
+    bool m_idle;
+    std::chrono::steady_clock::time_point m_idleSince;
+};
+
+#endif
@@ -22,7 +22,7 @@ public:
     // (might be overflow)
     size_t fill(unsigned long x)
     {
-        int bin=64-__builtin_clzl(x);
+        int bin=(x==0) ? 0 : 64-__builtin_clzl(x); // clz(0) is undefined
         if((size_t)bin>=Nbins) bin=Nbins-1;
         ++bins[bin];
         return bin;